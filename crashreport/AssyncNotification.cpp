@@ -5,10 +5,12 @@
 AssyncNotification::AssyncNotification() {
   // Init variables
   m_hCompletionEvent = CreateEvent(0, FALSE, FALSE, 0);
-  m_hCancelEvent = CreateEvent(0, FALSE, FALSE, 0);
   m_hFeedbackEvent = CreateEvent(0, FALSE, FALSE, 0);
+  m_lCancelled = 0;
+  m_lPercentCompleted = 0;
   // Init handle to log file
   m_fileLog = NULL;
+  m_bStopLogWriter = false;
 
   Reset();
 }
@@ -18,13 +20,30 @@ AssyncNotification::~AssyncNotification() {
 }
 
 void AssyncNotification::CloseLogFile() {
+  // Let the writer drain the queue and exit
+  if (m_LogWriter.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(m_LogLock);
+      m_bStopLogWriter = true;
+      m_LogCond.notify_all();
+    }
+    m_LogWriter.join();
+  }
+
+  std::unique_lock<std::mutex> lock(m_LogLock);
   if (m_fileLog != NULL) {
     fclose(m_fileLog);
     m_fileLog = NULL;
   }
+  m_LogQueue.clear();
+  m_bStopLogWriter = false;
 }
 
 void AssyncNotification::InitLogFile(LPCTSTR szFileName) {
+  CloseLogFile();
+
+  std::unique_lock<std::mutex> lock(m_LogLock);
+
   // Open log file
   m_sLogFile = szFileName;
 #if _MSC_VER < 1400
@@ -32,7 +51,46 @@ void AssyncNotification::InitLogFile(LPCTSTR szFileName) {
 #else
   _tfopen_s(&m_fileLog, m_sLogFile.GetBuffer(0), _T("wt"));
 #endif
+  if (m_fileLog == NULL)
+    return;
+
   fprintf(m_fileLog, "%c%c%c", 0xEF, 0xBB, 0xBF);  // UTF-8 signature
+
+  m_LogWriter = std::thread(&AssyncNotification::LogWriterThread, this);
+}
+
+void AssyncNotification::LogWriterThread() {
+  std::deque<CString> batch;
+  std::string sBuffer;
+
+  std::unique_lock<std::mutex> lock(m_LogLock);
+  for (;;) {
+    while (m_LogQueue.empty() && !m_bStopLogWriter)
+      m_LogCond.wait(lock);
+
+    if (m_LogQueue.empty())
+      break;  // Stopped and drained
+
+    // Take everything queued so far and let producers continue
+    batch.swap(m_LogQueue);
+    m_LogCond.notify_all();
+    lock.unlock();
+
+    // One write per batch. Messages are data, not format strings.
+    sBuffer.clear();
+    std::deque<CString>::iterator it;
+    for (it = batch.begin(); it != batch.end(); it++) {
+      strconv_t strconv;
+      sBuffer += strconv.t2utf8(*it);
+      sBuffer += "\n";
+    }
+    batch.clear();
+
+    fwrite(sBuffer.c_str(), 1, sBuffer.size(), m_fileLog);
+    fflush(m_fileLog);
+
+    lock.lock();
+  }
 }
 
 CString AssyncNotification::GetLogFilePath() {
@@ -45,10 +103,10 @@ void AssyncNotification::Reset() {
   m_cs.Lock();  // Acquire lock
 
   m_nCompletionStatus = -1;
-  m_nPercentCompleted = 0;
+  InterlockedExchange(&m_lPercentCompleted, 0);
+  InterlockedExchange(&m_lCancelled, 0);
   m_statusLog.clear();
 
-  ResetEvent(m_hCancelEvent);
   ResetEvent(m_hCompletionEvent);
   ResetEvent(m_hFeedbackEvent);
 
@@ -57,45 +115,39 @@ void AssyncNotification::Reset() {
 
 void AssyncNotification::SetProgress(CString sStatusMsg, int percentCompleted, bool bRelative) {
   m_cs.Lock();  // Acquire lock
-
   m_statusLog.push_back(sStatusMsg);
+  m_cs.Unlock();  // Free lock
 
-  if (m_fileLog) {
-    strconv_t strconv;
-    LPCSTR szLine = strconv.t2utf8(sStatusMsg);
-    fprintf(m_fileLog, szLine);
-    fprintf(m_fileLog, "\n");
-  }
-
-  if (bRelative)  // Update progress relatively to its previous value
-  {
-    m_nPercentCompleted += percentCompleted;
-    if (m_nPercentCompleted > 100)
-      m_nPercentCompleted = 100;
-  }
-  else  // Update progress relatively to zero
+  // Hand the message over to the log writer; wait only if it is far behind
   {
-    m_nPercentCompleted = percentCompleted;
+    std::unique_lock<std::mutex> lock(m_LogLock);
+    if (m_fileLog != NULL) {
+      while (m_LogQueue.size() >= ASSYNC_LOG_QUEUE_SIZE)
+        m_LogCond.wait(lock);
+      m_LogQueue.push_back(sStatusMsg);
+      m_LogCond.notify_all();
+    }
   }
 
-  m_cs.Unlock();  // Free lock
+  SetProgress(percentCompleted, bRelative);
 }
 
 void AssyncNotification::SetProgress(int percentCompleted, bool bRelative) {
-  m_cs.Lock();  // Acquire lock
-
   if (bRelative)  // Update progress relatively to its previous value
   {
-    m_nPercentCompleted += percentCompleted;
-    if (m_nPercentCompleted > 100)
-      m_nPercentCompleted = 100;
+    LONG lOld;
+    LONG lNew;
+    do {
+      lOld = m_lPercentCompleted;
+      lNew = lOld + percentCompleted;
+      if (lNew > 100)
+        lNew = 100;
+    } while (InterlockedCompareExchange(&m_lPercentCompleted, lNew, lOld) != lOld);
   }
   else  // Update progress relatively to zero
   {
-    m_nPercentCompleted = percentCompleted;
+    InterlockedExchange(&m_lPercentCompleted, percentCompleted);
   }
-
-  m_cs.Unlock();  // Free lock
 }
 
 void AssyncNotification::GetProgress(int& nProgressPct, std::vector<CString>& msg_log) {
@@ -103,7 +155,7 @@ void AssyncNotification::GetProgress(int& nProgressPct, std::vector<CString>& ms
 
   m_cs.Lock();  // Acquire lock
 
-  nProgressPct = m_nPercentCompleted;
+  nProgressPct = m_lPercentCompleted;
   msg_log = m_statusLog;
   m_statusLog.clear();
 
@@ -134,18 +186,12 @@ int AssyncNotification::WaitForCompletion() {
 void AssyncNotification::Cancel() {
   // Cansels the assync operation
   SetProgress(_T("[cancelled_by_user]"), 0);
-  SetEvent(m_hCancelEvent);
+  InterlockedExchange(&m_lCancelled, 1);
 }
 
 bool AssyncNotification::IsCancelled() {
   // Determines if the assync operation is cancelled or not
-  DWORD dwWaitResult = WaitForSingleObject(m_hCancelEvent, 0);
-  if (dwWaitResult == WAIT_OBJECT_0) {
-    SetEvent(m_hCancelEvent);
-    return true;
-  }
-
-  return false;
+  return m_lCancelled != 0;
 }
 
 void AssyncNotification::WaitForFeedback(int& code) {
@@ -15,6 +15,12 @@ be found in the Authors.txt file in the root of the source tree.
 
 #pragma once
 #include "stdafx.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#define ASSYNC_LOG_QUEUE_SIZE 1024  /* Count of log messages waiting for the writer before SetProgress() blocks */
 
 struct AssyncNotification {
   /* Constructor */
@@ -32,7 +38,7 @@ struct AssyncNotification {
   // Sets the progress message and percent completed
   void SetProgress(CString sStatusMsg, int percentCompleted, bool bRelative = true);
 
-  // Sets the percent completed
+  // Sets the percent completed (doesn't lock, may be called for every chunk of data)
   void SetProgress(int percentCompleted, bool bRelative = true);
 
   // Returns the current assynchronous operation progress
@@ -47,7 +53,7 @@ struct AssyncNotification {
   // Cancels the assynchronous operation
   void Cancel();
 
-  // Determines if the assynchronous operation was cancelled
+  // Determines if the assynchronous operation was cancelled (doesn't lock)
   bool IsCancelled();
 
   // Waits until the feedback is received
@@ -57,13 +63,21 @@ struct AssyncNotification {
   void FeedbackReady(int code);
 
  private:
+  // Writes queued log messages to the log file in batches.
+  void LogWriterThread();
+
   CComAutoCriticalSection m_cs;      // Protects internal state
   int m_nCompletionStatus;           // Completion status of the assync operation
   HANDLE m_hCompletionEvent;         // Completion event
-  HANDLE m_hCancelEvent;             // Cancel event
   HANDLE m_hFeedbackEvent;           // Feedback event
-  int m_nPercentCompleted;           // Percent completed
+  volatile LONG m_lCancelled;        // Whether the operation was cancelled
+  volatile LONG m_lPercentCompleted; // Percent completed
   std::vector<CString> m_statusLog;  // Status log
   CString m_sLogFile;
   FILE* m_fileLog;
+  std::thread m_LogWriter;           // Log writer thread
+  std::mutex m_LogLock;              // Protects the log queue
+  std::condition_variable m_LogCond; // Signalled when messages are queued or dequeued
+  std::deque<CString> m_LogQueue;    // Messages waiting for the log writer
+  bool m_bStopLogWriter;             // Tells the log writer to exit
 };
@@ -5,6 +5,14 @@
 #include "tinyxml.h"
 #include "Utility.h"
 #include "SharedMem.h"
+#include "PropertyTable.h"
+#include "Breadcrumbs.h"
+
+LONG64 ERIFileItem::GetReportSize(LONG64 lFileSize) {
+  if (m_lLinkedSize >= 0 && m_lLinkedSize < lFileSize)
+    return m_lLinkedSize;  // Data appended after the crash is not part of the report
+  return lFileSize;
+}
 
 BOOL ERIFileItem::GetFileInfo(HICON& hIcon, CString& sTypeName, LONGLONG& lSize) {
   hIcon = NULL;
@@ -13,8 +21,8 @@ BOOL ERIFileItem::GetFileInfo(HICON& hIcon, CString& sTypeName, LONGLONG& lSize)
   SHFILEINFO sfi;
   HANDLE hFile = INVALID_HANDLE_VALUE;
 
-  // Open file for reading
-  hFile = CreateFile(m_sSrcFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
+  // Open file for reading (a hard link may still be open for writing by the application)
+  hFile = CreateFile(m_sSrcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, NULL, NULL);
   if (hFile == INVALID_HANDLE_VALUE)
     return FALSE;  // Error - file may not exist
 
@@ -22,7 +30,7 @@ BOOL ERIFileItem::GetFileInfo(HICON& hIcon, CString& sTypeName, LONGLONG& lSize)
   LARGE_INTEGER lFileSize;
   BOOL bGetSize = GetFileSizeEx(hFile, &lFileSize);
   if (bGetSize) {
-    lSize = lFileSize.QuadPart;
+    lSize = GetReportSize(lFileSize.QuadPart);
   }
 
   // Get file icon and type name
@@ -222,6 +230,17 @@ void CErrorReportInfo::AddProp(LPCTSTR szName, LPCTSTR szVal) {
   m_Props[szName] = szVal;
 }
 
+int CErrorReportInfo::GetBreadcrumbCount() {
+  return (int)m_Breadcrumbs.size();
+}
+
+BreadcrumbInfo* CErrorReportInfo::GetBreadcrumbByIndex(int nItem) {
+  if (nItem < 0 || nItem >= (int)m_Breadcrumbs.size())
+    return NULL;  // No such item
+
+  return &m_Breadcrumbs[nItem];
+}
+
 int CErrorReportInfo::GetRegKeyCount() {
   return (int)m_RegKeys.size();
 }
@@ -262,7 +281,7 @@ LONG64 CErrorReportInfo::CalcUncompressedReportSize() {
     // Get name of the file
     CString sFileName = pfi->m_sSrcFile.GetBuffer(0);
     // Open file for reading
-    hFile = CreateFile(sFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
+    hFile = CreateFile(sFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, NULL, NULL);
     if (hFile == INVALID_HANDLE_VALUE) {
       continue;
     }
@@ -275,7 +294,7 @@ LONG64 CErrorReportInfo::CalcUncompressedReportSize() {
     }
 
     // Update totals
-    lTotalSize += lFileSize.QuadPart;
+    lTotalSize += pfi->GetReportSize(lFileSize.QuadPart);
 
     // Close file
     CloseHandle(hFile);
@@ -302,6 +321,12 @@ CCrashInfoReader::CCrashInfoReader() {
   m_dwProcessId = 0;
   m_dwThreadId = 0;
   m_pExInfo = NULL;
+  m_llCrashTimestamp = 0;
+  m_nSecondaryCrashCount = 0;
+  m_ullCrashSignature = 0;
+  m_dwSignatureCountToday = 0;
+  m_dwSignatureCountTotal = 0;
+  m_nReportLevel = REPORT_LEVEL_FULL;
   m_nExceptionType = 0;
   m_dwExceptionCode = 0;
   m_uFPESubcode = 0;
@@ -328,6 +353,16 @@ int CCrashInfoReader::Init(LPCTSTR szFileMappingName) {
 
   // Unpack crash description from shared memory
   m_pCrashDesc = (CRASH_DESCRIPTION*)m_SharedMem.CreateView(0, sizeof(CRASH_DESCRIPTION));
+  if (m_pCrashDesc == NULL) {
+    m_sErrorMsg = _T("Error mapping crash description.");
+    return 2;
+  }
+
+  // The description may have grown beyond the first segment, make the whole of it accessible.
+  if (!m_SharedMem.Commit(m_pCrashDesc->m_dwCommittedSize)) {
+    m_sErrorMsg = _T("Error mapping crash description.");
+    return 2;
+  }
 
   int nUnpack = UnpackCrashDescription(eri);
   if (0 != nUnpack) {
@@ -350,16 +385,44 @@ int CCrashInfoReader::Init(LPCTSTR szFileMappingName) {
   return 0;
 }
 
+void CCrashInfoReader::ReadSecondaryCrashes() {
+  if (m_pCrashDesc == NULL)
+    return;
+
+  // Slots still being written at the moment of reading have zero thread ID.
+  m_aSecondaryCrashes.clear();
+  m_nSecondaryCrashCount = m_pCrashDesc->m_lSecondaryCrashCount;
+  for (int i = 0; i < m_nSecondaryCrashCount && i < MAX_SECONDARY_CRASHES; i++) {
+    SECONDARY_CRASH sc = m_pCrashDesc->m_SecondaryCrashes[i];
+    if (sc.m_lThreadId != 0)
+      m_aSecondaryCrashes.push_back(sc);
+  }
+}
+
 int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
   // This method unpacks crash description data from shared memory.
 
   if (memcmp(m_pCrashDesc->m_uchMagic, "CRD", 3) != 0)
     return 1;  // Invalid magic word
 
+  if (m_pCrashDesc->m_dwFormatVersion != CRASH_DESCRIPTION_VERSION)
+    return 1;  // Layout produced by an incompatible CrashRpt version
+
   // Unpack process ID, thread ID and exception pointers address.
   m_dwProcessId = m_pCrashDesc->m_dwProcessId;
   m_dwThreadId = m_pCrashDesc->m_dwThreadId;
   m_pExInfo = m_pCrashDesc->m_pExceptionPtrs;
+  m_llCrashTimestamp = m_pCrashDesc->m_llCrashTimestamp;
+
+  // Unpack crash signature counters
+  m_ullCrashSignature = m_pCrashDesc->m_ullCrashSignature;
+  m_dwSignatureCountToday = m_pCrashDesc->m_dwSignatureCountToday;
+  m_dwSignatureCountTotal = m_pCrashDesc->m_dwSignatureCountTotal;
+  m_nReportLevel = m_pCrashDesc->m_nReportLevel;
+
+  // Unpack threads that crashed while the report was in flight.
+  ReadSecondaryCrashes();
+
   m_nExceptionType = m_pCrashDesc->m_nExceptionType;
   if (m_nExceptionType == CR_SEH_EXCEPTION) {
     m_dwExceptionCode = m_pCrashDesc->m_dwExceptionCode;
@@ -397,14 +460,15 @@ int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
   UnpackString(m_pCrashDesc->m_dwCustomSenderIconOffs, m_sCustomSenderIcon);
   m_bClientAppCrashed = m_pCrashDesc->m_bClientAppCrashed;
 
-  DWORD dwOffs = m_pCrashDesc->m_wSize;
+  DWORD dwOffs = m_pCrashDesc->m_dwSize;
   while (dwOffs < m_pCrashDesc->m_dwTotalSize) {
-    LPBYTE pView = m_SharedMem.CreateView(dwOffs, sizeof(GENERIC_HEADER));
-    GENERIC_HEADER* pHeader = (GENERIC_HEADER*)pView;
+    GENERIC_HEADER* pHeader = (GENERIC_HEADER*)m_SharedMem.CreateView(dwOffs, sizeof(GENERIC_HEADER));
+    if (pHeader == NULL || pHeader->m_dwSize < sizeof(GENERIC_HEADER) || m_SharedMem.CreateView(dwOffs, pHeader->m_dwSize) == NULL)
+      return 1;  // Corrupted block
 
     if (memcmp(pHeader->m_uchMagic, "FIL", 3) == 0) {
       // File item entry
-      FILE_ITEM* pFileItem = (FILE_ITEM*)m_SharedMem.CreateView(dwOffs, pHeader->m_wSize);
+      FILE_ITEM* pFileItem = (FILE_ITEM*)pHeader;
 
       ERIFileItem fi;
       UnpackString(pFileItem->m_dwSrcFilePathOffs, fi.m_sSrcFile);
@@ -414,12 +478,10 @@ int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
       fi.m_bAllowDelete = pFileItem->m_bAllowDelete;
 
       eri.m_FileItems[fi.m_sDestFile] = fi;
-
-      m_SharedMem.DestroyView((LPBYTE)pFileItem);
     }
     else if (memcmp(pHeader->m_uchMagic, "CPR", 3) == 0) {
       // Custom prop entry
-      CUSTOM_PROP* pProp = (CUSTOM_PROP*)m_SharedMem.CreateView(dwOffs, pHeader->m_wSize);
+      CUSTOM_PROP* pProp = (CUSTOM_PROP*)pHeader;
 
       CString sName;
       CString sValue;
@@ -427,12 +489,10 @@ int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
       UnpackString(pProp->m_dwValueOffs, sValue);
 
       eri.m_Props[sName] = sValue;
-
-      m_SharedMem.DestroyView((LPBYTE)pProp);
     }
     else if (memcmp(pHeader->m_uchMagic, "REG", 3) == 0) {
       // Reg key entry
-      REG_KEY* pKey = (REG_KEY*)m_SharedMem.CreateView(dwOffs, pHeader->m_wSize);
+      REG_KEY* pKey = (REG_KEY*)pHeader;
 
       CString sKeyName;
       ERIRegKey rki;
@@ -441,8 +501,6 @@ int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
       UnpackString(pKey->m_dwDstFileNameOffs, rki.m_sDstFileName);
 
       eri.m_RegKeys[sKeyName] = rki;
-
-      m_SharedMem.DestroyView((LPBYTE)pKey);
     }
     else if (memcmp(pHeader->m_uchMagic, "STR", 3) == 0) {
       // Skip string
@@ -452,30 +510,62 @@ int CCrashInfoReader::UnpackCrashDescription(CErrorReportInfo& eri) {
       return 1;
     }
 
-    dwOffs += pHeader->m_wSize;
+    dwOffs += pHeader->m_dwSize;
+  }
+
+  // Unpack typed properties. Their values are formatted here, not in the client app.
+  CString sPropTableName;
+  if (UnpackString(m_pCrashDesc->m_dwPropTableNameOffs, sPropTableName) == 0) {
+    CPropertyTable PropTable;
+    if (PropTable.Init(sPropTableName, TRUE)) {
+      for (int i = 0; i < PropTable.GetCapacity(); i++) {
+        CString sName;
+        CString sValue;
+        if (PropTable.GetProperty(i, sName, sValue))
+          eri.m_Props[sName] = sValue;
+      }
+    }
+  }
 
-    m_SharedMem.DestroyView(pView);
+  // Read breadcrumb rings of the client.
+  CString sBreadcrumbsName;
+  if (UnpackString(m_pCrashDesc->m_dwBreadcrumbsNameOffs, sBreadcrumbsName) == 0) {
+    CBreadcrumbs Breadcrumbs;
+    if (Breadcrumbs.Init(sBreadcrumbsName, TRUE))
+      Breadcrumbs.Read(eri.m_Breadcrumbs);
   }
 
   // Success
   return 0;
 }
 
-int CCrashInfoReader::UnpackString(DWORD dwOffset, CString& str) {
+LPCTSTR CCrashInfoReader::GetStringView(DWORD dwOffset, int& nLength) {
+  nLength = 0;
+
   STRING_DESC* pStrDesc = (STRING_DESC*)m_SharedMem.CreateView(dwOffset, sizeof(STRING_DESC));
-  if (memcmp(pStrDesc, "STR", 3) != 0)
+  if (pStrDesc == NULL || memcmp(pStrDesc, "STR", 3) != 0)
+    return NULL;
+
+  if (pStrDesc->m_dwSize < sizeof(STRING_DESC) || m_SharedMem.CreateView(dwOffset, pStrDesc->m_dwSize) == NULL)
+    return NULL;
+
+  // String data follows the header. The block may be longer than the
+  // string (alignment and reserved capacity), the tail is zero-filled.
+  LPCTSTR pszData = (LPCTSTR)((LPBYTE)pStrDesc + sizeof(STRING_DESC));
+  nLength = (int)_tcsnlen(pszData, (pStrDesc->m_dwSize - sizeof(STRING_DESC)) / sizeof(TCHAR));
+  return pszData;
+}
+
+int CCrashInfoReader::UnpackString(DWORD dwOffset, CString& str) {
+  int nLength = 0;
+  LPCTSTR pszData = GetStringView(dwOffset, nLength);
+  if (pszData == NULL)
     return 1;
 
-  WORD wLength = pStrDesc->m_wSize;
-  if (wLength <= sizeof(STRING_DESC))
+  if (nLength == 0)
     return 2;
 
-  WORD wStrLen = wLength - sizeof(STRING_DESC);
-
-  m_SharedMem.DestroyView((LPBYTE)pStrDesc);
-  LPBYTE pStrData = m_SharedMem.CreateView(dwOffset + sizeof(STRING_DESC), wStrLen);
-  str = CString((LPCTSTR)pStrData, wStrLen / sizeof(TCHAR));
-  m_SharedMem.DestroyView(pStrData);
+  str = CString(pszData, nLength);
 
   return 0;
 }
@@ -783,6 +873,7 @@ int CCrashInfoReader::ParseCrashDescription(CString sFileName,
       const char* pszDestFile = fi.ToElement()->Attribute("name");
       const char* pszDesc = fi.ToElement()->Attribute("description");
       const char* pszOptional = fi.ToElement()->Attribute("optional");
+      const char* pszSize = fi.ToElement()->Attribute("size");
 
       if (pszDestFile != NULL) {
         CString sDestFile = strconv.utf82t(pszDestFile);
@@ -796,6 +887,20 @@ int CCrashInfoReader::ParseCrashDescription(CString sFileName,
         if (pszOptional && strcmp(pszOptional, "1") == 0)
           item.m_bAllowDelete = true;
 
+        // Hard link to a file that may have grown after the crash
+        if (pszSize) {
+          item.m_lLinkedSize = _atoi64(pszSize);
+          const char* pszFileId = fi.ToElement()->Attribute("fileid");
+          const char* pszWriteTime = fi.ToElement()->Attribute("mtime");
+          const char* pszTailCrc = fi.ToElement()->Attribute("tailcrc");
+          if (pszFileId)
+            item.m_ullLinkedFileId = _strtoui64(pszFileId, NULL, 10);
+          if (pszWriteTime)
+            item.m_ullLinkedWriteTime = _strtoui64(pszWriteTime, NULL, 10);
+          if (pszTailCrc)
+            item.m_dwLinkedTailCrc = strtoul(pszTailCrc, NULL, 10);
+        }
+
         // Check that file really exists
         DWORD dwAttrs = GetFileAttributes(item.m_sSrcFile);
         if (dwAttrs != INVALID_FILE_ATTRIBUTES && (dwAttrs & FILE_ATTRIBUTE_DIRECTORY) == 0) {
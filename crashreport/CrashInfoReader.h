@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "tinyxml.h"
 #include "SharedMem.h"
+#include "Breadcrumbs.h"
 #include "ScreenCap.h"
 
 using namespace CrashReport;
@@ -12,6 +13,10 @@ struct ERIFileItem {
   ERIFileItem() {
     m_bMakeCopy = FALSE;
     m_bAllowDelete = FALSE;
+    m_lLinkedSize = -1;
+    m_ullLinkedFileId = 0;
+    m_ullLinkedWriteTime = 0;
+    m_dwLinkedTailCrc = 0;
   }
 
   // Destination file name as it appears in ZIP archive (not including directory name).
@@ -21,6 +26,13 @@ struct ERIFileItem {
   BOOL m_bMakeCopy;        // Should we copy source file to error report folder?
   BOOL m_bAllowDelete;     // Should allow user to delete the file from crash report?
   CString m_sErrorStatus;  // Empty if OK, non-empty if error occurred.
+  LONG64 m_lLinkedSize;    // If the file is a hard link to the original, size of the original at crash time (-1 otherwise).
+  ULONG64 m_ullLinkedFileId;    // File index of the hard-linked file.
+  ULONG64 m_ullLinkedWriteTime; // Last write time of the hard-linked file at crash time.
+  DWORD m_dwLinkedTailCrc;      // CRC-32 of the last bytes of the hard-linked file at crash time.
+
+  // Returns size of the file as it belongs to the report (the part present at crash time for hard links).
+  LONG64 GetReportSize(LONG64 lFileSize);
 
   // Retrieves file information, such as type and size.
   BOOL GetFileInfo(HICON& hIcon, CString& sTypeName, LONGLONG& lSize);
@@ -77,6 +89,12 @@ class CErrorReportInfo {
   // Adds/replaces a property in crash report.
   void AddProp(LPCTSTR szName, LPCTSTR szVal);
 
+  // Returns count of breadcrumbs (ordered by time).
+  int GetBreadcrumbCount();
+
+  // Method that retrieves a breadcrumb by zero-based index.
+  BreadcrumbInfo* GetBreadcrumbByIndex(int nItem);
+
   // Returns count of registry keys in error report.
   int GetRegKeyCount();
 
@@ -201,6 +219,7 @@ class CErrorReportInfo {
       m_RegKeys;  // The list of registry keys included into this error report.
   std::map<CString, CString>
       m_Props;  // The list of custom properties included into this error report.
+  std::vector<BreadcrumbInfo> m_Breadcrumbs;  // Breadcrumbs preceding the crash, ordered by time.
 };
 
 // Class responsible for reading the crash info passed by the crashed application.
@@ -236,6 +255,13 @@ class CCrashInfoReader {
   CString m_sInvParamFunction;    // Invalid parameter function.
   CString m_sInvParamFile;        // Invalid parameter file.
   UINT m_uInvParamLine;           // Invalid parameter line.
+  LONGLONG m_llCrashTimestamp;    // Performance counter value at the moment of crash.
+  int m_nSecondaryCrashCount;     // Count of threads crashed while the report was in flight.
+  std::vector<SECONDARY_CRASH> m_aSecondaryCrashes;  // Recorded secondary crashes.
+  ULONG64 m_ullCrashSignature;    // Crash signature (zero if no report policy is set).
+  DWORD m_dwSignatureCountToday;  // Crashes with this signature today.
+  DWORD m_dwSignatureCountTotal;  // Crashes with this signature in total.
+  int m_nReportLevel;             // How much is collected (one of REPORT_LEVEL_* values).
 
   /* Member functions */
 
@@ -269,6 +295,9 @@ class CCrashInfoReader {
   // Removes several files by names.
   BOOL RemoveFilesFromCrashReport(int nReport, std::vector<CString> FilesToRemove);
 
+  // Re-reads secondary crash slots, threads keep crashing while the report is being generated.
+  void ReadSecondaryCrashes();
+
  private:
   // Retrieves some crash info from crash description XML.
   int ParseCrashDescription(CString sFileName, BOOL bParseFileItems, CErrorReportInfo& eri);
@@ -279,6 +308,9 @@ class CCrashInfoReader {
   // Unpacks crash description from shared memory.
   int UnpackCrashDescription(CErrorReportInfo& eri);
 
+  // Returns pointer to a packed string inside of shared memory (no copy is made).
+  LPCTSTR GetStringView(DWORD dwOffset, int& nLength);
+
   // Unpacks a string.
   int UnpackString(DWORD dwOffset, CString& str);
 
@@ -2,10 +2,13 @@
 #include "CrashReporter.h"
 #include "CrashRpt.h"
 #include "Utility.h"
-#include "zip.h"
 #include "CrashInfoReader.h"
 #include "strconv.h"
 #include "ScreenCap.h"
+#include "Symbolizer.h"
+#include "FileCopier.h"
+#include <thread>
+#include <processsnapshot.h>
 #include <sys/stat.h>
 
 CrashReporter* CrashReporter::m_pInstance = NULL;
@@ -16,6 +19,11 @@ CrashReporter::CrashReporter() {
   m_SendAttempt = 0;
   m_bExport = FALSE;
   m_bErrors = FALSE;
+  m_lParentUnblocked = FALSE;
+  m_lStateCaptured = 0;
+  m_bDumpFromSnapshot = FALSE;
+  m_lStreamedSize = 0;
+  m_bZipDamaged = FALSE;
 }
 
 CrashReporter::~CrashReporter() {
@@ -122,12 +130,36 @@ void CrashReporter::UnblockParentProcess() {
   // Notify the parent process that we have finished with minidump,
   // so the parent process is able to unblock and terminate itself.
 
+  if (InterlockedExchange(&m_lParentUnblocked, TRUE))
+    return;  // Already done
+
   // Open the event the parent process had created for us
   CString sEventName;
   sEventName.Format(_T("Local\\CrashRptEvent_%s"), GetCrashInfo()->GetReport(0)->GetCrashGUID());
   HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, sEventName);
-  if (hEvent != NULL)
+  if (hEvent != NULL) {
     SetEvent(hEvent);  // Signal event
+    CloseHandle(hEvent);
+  }
+
+  // Log how long the parent process stayed blocked after the crash.
+  if (m_CrashInfo.m_llCrashTimestamp != 0) {
+    LARGE_INTEGER liFreq;
+    LARGE_INTEGER liNow;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liNow);
+
+    CString sMsg;
+    sMsg.Format(_T("Crash-to-unblock latency: %.1f ms"), (double)(liNow.QuadPart - m_CrashInfo.m_llCrashTimestamp) * 1000.0 / (double)liFreq.QuadPart);
+    m_Assync.SetProgress(sMsg, 0, false);
+  }
+}
+
+void CrashReporter::OnStateCaptured(LONG lStage) {
+  // The last state-capturing stage to finish lets the parent process go
+  LONG lPrev = InterlockedOr(&m_lStateCaptured, lStage);
+  if ((lPrev | lStage) == STATE_CAPTURED_ALL && lPrev != STATE_CAPTURED_ALL)
+    UnblockParentProcess();
 }
 
 BOOL CrashReporter::DoWork() {
@@ -138,21 +170,68 @@ BOOL CrashReporter::DoWork() {
   // Add a message to log
   m_Assync.SetProgress(_T("Start collecting information about the crash..."), 0, false);
 
-  // First take a screenshot of user's desktop (if needed).
-  TakeDesktopScreenshot();
+  m_lStateCaptured = 0;
 
-  if (m_Assync.IsCancelled())  // Check if user-cancelled
-  {
-    // Parent process can now terminate
-    UnblockParentProcess();
+  // Take application-defined files before other stages start adding theirs
+  std::vector<ERIFileItem> aUserFiles;
+  int i;
+  for (i = 0; i < m_CrashInfo.GetReport(m_nCurReport)->GetFileItemCount(); i++)
+    aUserFiles.push_back(*m_CrashInfo.GetReport(m_nCurReport)->GetFileItemByIndex(i));
+
+  // Stages that don't depend on each other run in parallel. The screenshot and
+  // the minidump capture the state of the crashed process, so the parent process
+  // is unblocked as soon as both are done (see OnStateCaptured()).
+  CTaskGraph graph;
+
+  int nScreenshot = graph.AddTask(_T("screenshot"), [this]() {
+    TakeDesktopScreenshot();
+    OnStateCaptured(STATE_CAPTURED_SCREENSHOT);
+  });
+
+  int nMinidump = graph.AddTask(_T("minidump"), [this]() {
+    CreateMiniDump();
+    OnStateCaptured(STATE_CAPTURED_PROCESS);
+  });
+
+  // Resolve the crash stack, so the report can be triaged without a debugger.
+  int nSymbolize = graph.AddTask(_T("symbolize"), [this]() { SymbolizeCrashStack(); });
+  graph.AddDependency(nSymbolize, nMinidump);
+
+  int nCollectFiles = graph.AddTask(_T("collect files"), [this, &aUserFiles]() { CollectCrashFiles(aUserFiles); });
+
+  int nRegKeys = graph.AddTask(_T("registry keys"), [this]() { DumpRegKeys(); });
+
+  // The description XML lists all files, so it waits for every stage adding them
+  int nXml = graph.AddTask(_T("description XML"), [this]() {
+    CreateCrashDescriptionXML(*m_CrashInfo.GetReport(0));
 
     // Add a message to log
-    m_Assync.SetProgress(_T("[exit_silently]"), 0, false);
-    return FALSE;
+    m_Assync.SetProgress(_T("[confirm_send_report]"), 100, false);
+  });
+  graph.AddDependency(nXml, nScreenshot);
+  graph.AddDependency(nXml, nMinidump);
+  graph.AddDependency(nXml, nSymbolize);
+  graph.AddDependency(nXml, nCollectFiles);
+  graph.AddDependency(nXml, nRegKeys);
+
+  if (m_CrashInfo.m_bStoreZIPArchives) {
+    int nCompress = graph.AddTask(_T("compress"), [this]() {
+      BOOL bCompress = CompressReportFiles(m_CrashInfo.GetReport(m_nCurReport));
+      if (!bCompress) {
+        m_Assync.SetProgress(_T("[status_failed]"), 100, false);
+      }
+    });
+    graph.AddDependency(nCompress, nXml);
   }
 
-  // Create crash dump.
-  CreateMiniDump();
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  graph.Run(si.dwNumberOfProcessors < 2 ? 2 : (int)si.dwNumberOfProcessors, [this]() { return m_Assync.IsCancelled(); });
+
+  LogStageTimings(graph);
+
+  // Left open if compression was cancelled
+  CloseReportZip();
 
   if (m_Assync.IsCancelled())  // Check if user-cancelled
   {
@@ -164,43 +243,53 @@ BOOL CrashReporter::DoWork() {
     return FALSE;
   }
 
-  // Notify the parent process that we have finished with minidump,
-  // so the parent process is able to unblock and terminate itself.
+  // Normally done by the state-capturing stages already
   UnblockParentProcess();
 
-  // Copy user-provided files.
-  CollectCrashFiles();
-
-  if (m_Assync.IsCancelled())  // Check if user-cancelled
-  {
-    m_Assync.SetProgress(_T("[exit_silently]"), 0, false);
-    return FALSE;
-  }
-
-  if (m_Assync.IsCancelled())  // Check if user-cancelled
-  {
-    m_Assync.SetProgress(_T("[exit_silently]"), 0, false);
-    return FALSE;
+  if (m_CrashInfo.m_bAppRestart) {
+    RestartApp();
   }
 
-  // Create crash description XML
-  CreateCrashDescriptionXML(*m_CrashInfo.GetReport(0));
-
-  // Add a message to log
-  m_Assync.SetProgress(_T("[confirm_send_report]"), 100, false);
+  return TRUE;
+}
 
-  if (m_CrashInfo.m_bStoreZIPArchives) {
-    BOOL bCompress = CompressReportFiles(m_CrashInfo.GetReport(m_nCurReport));
-    if (!bCompress) {
-      m_Assync.SetProgress(_T("[status_failed]"), 100, false);
-    }
+void CrashReporter::LogStageTimings(CTaskGraph& graph) {
+  CString sMsg;
+  int i;
+  for (i = 0; i < graph.GetTaskCount(); i++) {
+    double dStartMs = 0;
+    double dDurationMs = 0;
+    if (graph.GetTaskTiming(i, dStartMs, dDurationMs))
+      sMsg.Format(_T("Stage '%s': started at %.1f ms, took %.1f ms"), graph.GetTaskName(i), dStartMs, dDurationMs);
+    else
+      sMsg.Format(_T("Stage '%s': skipped"), graph.GetTaskName(i));
+    m_Assync.SetProgress(sMsg, 0);
   }
 
-  if (m_CrashInfo.m_bAppRestart) {
-    RestartApp();
+  std::vector<int> aPath;
+  graph.GetCriticalPath(aPath);
+  if (aPath.empty())
+    return;
+
+  CString sPath;
+  size_t j;
+  for (j = 0; j < aPath.size(); j++) {
+    if (j != 0)
+      sPath += _T(" -> ");
+    sPath += graph.GetTaskName(aPath[j]);
   }
 
-  return TRUE;
+  double dStartMs = 0;
+  double dDurationMs = 0;
+  graph.GetTaskTiming(aPath.back(), dStartMs, dDurationMs);
+  sMsg.Format(_T("Critical path: %s (%.1f ms)"), sPath, dStartMs + dDurationMs);
+  m_Assync.SetProgress(sMsg, 0);
+}
+
+void CrashReporter::AddReportFile(ERIFileItem* pfi) {
+  m_csFileItems.Lock();
+  m_CrashInfo.GetReport(0)->AddFileItem(pfi);
+  m_csFileItems.Unlock();
 }
 
 // Returns the export flag (the flag is set if we are exporting error report as a ZIP archive)
@@ -300,7 +389,7 @@ BOOL CrashReporter::TakeDesktopScreenshot() {
     fi.m_sDestFile = sDestFile;
     fi.m_sDesc = TEXT("Desktop Screenshot");
     fi.m_bAllowDelete = bAllowDelete;
-    m_CrashInfo.GetReport(0)->AddFileItem(&fi);
+    AddReportFile(&fi);
   }
 
   // Done
@@ -318,6 +407,12 @@ BOOL CALLBACK CrashReporter::MiniDumpCallback(PVOID CallbackParam, PMINIDUMP_CAL
 // currently performed action
 BOOL CrashReporter::OnMinidumpProgress(const PMINIDUMP_CALLBACK_INPUT CallbackInput, PMINIDUMP_CALLBACK_OUTPUT CallbackOutput) {
   switch (CallbackInput->CallbackType) {
+    case IsProcessSnapshotCallback: {
+      // Tell dbghelp the handle passed to MiniDumpWriteDump is a snapshot, not a process
+      if (m_bDumpFromSnapshot)
+        CallbackOutput->Status = S_FALSE;
+    } break;
+
     case CancelCallback: {
       // This callback allows to cancel minidump generation
       if (m_Assync.IsCancelled()) {
@@ -377,9 +472,20 @@ BOOL CrashReporter::CreateMiniDump() {
     return TRUE;
   }
 
+  typedef LPAPI_VERSION(WINAPI * LPIMAGEHLPAPIVERSIONEX)(LPAPI_VERSION AppVersion);
+  typedef BOOL(WINAPI * LPMINIDUMPWRITEDUMP)(HANDLE hProcess, DWORD ProcessId, HANDLE hFile, MINIDUMP_TYPE DumpType, CONST PMINIDUMP_EXCEPTION_INFORMATION ExceptionParam,
+                                             CONST PMINIDUMP_USER_STREAM_INFORMATION UserEncoderParam, CONST PMINIDUMP_CALLBACK_INFORMATION CallbackParam);
+
   BOOL bStatus = FALSE;
   HMODULE hDbgHelp = NULL;
   HANDLE hFile = NULL;
+  HANDLE hProcess = NULL;
+  HANDLE hSnapshot = NULL;
+  LPIMAGEHLPAPIVERSIONEX lpImagehlpApiVersionEx = NULL;
+  LPMINIDUMPWRITEDUMP pfnMiniDumpWriteDump = NULL;
+  PMINIDUMP_EXCEPTION_INFORMATION pExceptionParam = NULL;
+  BOOL bWriteDump = FALSE;
+  DWORD dwWriteDumpError = 0;
   MINIDUMP_EXCEPTION_INFORMATION mei;
   MINIDUMP_CALLBACK_INFORMATION mci;
   CString sMinidumpFile = m_CrashInfo.GetReport(m_nCurReport)->GetErrorReportDirName() + _T("\\crashdump.dmp");
@@ -418,12 +524,12 @@ BOOL CrashReporter::CreateMiniDump() {
     sMsg.Format(_T("Couldn't create minidump file: %s"), Utility::FormatErrorMsg(dwError));
     m_Assync.SetProgress(sMsg, 0, false);
     sErrorMsg = sMsg;
-    return FALSE;
+    hFile = NULL;
+    goto cleanup;
   }
 
   // Set valid dbghelp API version
-  typedef LPAPI_VERSION(WINAPI * LPIMAGEHLPAPIVERSIONEX)(LPAPI_VERSION AppVersion);
-  LPIMAGEHLPAPIVERSIONEX lpImagehlpApiVersionEx = (LPIMAGEHLPAPIVERSIONEX)GetProcAddress(hDbgHelp, "ImagehlpApiVersionEx");
+  lpImagehlpApiVersionEx = (LPIMAGEHLPAPIVERSIONEX)GetProcAddress(hDbgHelp, "ImagehlpApiVersionEx");
   ATLASSERT(lpImagehlpApiVersionEx != NULL);
   if (lpImagehlpApiVersionEx != NULL) {
     API_VERSION CompiledApiVer;
@@ -446,26 +552,40 @@ BOOL CrashReporter::CreateMiniDump() {
   mci.CallbackRoutine = MiniDumpCallback;
   mci.CallbackParam = this;
 
-  typedef BOOL(WINAPI * LPMINIDUMPWRITEDUMP)(HANDLE hProcess, DWORD ProcessId, HANDLE hFile, MINIDUMP_TYPE DumpType, CONST PMINIDUMP_EXCEPTION_INFORMATION ExceptionParam,
-                                             CONST PMINIDUMP_USER_STREAM_INFORMATION UserEncoderParam, CONST PMINIDUMP_CALLBACK_INFORMATION CallbackParam);
-
   // Get address of MiniDumpWirteDump function
-  LPMINIDUMPWRITEDUMP pfnMiniDumpWriteDump = (LPMINIDUMPWRITEDUMP)GetProcAddress(hDbgHelp, "MiniDumpWriteDump");
+  pfnMiniDumpWriteDump = (LPMINIDUMPWRITEDUMP)GetProcAddress(hDbgHelp, "MiniDumpWriteDump");
   if (!pfnMiniDumpWriteDump) {
     m_Assync.SetProgress(_T("Bad MiniDumpWriteDump function."), 0, false);
     sErrorMsg = _T("Bad MiniDumpWriteDump function");
-    return FALSE;
+    goto cleanup;
   }
 
   // Open client process
-  HANDLE hProcess = OpenProcess(PROCESS_ALL_ACCESS, FALSE, m_CrashInfo.m_dwProcessId);
+  hProcess = OpenProcess(PROCESS_ALL_ACCESS, FALSE, m_CrashInfo.m_dwProcessId);
+
+  // Clone the process state, then let the parent go: the minidump is written
+  // from the clone, so the parent doesn't stay frozen while the file is written.
+  hSnapshot = CaptureProcessSnapshot(hProcess);
+  m_bDumpFromSnapshot = hSnapshot != NULL;
+  if (m_bDumpFromSnapshot)
+    OnStateCaptured(STATE_CAPTURED_PROCESS);
 
   // Now actually write the minidump
-  BOOL bWriteDump = pfnMiniDumpWriteDump(hProcess, m_CrashInfo.m_dwProcessId, hFile, m_CrashInfo.m_MinidumpType, &mei, NULL, &mci);
+  // A hang has no exception, the context captured by the watchdog thread would only mislead.
+  pExceptionParam = m_CrashInfo.m_nExceptionType == CR_HANG ? NULL : &mei;
+  bWriteDump =
+      pfnMiniDumpWriteDump(m_bDumpFromSnapshot ? hSnapshot : hProcess, m_CrashInfo.m_dwProcessId, hFile, m_CrashInfo.m_MinidumpType, pExceptionParam, NULL, &mci);
+  dwWriteDumpError = GetLastError();
+
+  if (hSnapshot != NULL)
+    FreeProcessSnapshot(hSnapshot);
+  m_bDumpFromSnapshot = FALSE;
+  if (hProcess != NULL)
+    CloseHandle(hProcess);
 
   // Check result
   if (!bWriteDump) {
-    CString sMsg = Utility::FormatErrorMsg(GetLastError());
+    CString sMsg = Utility::FormatErrorMsg(dwWriteDumpError);
     m_Assync.SetProgress(_T("Error writing dump."), 0, false);
     m_Assync.SetProgress(sMsg, 0, false);
     sErrorMsg = sMsg;
@@ -495,11 +615,98 @@ cleanup:
   files_to_add.push_back(fi);
 
   // Add file to the list
-  m_CrashInfo.GetReport(0)->AddFileItem(&fi);
+  AddReportFile(&fi);
 
   return bStatus;
 }
 
+BOOL CrashReporter::SymbolizeCrashStack() {
+  CString sMinidumpFile = m_CrashInfo.GetReport(m_nCurReport)->GetErrorReportDirName() + _T("\\crashdump.dmp");
+  if (m_CrashInfo.m_bGenerateMinidump == FALSE || GetFileAttributes(sMinidumpFile) == INVALID_FILE_ATTRIBUTES)
+    return TRUE;  // Nothing to symbolize
+
+  m_Assync.SetProgress(_T("Symbolizing crash stack..."), 0, false);
+
+  CString sStackFile = m_CrashInfo.GetReport(m_nCurReport)->GetErrorReportDirName() + _T("\\crashstack.txt");
+  CSymbolizer symbolizer;
+  if (!symbolizer.Init(m_CrashInfo.m_sDbgHelpPath, CSymbolizer::GetDefaultCacheFolder()) ||
+      !symbolizer.SymbolizeDump(sMinidumpFile, m_CrashInfo.m_dwThreadId, sStackFile)) {
+    m_Assync.SetProgress(_T("Error symbolizing crash stack: ") + symbolizer.GetErrorMsg(), 0, false);
+    return FALSE;
+  }
+
+  // Add the stack file to error report
+  ERIFileItem fi;
+  fi.m_bMakeCopy = false;
+  fi.m_sDesc = TEXT("Symbolized Crash Stack");
+  fi.m_sDestFile = _T("crashstack.txt");
+  fi.m_sSrcFile = sStackFile;
+  AddReportFile(&fi);
+
+  m_Assync.SetProgress(_T("Finished symbolizing crash stack."), 0, false);
+  return TRUE;
+}
+
+int CrashReporter::SymbolizeReport(LPCTSTR szPath, DWORD dwThreadId) {
+  // Either a minidump file or a report folder
+  CString sMinidumpFile = szPath;
+  DWORD dwAttrs = GetFileAttributes(szPath);
+  if (dwAttrs != INVALID_FILE_ATTRIBUTES && (dwAttrs & FILE_ATTRIBUTE_DIRECTORY) != 0)
+    sMinidumpFile += _T("\\crashdump.dmp");
+
+  CString sStackFile = sMinidumpFile;
+  int pos = sStackFile.ReverseFind('\\');
+  sStackFile = (pos >= 0 ? sStackFile.Left(pos + 1) : CString()) + _T("crashstack.txt");
+
+  CSymbolizer symbolizer;
+  if (!symbolizer.Init(NULL, CSymbolizer::GetDefaultCacheFolder()) || !symbolizer.SymbolizeDump(sMinidumpFile, dwThreadId, sStackFile))
+    return 1;
+
+  return 0;
+}
+
+HANDLE CrashReporter::CaptureProcessSnapshot(HANDLE hProcess) {
+  // Process snapshots are available since Windows 8.1, so resolve the function dynamically.
+  typedef DWORD(WINAPI * LPPSSCAPTURESNAPSHOT)(HANDLE ProcessHandle, PSS_CAPTURE_FLAGS CaptureFlags, DWORD ThreadContextFlags, HPSS* SnapshotHandle);
+  LPPSSCAPTURESNAPSHOT pfnPssCaptureSnapshot = (LPPSSCAPTURESNAPSHOT)GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "PssCaptureSnapshot");
+  if (pfnPssCaptureSnapshot == NULL || hProcess == NULL)
+    return NULL;
+
+  LARGE_INTEGER liFreq;
+  LARGE_INTEGER liStart;
+  LARGE_INTEGER liEnd;
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+
+  // Clone the address space copy-on-write and capture all threads with their contexts
+  HPSS hSnapshot = NULL;
+  DWORD dwFlags = PSS_CAPTURE_VA_CLONE | PSS_CAPTURE_HANDLES | PSS_CAPTURE_HANDLE_NAME_INFORMATION | PSS_CAPTURE_HANDLE_BASIC_INFORMATION |
+                  PSS_CAPTURE_HANDLE_TYPE_SPECIFIC_INFORMATION | PSS_CAPTURE_HANDLE_TRACE | PSS_CAPTURE_THREADS | PSS_CAPTURE_THREAD_CONTEXT |
+                  PSS_CAPTURE_THREAD_CONTEXT_EXTENDED | PSS_CREATE_BREAKAWAY | PSS_CREATE_BREAKAWAY_OPTIONAL | PSS_CREATE_USE_VM_ALLOCATIONS |
+                  PSS_CREATE_RELEASE_SECTION;
+  DWORD dwResult = pfnPssCaptureSnapshot(hProcess, (PSS_CAPTURE_FLAGS)dwFlags, CONTEXT_ALL, &hSnapshot);
+  if (dwResult != ERROR_SUCCESS) {
+    CString sMsg;
+    sMsg.Format(_T("Couldn't capture process snapshot: %s"), Utility::FormatErrorMsg(dwResult));
+    m_Assync.SetProgress(sMsg, 0, false);
+    return NULL;
+  }
+
+  QueryPerformanceCounter(&liEnd);
+  CString sMsg;
+  sMsg.Format(_T("Captured process snapshot in %.1f ms"), (double)(liEnd.QuadPart - liStart.QuadPart) * 1000.0 / (double)liFreq.QuadPart);
+  m_Assync.SetProgress(sMsg, 0, false);
+
+  return (HANDLE)hSnapshot;
+}
+
+void CrashReporter::FreeProcessSnapshot(HANDLE hSnapshot) {
+  typedef DWORD(WINAPI * LPPSSFREESNAPSHOT)(HANDLE ProcessHandle, HPSS SnapshotHandle);
+  LPPSSFREESNAPSHOT pfnPssFreeSnapshot = (LPPSSFREESNAPSHOT)GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "PssFreeSnapshot");
+  if (pfnPssFreeSnapshot != NULL)
+    pfnPssFreeSnapshot(GetCurrentProcess(), (HPSS)hSnapshot);
+}
+
 BOOL CrashReporter::SetDumpPrivileges() {
   // This method is used to have the current process be able to call MiniDumpWriteDump
   // This code was taken from:
@@ -621,6 +828,11 @@ BOOL CrashReporter::CreateCrashDescriptionXML(CErrorReportInfo& eri) {
     sInvParamLine.Format(_T("%d"), m_CrashInfo.m_uInvParamLine);
     AddElemToXML(_T("InvParamLine"), sInvParamLine, root);
   }
+  else if (m_CrashInfo.m_nExceptionType == CR_HANG) {
+    // Thread that stopped beating its heartbeat slot
+    sNum.Format(_T("%u"), m_CrashInfo.m_dwThreadId);
+    AddElemToXML(_T("HangThreadId"), sNum, root);
+  }
 
   CString sGuiResources;
   sGuiResources.Format(_T("%d"), eri.GetGuiResourceCount());
@@ -632,6 +844,53 @@ BOOL CrashReporter::CreateCrashDescriptionXML(CErrorReportInfo& eri) {
 
   AddElemToXML(_T("MemoryUsageKbytes"), eri.GetMemUsage(), root);
 
+  if (m_CrashInfo.m_ullCrashSignature != 0) {
+    // Crash counters maintained by the report policy
+    sNum.Format(_T("0x%016I64x"), m_CrashInfo.m_ullCrashSignature);
+    AddElemToXML(_T("CrashSignature"), sNum, root);
+
+    sNum.Format(_T("%u"), m_CrashInfo.m_dwSignatureCountToday);
+    AddElemToXML(_T("SignatureCountToday"), sNum, root);
+
+    sNum.Format(_T("%u"), m_CrashInfo.m_dwSignatureCountTotal);
+    AddElemToXML(_T("SignatureCountTotal"), sNum, root);
+
+    AddElemToXML(_T("ReportLevel"), m_CrashInfo.m_nReportLevel == REPORT_LEVEL_SUMMARY ? _T("summary") : _T("full"), root);
+  }
+
+  // More threads may have crashed since the crash description was read.
+  m_CrashInfo.ReadSecondaryCrashes();
+
+  if (m_CrashInfo.m_nSecondaryCrashCount != 0) {
+    // Threads that crashed while this report was being generated
+    TiXmlHandle hSecondaryCrashes = new TiXmlElement("SecondaryCrashes");
+    root->LinkEndChild(hSecondaryCrashes.ToNode());
+
+    sNum.Format(_T("%d"), m_CrashInfo.m_nSecondaryCrashCount);
+    hSecondaryCrashes.ToElement()->SetAttribute("count", strconv.t2utf8(sNum));
+
+    for (size_t j = 0; j < m_CrashInfo.m_aSecondaryCrashes.size(); j++) {
+      SECONDARY_CRASH& sc = m_CrashInfo.m_aSecondaryCrashes[j];
+      TiXmlHandle hCrash = new TiXmlElement("Crash");
+
+      sNum.Format(_T("%u"), (DWORD)sc.m_lThreadId);
+      hCrash.ToElement()->SetAttribute("thread", strconv.t2utf8(sNum));
+
+      sNum.Format(_T("%d"), sc.m_nExceptionType);
+      hCrash.ToElement()->SetAttribute("type", strconv.t2utf8(sNum));
+
+      if (sc.m_nExceptionType == CR_SEH_EXCEPTION || sc.m_ullExceptionAddress != 0) {
+        sNum.Format(_T("%d"), sc.m_dwExceptionCode);
+        hCrash.ToElement()->SetAttribute("code", strconv.t2utf8(sNum));
+
+        sNum.Format(_T("0x%I64x"), sc.m_ullExceptionAddress);
+        hCrash.ToElement()->SetAttribute("address", strconv.t2utf8(sNum));
+      }
+
+      hSecondaryCrashes.ToElement()->LinkEndChild(hCrash.ToNode());
+    }
+  }
+
   if (eri.GetScreenshotInfo().m_bValid) {
     TiXmlHandle hScreenshotInfo = new TiXmlElement("ScreenshotInfo");
     root->LinkEndChild(hScreenshotInfo.ToNode());
@@ -719,6 +978,37 @@ BOOL CrashReporter::CreateCrashDescriptionXML(CErrorReportInfo& eri) {
     hCustomProps.ToElement()->LinkEndChild(hProp.ToNode());
   }
 
+  if (eri.GetBreadcrumbCount() != 0) {
+    TiXmlHandle hBreadcrumbs = new TiXmlElement("Breadcrumbs");
+    root->LinkEndChild(hBreadcrumbs.ToNode());
+
+    for (i = 0; i < eri.GetBreadcrumbCount(); i++) {
+      BreadcrumbInfo* pbi = eri.GetBreadcrumbByIndex(i);
+
+      FILETIME ft;
+      SYSTEMTIME st;
+      ft.dwLowDateTime = (DWORD)pbi->m_ullTime;
+      ft.dwHighDateTime = (DWORD)(pbi->m_ullTime >> 32);
+      FileTimeToSystemTime(&ft, &st);
+
+      TiXmlHandle hBreadcrumb = new TiXmlElement("Breadcrumb");
+
+      sNum.Format(_T("%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+      hBreadcrumb.ToElement()->SetAttribute("time", strconv.t2utf8(sNum));
+
+      sNum.Format(_T("%u"), pbi->m_dwThreadId);
+      hBreadcrumb.ToElement()->SetAttribute("thread", strconv.t2utf8(sNum));
+
+      sNum.Format(_T("%d"), pbi->m_nLevel);
+      hBreadcrumb.ToElement()->SetAttribute("level", strconv.t2utf8(sNum));
+
+      hBreadcrumb.ToElement()->SetAttribute("category", strconv.t2utf8(pbi->m_sCategory));
+      hBreadcrumb.ToElement()->SetAttribute("message", strconv.t2utf8(pbi->m_sMessage));
+
+      hBreadcrumbs.ToElement()->LinkEndChild(hBreadcrumb.ToNode());
+    }
+  }
+
   TiXmlHandle hFileItems = new TiXmlElement("FileList");
   root->LinkEndChild(hFileItems.ToNode());
 
@@ -732,6 +1022,18 @@ BOOL CrashReporter::CreateCrashDescriptionXML(CErrorReportInfo& eri) {
       hFileItem.ToElement()->SetAttribute("optional", "1");
     if (!rfi->m_sErrorStatus.IsEmpty())
       hFileItem.ToElement()->SetAttribute("error", strconv.t2utf8(rfi->m_sErrorStatus));
+    if (rfi->m_lLinkedSize >= 0) {
+      // The file in the report folder is a hard link, readers must stop at this size
+      // and check that the application didn't rewrite the file since.
+      sNum.Format(_T("%I64d"), rfi->m_lLinkedSize);
+      hFileItem.ToElement()->SetAttribute("size", strconv.t2utf8(sNum));
+      sNum.Format(_T("%I64u"), rfi->m_ullLinkedFileId);
+      hFileItem.ToElement()->SetAttribute("fileid", strconv.t2utf8(sNum));
+      sNum.Format(_T("%I64u"), rfi->m_ullLinkedWriteTime);
+      hFileItem.ToElement()->SetAttribute("mtime", strconv.t2utf8(sNum));
+      sNum.Format(_T("%u"), rfi->m_dwLinkedTailCrc);
+      hFileItem.ToElement()->SetAttribute("tailcrc", strconv.t2utf8(sNum));
+    }
 
     hFileItems.ToElement()->LinkEndChild(hFileItem.ToNode());
   }
@@ -772,21 +1074,23 @@ cleanup:
 }
 
 // This method collects user-specified files
-BOOL CrashReporter::CollectCrashFiles() {
+BOOL CrashReporter::CollectCrashFiles(std::vector<ERIFileItem>& aFileItems) {
   BOOL bStatus = FALSE;
-  CString str;
-  CString sErrorReportDir = m_CrashInfo.GetReport(m_nCurReport)->GetErrorReportDirName();
-  CString sSrcFile;
-  CString sDestFile;
   std::vector<ERIFileItem> file_list;
+  size_t i;
 
   // Copy application-defined files that should be copied on crash
   m_Assync.SetProgress(_T("[copying_files]"), 0, false);
 
-  // Walk through error report files
-  int i;
-  for (i = 0; i < m_CrashInfo.GetReport(m_nCurReport)->GetFileItemCount(); i++) {
-    ERIFileItem* pfi = m_CrashInfo.GetReport(m_nCurReport)->GetFileItemByIndex(i);
+  // Files being copied are deflated into the ZIP archive at the same time
+  // (CompressReportFiles() adds the rest of the files later).
+  if (m_CrashInfo.m_bStoreZIPArchives)
+    OpenReportZip();
+
+  // Walk through error report files. Other stages add their files to the report
+  // meanwhile, so work on our own copy of the items.
+  for (i = 0; i < aFileItems.size(); i++) {
+    ERIFileItem* pfi = &aFileItems[i];
 
     // Check if operation has been cancelled by user
     if (m_Assync.IsCancelled())
@@ -796,32 +1100,83 @@ BOOL CrashReporter::CollectCrashFiles() {
     BOOL bSearchPattern = Utility::IsFileSearchPattern(pfi->m_sSrcFile);
     if (bSearchPattern)
       CollectFilesBySearchTemplate(pfi, file_list);
-    else
-      CollectSingleFile(pfi);
   }
 
-  // Add newly collected files to the list of file items
-  for (i = 0; i < (int)file_list.size(); i++) {
-    m_CrashInfo.GetReport(0)->AddFileItem(&file_list[i]);
-  }
-
-  // Remove file items that are search patterns
-  BOOL bFound = FALSE;
-  do {
-    bFound = FALSE;
-    for (i = 0; i < m_CrashInfo.GetReport(m_nCurReport)->GetFileItemCount(); i++) {
-      ERIFileItem* pfi = m_CrashInfo.GetReport(m_nCurReport)->GetFileItemByIndex(i);
-
-      // Check if the file name is a search template.
-      BOOL bSearchPattern = Utility::IsFileSearchPattern(pfi->m_sSrcFile);
-      if (bSearchPattern) {
-        // Delete this item
-        m_CrashInfo.GetReport(m_nCurReport)->DeleteFileItemByIndex(i);
-        bFound = TRUE;
+  {
+    // Copy files concurrently, large attachments take most of the time
+    std::vector<ERIFileItem*> aFilesToCopy;
+    for (i = 0; i < aFileItems.size(); i++) {
+      if (!Utility::IsFileSearchPattern(aFileItems[i].m_sSrcFile))
+        aFilesToCopy.push_back(&aFileItems[i]);
+    }
+    for (i = 0; i < file_list.size(); i++)
+      aFilesToCopy.push_back(&file_list[i]);
+
+    volatile LONG lNextFile = -1;
+    auto CopyFiles = [this, &aFilesToCopy, &lNextFile]() {
+      LONG lFile;
+      while ((lFile = InterlockedIncrement(&lNextFile)) < (LONG)aFilesToCopy.size()) {
+        if (m_Assync.IsCancelled())
+          break;
+        CollectSingleFile(aFilesToCopy[lFile]);
+      }
+    };
+
+    std::vector<std::thread> aThreads;
+    for (i = 1; i < aFilesToCopy.size() && i < MAX_CONCURRENT_FILE_COPIES; i++)
+      aThreads.push_back(std::thread(CopyFiles));
+
+    CopyFiles();
+
+    for (i = 0; i < aThreads.size(); i++)
+      aThreads[i].join();
+  }
+
+  if (m_Assync.IsCancelled())
+    goto cleanup;
+
+  // Success
+  bStatus = TRUE;
+
+cleanup:
+
+  m_csFileItems.Lock();
+
+  CErrorReportInfo* eri = m_CrashInfo.GetReport(m_nCurReport);
+
+  // Update file items (error status and path of the copy) and
+  // remove file items that are search patterns
+  for (i = 0; i < aFileItems.size(); i++) {
+    if (!Utility::IsFileSearchPattern(aFileItems[i].m_sSrcFile)) {
+      eri->AddFileItem(&aFileItems[i]);
+      continue;
+    }
+
+    int j;
+    for (j = 0; j < eri->GetFileItemCount(); j++) {
+      if (eri->GetFileItemByIndex(j)->m_sDestFile == aFileItems[i].m_sDestFile) {
+        eri->DeleteFileItemByIndex(j);
         break;
       }
     }
-  } while (bFound);
+  }
+
+  // Add newly collected files to the list of file items
+  for (i = 0; i < file_list.size(); i++) {
+    eri->AddFileItem(&file_list[i]);
+  }
+
+  m_csFileItems.Unlock();
+
+  // Clean up
+  m_Assync.SetProgress(_T("Finished copying files."), 100, false);
+
+  return bStatus;
+}
+
+// This method dumps user-specified registry keys
+BOOL CrashReporter::DumpRegKeys() {
+  CString str;
 
   // Create dump of registry keys
 
@@ -831,13 +1186,14 @@ BOOL CrashReporter::CollectCrashFiles() {
   }
 
   // Walk through our registry key list
+  int i;
   for (i = 0; i < eri->GetRegKeyCount(); i++) {
     CString sKeyName;
     ERIRegKey rki;
     eri->GetRegKeyByIndex(i, sKeyName, rki);
 
     if (m_Assync.IsCancelled())
-      goto cleanup;
+      return FALSE;
 
     CString sFilePath = eri->GetErrorReportDirName() + _T("\\") + rki.m_sDstFileName;
 
@@ -854,21 +1210,11 @@ BOOL CrashReporter::CollectCrashFiles() {
     fi.m_bMakeCopy = FALSE;
     fi.m_bAllowDelete = rki.m_bAllowDelete;
     fi.m_sErrorStatus = sErrorMsg;
-    std::vector<ERIFileItem> file_list;
-    file_list.push_back(fi);
     // Add file to the list of file items
-    m_CrashInfo.GetReport(0)->AddFileItem(&fi);
+    AddReportFile(&fi);
   }
 
-  // Success
-  bStatus = TRUE;
-
-cleanup:
-
-  // Clean up
-  m_Assync.SetProgress(_T("Finished copying files."), 100, false);
-
-  return 0;
+  return TRUE;
 }
 
 BOOL CrashReporter::CollectSingleFile(ERIFileItem* pfi) {
@@ -878,18 +1224,16 @@ BOOL CrashReporter::CollectSingleFile(ERIFileItem* pfi) {
   HANDLE hDestFile = INVALID_HANDLE_VALUE;
   BOOL bGetSize = FALSE;
   LARGE_INTEGER lFileSize;
-  LARGE_INTEGER lTotalWritten;
   CString sDestFile;
-  BOOL bRead = FALSE;
-  BOOL bWrite = FALSE;
-  LPBYTE buffer[1024];
-  DWORD dwBytesRead = 0;
-  DWORD dwBytesWritten = 0;
+  BOOL bStream = FALSE;
+  BOOL bCopy = FALSE;
+  CFileCopier copier;
+  std::unique_lock<std::mutex> ZipLock(m_ZipLock, std::defer_lock);
 
   CString sErrorReportDir = m_CrashInfo.GetReport(m_nCurReport)->GetErrorReportDirName();
 
   // Open source file with read/write sharing permissions.
-  hSrcFile = CreateFile(pfi->m_sSrcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+  hSrcFile = CreateFile(pfi->m_sSrcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
   if (hSrcFile == INVALID_HANDLE_VALUE) {
     pfi->m_sErrorStatus = Utility::FormatErrorMsg(GetLastError());
     str.Format(_T("Error opening file %s."), pfi->m_sSrcFile);
@@ -907,48 +1251,100 @@ BOOL CrashReporter::CollectSingleFile(ERIFileItem* pfi) {
       pfi->m_sErrorStatus = Utility::FormatErrorMsg(GetLastError());
       str.Format(_T("Couldn't get file size of %s"), pfi->m_sSrcFile);
       m_Assync.SetProgress(str, 0, false);
-      CloseHandle(hSrcFile);
-      hSrcFile = INVALID_HANDLE_VALUE;
       goto cleanup;
     }
 
     sDestFile = sErrorReportDir + _T("\\") + pfi->m_sDestFile;
 
-    hDestFile = CreateFile(sDestFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+    // Produce the copy and the compressed entry from a single read of the source
+    // (zipWriteInFileInZip() computes the CRC as data goes in). Files are copied
+    // concurrently, but only one of them at a time can be streamed into the archive;
+    // the others are compressed by CompressReportFiles() later.
+    if (m_Zip.IsOpen() && ZipLock.try_lock()) {
+      bStream = m_StreamedFiles.find(pfi->m_sDestFile) == m_StreamedFiles.end();
+      if (bStream) {
+        int nMethod = Z_DEFLATED;
+        int nLevel = Z_DEFAULT_COMPRESSION;
+        CZipWriter::SelectCodec(pfi->m_sDestFile, hSrcFile, nMethod, nLevel);
+        bStream = m_Zip.OpenEntry(pfi->m_sDestFile, pfi->m_sDesc, hSrcFile, nMethod, nLevel);
+      }
+      if (bStream)
+        m_StreamedFiles.insert(pfi->m_sDestFile);
+      else
+        ZipLock.unlock();
+    }
+
+    // Unless the data is needed for the archive right now, try to avoid copying it at all
+    if (!bStream) {
+      FileLinkInfo LinkInfo;
+      FILE_SNAPSHOT_TYPE snapshot = copier.Snapshot(pfi->m_sSrcFile, hSrcFile, sDestFile, lFileSize.QuadPart, &LinkInfo);
+      if (snapshot != FILE_SNAPSHOT_NONE) {
+        if (snapshot == FILE_SNAPSHOT_HARDLINK) {
+          // The application may keep appending; only the current size belongs to the report
+          pfi->m_lLinkedSize = lFileSize.QuadPart;
+          pfi->m_ullLinkedFileId = LinkInfo.m_ullFileId;
+          pfi->m_ullLinkedWriteTime = LinkInfo.m_ullWriteTime;
+          pfi->m_dwLinkedTailCrc = LinkInfo.m_dwTailCrc;
+          str.Format(_T("Linked file %s (%I64d bytes)."), pfi->m_sSrcFile, lFileSize.QuadPart);
+        }
+        else {
+          str.Format(_T("Cloned file %s."), pfi->m_sSrcFile);
+        }
+        m_Assync.SetProgress(str, 0, false);
+
+        // Use the snapshot for display and zipping.
+        pfi->m_sSrcFile = sDestFile;
+        bStatus = true;
+        goto cleanup;
+      }
+    }
+
+    hDestFile = CreateFile(sDestFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
     if (hDestFile == INVALID_HANDLE_VALUE) {
       pfi->m_sErrorStatus = Utility::FormatErrorMsg(GetLastError());
       str.Format(_T("Error creating file %s."), sDestFile);
       m_Assync.SetProgress(str, 0, false);
-      CloseHandle(hSrcFile);
-      hSrcFile = INVALID_HANDLE_VALUE;
       goto cleanup;
     }
 
-    lTotalWritten.QuadPart = 0;
-
-    for (;;) {
-      if (m_Assync.IsCancelled())
-        goto cleanup;
-
-      bRead = ReadFile(hSrcFile, buffer, 1024, &dwBytesRead, NULL);
-      if (!bRead || dwBytesRead == 0)
-        break;
-
-      bWrite = WriteFile(hDestFile, buffer, dwBytesRead, &dwBytesWritten, NULL);
-      if (!bWrite || dwBytesRead != dwBytesWritten)
-        break;
-
-      lTotalWritten.QuadPart += dwBytesWritten;
-
-      int nProgress = (int)(100.0f * lTotalWritten.QuadPart / lFileSize.QuadPart);
-
-      m_Assync.SetProgress(nProgress, false);
+    bCopy = copier.Copy(hSrcFile, hDestFile, lFileSize.QuadPart,
+                        bStream ? std::function<void(LPBYTE, DWORD)>([this, &bStream, pfi](LPBYTE pData, DWORD dwSize) {
+                          if (!bStream)
+                            return;
+
+                          if (!m_Zip.WriteEntry(pData, dwSize)) {
+                            // The entry stays truncated, the archive is rebuilt by CompressReportFiles()
+                            CString sMsg;
+                            sMsg.Format(_T("Couldn't write to compressed file %s"), pfi->m_sDestFile);
+                            m_Assync.SetProgress(sMsg, 0, false);
+                            bStream = FALSE;
+                          }
+                          else {
+                            m_lStreamedSize += dwSize;
+                          }
+                        })
+                                : std::function<void(LPBYTE, DWORD)>(),
+                        [this, &lFileSize](ULONG64 ullCopied) {
+                          int nProgress = lFileSize.QuadPart == 0 ? 100 : (int)(100.0f * ullCopied / lFileSize.QuadPart);
+                          m_Assync.SetProgress(nProgress, false);
+                        },
+                        [this]() { return m_Assync.IsCancelled(); });
+
+    if (ZipLock.owns_lock()) {
+      // An entry cut short by a failed or cancelled copy must not pass for the whole file
+      if (!bCopy || !bStream)
+        m_bZipDamaged = TRUE;
+      m_Zip.CloseEntry();
+      ZipLock.unlock();
     }
 
-    CloseHandle(hSrcFile);
-    hSrcFile = INVALID_HANDLE_VALUE;
-    CloseHandle(hDestFile);
-    hDestFile = INVALID_HANDLE_VALUE;
+    if (!bCopy) {
+      if (copier.GetLastError() != ERROR_CANCELLED)
+        pfi->m_sErrorStatus = Utility::FormatErrorMsg(copier.GetLastError());
+      str.Format(_T("Error copying file %s."), pfi->m_sSrcFile);
+      m_Assync.SetProgress(str, 0, false);
+      goto cleanup;
+    }
 
     // Use the copy for display and zipping.
     pfi->m_sSrcFile = sDestFile;
@@ -958,6 +1354,13 @@ BOOL CrashReporter::CollectSingleFile(ERIFileItem* pfi) {
 
 cleanup:
 
+  if (ZipLock.owns_lock()) {
+    // The entry was opened, but nothing was copied into it
+    m_bZipDamaged = TRUE;
+    m_Zip.CloseEntry();
+    ZipLock.unlock();
+  }
+
   if (hSrcFile != INVALID_HANDLE_VALUE)
     CloseHandle(hSrcFile);
 
@@ -1005,8 +1408,6 @@ BOOL CrashReporter::CollectFilesBySearchTemplate(ERIFileItem* pfi, std::vector<E
         fi.m_bAllowDelete = pfi->m_bAllowDelete;
         file_list.push_back(fi);
 
-        CollectSingleFile(&fi);
-
         nFileCount++;
       }
 
@@ -1337,13 +1738,9 @@ BOOL CrashReporter::RestartApp() {
 // This method compresses the files contained in the report and produces a ZIP archive.
 BOOL CrashReporter::CompressReportFiles(CErrorReportInfo* eri) {
   BOOL bStatus = FALSE;
-  strconv_t strconv;
-  zipFile hZip = NULL;
   CString sMsg;
   LONG64 lTotalSize = 0;
   LONG64 lTotalCompressed = 0;
-  BYTE buff[1024];
-  DWORD dwBytesRead = 0;
   HANDLE hFile = INVALID_HANDLE_VALUE;
   std::map<CString, ERIFileItem>::iterator it;
   FILE* f = NULL;
@@ -1362,23 +1759,24 @@ BOOL CrashReporter::CompressReportFiles(CErrorReportInfo* eri) {
   sMsg.Format(_T("Total file size for compression is %I64d bytes"), lTotalSize);
   m_Assync.SetProgress(sMsg, 0, false);
 
-  // Determine what name to use for the output ZIP archive file.
-  if (m_bExport)
-    m_sZipName = m_sExportFileName;
-  else
-    m_sZipName = eri->GetErrorReportDirName() + _T(".zip");
-
-  // Update progress
-  sMsg.Format(_T("Creating ZIP archive file %s"), m_sZipName);
-  m_Assync.SetProgress(sMsg, 1, false);
+  // An entry streamed while copying was left incomplete. minizip can't replace an entry,
+  // so start the archive over and compress every file from its copy.
+  if (m_bZipDamaged) {
+    m_Assync.SetProgress(_T("ZIP archive has an incomplete entry, recreating it."), 0, false);
+    CloseReportZip();
+    DeleteFile(m_sZipName);
+    m_bZipDamaged = FALSE;
+  }
 
-  // Create ZIP archive
-  hZip = zipOpen((const char*)m_sZipName.GetBuffer(0), APPEND_STATUS_CREATE);
-  if (hZip == NULL) {
+  // Create ZIP archive (unless created already when copying files)
+  if (!OpenReportZip()) {
     m_Assync.SetProgress(_T("Failed to create ZIP file."), 100, true);
     goto cleanup;
   }
 
+  // Files deflated while being copied are already in the archive
+  lTotalCompressed = m_lStreamedSize;
+
   // Enumerate files contained in the report
   int i;
   for (i = 0; i < eri->GetFileItemCount(); i++) {
@@ -1395,84 +1793,98 @@ BOOL CrashReporter::CompressReportFiles(CErrorReportInfo* eri) {
     // Define file description
     CString sDesc = pfi->m_sDesc;
 
+    if (m_StreamedFiles.find(sDstFileName) != m_StreamedFiles.end())
+      continue;
+
     // Update progress
     sMsg.Format(_T("Compressing file %s"), sDstFileName);
     m_Assync.SetProgress(sMsg, 0, false);
 
-    // Open file for reading
-    hFile = CreateFile(sFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
+    // Open file for reading (a hard link may still be open for writing by the application)
+    hFile = CreateFile(sFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, NULL, NULL);
     if (hFile == INVALID_HANDLE_VALUE) {
       sMsg.Format(_T("Couldn't open file %s"), sFileName);
       m_Assync.SetProgress(sMsg, 0, false);
       continue;
     }
 
-    // Get file information.
-    BY_HANDLE_FILE_INFORMATION fi;
-    GetFileInformationByHandle(hFile, &fi);
-
-    // Convert file creation time to system file time.
-    SYSTEMTIME st;
-    FileTimeToSystemTime(&fi.ftLastWriteTime, &st);
-
-    // Fill in the ZIP file info
-    zip_fileinfo info;
-    info.dosDate = 0;
-    info.tmz_date.tm_year = st.wYear;
-    info.tmz_date.tm_mon = st.wMonth - 1;
-    info.tmz_date.tm_mday = st.wDay;
-    info.tmz_date.tm_hour = st.wHour;
-    info.tmz_date.tm_min = st.wMinute;
-    info.tmz_date.tm_sec = st.wSecond;
-    info.external_fa = FILE_ATTRIBUTE_NORMAL;
-    info.internal_fa = FILE_ATTRIBUTE_NORMAL;
-
-    // Create new file inside of our ZIP archive
-    int n = zipOpenNewFileInZip(hZip, (const char*)strconv.t2a(sDstFileName.GetBuffer(0)), &info, NULL, 0, NULL, 0, strconv.t2a(sDesc), Z_DEFLATED, Z_DEFAULT_COMPRESSION);
-    if (n != 0) {
+    // Only read what belongs to the report
+    LARGE_INTEGER lFileSize;
+    if (!GetFileSizeEx(hFile, &lFileSize))
+      lFileSize.QuadPart = 0;
+    LONG64 lRemaining = pfi->GetReportSize(lFileSize.QuadPart);
+
+    // A hard-linked file may have been truncated or rewritten by the application since the crash
+    // (the report may be sent at the next start); its data is not what the report captured then.
+    if (pfi->m_lLinkedSize >= 0) {
+      FileLinkInfo LinkInfo;
+      LinkInfo.m_ullSize = (ULONG64)pfi->m_lLinkedSize;
+      LinkInfo.m_ullFileId = pfi->m_ullLinkedFileId;
+      LinkInfo.m_ullWriteTime = pfi->m_ullLinkedWriteTime;
+      LinkInfo.m_dwTailCrc = pfi->m_dwLinkedTailCrc;
+      if (!CFileCopier::CheckLinkInfo(hFile, LinkInfo)) {
+        pfi->m_sErrorStatus = _T("File was modified after the crash");
+        sMsg.Format(_T("File %s was modified after the crash, it is not included"), sDstFileName);
+        m_Assync.SetProgress(sMsg, 0, false);
+        lTotalSize -= lRemaining;
+        CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+        continue;
+      }
+    }
+
+    // Don't spend time on data that won't get smaller
+    int nMethod = Z_DEFLATED;
+    int nLevel = Z_DEFAULT_COMPRESSION;
+    CZipWriter::SelectCodec(sDstFileName, hFile, nMethod, nLevel);
+
+    // Create new file inside of our ZIP archive and compress the file into it
+    LONG64 lAdded = 0;
+    ZIP_ADD_RESULT result = m_Zip.AddFile(sDstFileName, sDesc, hFile, lRemaining, nMethod, nLevel, lAdded,
+                                          [this, lTotalCompressed, lTotalSize](LONG64 lFileAdded) {
+                                            // Update progress
+                                            float fProgress = 100.0f * (lTotalCompressed + lFileAdded) / lTotalSize;
+                                            m_Assync.SetProgress((int)fProgress, false);
+                                          },
+                                          [this]() { return m_Assync.IsCancelled(); });
+    CloseHandle(hFile);
+    hFile = INVALID_HANDLE_VALUE;
+
+    // Update totals
+    lTotalCompressed += lAdded;
+
+    if (result == ZIP_ADD_NO_ENTRY) {
       sMsg.Format(_T("Couldn't compress file %s"), sDstFileName);
       m_Assync.SetProgress(sMsg, 0, false);
       continue;
     }
 
-    // Read source file contents and write it to ZIP archive
-    for (;;) {
-      // Check if operation was cancelled by user
-      if (m_Assync.IsCancelled())
-        goto cleanup;
-
-      // Read a portion of source file
-      BOOL bRead = ReadFile(hFile, buff, 1024, &dwBytesRead, NULL);
-      if (!bRead || dwBytesRead == 0)
-        break;
-
-      // Write a portion into destination file
-      int res = zipWriteInFileInZip(hZip, buff, dwBytesRead);
-      if (res != 0) {
-        zipCloseFileInZip(hZip);
+    if (result == ZIP_ADD_BROKEN) {
+      // The entry lacks its final deflate block and can't be closed properly;
+      // don't leave an archive that looks valid.
+      if (!m_Assync.IsCancelled()) {
         sMsg.Format(_T("Couldn't write to compressed file %s"), sDstFileName);
         m_Assync.SetProgress(sMsg, 0, false);
-        break;
       }
+      CloseReportZip();
+      DeleteFile(m_sZipName);
+      goto cleanup;
+    }
 
-      // Update totals
-      lTotalCompressed += dwBytesRead;
+    // Check if the operation was cancelled by user
+    if (m_Assync.IsCancelled())
+      goto cleanup;
 
-      // Update progress
-      float fProgress = 100.0f * lTotalCompressed / lTotalSize;
-      m_Assync.SetProgress((int)fProgress, false);
+    if (result == ZIP_ADD_INCOMPLETE) {
+      sMsg.Format(_T("Couldn't write to compressed file %s"), sDstFileName);
+      m_Assync.SetProgress(sMsg, 0, false);
     }
-
-    // Close file
-    zipCloseFileInZip(hZip);
-    CloseHandle(hFile);
-    hFile = INVALID_HANDLE_VALUE;
   }
 
-  // Close ZIP archive
-  if (hZip != NULL) {
-    zipClose(hZip, NULL);
-    hZip = NULL;
+  // Close ZIP archive (writes the central directory, in ZIP64 format when the archive exceeds 4 GB)
+  if (!CloseReportZip()) {
+    m_Assync.SetProgress(_T("Failed to write ZIP central directory."), 0, false);
+    goto cleanup;
   }
 
   // Check if totals match
@@ -1483,8 +1895,7 @@ cleanup:
 
   // Clean up
 
-  if (hZip != NULL)
-    zipClose(hZip, NULL);
+  CloseReportZip();
 
   if (hFile != INVALID_HANDLE_VALUE)
     CloseHandle(hFile);
@@ -1510,6 +1921,34 @@ cleanup:
   return bStatus;
 }
 
+BOOL CrashReporter::OpenReportZip() {
+  if (m_Zip.IsOpen())
+    return TRUE;  // Already open
+
+  CErrorReportInfo* eri = m_CrashInfo.GetReport(m_nCurReport);
+
+  // Determine what name to use for the output ZIP archive file.
+  if (m_bExport)
+    m_sZipName = m_sExportFileName;
+  else
+    m_sZipName = eri->GetErrorReportDirName() + _T(".zip");
+
+  // Update progress
+  CString sMsg;
+  sMsg.Format(_T("Creating ZIP archive file %s"), m_sZipName);
+  m_Assync.SetProgress(sMsg, 1, false);
+
+  m_StreamedFiles.clear();
+  m_lStreamedSize = 0;
+
+  // Create ZIP archive
+  return m_Zip.Open(m_sZipName);
+}
+
+BOOL CrashReporter::CloseReportZip() {
+  return m_Zip.Close();
+}
+
 BOOL CrashReporter::HasErrors() {
   return m_bErrors;
 }
@@ -1518,6 +1957,30 @@ CString CrashReporter::GetLogFilePath() {
   return m_Assync.GetLogFilePath();
 }
 
+BOOL CrashReporter::WaitForActivation(LPCTSTR szCrashGUID, DWORD dwParentProcessId) {
+  // The parent process has created the event before starting us.
+  CString sEventName;
+  sEventName.Format(_T("Local\\CrashRptStandby_%s"), szCrashGUID);
+  HANDLE hEvent = OpenEvent(SYNCHRONIZE, FALSE, sEventName);
+  if (hEvent == NULL)
+    return FALSE;
+
+  HANDLE hParentProcess = OpenProcess(SYNCHRONIZE, FALSE, dwParentProcessId);
+  if (hParentProcess == NULL) {
+    CloseHandle(hEvent);
+    return FALSE;
+  }
+
+  // The event is signaled on crash. If the parent exits normally, there is nothing to report.
+  HANDLE hWaitHandles[2] = {hEvent, hParentProcess};
+  DWORD dwWaitResult = WaitForMultipleObjects(2, hWaitHandles, FALSE, INFINITE);
+
+  CloseHandle(hParentProcess);
+  CloseHandle(hEvent);
+
+  return dwWaitResult == WAIT_OBJECT_0;
+}
+
 int CrashReporter::TerminateAllCrashReportProcesses() {
   // This method looks for all runing CrashReport.exe processes
   // and terminates each one. This may be needed when an application's installer
@@ -2,7 +2,17 @@
 #include "AssyncNotification.h"
 #include "tinyxml.h"
 #include "CrashInfoReader.h"
+#include "TaskGraph.h"
+#include "ZipWriter.h"
 #include <future>
+#include <mutex>
+
+// State-capturing stages; the parent process is unblocked once all of them are done.
+#define STATE_CAPTURED_SCREENSHOT 0x1  /* Desktop screenshot taken (or skipped) */
+#define STATE_CAPTURED_PROCESS 0x2     /* Process state snapshotted or written to minidump */
+#define STATE_CAPTURED_ALL 0x3
+
+#define MAX_CONCURRENT_FILE_COPIES 4  /* Count of attachments copied at the same time */
 
 class CrashReporter {
  public:
@@ -63,13 +73,27 @@ class CrashReporter {
   // This method finds and terminates all instances of CrashSender.exe process.
   static int TerminateAllCrashReportProcesses();
 
+  // Writes the symbolized stack of a minidump (or of crashdump.dmp in a report folder) next to it.
+  // Returns zero on success.
+  static int SymbolizeReport(LPCTSTR szPath, DWORD dwThreadId);
+
+  // Used by a standby instance: waits until the parent process signals a crash with the given GUID.
+  // Returns FALSE if the parent process exits without crash.
+  static BOOL WaitForActivation(LPCTSTR szCrashGUID, DWORD dwParentProcessId);
+
  private:
   BOOL InitLog();
 
   BOOL DoWork();
 
-  // Collects crash report files.
-  BOOL CollectCrashFiles();
+  // Collects application-defined crash report files (items present in the report before other stages started).
+  BOOL CollectCrashFiles(std::vector<ERIFileItem>& aFileItems);
+
+  // Dumps application-defined registry keys to XML files.
+  BOOL DumpRegKeys();
+
+  // Adds a file to the report (may be called by concurrently running stages).
+  void AddReportFile(ERIFileItem* pfi);
 
   // Includes a single file to crash report
   BOOL CollectSingleFile(ERIFileItem* pfi);
@@ -83,6 +107,9 @@ class CrashReporter {
   // Creates crash dump file.
   BOOL CreateMiniDump();
 
+  // Writes the symbolized stack of the crashed thread and adds it to the report.
+  BOOL SymbolizeCrashStack();
+
   // This method is used to have the current process be able to call MiniDumpWriteDump.
   BOOL SetDumpPrivileges();
 
@@ -113,10 +140,27 @@ class CrashReporter {
   // Packs error report files to ZIP archive.
   BOOL CompressReportFiles(CErrorReportInfo* eri);
 
-  // Unblocks parent process.
+  // Creates the ZIP archive of the report (if not created yet).
+  BOOL OpenReportZip();
+
+  // Closes the ZIP archive of the report. Returns FALSE if the central directory couldn't be written.
+  BOOL CloseReportZip();
+
+  // Unblocks parent process (only once).
   void UnblockParentProcess();
 
+  // Marks a state-capturing stage as done and unblocks the parent process after the last one.
+  void OnStateCaptured(LONG lStage);
+
+  // Writes start time and duration of each stage and the critical path to the log.
+  void LogStageTimings(CTaskGraph& graph);
+
+  // Captures a snapshot of the parent process, so the minidump can be written
+  // after the parent is unblocked. Returns NULL if snapshots are not supported.
+  HANDLE CaptureProcessSnapshot(HANDLE hProcess);
 
+  // Frees the snapshot captured by CaptureProcessSnapshot().
+  void FreeProcessSnapshot(HANDLE hSnapshot);
 
   // Internal variables
   static CrashReporter* m_pInstance;       // Singleton
@@ -134,6 +178,15 @@ class CrashReporter {
   CString m_sExportFileName;               // File name for exporting.
   BOOL m_bErrors;                          // TRUE if there were errors.
   CString m_sCrashLogFile;                 // Log file.
+  volatile LONG m_lParentUnblocked;        // TRUE if the parent process has been unblocked.
+  volatile LONG m_lStateCaptured;          // STATE_CAPTURED_* flags of finished state-capturing stages.
+  CComAutoCriticalSection m_csFileItems;   // Protects the file list of the report while stages run in parallel.
+  BOOL m_bDumpFromSnapshot;                // TRUE if the minidump is written from a process snapshot.
+  CZipWriter m_Zip;                        // ZIP archive being written.
+  std::mutex m_ZipLock;                    // Held by the file being streamed into the ZIP archive.
+  std::set<CString> m_StreamedFiles;       // Files already deflated into the ZIP archive while being copied.
+  LONG64 m_lStreamedSize;                  // Uncompressed size of those files.
+  BOOL m_bZipDamaged;                      // TRUE if a streamed entry was left incomplete.
 
   std::future<BOOL> thread_;
 };
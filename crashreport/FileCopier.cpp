@@ -0,0 +1,369 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "FileCopier.h"
+#include <winioctl.h>
+#include "zlib.h"
+
+// Block cloning is declared by recent SDKs only
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+typedef struct _DUPLICATE_EXTENTS_DATA {
+  HANDLE FileHandle;
+  LARGE_INTEGER SourceFileOffset;
+  LARGE_INTEGER TargetFileOffset;
+  LARGE_INTEGER ByteCount;
+} DUPLICATE_EXTENTS_DATA, *PDUPLICATE_EXTENTS_DATA;
+#endif
+
+#ifndef FSCTL_GET_INTEGRITY_INFORMATION
+#define FSCTL_GET_INTEGRITY_INFORMATION CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 159, METHOD_BUFFERED, FILE_ANY_ACCESS)
+typedef struct _FSCTL_GET_INTEGRITY_INFORMATION_BUFFER {
+  WORD ChecksumAlgorithm;
+  WORD Reserved;
+  DWORD Flags;
+  DWORD ChecksumChunkSizeInBytes;
+  DWORD ClusterSizeInBytes;
+} FSCTL_GET_INTEGRITY_INFORMATION_BUFFER, *PFSCTL_GET_INTEGRITY_INFORMATION_BUFFER;
+#endif
+
+#ifndef FILE_SUPPORTS_BLOCK_REFCOUNTING
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+#endif
+
+#define FILE_CLONE_CHUNK_SIZE (1024 * 1024 * 1024)  /* A single clone request must stay below 4 GB */
+
+CFileCopier::CFileCopier() {
+  m_dwError = ERROR_SUCCESS;
+}
+
+CFileCopier::~CFileCopier() {
+}
+
+FILE_SNAPSHOT_TYPE CFileCopier::Snapshot(LPCTSTR szSrcFile, HANDLE hSrcFile, LPCTSTR szDestFile, ULONG64 ullSize, FileLinkInfo* pLinkInfo) {
+  if (ullSize == 0)
+    return FILE_SNAPSHOT_NONE;  // Nothing to share
+
+  // A clone is a real snapshot: later writes to the source don't affect it
+  HANDLE hDestFile = CreateFile(szDestFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+  if (hDestFile != INVALID_HANDLE_VALUE) {
+    BOOL bClone = CloneFile(hSrcFile, hDestFile, ullSize);
+    CloseHandle(hDestFile);
+    if (bClone)
+      return FILE_SNAPSHOT_CLONE;
+  }
+
+  // A hard link shares the file itself, so the recorded size marks the end of the snapshot
+  // and the recorded identity tells whether the application rewrote it later.
+  DeleteFile(szDestFile);
+  if (!GetLinkInfo(hSrcFile, ullSize, pLinkInfo))
+    return FILE_SNAPSHOT_NONE;
+  if (CreateHardLink(szDestFile, szSrcFile, NULL))
+    return FILE_SNAPSHOT_HARDLINK;
+
+  return FILE_SNAPSHOT_NONE;
+}
+
+BOOL CFileCopier::GetLinkInfo(HANDLE hFile, ULONG64 ullSize, FileLinkInfo* pLinkInfo) {
+  BY_HANDLE_FILE_INFORMATION fi;
+  if (!GetFileInformationByHandle(hFile, &fi))
+    return FALSE;
+
+  pLinkInfo->m_ullSize = ullSize;
+  pLinkInfo->m_ullFileId = ((ULONG64)fi.nFileIndexHigh << 32) | fi.nFileIndexLow;
+  pLinkInfo->m_ullWriteTime = ((ULONG64)fi.ftLastWriteTime.dwHighDateTime << 32) | fi.ftLastWriteTime.dwLowDateTime;
+
+  // CRC of the bytes written last before the snapshot. The read is positioned
+  // explicitly, so it works for both synchronous and overlapped handles.
+  DWORD dwTailSize = ullSize < FILE_LINK_TAIL_SIZE ? (DWORD)ullSize : FILE_LINK_TAIL_SIZE;
+  BYTE Tail[FILE_LINK_TAIL_SIZE];
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(OVERLAPPED));
+  ov.Offset = (DWORD)(ullSize - dwTailSize);
+  ov.OffsetHigh = (DWORD)((ullSize - dwTailSize) >> 32);
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (ov.hEvent == NULL)
+    return FALSE;
+
+  DWORD dwBytesRead = 0;
+  BOOL bRead = dwTailSize == 0 || ReadFile(hFile, Tail, dwTailSize, &dwBytesRead, &ov);
+  if (!bRead && ::GetLastError() == ERROR_IO_PENDING)
+    bRead = GetOverlappedResult(hFile, &ov, &dwBytesRead, TRUE);
+  CloseHandle(ov.hEvent);
+
+  // A synchronous handle has its file pointer moved by the read
+  LARGE_INTEGER liZero;
+  liZero.QuadPart = 0;
+  SetFilePointerEx(hFile, liZero, NULL, FILE_BEGIN);
+
+  if (!bRead || dwBytesRead != dwTailSize)
+    return FALSE;  // The file is shorter than the snapshot
+
+  pLinkInfo->m_dwTailCrc = (DWORD)crc32(crc32(0L, Z_NULL, 0), Tail, dwTailSize);
+  return TRUE;
+}
+
+BOOL CFileCopier::CheckLinkInfo(HANDLE hFile, const FileLinkInfo& LinkInfo) {
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(hFile, &liSize) || (ULONG64)liSize.QuadPart < LinkInfo.m_ullSize)
+    return FALSE;  // Truncated
+
+  FileLinkInfo Current;
+  if (!GetLinkInfo(hFile, LinkInfo.m_ullSize, &Current) || Current.m_ullFileId != LinkInfo.m_ullFileId)
+    return FALSE;
+
+  if (Current.m_ullWriteTime == LinkInfo.m_ullWriteTime)
+    return TRUE;  // Not written since
+
+  // Written since: appending keeps the snapshot range, rewriting almost certainly changes its tail
+  return Current.m_dwTailCrc == LinkInfo.m_dwTailCrc;
+}
+
+DWORD CFileCopier::GetLastError() {
+  return m_dwError;
+}
+
+BOOL CFileCopier::CloneFile(HANDLE hSrcFile, HANDLE hDestFile, ULONG64 ullSize) {
+  // Both files must be on the same volume supporting block cloning (ReFS)
+  DWORD dwFlags = 0;
+  if (!GetVolumeInformationByHandleW(hSrcFile, NULL, 0, NULL, NULL, &dwFlags, NULL, 0) || (dwFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) == 0)
+    return FALSE;
+
+  BY_HANDLE_FILE_INFORMATION SrcInfo;
+  BY_HANDLE_FILE_INFORMATION DestInfo;
+  if (!GetFileInformationByHandle(hSrcFile, &SrcInfo) || !GetFileInformationByHandle(hDestFile, &DestInfo) ||
+      SrcInfo.dwVolumeSerialNumber != DestInfo.dwVolumeSerialNumber)
+    return FALSE;
+
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(OVERLAPPED));
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (ov.hEvent == NULL)
+    return FALSE;
+
+  BOOL bStatus = FALSE;
+  DWORD dwBytesReturned = 0;
+  ULONG64 ullOffset = 0;
+  FSCTL_GET_INTEGRITY_INFORMATION_BUFFER Integrity;
+  FILE_END_OF_FILE_INFO EndOfFile;
+
+  // Cloned ranges are made of whole clusters (the last one may extend past the end of file)
+  memset(&Integrity, 0, sizeof(Integrity));
+  if ((!DeviceIoControl(hSrcFile, FSCTL_GET_INTEGRITY_INFORMATION, NULL, 0, &Integrity, sizeof(Integrity), &dwBytesReturned, &ov) &&
+       (::GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hSrcFile, &ov, &dwBytesReturned, TRUE))) ||
+      Integrity.ClusterSizeInBytes == 0)
+    goto cleanup;
+
+  // The destination must have its final size before blocks are cloned into it
+  EndOfFile.EndOfFile.QuadPart = (LONGLONG)ullSize;
+  if (!SetFileInformationByHandle(hDestFile, FileEndOfFileInfo, &EndOfFile, sizeof(FILE_END_OF_FILE_INFO)))
+    goto cleanup;
+
+  while (ullOffset < ullSize) {
+    ULONG64 ullCount = ullSize - ullOffset;
+    if (ullCount > FILE_CLONE_CHUNK_SIZE)
+      ullCount = FILE_CLONE_CHUNK_SIZE;
+    else
+      ullCount = (ullCount + Integrity.ClusterSizeInBytes - 1) / Integrity.ClusterSizeInBytes * Integrity.ClusterSizeInBytes;
+
+    DUPLICATE_EXTENTS_DATA ded;
+    ded.FileHandle = hSrcFile;
+    ded.SourceFileOffset.QuadPart = (LONGLONG)ullOffset;
+    ded.TargetFileOffset.QuadPart = (LONGLONG)ullOffset;
+    ded.ByteCount.QuadPart = (LONGLONG)ullCount;
+
+    if (!DeviceIoControl(hDestFile, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &ded, sizeof(ded), NULL, 0, &dwBytesReturned, &ov) &&
+        (::GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hDestFile, &ov, &dwBytesReturned, TRUE))) {
+      // Let the regular copy start over
+      EndOfFile.EndOfFile.QuadPart = 0;
+      SetFileInformationByHandle(hDestFile, FileEndOfFileInfo, &EndOfFile, sizeof(FILE_END_OF_FILE_INFO));
+      goto cleanup;
+    }
+
+    ullOffset += ullCount;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  CloseHandle(ov.hEvent);
+
+  return bStatus;
+}
+
+BOOL CFileCopier::Copy(HANDLE hSrcFile,
+                       HANDLE hDestFile,
+                       ULONG64 ullSize,
+                       std::function<void(LPBYTE, DWORD)> fnData,
+                       std::function<void(ULONG64)> fnProgress,
+                       std::function<bool()> fnIsCancelled) {
+  BOOL bStatus = FALSE;
+  FileCopySlot aSlots[FILE_COPY_SLOT_COUNT];
+  ULONG64 ullReadOffset = 0;
+  ULONG64 ullWritten = 0;
+  BOOL bEof = FALSE;
+  DWORD dwBytes = 0;
+  FILE_ALLOCATION_INFO AllocInfo;
+  int i;
+
+  m_dwError = ERROR_SUCCESS;
+
+  // Small files are copied with a single buffer, large ones with big buffers
+  ULONG64 ullBufferSize = (ullSize / FILE_COPY_SLOT_COUNT + FILE_COPY_MIN_BUFFER_SIZE - 1) / FILE_COPY_MIN_BUFFER_SIZE * FILE_COPY_MIN_BUFFER_SIZE;
+  if (ullBufferSize < FILE_COPY_MIN_BUFFER_SIZE)
+    ullBufferSize = FILE_COPY_MIN_BUFFER_SIZE;
+  if (ullBufferSize > FILE_COPY_MAX_BUFFER_SIZE)
+    ullBufferSize = FILE_COPY_MAX_BUFFER_SIZE;
+  DWORD dwBufferSize = (DWORD)ullBufferSize;
+
+  memset(aSlots, 0, sizeof(aSlots));
+  for (i = 0; i < FILE_COPY_SLOT_COUNT; i++) {
+    aSlots[i].m_pBuffer = (LPBYTE)VirtualAlloc(NULL, dwBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    aSlots[i].m_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (aSlots[i].m_pBuffer == NULL || aSlots[i].m_ov.hEvent == NULL) {
+      m_dwError = ERROR_NOT_ENOUGH_MEMORY;
+      goto cleanup;
+    }
+  }
+
+  // Reserve space, so the destination isn't fragmented by growing piece by piece
+  AllocInfo.AllocationSize.QuadPart = (LONGLONG)ullSize;
+  SetFileInformationByHandle(hDestFile, FileAllocationInfo, &AllocInfo, sizeof(FILE_ALLOCATION_INFO));
+
+  // Start reading ahead into every buffer
+  for (i = 0; i < FILE_COPY_SLOT_COUNT && ullReadOffset < ullSize; i++) {
+    if (!IssueRead(hSrcFile, &aSlots[i], ullReadOffset, ullSize, dwBufferSize))
+      goto cleanup;
+  }
+
+  // Buffers are consumed in file order: wait for the read, pass the data on, start the write.
+  // The buffer written in the previous step is refilled once its write completes.
+  for (i = 0; aSlots[i].m_bReadPending; i = (i + 1) % FILE_COPY_SLOT_COUNT) {
+    FileCopySlot* pSlot = &aSlots[i];
+
+    if (fnIsCancelled && fnIsCancelled()) {
+      m_dwError = ERROR_CANCELLED;
+      goto cleanup;
+    }
+
+    if (!WaitSlot(hSrcFile, pSlot, dwBytes))
+      goto cleanup;
+
+    // The source may be shorter than it was when the copy started
+    if (dwBytes < pSlot->m_dwSize)
+      bEof = TRUE;
+    pSlot->m_dwSize = dwBytes;
+
+    if (dwBytes != 0) {
+      if (fnData)
+        fnData(pSlot->m_pBuffer, dwBytes);
+
+      pSlot->m_ov.Offset = (DWORD)pSlot->m_ullOffset;
+      pSlot->m_ov.OffsetHigh = (DWORD)(pSlot->m_ullOffset >> 32);
+      if (!WriteFile(hDestFile, pSlot->m_pBuffer, dwBytes, NULL, &pSlot->m_ov) && ::GetLastError() != ERROR_IO_PENDING) {
+        m_dwError = ::GetLastError();
+        goto cleanup;
+      }
+      pSlot->m_bWritePending = TRUE;
+    }
+
+    FileCopySlot* pPrev = &aSlots[(i + FILE_COPY_SLOT_COUNT - 1) % FILE_COPY_SLOT_COUNT];
+    if (pPrev->m_bWritePending) {
+      if (!WaitSlot(hDestFile, pPrev, dwBytes))
+        goto cleanup;
+
+      ullWritten += dwBytes;
+      if (fnProgress)
+        fnProgress(ullWritten);
+
+      if (!bEof && ullReadOffset < ullSize && !IssueRead(hSrcFile, pPrev, ullReadOffset, ullSize, dwBufferSize))
+        goto cleanup;
+    }
+
+    if (bEof)
+      break;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  // Wait for all I/O still in flight, the buffers can't be freed before
+  for (i = 0; i < FILE_COPY_SLOT_COUNT; i++) {
+    if (aSlots[i].m_bReadPending && !WaitSlot(hSrcFile, &aSlots[i], dwBytes))
+      bStatus = FALSE;
+
+    if (aSlots[i].m_bWritePending) {
+      if (WaitSlot(hDestFile, &aSlots[i], dwBytes))
+        ullWritten += dwBytes;
+      else
+        bStatus = FALSE;
+    }
+  }
+
+  if (bStatus && fnProgress)
+    fnProgress(ullWritten);
+
+  for (i = 0; i < FILE_COPY_SLOT_COUNT; i++) {
+    if (aSlots[i].m_pBuffer != NULL)
+      VirtualFree(aSlots[i].m_pBuffer, 0, MEM_RELEASE);
+    if (aSlots[i].m_ov.hEvent != NULL)
+      CloseHandle(aSlots[i].m_ov.hEvent);
+  }
+
+  return bStatus;
+}
+
+BOOL CFileCopier::IssueRead(HANDLE hSrcFile, FileCopySlot* pSlot, ULONG64& ullReadOffset, ULONG64 ullSize, DWORD dwBufferSize) {
+  pSlot->m_ullOffset = ullReadOffset;
+  pSlot->m_dwSize = ullSize - ullReadOffset < dwBufferSize ? (DWORD)(ullSize - ullReadOffset) : dwBufferSize;
+  ullReadOffset += pSlot->m_dwSize;
+
+  pSlot->m_ov.Offset = (DWORD)pSlot->m_ullOffset;
+  pSlot->m_ov.OffsetHigh = (DWORD)(pSlot->m_ullOffset >> 32);
+  if (!ReadFile(hSrcFile, pSlot->m_pBuffer, pSlot->m_dwSize, NULL, &pSlot->m_ov)) {
+    DWORD dwError = ::GetLastError();
+    if (dwError == ERROR_HANDLE_EOF) {
+      // Nothing was started, the file got shorter
+      pSlot->m_bAtEof = TRUE;
+    }
+    else if (dwError != ERROR_IO_PENDING) {
+      m_dwError = dwError;
+      return FALSE;
+    }
+  }
+
+  pSlot->m_bReadPending = TRUE;
+  return TRUE;
+}
+
+BOOL CFileCopier::WaitSlot(HANDLE hFile, FileCopySlot* pSlot, DWORD& dwBytes) {
+  dwBytes = 0;
+  pSlot->m_bReadPending = FALSE;
+  pSlot->m_bWritePending = FALSE;
+
+  if (pSlot->m_bAtEof) {
+    pSlot->m_bAtEof = FALSE;
+    return TRUE;
+  }
+
+  if (!GetOverlappedResult(hFile, &pSlot->m_ov, &dwBytes, TRUE)) {
+    DWORD dwError = ::GetLastError();
+    if (dwError == ERROR_HANDLE_EOF)
+      return TRUE;
+
+    m_dwError = dwError;
+    return FALSE;
+  }
+
+  return TRUE;
+}
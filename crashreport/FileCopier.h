@@ -0,0 +1,94 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: FileCopier.h
+// Description: Copies a file using several overlapped reads and writes in flight,
+// or makes the file system share its data with the destination (block cloning or a hard link).
+
+#pragma once
+#include "stdafx.h"
+#include <functional>
+
+#define FILE_COPY_SLOT_COUNT 4                    /* Count of buffers in flight */
+#define FILE_COPY_MIN_BUFFER_SIZE (64 * 1024)     /* Buffer size for small files */
+#define FILE_COPY_MAX_BUFFER_SIZE (2 * 1024 * 1024) /* Buffer size for large files */
+#define FILE_LINK_TAIL_SIZE 4096                  /* Bytes before the end of a hard-linked snapshot covered by its CRC */
+
+// How Snapshot() captured the file.
+enum FILE_SNAPSHOT_TYPE {
+  FILE_SNAPSHOT_NONE = 0,  // Not supported, the file has to be copied.
+  FILE_SNAPSHOT_CLONE,     // Blocks of the file are shared copy-on-write (ReFS).
+  FILE_SNAPSHOT_HARDLINK   // The destination is another name of the same file; only its first bytes belong to the snapshot.
+};
+
+// Identity of a hard-linked file at snapshot time, used to tell whether
+// the snapshot range was rewritten (not just appended to) later.
+struct FileLinkInfo {
+  ULONG64 m_ullSize;       // Size of the file at snapshot time (end of the snapshot).
+  ULONG64 m_ullFileId;     // File index on its volume.
+  ULONG64 m_ullWriteTime;  // Last write time (FILETIME).
+  DWORD m_dwTailCrc;       // CRC-32 of the last FILE_LINK_TAIL_SIZE bytes of the snapshot.
+};
+
+// Buffer and its pending I/O.
+struct FileCopySlot {
+  LPBYTE m_pBuffer;      // Data buffer.
+  OVERLAPPED m_ov;       // Pending read or write.
+  ULONG64 m_ullOffset;   // File offset of the buffer.
+  DWORD m_dwSize;        // Bytes in the buffer.
+  BOOL m_bReadPending;   // Whether a read was issued and not waited for yet.
+  BOOL m_bWritePending;  // Whether a write was issued and not waited for yet.
+  BOOL m_bAtEof;         // Whether the read found the end of file without starting I/O.
+};
+
+// File copy engine.
+class CFileCopier {
+ public:
+  // Construction/destruction
+  CFileCopier();
+  ~CFileCopier();
+
+  // Creates the destination file sharing the first ullSize bytes of the source without copying them:
+  // clones the blocks where the file system supports it, otherwise creates a hard link
+  // and fills pLinkInfo. The source must be opened with FILE_FLAG_OVERLAPPED.
+  FILE_SNAPSHOT_TYPE Snapshot(LPCTSTR szSrcFile, HANDLE hSrcFile, LPCTSTR szDestFile, ULONG64 ullSize, FileLinkInfo* pLinkInfo);
+
+  // Records the identity of the file and of its first ullSize bytes.
+  static BOOL GetLinkInfo(HANDLE hFile, ULONG64 ullSize, FileLinkInfo* pLinkInfo);
+
+  // Checks that the first bytes of a hard-linked file are still those recorded by Snapshot():
+  // the file must not be shorter, and unless it is unchanged, the tail of the range must match.
+  static BOOL CheckLinkInfo(HANDLE hFile, const FileLinkInfo& LinkInfo);
+
+  // Copies ullSize bytes of the source file to the beginning of the destination file.
+  // Both files must be opened with FILE_FLAG_OVERLAPPED. If fnData is set, it receives
+  // the data in file order as it is copied. Copying stops early if the source turns out to be shorter.
+  BOOL Copy(HANDLE hSrcFile,
+            HANDLE hDestFile,
+            ULONG64 ullSize,
+            std::function<void(LPBYTE, DWORD)> fnData,
+            std::function<void(ULONG64)> fnProgress,
+            std::function<bool()> fnIsCancelled);
+
+  // Returns the error code of the last failed Copy() call.
+  DWORD GetLastError();
+
+ private:
+  // Shares file blocks between source and destination (ReFS). Returns FALSE if not supported.
+  BOOL CloneFile(HANDLE hSrcFile, HANDLE hDestFile, ULONG64 ullSize);
+
+  // Starts reading the next portion of the source into the slot.
+  BOOL IssueRead(HANDLE hSrcFile, FileCopySlot* pSlot, ULONG64& ullReadOffset, ULONG64 ullSize, DWORD dwBufferSize);
+
+  // Waits for the pending I/O of the slot. Returns count of bytes transferred in dwBytes.
+  BOOL WaitSlot(HANDLE hFile, FileCopySlot* pSlot, DWORD& dwBytes);
+
+  DWORD m_dwError;  // Error code of the last failure.
+};
@@ -0,0 +1,270 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "ParallelDeflate.h"
+#include <thread>
+
+CParallelDeflate::CParallelDeflate() {
+  m_nLevel = Z_DEFAULT_COMPRESSION;
+  m_bStop = FALSE;
+  m_ullSize = 0;
+  m_ulCrc32 = 0;
+}
+
+CParallelDeflate::~CParallelDeflate() {
+}
+
+BOOL CParallelDeflate::Compress(HANDLE hSrcFile,
+                                ULONG64 ullMaxSize,
+                                int nLevel,
+                                int nThreadCount,
+                                std::function<BOOL(LPBYTE, DWORD)> fnWrite,
+                                std::function<bool()> fnIsCancelled) {
+  BOOL bStatus = FALSE;
+  DeflateBlock* pBlock = NULL;
+  DeflateBlock* pNext = NULL;
+  std::vector<std::thread> aThreads;
+  ULONG64 ullRemaining = ullMaxSize;
+  size_t i;
+
+  m_nLevel = nLevel;
+  m_fnWrite = fnWrite;
+  m_bStop = FALSE;
+  m_ullSize = 0;
+  m_ulCrc32 = crc32(0L, Z_NULL, 0);
+
+  if (nThreadCount < 1)
+    nThreadCount = 1;
+
+  // Keep a couple of blocks per thread in flight, so workers don't wait for the reader
+  size_t nMaxBlocks = 2 * nThreadCount;
+
+  for (i = 0; i < (size_t)nThreadCount; i++)
+    aThreads.push_back(std::thread(&CParallelDeflate::WorkerThread, this));
+
+  pBlock = new DeflateBlock;
+  if (!ReadBlock(hSrcFile, pBlock, ullRemaining))
+    goto cleanup;
+
+  for (;;) {
+    if (fnIsCancelled && fnIsCancelled())
+      goto cleanup;
+
+    // Read one block ahead to know whether the current one is the last
+    pNext = NULL;
+    if (!pBlock->m_aInput.empty()) {
+      pNext = new DeflateBlock;
+      size_t nDictSize = pBlock->m_aInput.size() < PARALLEL_DEFLATE_DICT_SIZE ? pBlock->m_aInput.size() : PARALLEL_DEFLATE_DICT_SIZE;
+      pNext->m_aDict.assign(pBlock->m_aInput.end() - nDictSize, pBlock->m_aInput.end());
+      if (!ReadBlock(hSrcFile, pNext, ullRemaining))
+        goto cleanup;
+
+      if (pNext->m_aInput.empty()) {
+        delete pNext;
+        pNext = NULL;
+      }
+    }
+
+    pBlock->m_bLast = pNext == NULL;
+
+    {
+      std::unique_lock<std::mutex> lock(m_Lock);
+      m_Blocks.push_back(pBlock);
+      m_Pending.push_back(pBlock);
+      m_Cond.notify_all();
+    }
+
+    BOOL bLast = pBlock->m_bLast;
+    pBlock = pNext;
+    pNext = NULL;
+
+    if (bLast)
+      break;
+
+    // Write what is ready; block while too much is in flight
+    if (!WriteCompletedBlocks(FALSE))
+      goto cleanup;
+    while (m_Blocks.size() >= nMaxBlocks) {
+      if (!WriteCompletedBlocks(TRUE))
+        goto cleanup;
+    }
+  }
+
+  // Write the rest of the stream
+  while (!m_Blocks.empty()) {
+    if (!WriteCompletedBlocks(TRUE))
+      goto cleanup;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  // Stop workers
+  {
+    std::unique_lock<std::mutex> lock(m_Lock);
+    m_bStop = TRUE;
+    m_Pending.clear();
+    m_Cond.notify_all();
+  }
+
+  for (i = 0; i < aThreads.size(); i++)
+    aThreads[i].join();
+
+  for (i = 0; i < m_Blocks.size(); i++)
+    delete m_Blocks[i];
+  m_Blocks.clear();
+
+  if (pBlock != NULL)
+    delete pBlock;
+
+  if (pNext != NULL)
+    delete pNext;
+
+  return bStatus;
+}
+
+ULONG64 CParallelDeflate::GetUncompressedSize() {
+  return m_ullSize;
+}
+
+DWORD CParallelDeflate::GetCrc32() {
+  return (DWORD)m_ulCrc32;
+}
+
+void CParallelDeflate::WorkerThread() {
+  std::unique_lock<std::mutex> lock(m_Lock);
+
+  for (;;) {
+    while (m_Pending.empty() && !m_bStop)
+      m_Cond.wait(lock);
+
+    if (m_bStop)
+      break;
+
+    DeflateBlock* pBlock = m_Pending.front();
+    m_Pending.pop_front();
+
+    lock.unlock();
+    CompressBlock(pBlock);
+    lock.lock();
+
+    pBlock->m_bDone = TRUE;
+    m_Cond.notify_all();
+  }
+}
+
+void CParallelDeflate::CompressBlock(DeflateBlock* pBlock) {
+  pBlock->m_ulCrc32 = crc32(crc32(0L, Z_NULL, 0), pBlock->m_aInput.empty() ? Z_NULL : &pBlock->m_aInput[0], (uInt)pBlock->m_aInput.size());
+
+  // Raw deflate, the ZIP entry provides the framing
+  z_stream zs;
+  memset(&zs, 0, sizeof(z_stream));
+  if (deflateInit2(&zs, m_nLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    pBlock->m_bError = TRUE;
+    return;
+  }
+
+  // Let matches reach back into the previous block, as a single-threaded deflate would
+  if (!pBlock->m_aDict.empty())
+    deflateSetDictionary(&zs, &pBlock->m_aDict[0], (uInt)pBlock->m_aDict.size());
+
+  // Intermediate blocks end with an empty stored block, which aligns the output to a byte
+  // boundary without marking the end of the stream.
+  int nFlush = pBlock->m_bLast ? Z_FINISH : Z_SYNC_FLUSH;
+
+  pBlock->m_aOutput.resize(deflateBound(&zs, (uLong)pBlock->m_aInput.size()) + 16);
+  zs.next_in = pBlock->m_aInput.empty() ? Z_NULL : &pBlock->m_aInput[0];
+  zs.avail_in = (uInt)pBlock->m_aInput.size();
+
+  int nResult = Z_OK;
+  for (;;) {
+    if (zs.total_out == pBlock->m_aOutput.size())
+      pBlock->m_aOutput.resize(pBlock->m_aOutput.size() * 2);
+
+    zs.next_out = &pBlock->m_aOutput[zs.total_out];
+    zs.avail_out = (uInt)(pBlock->m_aOutput.size() - zs.total_out);
+
+    nResult = deflate(&zs, nFlush);
+    if (nResult == Z_STREAM_ERROR)
+      break;
+
+    if (nFlush == Z_FINISH ? nResult == Z_STREAM_END : zs.avail_out != 0)
+      break;
+  }
+
+  pBlock->m_aOutput.resize(zs.total_out);
+  pBlock->m_bError = nResult == Z_STREAM_ERROR;
+  deflateEnd(&zs);
+}
+
+BOOL CParallelDeflate::ReadBlock(HANDLE hSrcFile, DeflateBlock* pBlock, ULONG64& ullRemaining) {
+  pBlock->m_bLast = FALSE;
+  pBlock->m_bDone = FALSE;
+  pBlock->m_bError = FALSE;
+  pBlock->m_ulCrc32 = 0;
+
+  DWORD dwBlockSize = ullRemaining < PARALLEL_DEFLATE_BLOCK_SIZE ? (DWORD)ullRemaining : PARALLEL_DEFLATE_BLOCK_SIZE;
+  pBlock->m_aInput.resize(dwBlockSize);
+
+  // ReadFile may return less than requested, fill the whole block
+  DWORD dwTotalRead = 0;
+  while (dwTotalRead < dwBlockSize) {
+    DWORD dwBytesRead = 0;
+    if (!ReadFile(hSrcFile, &pBlock->m_aInput[dwTotalRead], dwBlockSize - dwTotalRead, &dwBytesRead, NULL))
+      return FALSE;
+
+    if (dwBytesRead == 0)
+      break;  // End of file
+
+    dwTotalRead += dwBytesRead;
+  }
+
+  pBlock->m_aInput.resize(dwTotalRead);
+  ullRemaining -= dwTotalRead;
+  return TRUE;
+}
+
+BOOL CParallelDeflate::WriteCompletedBlocks(BOOL bWait) {
+  for (;;) {
+    DeflateBlock* pBlock = NULL;
+
+    {
+      std::unique_lock<std::mutex> lock(m_Lock);
+      if (m_Blocks.empty())
+        return TRUE;
+
+      if (bWait) {
+        while (!m_Blocks.front()->m_bDone)
+          m_Cond.wait(lock);
+        bWait = FALSE;  // Only for the head block
+      }
+      else if (!m_Blocks.front()->m_bDone) {
+        return TRUE;
+      }
+
+      pBlock = m_Blocks.front();
+      m_Blocks.pop_front();
+    }
+
+    BOOL bWrite = !pBlock->m_bError && (pBlock->m_aOutput.empty() || m_fnWrite(&pBlock->m_aOutput[0], (DWORD)pBlock->m_aOutput.size()));
+
+    if (bWrite) {
+      m_ulCrc32 = crc32_combine(m_ulCrc32, pBlock->m_ulCrc32, (z_off_t)pBlock->m_aInput.size());
+      m_ullSize += pBlock->m_aInput.size();
+    }
+
+    delete pBlock;
+
+    if (!bWrite)
+      return FALSE;
+  }
+}
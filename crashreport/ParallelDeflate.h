@@ -0,0 +1,84 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: ParallelDeflate.h
+// Description: Compresses a file into a single raw deflate stream using several threads.
+// The input is split into blocks compressed independently (each primed with the last 32 KB of the
+// previous block); blocks end on a byte boundary (Z_SYNC_FLUSH), so their output is simply concatenated.
+
+#pragma once
+#include "stdafx.h"
+#include "zlib.h"
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#define PARALLEL_DEFLATE_BLOCK_SIZE (1024 * 1024)      /* Input block size */
+#define PARALLEL_DEFLATE_DICT_SIZE (32 * 1024)         /* Deflate window size */
+#define PARALLEL_DEFLATE_MIN_SIZE (8 * 1024 * 1024)    /* Smaller files are not worth splitting */
+
+// Block of input data and its compressed output.
+struct DeflateBlock {
+  std::vector<BYTE> m_aDict;    // Last bytes of the previous block (empty for the first block).
+  std::vector<BYTE> m_aInput;   // Uncompressed data.
+  std::vector<BYTE> m_aOutput;  // Compressed data.
+  BOOL m_bLast;                 // Whether this block ends the stream.
+  BOOL m_bDone;                 // Whether the block has been compressed.
+  BOOL m_bError;                // Whether compression failed.
+  uLong m_ulCrc32;              // CRC-32 of the input.
+};
+
+// Block-parallel deflate compressor.
+class CParallelDeflate {
+ public:
+  // Construction/destruction
+  CParallelDeflate();
+  ~CParallelDeflate();
+
+  // Reads up to ullMaxSize bytes of the file and passes compressed data to fnWrite in order.
+  // Returns FALSE on read/compression/write error, or if fnIsCancelled returns true.
+  BOOL Compress(HANDLE hSrcFile,
+                ULONG64 ullMaxSize,
+                int nLevel,
+                int nThreadCount,
+                std::function<BOOL(LPBYTE, DWORD)> fnWrite,
+                std::function<bool()> fnIsCancelled);
+
+  // Returns count of bytes read by the last Compress() call.
+  ULONG64 GetUncompressedSize();
+
+  // Returns CRC-32 of data read by the last Compress() call.
+  DWORD GetCrc32();
+
+ private:
+  // Compresses queued blocks until Compress() stops the workers.
+  void WorkerThread();
+
+  // Compresses a single block.
+  void CompressBlock(DeflateBlock* pBlock);
+
+  // Reads up to a block of data (but not more than ullRemaining bytes). Returns FALSE on read error.
+  BOOL ReadBlock(HANDLE hSrcFile, DeflateBlock* pBlock, ULONG64& ullRemaining);
+
+  // Writes the blocks at the head of the queue that are compressed already;
+  // waits for the head block if bWait is set. Returns FALSE on error.
+  BOOL WriteCompletedBlocks(BOOL bWait);
+
+  int m_nLevel;                                   // Compression level.
+  std::function<BOOL(LPBYTE, DWORD)> m_fnWrite;   // Output.
+  std::deque<DeflateBlock*> m_Blocks;             // Blocks in flight, in stream order.
+  std::deque<DeflateBlock*> m_Pending;            // Blocks waiting for a worker.
+  BOOL m_bStop;                                   // Tells workers to exit.
+  std::mutex m_Lock;                              // Protects the queues and block states.
+  std::condition_variable m_Cond;                 // Signalled when a block is queued or compressed.
+  ULONG64 m_ullSize;                              // Uncompressed size written so far.
+  uLong m_ulCrc32;                                // CRC-32 of blocks written so far.
+};
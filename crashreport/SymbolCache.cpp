@@ -0,0 +1,164 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "SymbolCache.h"
+#include <algorithm>
+
+// Orders cache entries by RVA.
+static bool SymbolCacheEntryLess(const SYMBOL_CACHE_ENTRY& a, const SYMBOL_CACHE_ENTRY& b) {
+  return a.m_dwRva < b.m_dwRva;
+}
+
+CSymbolCache::CSymbolCache() {
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hFileMapping = NULL;
+  m_pHeader = NULL;
+  m_pEntries = NULL;
+}
+
+CSymbolCache::~CSymbolCache() {
+  Close();
+}
+
+BOOL CSymbolCache::Open(LPCTSTR szFilePath) {
+  Close();
+  m_sFilePath = szFilePath;
+
+  m_hFile = CreateFile(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE)
+    return TRUE;  // Not cached yet
+
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(m_hFile, &liSize) || liSize.QuadPart < (LONGLONG)sizeof(SYMBOL_CACHE_HEADER)) {
+    Close();
+    return TRUE;  // Empty or truncated file is rewritten by Save()
+  }
+
+  m_hFileMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (m_hFileMapping == NULL) {
+    Close();
+    return FALSE;
+  }
+
+  m_pHeader = (SYMBOL_CACHE_HEADER*)MapViewOfFile(m_hFileMapping, FILE_MAP_READ, 0, 0, 0);
+  if (m_pHeader == NULL) {
+    Close();
+    return FALSE;
+  }
+
+  if (memcmp(m_pHeader->m_uchMagic, "SYC", 3) != 0 || m_pHeader->m_dwSize != sizeof(SYMBOL_CACHE_HEADER) ||
+      m_pHeader->m_dwEntrySize != sizeof(SYMBOL_CACHE_ENTRY) ||
+      (ULONGLONG)liSize.QuadPart < sizeof(SYMBOL_CACHE_HEADER) + (ULONGLONG)m_pHeader->m_dwEntryCount * sizeof(SYMBOL_CACHE_ENTRY)) {
+    // Foreign or damaged file, start over
+    Close();
+    return TRUE;
+  }
+
+  m_pEntries = (SYMBOL_CACHE_ENTRY*)(m_pHeader + 1);
+  return TRUE;
+}
+
+void CSymbolCache::Close() {
+  if (m_pHeader != NULL) {
+    UnmapViewOfFile(m_pHeader);
+    m_pHeader = NULL;
+    m_pEntries = NULL;
+  }
+
+  if (m_hFileMapping != NULL) {
+    CloseHandle(m_hFileMapping);
+    m_hFileMapping = NULL;
+  }
+
+  if (m_hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+  }
+}
+
+BOOL CSymbolCache::Find(DWORD dwRva, SYMBOL_CACHE_ENTRY* pEntry) {
+  // Binary search in the mapped file
+  if (m_pEntries != NULL) {
+    DWORD dwLow = 0;
+    DWORD dwHigh = m_pHeader->m_dwEntryCount;
+    while (dwLow < dwHigh) {
+      DWORD dwMid = dwLow + (dwHigh - dwLow) / 2;
+      if (m_pEntries[dwMid].m_dwRva < dwRva)
+        dwLow = dwMid + 1;
+      else
+        dwHigh = dwMid;
+    }
+
+    if (dwLow < m_pHeader->m_dwEntryCount && m_pEntries[dwLow].m_dwRva == dwRva) {
+      *pEntry = m_pEntries[dwLow];
+      pEntry->m_szFunction[SYMBOL_CACHE_MAX_FUNCTION - 1] = 0;
+      pEntry->m_szFile[SYMBOL_CACHE_MAX_FILE - 1] = 0;
+      return TRUE;
+    }
+  }
+
+  // Entries resolved during this run (there are only a few)
+  for (size_t i = 0; i < m_aAdded.size(); i++) {
+    if (m_aAdded[i].m_dwRva == dwRva) {
+      *pEntry = m_aAdded[i];
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+void CSymbolCache::Add(const SYMBOL_CACHE_ENTRY& Entry) {
+  m_aAdded.push_back(Entry);
+}
+
+BOOL CSymbolCache::Save() {
+  if (m_aAdded.empty())
+    return TRUE;  // Nothing new
+
+  std::vector<SYMBOL_CACHE_ENTRY> aEntries;
+  if (m_pEntries != NULL)
+    aEntries.assign(m_pEntries, m_pEntries + m_pHeader->m_dwEntryCount);
+  aEntries.insert(aEntries.end(), m_aAdded.begin(), m_aAdded.end());
+  std::stable_sort(aEntries.begin(), aEntries.end(), SymbolCacheEntryLess);
+
+  SYMBOL_CACHE_HEADER Header;
+  memset(&Header, 0, sizeof(SYMBOL_CACHE_HEADER));
+  memcpy(Header.m_uchMagic, "SYC", 3);
+  Header.m_dwSize = sizeof(SYMBOL_CACHE_HEADER);
+  Header.m_dwEntrySize = sizeof(SYMBOL_CACHE_ENTRY);
+  Header.m_dwEntryCount = (DWORD)aEntries.size();
+
+  // Write a temp file, then replace the old one, so concurrent readers
+  // never see a partially written cache.
+  CString sTempFile;
+  sTempFile.Format(_T("%s.%u.tmp"), m_sFilePath.GetString(), GetCurrentProcessId());
+  HANDLE hFile = CreateFile(sTempFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  DWORD dwBytesWritten = 0;
+  DWORD dwEntriesSize = (DWORD)(aEntries.size() * sizeof(SYMBOL_CACHE_ENTRY));
+  BOOL bWrite = WriteFile(hFile, &Header, sizeof(SYMBOL_CACHE_HEADER), &dwBytesWritten, NULL) &&
+                WriteFile(hFile, &aEntries[0], dwEntriesSize, &dwBytesWritten, NULL) && dwBytesWritten == dwEntriesSize;
+  CloseHandle(hFile);
+
+  // The old file must be unmapped before it can be replaced
+  Close();
+
+  if (!bWrite || !MoveFileEx(sTempFile, m_sFilePath, MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFile(sTempFile);
+    return FALSE;
+  }
+
+  m_aAdded.clear();
+  return Open(m_sFilePath);
+}
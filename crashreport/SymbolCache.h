@@ -0,0 +1,70 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: SymbolCache.h
+// Description: On-disk cache of resolved symbols, one file per module identity
+// (CodeView GUID and age of the PDB, or time stamp and size of the PE image).
+
+#pragma once
+#include "stdafx.h"
+
+#define SYMBOL_CACHE_MAX_FUNCTION 256  /* Max function name length in UTF-8 (including terminating zero) */
+#define SYMBOL_CACHE_MAX_FILE 260      /* Max source file path length in UTF-8 (including terminating zero) */
+
+// Symbol cache file header.
+struct SYMBOL_CACHE_HEADER {
+  BYTE m_uchMagic[3];    // Magic sequence "SYC"
+  BYTE m_uchReserved;    // Reserved, must be zero.
+  DWORD m_dwSize;        // Size of the header.
+  DWORD m_dwEntrySize;   // Size of an entry.
+  DWORD m_dwEntryCount;  // Count of entries following the header, sorted by RVA.
+};
+
+// Resolved address.
+struct SYMBOL_CACHE_ENTRY {
+  DWORD m_dwRva;                                  // Address relative to module base.
+  DWORD m_dwDisplacement;                         // Offset from the start of the function.
+  DWORD m_dwLine;                                 // Source line number (zero if unknown).
+  DWORD m_dwReserved;                             // Reserved, must be zero.
+  char m_szFunction[SYMBOL_CACHE_MAX_FUNCTION];   // Function name.
+  char m_szFile[SYMBOL_CACHE_MAX_FILE];           // Source file path (empty if unknown).
+};
+
+// Cache file of a single module. The file is mapped into memory and searched in place;
+// new entries are kept in memory and merged into the file by Save().
+class CSymbolCache {
+ public:
+  // Construction/destruction
+  CSymbolCache();
+  ~CSymbolCache();
+
+  // Maps the cache file (it is fine if it doesn't exist yet).
+  BOOL Open(LPCTSTR szFilePath);
+
+  // Unmaps the file.
+  void Close();
+
+  // Looks up an address. Returns FALSE if it is not cached.
+  BOOL Find(DWORD dwRva, SYMBOL_CACHE_ENTRY* pEntry);
+
+  // Adds a resolved address.
+  void Add(const SYMBOL_CACHE_ENTRY& Entry);
+
+  // Writes the file with new entries merged in (replacing the file atomically).
+  BOOL Save();
+
+ private:
+  CString m_sFilePath;                       // Cache file path.
+  HANDLE m_hFile;                            // Cache file.
+  HANDLE m_hFileMapping;                     // File mapping.
+  SYMBOL_CACHE_HEADER* m_pHeader;            // Mapped header.
+  SYMBOL_CACHE_ENTRY* m_pEntries;            // Mapped entries.
+  std::vector<SYMBOL_CACHE_ENTRY> m_aAdded;  // Entries added since the file was mapped.
+};
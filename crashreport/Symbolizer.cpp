@@ -0,0 +1,577 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "Symbolizer.h"
+#include "Utility.h"
+#include "strconv.h"
+
+// CodeView debug info record of a module built with a PDB 7.0 file.
+struct CodeViewPdb70 {
+  DWORD m_dwSignature;  // "RSDS"
+  GUID m_Guid;          // PDB GUID.
+  DWORD m_dwAge;        // PDB age.
+  char m_szPdbFileName[1];
+};
+
+#define CODEVIEW_PDB70_SIGNATURE 0x53445352 /* "RSDS" */
+
+// Machine type of the dumps this build can unwind.
+#if defined(_M_X64)
+#define SYMBOLIZER_MACHINE IMAGE_FILE_MACHINE_AMD64
+#define SYMBOLIZER_ARCHITECTURE PROCESSOR_ARCHITECTURE_AMD64
+#elif defined(_M_ARM64)
+#define SYMBOLIZER_MACHINE IMAGE_FILE_MACHINE_ARM64
+#define SYMBOLIZER_ARCHITECTURE PROCESSOR_ARCHITECTURE_ARM64
+#else
+#define SYMBOLIZER_MACHINE IMAGE_FILE_MACHINE_I386
+#define SYMBOLIZER_ARCHITECTURE PROCESSOR_ARCHITECTURE_INTEL
+#endif
+
+// Copies a wide-char string to a fixed-size UTF-8 field, truncating it if needed.
+static void CopyUtf8(char* pszDst, int nMaxCount, LPCWSTR pszSrc) {
+  strconv_t strconv;
+  LPCSTR pszUtf8 = strconv.w2utf8(pszSrc);
+  STRNCPY_S(pszDst, nMaxCount, pszUtf8 != NULL ? pszUtf8 : "", _TRUNCATE);
+}
+
+CSymbolizer::CSymbolizer() {
+  m_hDbgHelp = NULL;
+  m_pfnSymSetOptions = NULL;
+  m_pfnSymInitializeW = NULL;
+  m_pfnSymCleanup = NULL;
+  m_pfnSymLoadModuleExW = NULL;
+  m_pfnSymFromAddrW = NULL;
+  m_pfnSymGetLineFromAddrW64 = NULL;
+  m_pfnSymGetModuleInfoW64 = NULL;
+  m_pfnStackWalk64 = NULL;
+  m_pfnSymFunctionTableAccess64 = NULL;
+  m_hDumpFile = INVALID_HANDLE_VALUE;
+  m_hDumpMapping = NULL;
+  m_ullDumpSize = 0;
+  m_pDumpDir = NULL;
+  m_ulStreamCount = 0;
+  m_pMemoryList = NULL;
+  m_pMemory64List = NULL;
+  m_bSymInitialized = FALSE;
+}
+
+CSymbolizer::~CSymbolizer() {
+  UnmapDump();
+
+  if (m_hDbgHelp != NULL)
+    FreeLibrary(m_hDbgHelp);
+}
+
+CString CSymbolizer::GetErrorMsg() {
+  return m_sErrorMsg;
+}
+
+CString CSymbolizer::GetDefaultCacheFolder() {
+  CString sLocalAppDataFolder;
+  Utility::GetSpecialFolder(CSIDL_LOCAL_APPDATA, sLocalAppDataFolder);
+  return sLocalAppDataFolder + _T("\\CrashReports\\SymbolCache");
+}
+
+BOOL CSymbolizer::Init(LPCTSTR szDbgHelpPath, LPCTSTR szCacheFolder) {
+  m_sCacheFolder = szCacheFolder;
+
+  // Load dbghelp.dll, falling back to dbghelp.dll in path
+  if (szDbgHelpPath != NULL && szDbgHelpPath[0] != 0)
+    m_hDbgHelp = LoadLibrary(szDbgHelpPath);
+  if (m_hDbgHelp == NULL)
+    m_hDbgHelp = LoadLibrary(_T("dbghelp.dll"));
+  if (m_hDbgHelp == NULL) {
+    m_sErrorMsg = _T("dbghelp.dll couldn't be loaded");
+    return FALSE;
+  }
+
+  m_pfnSymSetOptions = (PFNSYMSETOPTIONS)GetProcAddress(m_hDbgHelp, "SymSetOptions");
+  m_pfnSymInitializeW = (PFNSYMINITIALIZEW)GetProcAddress(m_hDbgHelp, "SymInitializeW");
+  m_pfnSymCleanup = (PFNSYMCLEANUP)GetProcAddress(m_hDbgHelp, "SymCleanup");
+  m_pfnSymLoadModuleExW = (PFNSYMLOADMODULEEXW)GetProcAddress(m_hDbgHelp, "SymLoadModuleExW");
+  m_pfnSymFromAddrW = (PFNSYMFROMADDRW)GetProcAddress(m_hDbgHelp, "SymFromAddrW");
+  m_pfnSymGetLineFromAddrW64 = (PFNSYMGETLINEFROMADDRW64)GetProcAddress(m_hDbgHelp, "SymGetLineFromAddrW64");
+  m_pfnSymGetModuleInfoW64 = (PFNSYMGETMODULEINFOW64)GetProcAddress(m_hDbgHelp, "SymGetModuleInfoW64");
+  m_pfnStackWalk64 = (PFNSTACKWALK64)GetProcAddress(m_hDbgHelp, "StackWalk64");
+  m_pfnSymFunctionTableAccess64 = (PFUNCTION_TABLE_ACCESS_ROUTINE64)GetProcAddress(m_hDbgHelp, "SymFunctionTableAccess64");
+
+  if (m_pfnSymSetOptions == NULL || m_pfnSymInitializeW == NULL || m_pfnSymCleanup == NULL ||
+      m_pfnSymLoadModuleExW == NULL || m_pfnSymFromAddrW == NULL || m_pfnSymGetLineFromAddrW64 == NULL || m_pfnSymGetModuleInfoW64 == NULL ||
+      m_pfnStackWalk64 == NULL || m_pfnSymFunctionTableAccess64 == NULL) {
+    m_sErrorMsg = _T("dbghelp.dll is too old");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CSymbolizer::MapDump(LPCTSTR szDumpFile) {
+  m_hDumpFile = CreateFile(szDumpFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hDumpFile == INVALID_HANDLE_VALUE) {
+    m_sErrorMsg.Format(_T("Couldn't open minidump file: %s"), Utility::FormatErrorMsg(GetLastError()).GetString());
+    return FALSE;
+  }
+
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx(m_hDumpFile, &liSize) || liSize.QuadPart == 0) {
+    m_sErrorMsg = _T("Minidump file is empty");
+    return FALSE;
+  }
+  m_ullDumpSize = (ULONG64)liSize.QuadPart;
+
+  // A full memory dump may not fit the address space of a 32-bit process,
+  // so only views of the parts actually used are mapped (see GetDumpData())
+  m_hDumpMapping = CreateFileMapping(m_hDumpFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (m_hDumpMapping == NULL) {
+    m_sErrorMsg = _T("Couldn't map minidump file");
+    return FALSE;
+  }
+
+  MINIDUMP_HEADER* pHeader = (MINIDUMP_HEADER*)GetDumpData(0, sizeof(MINIDUMP_HEADER));
+  if (pHeader == NULL || pHeader->Signature != MINIDUMP_SIGNATURE) {
+    m_sErrorMsg = _T("File is not a minidump");
+    return FALSE;
+  }
+
+  m_pDumpDir = (MINIDUMP_DIRECTORY*)GetDumpData(pHeader->StreamDirectoryRva, (ULONG64)pHeader->NumberOfStreams * sizeof(MINIDUMP_DIRECTORY));
+  if (m_pDumpDir == NULL) {
+    m_sErrorMsg = _T("Minidump stream directory is truncated");
+    return FALSE;
+  }
+  m_ulStreamCount = pHeader->NumberOfStreams;
+
+  // Memory lists are searched for every read made while unwinding
+  ULONG ulSize = 0;
+  m_pMemoryList = (MINIDUMP_MEMORY_LIST*)ReadStream(MemoryListStream, &ulSize);
+  if (m_pMemoryList != NULL && (ulSize < offsetof(MINIDUMP_MEMORY_LIST, MemoryRanges) ||
+                                (ulSize - offsetof(MINIDUMP_MEMORY_LIST, MemoryRanges)) / sizeof(MINIDUMP_MEMORY_DESCRIPTOR) <
+                                    m_pMemoryList->NumberOfMemoryRanges))
+    m_pMemoryList = NULL;  // Truncated dump
+
+  m_pMemory64List = (MINIDUMP_MEMORY64_LIST*)ReadStream(Memory64ListStream, &ulSize);
+  if (m_pMemory64List != NULL && (ulSize < offsetof(MINIDUMP_MEMORY64_LIST, MemoryRanges) ||
+                                  (ulSize - offsetof(MINIDUMP_MEMORY64_LIST, MemoryRanges)) / sizeof(MINIDUMP_MEMORY_DESCRIPTOR64) <
+                                      m_pMemory64List->NumberOfMemoryRanges))
+    m_pMemory64List = NULL;  // Truncated dump
+
+  return TRUE;
+}
+
+void CSymbolizer::UnmapDump() {
+  for (size_t i = 0; i < m_aModules.size(); i++) {
+    if (m_aModules[i]->m_bCacheOpened)
+      m_aModules[i]->m_Cache.Save();
+    delete m_aModules[i];
+  }
+  m_aModules.clear();
+
+  if (m_bSymInitialized) {
+    m_pfnSymCleanup((HANDLE)this);
+    m_bSymInitialized = FALSE;
+  }
+
+  for (size_t i = 0; i < m_aViews.size(); i++)
+    UnmapViewOfFile(m_aViews[i].m_pData);
+  m_aViews.clear();
+
+  if (m_hDumpMapping != NULL) {
+    CloseHandle(m_hDumpMapping);
+    m_hDumpMapping = NULL;
+  }
+
+  if (m_hDumpFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hDumpFile);
+    m_hDumpFile = INVALID_HANDLE_VALUE;
+  }
+
+  m_ullDumpSize = 0;
+  m_pDumpDir = NULL;
+  m_ulStreamCount = 0;
+  m_pMemoryList = NULL;
+  m_pMemory64List = NULL;
+}
+
+LPBYTE CSymbolizer::GetDumpData(ULONG64 ullRva, ULONG64 ullSize) {
+  if (m_hDumpMapping == NULL || ullRva > m_ullDumpSize || ullSize > m_ullDumpSize - ullRva)
+    return NULL;
+
+  // Streams lie close to each other, so a view mapped for one usually has the next one too
+  for (size_t i = 0; i < m_aViews.size(); i++) {
+    DumpView& view = m_aViews[i];
+    if (ullRva >= view.m_ullOffset && ullRva + ullSize <= view.m_ullOffset + view.m_nSize)
+      return view.m_pData + (ullRva - view.m_ullOffset);
+  }
+
+  // Views must start at a multiple of the allocation granularity
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  ULONG64 ullOffset = ullRva - ullRva % si.dwAllocationGranularity;
+  ULONG64 ullViewSize = max(ullRva + ullSize - ullOffset, (ULONG64)SYMBOLIZER_VIEW_SIZE);
+  ullViewSize = min(ullViewSize, m_ullDumpSize - ullOffset);
+  if (ullViewSize == 0 || ullViewSize > SYMBOLIZER_MAX_VIEW_SIZE)
+    return NULL;
+
+  DumpView view;
+  view.m_ullOffset = ullOffset;
+  view.m_nSize = (SIZE_T)ullViewSize;
+  view.m_pData = (LPBYTE)MapViewOfFile(m_hDumpMapping, FILE_MAP_READ, (DWORD)(ullOffset >> 32), (DWORD)ullOffset, view.m_nSize);
+  if (view.m_pData == NULL)
+    return NULL;
+
+  m_aViews.push_back(view);
+  return view.m_pData + (ullRva - ullOffset);
+}
+
+BOOL CSymbolizer::ReadDumpData(ULONG64 ullRva, PVOID pBuffer, DWORD dwSize) {
+  if (m_hDumpFile == INVALID_HANDLE_VALUE || ullRva > m_ullDumpSize || dwSize > m_ullDumpSize - ullRva)
+    return FALSE;
+
+  // The file is opened for synchronous I/O, the offset just positions the read
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(OVERLAPPED));
+  ov.Offset = (DWORD)ullRva;
+  ov.OffsetHigh = (DWORD)(ullRva >> 32);
+
+  DWORD dwBytesRead = 0;
+  return ReadFile(m_hDumpFile, pBuffer, dwSize, &dwBytesRead, &ov) && dwBytesRead == dwSize;
+}
+
+LPBYTE CSymbolizer::ReadStream(ULONG ulStreamType, ULONG* pulSize) {
+  for (ULONG32 i = 0; m_pDumpDir != NULL && i < m_ulStreamCount; i++) {
+    if (m_pDumpDir[i].StreamType != ulStreamType)
+      continue;
+
+    LPBYTE pStream = GetDumpData(m_pDumpDir[i].Location.Rva, m_pDumpDir[i].Location.DataSize);
+    if (pStream != NULL && pulSize != NULL)
+      *pulSize = m_pDumpDir[i].Location.DataSize;
+    return pStream;
+  }
+
+  return NULL;
+}
+
+void CSymbolizer::ReadModules() {
+  ULONG ulSize = 0;
+  MINIDUMP_MODULE_LIST* pModuleList = (MINIDUMP_MODULE_LIST*)ReadStream(ModuleListStream, &ulSize);
+  if (pModuleList == NULL || ulSize < offsetof(MINIDUMP_MODULE_LIST, Modules))
+    return;
+
+  for (ULONG32 i = 0; i < pModuleList->NumberOfModules; i++) {
+    if (ulSize < offsetof(MINIDUMP_MODULE_LIST, Modules) + (ULONG64)(i + 1) * sizeof(MINIDUMP_MODULE))
+      break;  // Truncated dump
+    MINIDUMP_MODULE* pModule = &pModuleList->Modules[i];
+
+    DumpModule* pDumpModule = new DumpModule();
+    pDumpModule->m_ullBase = pModule->BaseOfImage;
+    pDumpModule->m_dwSize = pModule->SizeOfImage;
+    pDumpModule->m_bCacheOpened = FALSE;
+    pDumpModule->m_bLoaded = FALSE;
+
+    // The name may lie across the end of the view the length was found in
+    MINIDUMP_STRING* pName = (MINIDUMP_STRING*)GetDumpData(pModule->ModuleNameRva, sizeof(ULONG32));
+    LPCWSTR pszName = pName != NULL ? (LPCWSTR)GetDumpData(pModule->ModuleNameRva + sizeof(ULONG32), pName->Length) : NULL;
+    if (pszName != NULL)
+      pDumpModule->m_sImagePath = CString(pszName, pName->Length / sizeof(WCHAR));
+    pDumpModule->m_sName = Utility::GetFileName(pDumpModule->m_sImagePath);
+
+    // Module identity: the PDB signature if there is one (as symbol servers do), otherwise the image stamp and size.
+    // Cache files are kept flat in the cache folder, which is the only folder created.
+    CString sCacheKey;
+    CodeViewPdb70* pCodeView = (CodeViewPdb70*)GetDumpData(pModule->CvRecord.Rva, pModule->CvRecord.DataSize);
+    size_t nNameOffset = offsetof(CodeViewPdb70, m_szPdbFileName);
+    if (pCodeView != NULL && pModule->CvRecord.DataSize > nNameOffset && pCodeView->m_dwSignature == CODEVIEW_PDB70_SIGNATURE) {
+      // The PDB name is not necessarily zero-terminated within the record
+      CStringA sPdbPath(pCodeView->m_szPdbFileName, (int)strnlen(pCodeView->m_szPdbFileName, pModule->CvRecord.DataSize - nNameOffset));
+      strconv_t strconv;
+      CString sPdbName = Utility::GetFileName(strconv.utf82t(sPdbPath));
+      const GUID& g = pCodeView->m_Guid;
+      sCacheKey.Format(_T("%s_%08X%04X%04X%02X%02X%02X%02X%02X%02X%02X%02X%X"), sPdbName.GetString(), g.Data1, g.Data2, g.Data3, g.Data4[0], g.Data4[1],
+                       g.Data4[2], g.Data4[3], g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7], pCodeView->m_dwAge);
+    }
+    else if (!pDumpModule->m_sName.IsEmpty()) {
+      sCacheKey.Format(_T("%s_%08X%x"), pDumpModule->m_sName.GetString(), pModule->TimeDateStamp, pModule->SizeOfImage);
+    }
+
+    if (!sCacheKey.IsEmpty())
+      pDumpModule->m_sCacheFile = m_sCacheFolder + _T("\\") + sCacheKey + _T(".syc");
+
+    // The image is read from disk, dbghelp needs it for unwind info and to find the PDB.
+    pDumpModule->m_bLoaded =
+        m_pfnSymLoadModuleExW((HANDLE)this, NULL, pDumpModule->m_sImagePath, NULL, pDumpModule->m_ullBase, pDumpModule->m_dwSize, NULL, 0) != 0;
+
+    m_aModules.push_back(pDumpModule);
+  }
+}
+
+BOOL CSymbolizer::ReadMemory(ULONG64 ullAddress, PVOID pBuffer, DWORD dwSize, DWORD* pdwRead) {
+  *pdwRead = 0;
+
+  // Mini dumps store memory ranges with individual RVAs...
+  MINIDUMP_MEMORY_LIST* pMemoryList = m_pMemoryList;
+  if (pMemoryList != NULL) {
+    for (ULONG32 i = 0; i < pMemoryList->NumberOfMemoryRanges; i++) {
+      MINIDUMP_MEMORY_DESCRIPTOR* pRange = &pMemoryList->MemoryRanges[i];
+      if (ullAddress < pRange->StartOfMemoryRange || ullAddress - pRange->StartOfMemoryRange >= pRange->Memory.DataSize)
+        continue;
+
+      ULONG64 ullOffset = ullAddress - pRange->StartOfMemoryRange;
+      DWORD dwAvail = (DWORD)min((ULONG64)dwSize, pRange->Memory.DataSize - ullOffset);
+      if (!ReadDumpData(pRange->Memory.Rva + ullOffset, pBuffer, dwAvail))
+        return FALSE;
+
+      *pdwRead = dwAvail;
+      return TRUE;
+    }
+  }
+
+  // ... full memory dumps store them one after another.
+  MINIDUMP_MEMORY64_LIST* pMemory64List = m_pMemory64List;
+  if (pMemory64List != NULL) {
+    ULONG64 ullRva = pMemory64List->BaseRva;
+    for (ULONG64 i = 0; i < pMemory64List->NumberOfMemoryRanges; i++) {
+      MINIDUMP_MEMORY_DESCRIPTOR64* pRange = &pMemory64List->MemoryRanges[i];
+      if (ullAddress >= pRange->StartOfMemoryRange && ullAddress - pRange->StartOfMemoryRange < pRange->DataSize) {
+        ULONG64 ullOffset = ullAddress - pRange->StartOfMemoryRange;
+        DWORD dwAvail = (DWORD)min((ULONG64)dwSize, pRange->DataSize - ullOffset);
+        if (!ReadDumpData(ullRva + ullOffset, pBuffer, dwAvail))
+          return FALSE;
+
+        *pdwRead = dwAvail;
+        return TRUE;
+      }
+      ullRva += pRange->DataSize;
+    }
+  }
+
+  return FALSE;
+}
+
+DumpModule* CSymbolizer::FindModule(ULONG64 ullAddress) {
+  for (size_t i = 0; i < m_aModules.size(); i++) {
+    DumpModule* pModule = m_aModules[i];
+    if (ullAddress >= pModule->m_ullBase && ullAddress - pModule->m_ullBase < pModule->m_dwSize)
+      return pModule;
+  }
+  return NULL;
+}
+
+BOOL CALLBACK CSymbolizer::ReadMemoryRoutine(HANDLE hProcess, DWORD64 ullBaseAddress, PVOID pBuffer, DWORD dwSize, LPDWORD pdwRead) {
+  // The "process handle" given to dbghelp is the symbolizer itself
+  CSymbolizer* pSymbolizer = (CSymbolizer*)hProcess;
+  return pSymbolizer->ReadMemory(ullBaseAddress, pBuffer, dwSize, pdwRead);
+}
+
+DWORD64 CALLBACK CSymbolizer::GetModuleBaseRoutine(HANDLE hProcess, DWORD64 ullAddress) {
+  CSymbolizer* pSymbolizer = (CSymbolizer*)hProcess;
+  DumpModule* pModule = pSymbolizer->FindModule(ullAddress);
+  return pModule != NULL ? pModule->m_ullBase : 0;
+}
+
+BOOL CSymbolizer::LookupSymbol(DumpModule* pModule, ULONG64 ullAddress, SYMBOL_CACHE_ENTRY* pEntry) {
+  if (!pModule->m_bLoaded)
+    return FALSE;
+
+  BYTE Buffer[sizeof(SYMBOL_INFOW) + SYMBOL_CACHE_MAX_FUNCTION * sizeof(WCHAR)];
+  memset(Buffer, 0, sizeof(Buffer));
+  PSYMBOL_INFOW pSymbol = (PSYMBOL_INFOW)Buffer;
+  pSymbol->SizeOfStruct = sizeof(SYMBOL_INFOW);
+  pSymbol->MaxNameLen = SYMBOL_CACHE_MAX_FUNCTION;
+
+  DWORD64 ullDisplacement = 0;
+  if (!m_pfnSymFromAddrW((HANDLE)this, ullAddress, &ullDisplacement, pSymbol))
+    return FALSE;
+
+  memset(pEntry, 0, sizeof(SYMBOL_CACHE_ENTRY));
+  pEntry->m_dwRva = (DWORD)(ullAddress - pModule->m_ullBase);
+  pEntry->m_dwDisplacement = (DWORD)ullDisplacement;
+  CopyUtf8(pEntry->m_szFunction, SYMBOL_CACHE_MAX_FUNCTION, pSymbol->Name);
+
+  IMAGEHLP_LINEW64 Line;
+  memset(&Line, 0, sizeof(IMAGEHLP_LINEW64));
+  Line.SizeOfStruct = sizeof(IMAGEHLP_LINEW64);
+  DWORD dwLineDisplacement = 0;
+  if (m_pfnSymGetLineFromAddrW64((HANDLE)this, ullAddress, &dwLineDisplacement, &Line)) {
+    pEntry->m_dwLine = Line.LineNumber;
+    CopyUtf8(pEntry->m_szFile, SYMBOL_CACHE_MAX_FILE, Line.FileName);
+  }
+
+  // Only symbols from a PDB are worth caching; export symbols are replaced once the PDB becomes available.
+  IMAGEHLP_MODULEW64 ModuleInfo;
+  memset(&ModuleInfo, 0, sizeof(IMAGEHLP_MODULEW64));
+  ModuleInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULEW64);
+  if (!pModule->m_sCacheFile.IsEmpty() && m_pfnSymGetModuleInfoW64((HANDLE)this, pModule->m_ullBase, &ModuleInfo) && ModuleInfo.SymType == SymPdb)
+    pModule->m_Cache.Add(*pEntry);
+
+  return TRUE;
+}
+
+CString CSymbolizer::ResolveFrame(ULONG64 ullAddress, BOOL bReturnAddress) {
+  CString sFrame;
+  DumpModule* pModule = FindModule(ullAddress);
+  if (pModule == NULL) {
+    sFrame.Format(_T("0x%I64x"), ullAddress);
+    return sFrame;
+  }
+
+  // A return address points past the call instruction, which may belong to the next line or function.
+  ULONG64 ullLookup = bReturnAddress ? ullAddress - 1 : ullAddress;
+  DWORD dwRva = (DWORD)(ullLookup - pModule->m_ullBase);
+
+  if (!pModule->m_bCacheOpened && !pModule->m_sCacheFile.IsEmpty()) {
+    pModule->m_Cache.Open(pModule->m_sCacheFile);
+    pModule->m_bCacheOpened = TRUE;
+  }
+
+  SYMBOL_CACHE_ENTRY Entry;
+  if (!pModule->m_Cache.Find(dwRva, &Entry) && !LookupSymbol(pModule, ullLookup, &Entry)) {
+    sFrame.Format(_T("%s+0x%x"), pModule->m_sName.GetString(), (DWORD)(ullAddress - pModule->m_ullBase));
+    return sFrame;
+  }
+
+  strconv_t strconv;
+  sFrame.Format(_T("%s!%s+0x%x"), pModule->m_sName.GetString(), strconv.utf82t(Entry.m_szFunction), Entry.m_dwDisplacement + (bReturnAddress ? 1 : 0));
+  if (Entry.m_dwLine != 0) {
+    CString sLine;
+    sLine.Format(_T(" [%s @ %u]"), strconv.utf82t(Entry.m_szFile), Entry.m_dwLine);
+    sFrame += sLine;
+  }
+  return sFrame;
+}
+
+BOOL CSymbolizer::SymbolizeDump(LPCTSTR szDumpFile, DWORD dwThreadId, LPCTSTR szOutputFile) {
+  if (m_hDbgHelp == NULL) {
+    m_sErrorMsg = _T("Symbolizer is not initialized");
+    return FALSE;
+  }
+
+  UnmapDump();
+  if (!MapDump(szDumpFile)) {
+    UnmapDump();
+    return FALSE;
+  }
+
+  BOOL bStatus = FALSE;
+  CString sText;
+  CString sLine;
+  LPBYTE pContext = NULL;
+  ULONG32 ulContextSize = 0;
+  CONTEXT Context;
+  STACKFRAME64 Frame;
+  MINIDUMP_SYSTEM_INFO* pSystemInfo = NULL;
+  MINIDUMP_EXCEPTION_STREAM* pException = NULL;
+  MINIDUMP_THREAD_LIST* pThreadList = NULL;
+  ULONG ulThreadListSize = 0;
+
+  // The context can only be unwound by a build of the same architecture
+  pSystemInfo = (MINIDUMP_SYSTEM_INFO*)ReadStream(SystemInfoStream, NULL);
+  if (pSystemInfo == NULL || pSystemInfo->ProcessorArchitecture != SYMBOLIZER_ARCHITECTURE) {
+    m_sErrorMsg = _T("Minidump architecture is not supported by this build");
+    goto cleanup;
+  }
+
+  // Take the context of the thread that raised the exception (it is the context at the moment of exception)...
+  pException = (MINIDUMP_EXCEPTION_STREAM*)ReadStream(ExceptionStream, NULL);
+  if (pException != NULL && (dwThreadId == 0 || dwThreadId == pException->ThreadId)) {
+    dwThreadId = pException->ThreadId;
+    pContext = GetDumpData(pException->ThreadContext.Rva, pException->ThreadContext.DataSize);
+    ulContextSize = pException->ThreadContext.DataSize;
+
+    sLine.Format(_T("Exception 0x%08X at 0x%I64x\r\n"), pException->ExceptionRecord.ExceptionCode, pException->ExceptionRecord.ExceptionAddress);
+    sText += sLine;
+  }
+  else {
+    // ... or the context of the requested thread as it was when the dump was written.
+    pThreadList = (MINIDUMP_THREAD_LIST*)ReadStream(ThreadListStream, &ulThreadListSize);
+    for (ULONG32 i = 0; pThreadList != NULL && i < pThreadList->NumberOfThreads &&
+                        ulThreadListSize >= offsetof(MINIDUMP_THREAD_LIST, Threads) + (ULONG64)(i + 1) * sizeof(MINIDUMP_THREAD);
+         i++) {
+      MINIDUMP_THREAD* pThread = &pThreadList->Threads[i];
+      if (pThread->ThreadId == dwThreadId || (dwThreadId == 0 && i == 0)) {
+        dwThreadId = pThread->ThreadId;
+        pContext = GetDumpData(pThread->ThreadContext.Rva, pThread->ThreadContext.DataSize);
+        ulContextSize = pThread->ThreadContext.DataSize;
+        break;
+      }
+    }
+  }
+
+  if (pContext == NULL) {
+    m_sErrorMsg = _T("Thread context not found in minidump");
+    goto cleanup;
+  }
+
+  memset(&Context, 0, sizeof(CONTEXT));
+  memcpy(&Context, pContext, min((size_t)ulContextSize, sizeof(CONTEXT)));
+
+  m_pfnSymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES | SYMOPT_FAIL_CRITICAL_ERRORS);
+  if (!m_pfnSymInitializeW((HANDLE)this, NULL, FALSE)) {
+    m_sErrorMsg = _T("SymInitialize failed");
+    goto cleanup;
+  }
+  m_bSymInitialized = TRUE;
+
+  Utility::CreateFolder(m_sCacheFolder);
+  ReadModules();
+
+  memset(&Frame, 0, sizeof(STACKFRAME64));
+#if defined(_M_X64)
+  Frame.AddrPC.Offset = Context.Rip;
+  Frame.AddrFrame.Offset = Context.Rbp;
+  Frame.AddrStack.Offset = Context.Rsp;
+#elif defined(_M_ARM64)
+  Frame.AddrPC.Offset = Context.Pc;
+  Frame.AddrFrame.Offset = Context.Fp;
+  Frame.AddrStack.Offset = Context.Sp;
+#else
+  Frame.AddrPC.Offset = Context.Eip;
+  Frame.AddrFrame.Offset = Context.Ebp;
+  Frame.AddrStack.Offset = Context.Esp;
+#endif
+  Frame.AddrPC.Mode = AddrModeFlat;
+  Frame.AddrFrame.Mode = AddrModeFlat;
+  Frame.AddrStack.Mode = AddrModeFlat;
+
+  sLine.Format(_T("Thread %u\r\n"), dwThreadId);
+  sText += sLine;
+
+  for (int i = 0; i < SYMBOLIZER_MAX_FRAMES; i++) {
+    if (!m_pfnStackWalk64(SYMBOLIZER_MACHINE, (HANDLE)this, NULL, &Frame, &Context, ReadMemoryRoutine, m_pfnSymFunctionTableAccess64, GetModuleBaseRoutine,
+                          NULL))
+      break;
+
+    if (Frame.AddrPC.Offset == 0)
+      break;
+
+    sLine.Format(_T(" #%-3d %s\r\n"), i, ResolveFrame(Frame.AddrPC.Offset, i > 0).GetString());
+    sText += sLine;
+  }
+
+  // Write the stack
+  {
+    HANDLE hFile = CreateFile(szOutputFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      m_sErrorMsg.Format(_T("Couldn't create stack file: %s"), Utility::FormatErrorMsg(GetLastError()).GetString());
+      goto cleanup;
+    }
+
+    strconv_t strconv;
+    LPCSTR pszUtf8 = strconv.t2utf8(sText);
+    DWORD dwBytesWritten = 0;
+    bStatus = WriteFile(hFile, pszUtf8, (DWORD)strlen(pszUtf8), &dwBytesWritten, NULL);
+    CloseHandle(hFile);
+  }
+
+cleanup:
+
+  // Saves symbol caches
+  UnmapDump();
+  return bStatus;
+}
@@ -0,0 +1,132 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: Symbolizer.h
+// Description: Unwinds a thread stored in a minidump file and writes its symbolized call stack.
+// Symbols resolved once are kept in a per-module cache, so repeated modules don't need debug info reparsed.
+
+#pragma once
+#include "stdafx.h"
+#include "SymbolCache.h"
+
+#define SYMBOLIZER_MAX_FRAMES 64  /* Max count of frames written */
+#define SYMBOLIZER_VIEW_SIZE (1024 * 1024)  /* Size of a view of the minidump file mapped for its streams */
+#define SYMBOLIZER_MAX_VIEW_SIZE (256 * 1024 * 1024)  /* Largest stream mapped (larger ones are taken as a damaged dump) */
+
+// Module recorded in a minidump.
+struct DumpModule {
+  ULONG64 m_ullBase;        // Base address.
+  DWORD m_dwSize;           // Size of image.
+  CString m_sImagePath;     // Image path (on the machine the dump was written on).
+  CString m_sName;          // Image file name.
+  CString m_sCacheFile;     // Symbol cache file path (derived from the module identity).
+  BOOL m_bCacheOpened;      // Whether the cache file was opened.
+  BOOL m_bLoaded;           // Whether the module was loaded into dbghelp.
+  CSymbolCache m_Cache;     // Symbols of this module.
+};
+
+// View of a part of the minidump file.
+struct DumpView {
+  ULONG64 m_ullOffset;  // File offset of the view (a multiple of the allocation granularity).
+  SIZE_T m_nSize;       // Size of the view.
+  LPBYTE m_pData;       // Mapped data.
+};
+
+// Minidump symbolizer.
+class CSymbolizer {
+ public:
+  // Construction/destruction
+  CSymbolizer();
+  ~CSymbolizer();
+
+  // Loads dbghelp.dll and sets the folder of symbol cache files.
+  BOOL Init(LPCTSTR szDbgHelpPath, LPCTSTR szCacheFolder);
+
+  // Unwinds the given thread (or the thread that raised the exception if zero)
+  // and writes the call stack to a text file.
+  BOOL SymbolizeDump(LPCTSTR szDumpFile, DWORD dwThreadId, LPCTSTR szOutputFile);
+
+  // Returns last error message.
+  CString GetErrorMsg();
+
+  // Returns the symbol cache folder shared by all applications of the user.
+  static CString GetDefaultCacheFolder();
+
+ private:
+  // Opens the minidump file and maps its header and stream directory.
+  BOOL MapDump(LPCTSTR szDumpFile);
+
+  // Unmaps the minidump file and unloads modules.
+  void UnmapDump();
+
+  // Returns pointer to the given range of the file, mapping a view of it if needed, or NULL if it is out of the file.
+  // The pointer is valid until the dump is unmapped.
+  LPBYTE GetDumpData(ULONG64 ullRva, ULONG64 ullSize);
+
+  // Copies the given range of the file to the buffer, without mapping it.
+  BOOL ReadDumpData(ULONG64 ullRva, PVOID pBuffer, DWORD dwSize);
+
+  // Returns the stream of the given type, or NULL if there is no such stream.
+  LPBYTE ReadStream(ULONG ulStreamType, ULONG* pulSize);
+
+  // Reads the module list and loads modules into dbghelp.
+  void ReadModules();
+
+  // Reads memory of the crashed process stored in the minidump.
+  BOOL ReadMemory(ULONG64 ullAddress, PVOID pBuffer, DWORD dwSize, DWORD* pdwRead);
+
+  // Returns the module containing the address, or NULL.
+  DumpModule* FindModule(ULONG64 ullAddress);
+
+  // Resolves the address using debug info. Returns FALSE if no symbol is found.
+  BOOL LookupSymbol(DumpModule* pModule, ULONG64 ullAddress, SYMBOL_CACHE_ENTRY* pEntry);
+
+  // Formats a frame as module!function+offset [file @ line].
+  CString ResolveFrame(ULONG64 ullAddress, BOOL bReturnAddress);
+
+  // Callbacks used by StackWalk64()
+  static BOOL CALLBACK ReadMemoryRoutine(HANDLE hProcess, DWORD64 ullBaseAddress, PVOID pBuffer, DWORD dwSize, LPDWORD pdwRead);
+  static DWORD64 CALLBACK GetModuleBaseRoutine(HANDLE hProcess, DWORD64 ullAddress);
+
+  // dbghelp.dll functions
+  typedef DWORD(WINAPI* PFNSYMSETOPTIONS)(DWORD);
+  typedef BOOL(WINAPI* PFNSYMINITIALIZEW)(HANDLE, PCWSTR, BOOL);
+  typedef BOOL(WINAPI* PFNSYMCLEANUP)(HANDLE);
+  typedef DWORD64(WINAPI* PFNSYMLOADMODULEEXW)(HANDLE, HANDLE, PCWSTR, PCWSTR, DWORD64, DWORD, PMODLOAD_DATA, DWORD);
+  typedef BOOL(WINAPI* PFNSYMFROMADDRW)(HANDLE, DWORD64, PDWORD64, PSYMBOL_INFOW);
+  typedef BOOL(WINAPI* PFNSYMGETLINEFROMADDRW64)(HANDLE, DWORD64, PDWORD, PIMAGEHLP_LINEW64);
+  typedef BOOL(WINAPI* PFNSYMGETMODULEINFOW64)(HANDLE, DWORD64, PIMAGEHLP_MODULEW64);
+  typedef BOOL(WINAPI* PFNSTACKWALK64)(DWORD, HANDLE, HANDLE, LPSTACKFRAME64, PVOID, PREAD_PROCESS_MEMORY_ROUTINE64, PFUNCTION_TABLE_ACCESS_ROUTINE64,
+                                       PGET_MODULE_BASE_ROUTINE64, PTRANSLATE_ADDRESS_ROUTINE64);
+
+  HMODULE m_hDbgHelp;                                   // dbghelp.dll
+  PFNSYMSETOPTIONS m_pfnSymSetOptions;
+  PFNSYMINITIALIZEW m_pfnSymInitializeW;
+  PFNSYMCLEANUP m_pfnSymCleanup;
+  PFNSYMLOADMODULEEXW m_pfnSymLoadModuleExW;
+  PFNSYMFROMADDRW m_pfnSymFromAddrW;
+  PFNSYMGETLINEFROMADDRW64 m_pfnSymGetLineFromAddrW64;
+  PFNSYMGETMODULEINFOW64 m_pfnSymGetModuleInfoW64;
+  PFNSTACKWALK64 m_pfnStackWalk64;
+  PFUNCTION_TABLE_ACCESS_ROUTINE64 m_pfnSymFunctionTableAccess64;
+
+  CString m_sCacheFolder;               // Folder of symbol cache files.
+  CString m_sErrorMsg;                  // Last error message.
+  HANDLE m_hDumpFile;                   // Minidump file.
+  HANDLE m_hDumpMapping;                // Minidump file mapping.
+  std::vector<DumpView> m_aViews;       // Views of the minidump file mapped so far.
+  ULONG64 m_ullDumpSize;                // Minidump file size.
+  MINIDUMP_DIRECTORY* m_pDumpDir;       // Stream directory.
+  ULONG32 m_ulStreamCount;              // Count of entries in the stream directory.
+  MINIDUMP_MEMORY_LIST* m_pMemoryList;  // Memory ranges of a mini dump (NULL if none).
+  MINIDUMP_MEMORY64_LIST* m_pMemory64List;  // Memory ranges of a full memory dump (NULL if none).
+  BOOL m_bSymInitialized;               // Whether SymInitialize() was called.
+  std::vector<DumpModule*> m_aModules;  // Modules of the crashed process.
+};
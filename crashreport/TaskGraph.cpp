@@ -0,0 +1,178 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "TaskGraph.h"
+#include <thread>
+#include <algorithm>
+
+CTaskGraph::CTaskGraph() {
+  m_nRemainingCount = 0;
+  m_llRunStart = 0;
+
+  LARGE_INTEGER liFreq;
+  QueryPerformanceFrequency(&liFreq);
+  m_llFrequency = liFreq.QuadPart;
+}
+
+CTaskGraph::~CTaskGraph() {
+}
+
+int CTaskGraph::AddTask(LPCTSTR szName, std::function<void()> fnRun) {
+  TaskInfo ti;
+  ti.m_sName = szName;
+  ti.m_fnRun = fnRun;
+  ti.m_nPendingCount = 0;
+  ti.m_bExecuted = FALSE;
+  ti.m_llStart = 0;
+  ti.m_llFinish = 0;
+  m_aTasks.push_back(ti);
+  return (int)m_aTasks.size() - 1;
+}
+
+void CTaskGraph::AddDependency(int nTask, int nDependsOn) {
+  // Dependencies may only point backwards, so the graph can't have cycles
+  ATLASSERT(nTask >= 0 && nTask < (int)m_aTasks.size());
+  ATLASSERT(nDependsOn >= 0 && nDependsOn < nTask);
+
+  m_aTasks[nTask].m_aDependencies.push_back(nDependsOn);
+  m_aTasks[nDependsOn].m_aDependents.push_back(nTask);
+}
+
+void CTaskGraph::Run(int nThreadCount, std::function<bool()> fnIsCancelled) {
+  LARGE_INTEGER liNow;
+  QueryPerformanceCounter(&liNow);
+  m_llRunStart = liNow.QuadPart;
+  m_fnIsCancelled = fnIsCancelled;
+
+  // Queue the tasks that don't depend on anything
+  m_aReady.clear();
+  m_nRemainingCount = (int)m_aTasks.size();
+  size_t i;
+  for (i = 0; i < m_aTasks.size(); i++) {
+    m_aTasks[i].m_nPendingCount = (int)m_aTasks[i].m_aDependencies.size();
+    m_aTasks[i].m_bExecuted = FALSE;
+    if (m_aTasks[i].m_nPendingCount == 0)
+      m_aReady.push_back((int)i);
+  }
+
+  // No use in more threads than tasks
+  if (nThreadCount > (int)m_aTasks.size())
+    nThreadCount = (int)m_aTasks.size();
+
+  // The calling thread works too
+  std::vector<std::thread> aThreads;
+  for (i = 1; i < (size_t)nThreadCount; i++)
+    aThreads.push_back(std::thread(&CTaskGraph::WorkerThread, this));
+
+  WorkerThread();
+
+  for (i = 0; i < aThreads.size(); i++)
+    aThreads[i].join();
+}
+
+void CTaskGraph::WorkerThread() {
+  std::unique_lock<std::mutex> lock(m_Lock);
+
+  for (;;) {
+    while (m_aReady.empty() && m_nRemainingCount != 0)
+      m_ReadyCond.wait(lock);
+
+    if (m_nRemainingCount == 0)
+      break;  // All done
+
+    int nTask = m_aReady.back();
+    m_aReady.pop_back();
+    TaskInfo& ti = m_aTasks[nTask];
+
+    lock.unlock();
+
+    // Skip tasks not started before cancellation, but still release their dependents,
+    // so every thread gets to the end of the graph.
+    if (!m_fnIsCancelled || !m_fnIsCancelled()) {
+      LARGE_INTEGER liStart;
+      LARGE_INTEGER liFinish;
+      QueryPerformanceCounter(&liStart);
+      ti.m_fnRun();
+      QueryPerformanceCounter(&liFinish);
+
+      ti.m_llStart = liStart.QuadPart;
+      ti.m_llFinish = liFinish.QuadPart;
+      ti.m_bExecuted = TRUE;
+    }
+
+    lock.lock();
+
+    m_nRemainingCount--;
+    size_t i;
+    for (i = 0; i < ti.m_aDependents.size(); i++) {
+      TaskInfo& dependent = m_aTasks[ti.m_aDependents[i]];
+      if (--dependent.m_nPendingCount == 0)
+        m_aReady.push_back(ti.m_aDependents[i]);
+    }
+
+    m_ReadyCond.notify_all();
+  }
+}
+
+int CTaskGraph::GetTaskCount() {
+  return (int)m_aTasks.size();
+}
+
+CString CTaskGraph::GetTaskName(int nTask) {
+  if (nTask < 0 || nTask >= (int)m_aTasks.size())
+    return CString();
+
+  return m_aTasks[nTask].m_sName;
+}
+
+BOOL CTaskGraph::GetTaskTiming(int nTask, double& dStartMs, double& dDurationMs) {
+  dStartMs = 0;
+  dDurationMs = 0;
+
+  if (nTask < 0 || nTask >= (int)m_aTasks.size() || !m_aTasks[nTask].m_bExecuted)
+    return FALSE;
+
+  dStartMs = TicksToMs(m_aTasks[nTask].m_llStart - m_llRunStart);
+  dDurationMs = TicksToMs(m_aTasks[nTask].m_llFinish - m_aTasks[nTask].m_llStart);
+  return TRUE;
+}
+
+void CTaskGraph::GetCriticalPath(std::vector<int>& aPath) {
+  aPath.clear();
+
+  // Find the task finished last
+  int nTask = -1;
+  size_t i;
+  for (i = 0; i < m_aTasks.size(); i++) {
+    if (m_aTasks[i].m_bExecuted && (nTask < 0 || m_aTasks[i].m_llFinish > m_aTasks[nTask].m_llFinish))
+      nTask = (int)i;
+  }
+
+  // Walk back through the dependencies that finished last
+  while (nTask >= 0) {
+    aPath.push_back(nTask);
+
+    int nPrev = -1;
+    for (i = 0; i < m_aTasks[nTask].m_aDependencies.size(); i++) {
+      int nDep = m_aTasks[nTask].m_aDependencies[i];
+      if (m_aTasks[nDep].m_bExecuted && (nPrev < 0 || m_aTasks[nDep].m_llFinish > m_aTasks[nPrev].m_llFinish))
+        nPrev = nDep;
+    }
+
+    nTask = nPrev;
+  }
+
+  std::reverse(aPath.begin(), aPath.end());
+}
+
+double CTaskGraph::TicksToMs(LONGLONG llTicks) {
+  return (double)llTicks * 1000.0 / (double)m_llFrequency;
+}
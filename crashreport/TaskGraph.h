@@ -0,0 +1,79 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: TaskGraph.h
+// Description: Runs a small set of dependent tasks on a pool of worker threads.
+// A task starts as soon as all tasks it depends on have finished; start and finish times are recorded.
+
+#pragma once
+#include "stdafx.h"
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+// Task of the graph.
+struct TaskInfo {
+  CString m_sName;                   // Task name (used in timing log).
+  std::function<void()> m_fnRun;     // Work to do.
+  std::vector<int> m_aDependencies;  // Tasks that must finish before this one starts.
+  std::vector<int> m_aDependents;    // Tasks waiting for this one.
+  int m_nPendingCount;               // Count of dependencies not finished yet.
+  BOOL m_bExecuted;                  // FALSE if the task was skipped because of cancellation.
+  LONGLONG m_llStart;                // Start time (performance counter).
+  LONGLONG m_llFinish;               // Finish time (performance counter).
+};
+
+// Dependency-aware task scheduler.
+class CTaskGraph {
+ public:
+  // Construction/destruction
+  CTaskGraph();
+  ~CTaskGraph();
+
+  // Adds a task and returns its index.
+  int AddTask(LPCTSTR szName, std::function<void()> fnRun);
+
+  // Makes the task wait for completion of another (earlier added) task.
+  void AddDependency(int nTask, int nDependsOn);
+
+  // Runs all tasks using up to nThreadCount threads (including the calling one) and
+  // returns when they have finished. Once fnIsCancelled returns true, tasks not started yet are skipped.
+  void Run(int nThreadCount, std::function<bool()> fnIsCancelled);
+
+  // Returns count of tasks.
+  int GetTaskCount();
+
+  // Returns task name.
+  CString GetTaskName(int nTask);
+
+  // Returns task start time and duration in milliseconds (relative to the Run() call).
+  // Returns FALSE if the task wasn't executed.
+  BOOL GetTaskTiming(int nTask, double& dStartMs, double& dDurationMs);
+
+  // Returns the chain of tasks that determined the total run time, starting from the first one:
+  // the task finished last, preceded by the dependency it waited for the longest, and so on.
+  void GetCriticalPath(std::vector<int>& aPath);
+
+ private:
+  // Takes ready tasks from the queue until all tasks have finished.
+  void WorkerThread();
+
+  // Converts performance counter ticks to milliseconds.
+  double TicksToMs(LONGLONG llTicks);
+
+  std::vector<TaskInfo> m_aTasks;        // Tasks.
+  std::vector<int> m_aReady;             // Tasks whose dependencies have finished.
+  int m_nRemainingCount;                 // Count of tasks not finished yet.
+  std::function<bool()> m_fnIsCancelled; // Cancellation check.
+  std::mutex m_Lock;                     // Protects the queue and task states.
+  std::condition_variable m_ReadyCond;   // Signalled when a task becomes ready or all tasks finish.
+  LONGLONG m_llRunStart;                 // Time Run() was called (performance counter).
+  LONGLONG m_llFrequency;                // Performance counter frequency.
+};
@@ -0,0 +1,238 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "ZipWriter.h"
+#include "ParallelDeflate.h"
+#include "Utility.h"
+#include "strconv.h"
+#include <math.h>
+
+CZipWriter::CZipWriter() {
+  m_hZip = NULL;
+}
+
+CZipWriter::~CZipWriter() {
+  Close();
+}
+
+BOOL CZipWriter::Open(CString sZipName) {
+  if (m_hZip != NULL)
+    return TRUE;  // Already open
+
+  m_hZip = zipOpen64((const char*)sZipName.GetBuffer(0), APPEND_STATUS_CREATE);
+  return m_hZip != NULL;
+}
+
+BOOL CZipWriter::Close() {
+  int n = 0;
+  if (m_hZip != NULL) {
+    // Writes the central directory, in ZIP64 format when the archive exceeds 4 GB
+    n = zipClose(m_hZip, NULL);
+    m_hZip = NULL;
+  }
+  return n == 0;
+}
+
+BOOL CZipWriter::IsOpen() {
+  return m_hZip != NULL;
+}
+
+void CZipWriter::SelectCodec(CString sDstFileName, HANDLE hSrcFile, int& nMethod, int& nLevel) {
+  nMethod = Z_DEFLATED;
+  nLevel = Z_DEFAULT_COMPRESSION;
+
+  // Formats that are compressed already
+  static LPCTSTR aszStoredExt[] = {_T("jpg"), _T("jpeg"), _T("png"), _T("gif"), _T("zip"), _T("7z"), _T("gz"),
+                                   _T("bz2"), _T("xz"), _T("cab"), _T("rar"), _T("mp3"), _T("mp4"), _T("avi"),
+                                   _T("docx"), _T("xlsx"), _T("pptx")};
+  CString sExt = Utility::GetFileExtension(sDstFileName);
+  int i;
+  for (i = 0; i < (int)(sizeof(aszStoredExt) / sizeof(aszStoredExt[0])); i++) {
+    if (sExt.CompareNoCase(aszStoredExt[i]) == 0) {
+      nMethod = 0;
+      nLevel = 0;
+      return;
+    }
+  }
+
+  // Sample the beginning of the file. The read is positioned explicitly,
+  // so it works for both synchronous and overlapped handles.
+  std::vector<BYTE> aSample(ZIP_SAMPLE_SIZE);
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(OVERLAPPED));
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (ov.hEvent == NULL)
+    return;
+
+  DWORD dwBytesRead = 0;
+  BOOL bRead = ReadFile(hSrcFile, &aSample[0], ZIP_SAMPLE_SIZE, &dwBytesRead, &ov);
+  if (!bRead && GetLastError() == ERROR_IO_PENDING)
+    bRead = GetOverlappedResult(hSrcFile, &ov, &dwBytesRead, TRUE);
+  CloseHandle(ov.hEvent);
+
+  // A synchronous handle has its file pointer moved by the read
+  LARGE_INTEGER liZero;
+  liZero.QuadPart = 0;
+  SetFilePointerEx(hSrcFile, liZero, NULL, FILE_BEGIN);
+
+  // Small files take no time to compress anyway
+  if (!bRead || dwBytesRead < 4096)
+    return;
+
+  // Order-0 entropy of the sample, in bits per byte
+  DWORD adwCounts[256];
+  memset(adwCounts, 0, sizeof(adwCounts));
+  DWORD dw;
+  for (dw = 0; dw < dwBytesRead; dw++)
+    adwCounts[aSample[dw]]++;
+
+  double dEntropy = 0;
+  for (i = 0; i < 256; i++) {
+    if (adwCounts[i] == 0)
+      continue;
+    double p = (double)adwCounts[i] / dwBytesRead;
+    dEntropy -= p * log(p) / log(2.0);
+  }
+
+  if (dEntropy >= ZIP_STORE_ENTROPY) {
+    // Looks like compressed or encrypted data
+    nMethod = 0;
+    nLevel = 0;
+  }
+  else if (dEntropy >= ZIP_FAST_ENTROPY) {
+    // Higher levels hardly find anything more in such data
+    nLevel = Z_BEST_SPEED;
+  }
+}
+
+BOOL CZipWriter::OpenEntry(CString sDstFileName, CString sDesc, HANDLE hSrcFile, int nMethod, int nLevel, BOOL bRaw) {
+  strconv_t strconv;
+
+  // Get file information.
+  BY_HANDLE_FILE_INFORMATION fi;
+  GetFileInformationByHandle(hSrcFile, &fi);
+
+  // Convert file creation time to system file time.
+  SYSTEMTIME st;
+  FileTimeToSystemTime(&fi.ftLastWriteTime, &st);
+
+  // Fill in the ZIP file info
+  zip_fileinfo info;
+  info.dosDate = 0;
+  info.tmz_date.tm_year = st.wYear;
+  info.tmz_date.tm_mon = st.wMonth - 1;
+  info.tmz_date.tm_mday = st.wDay;
+  info.tmz_date.tm_hour = st.wHour;
+  info.tmz_date.tm_min = st.wMinute;
+  info.tmz_date.tm_sec = st.wSecond;
+  info.external_fa = FILE_ATTRIBUTE_NORMAL;
+  info.internal_fa = FILE_ATTRIBUTE_NORMAL;
+
+  // Sizes are written to the local header when the entry is closed; a 32-bit field
+  // can't be extended then, so reserve the ZIP64 extra field for large files now.
+  LARGE_INTEGER lFileSize;
+  int nZip64 = GetFileSizeEx(hSrcFile, &lFileSize) && lFileSize.QuadPart >= ZIP64_MIN_ENTRY_SIZE;
+
+  // Create new file inside of our ZIP archive
+  int n = zipOpenNewFileInZip2_64(m_hZip, (const char*)strconv.t2a(sDstFileName.GetBuffer(0)), &info, NULL, 0, NULL, 0, strconv.t2a(sDesc), nMethod, nLevel, bRaw, nZip64);
+  return n == 0;
+}
+
+BOOL CZipWriter::WriteEntry(LPBYTE pData, DWORD dwSize) {
+  return zipWriteInFileInZip(m_hZip, pData, dwSize) == 0;
+}
+
+BOOL CZipWriter::CloseEntry() {
+  return zipCloseFileInZip(m_hZip) == 0;
+}
+
+ZIP_ADD_RESULT CZipWriter::AddFile(CString sDstFileName,
+                                   CString sDesc,
+                                   HANDLE hSrcFile,
+                                   LONG64 lSize,
+                                   int nMethod,
+                                   int nLevel,
+                                   LONG64& lAdded,
+                                   std::function<void(LONG64)> fnProgress,
+                                   std::function<bool()> fnIsCancelled) {
+  BYTE buff[1024];
+  DWORD dwBytesRead = 0;
+  LONG64 lRemaining = lSize;
+
+  lAdded = 0;
+
+  // Large files (the minidump mostly) are deflated on all processors
+  BOOL bParallel = nMethod == Z_DEFLATED && lSize >= PARALLEL_DEFLATE_MIN_SIZE;
+
+  if (!OpenEntry(sDstFileName, sDesc, hSrcFile, nMethod, nLevel, bParallel))
+    return ZIP_ADD_NO_ENTRY;
+
+  if (bParallel)
+    return CompressParallel(hSrcFile, lSize, nLevel, lAdded, fnProgress, fnIsCancelled) ? ZIP_ADD_OK : ZIP_ADD_BROKEN;
+
+  // Read source file contents and write it to ZIP archive
+  while (lRemaining != 0) {
+    // Check if operation was cancelled by user
+    if (fnIsCancelled && fnIsCancelled())
+      break;
+
+    // Read a portion of source file
+    BOOL bRead = ReadFile(hSrcFile, buff, lRemaining < 1024 ? (DWORD)lRemaining : 1024, &dwBytesRead, NULL);
+    if (!bRead || dwBytesRead == 0)
+      break;
+    lRemaining -= dwBytesRead;
+
+    // Write a portion into destination file
+    if (!WriteEntry(buff, dwBytesRead))
+      break;
+
+    lAdded += dwBytesRead;
+    if (fnProgress)
+      fnProgress(lAdded);
+  }
+
+  // Close file
+  BOOL bClose = CloseEntry();
+
+  return lRemaining == 0 && bClose ? ZIP_ADD_OK : ZIP_ADD_INCOMPLETE;
+}
+
+BOOL CZipWriter::CompressParallel(HANDLE hSrcFile,
+                                  LONG64 lSize,
+                                  int nLevel,
+                                  LONG64& lAdded,
+                                  std::function<void(LONG64)> fnProgress,
+                                  std::function<bool()> fnIsCancelled) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+
+  CParallelDeflate deflater;
+  BOOL bCompress = deflater.Compress(hSrcFile, lSize, nLevel, (int)si.dwNumberOfProcessors,
+                                     [this, &deflater, fnProgress](LPBYTE pData, DWORD dwSize) {
+                                       if (!WriteEntry(pData, dwSize))
+                                         return FALSE;
+
+                                       if (fnProgress)
+                                         fnProgress(deflater.GetUncompressedSize());
+                                       return TRUE;
+                                     },
+                                     fnIsCancelled);
+
+  if (!bCompress)
+    return FALSE;  // The caller discards the archive
+
+  // The entry is closed with the size and CRC of what was actually compressed
+  if (zipCloseFileInZipRaw64(m_hZip, deflater.GetUncompressedSize(), deflater.GetCrc32()) != 0)
+    return FALSE;
+  lAdded = deflater.GetUncompressedSize();
+
+  return TRUE;
+}
@@ -0,0 +1,87 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: ZipWriter.h
+// Description: Writes the ZIP archive of an error report. Picks the codec of each file,
+// deflates large files on all processors and uses ZIP64 records where sizes or offsets need them.
+
+#pragma once
+#include "stdafx.h"
+#include "zip.h"
+#include <functional>
+
+#define ZIP_SAMPLE_SIZE (64 * 1024)  /* Bytes sampled at the beginning of a file to choose its codec */
+#define ZIP_STORE_ENTROPY 7.5        /* Bits per byte above which data is stored uncompressed */
+#define ZIP_FAST_ENTROPY 6.0         /* Bits per byte above which the fastest deflate level is used */
+#define ZIP64_MIN_ENTRY_SIZE 0xFF000000  /* Files that may not fit 32-bit sizes (stored data grows a little) */
+
+// Result of CZipWriter::AddFile().
+enum ZIP_ADD_RESULT {
+  ZIP_ADD_OK = 0,      // The file was added.
+  ZIP_ADD_NO_ENTRY,    // The entry couldn't be created, the file is not in the archive.
+  ZIP_ADD_INCOMPLETE,  // Reading, writing failed or was cancelled; the entry is closed with the data added so far.
+  ZIP_ADD_BROKEN       // Parallel deflate stopped; the entry can't be closed and the archive can only be discarded.
+};
+
+// ZIP archive writer.
+class CZipWriter {
+ public:
+  // Construction/destruction
+  CZipWriter();
+  ~CZipWriter();
+
+  // Creates the archive (the ZIP64 API, as full memory dumps may exceed 4 GB).
+  BOOL Open(CString sZipName);
+
+  // Writes the central directory and closes the archive. Returns FALSE if the central directory couldn't be written.
+  BOOL Close();
+
+  // Returns TRUE if the archive is open.
+  BOOL IsOpen();
+
+  // Chooses how to pack the file: stores already compressed formats and picks
+  // the deflate level by the entropy of the first bytes of the file.
+  static void SelectCodec(CString sDstFileName, HANDLE hSrcFile, int& nMethod, int& nLevel);
+
+  // Starts a new entry for the (opened) source file, with ZIP64 sizes if the file is large.
+  // If bRaw is set, the caller writes deflated data and closes the entry with zipCloseFileInZipRaw64().
+  BOOL OpenEntry(CString sDstFileName, CString sDesc, HANDLE hSrcFile, int nMethod, int nLevel, BOOL bRaw = FALSE);
+
+  // Compresses data into the open entry.
+  BOOL WriteEntry(LPBYTE pData, DWORD dwSize);
+
+  // Closes the open entry.
+  BOOL CloseEntry();
+
+  // Adds the first lSize bytes of the file (opened for synchronous reading) as a new entry.
+  // Large files are deflated on all processors. lAdded receives count of bytes added,
+  // fnProgress receives it while the file is being added.
+  ZIP_ADD_RESULT AddFile(CString sDstFileName,
+                         CString sDesc,
+                         HANDLE hSrcFile,
+                         LONG64 lSize,
+                         int nMethod,
+                         int nLevel,
+                         LONG64& lAdded,
+                         std::function<void(LONG64)> fnProgress,
+                         std::function<bool()> fnIsCancelled);
+
+ private:
+  // Deflates the first lSize bytes of the file into the opened raw entry using several threads
+  // and closes the entry. On failure the entry is left open and incomplete.
+  BOOL CompressParallel(HANDLE hSrcFile,
+                        LONG64 lSize,
+                        int nLevel,
+                        LONG64& lAdded,
+                        std::function<void(LONG64)> fnProgress,
+                        std::function<bool()> fnIsCancelled);
+
+  zipFile m_hZip;  // Archive being written (NULL if not open).
+};
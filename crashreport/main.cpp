@@ -15,14 +15,33 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 
   int argc = 0;
   LPWSTR* argv = CommandLineToArgvW(szCommandLine, &argc);
-  if (argc != 2)
+  if (argc >= 3 && _tcscmp(argv[1], _T("/symbolize")) == 0) {
+    // Offline symbolization: /symbolize <MinidumpFile or ReportFolder> [ThreadId]
+    if (argc > 4)
+      return 1;
+    return CrashReporter::SymbolizeReport(argv[2], argc == 4 ? (DWORD)_tcstoul(argv[3], NULL, 10) : 0);
+  }
+
+  if (argc != 2 && argc != 4)
     return 1;
 
-  if (_tcscmp(argv[1], _T("/terminate")) == 0) {
+  CString sFileMappingName;
+  if (argc == 4) {
+    // Standby instance started in advance (CR_INST_PRESPAWN_SENDER): /standby <CrashGUID> <ParentPID>
+    if (_tcscmp(argv[1], _T("/standby")) != 0)
+      return 1;
+
+    if (!CrashReporter::WaitForActivation(argv[2], (DWORD)_tcstoul(argv[3], NULL, 10)))
+      return 0;  // Parent process exited without crash
+
+    sFileMappingName = CString(argv[2]);
+  }
+  else if (_tcscmp(argv[1], _T("/terminate")) == 0) {
     return CrashReporter::TerminateAllCrashReportProcesses();
   }
-
-  CString sFileMappingName = CString(argv[1]);
+  else {
+    sFileMappingName = CString(argv[1]);
+  }
 
   CrashReporter* pReporter = CrashReporter::GetInstance();
 
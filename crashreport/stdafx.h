@@ -25,10 +25,12 @@
 #define _TCSCPY_S(strDestination, numberOfElements, strSource) _tcscpy(strDestination, strSource)
 #define _TCSNCPY_S(strDest, sizeInBytes, strSource, count) _tcsncpy(strDest, strSource, count)
 #define STRCPY_S(strDestination, numberOfElements, strSource) strcpy(strDestination, strSource)
+#define STRNCPY_S(strDest, sizeInBytes, strSource, count) (strncpy(strDest, strSource, (sizeInBytes) - 1), (strDest)[(sizeInBytes) - 1] = 0)
 #define _TFOPEN_S(_File, _Filename, _Mode) _File = _tfopen(_Filename, _Mode);
 #else
 #define _TCSCPY_S(strDestination, numberOfElements, strSource) _tcscpy_s(strDestination, numberOfElements, strSource)
 #define _TCSNCPY_S(strDest, sizeInBytes, strSource, count) _tcsncpy_s(strDest, sizeInBytes, strSource, count)
 #define STRCPY_S(strDestination, numberOfElements, strSource) strcpy_s(strDestination, numberOfElements, strSource)
+#define STRNCPY_S(strDest, sizeInBytes, strSource, count) strncpy_s(strDest, sizeInBytes, strSource, count)
 #define _TFOPEN_S(_File, _Filename, _Mode) _tfopen_s(&(_File), _Filename, _Mode);
 #endif
@@ -0,0 +1,297 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "Breadcrumbs.h"
+#include <algorithm>
+
+namespace CrashReport {
+// Ring assigned to the caller thread and the buffer it belongs to.
+static __declspec(thread) BREADCRUMB_HEADER* t_pRingBuffer = NULL;
+static __declspec(thread) BREADCRUMB_RING* t_pRing = NULL;
+
+// Orders breadcrumbs by time.
+static bool BreadcrumbLess(const BreadcrumbInfo& a, const BreadcrumbInfo& b) {
+  return a.m_llTimestamp < b.m_llTimestamp;
+}
+
+CBreadcrumbs::CBreadcrumbs() {
+  m_pHeader = NULL;
+  m_pRings = NULL;
+}
+
+CBreadcrumbs::~CBreadcrumbs() {
+  Destroy();
+}
+
+BOOL CBreadcrumbs::Init(LPCTSTR szName, BOOL bOpenExisting) {
+  if (m_SharedMem.IsInitialized())
+    return FALSE;  // Already initialized
+
+  if (!m_SharedMem.Init(szName, bOpenExisting, BREADCRUMB_BUFFER_SIZE))
+    return FALSE;
+
+  // Only the header and the first ring are committed by now. The other rings
+  // are committed by the threads claiming them (see CommitRing()).
+  m_pHeader = (BREADCRUMB_HEADER*)m_SharedMem.CreateView(0, sizeof(BREADCRUMB_HEADER));
+  m_pRings = (BREADCRUMB_RING*)(m_SharedMem.GetBasePtr() + SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER)));
+
+  if (!bOpenExisting) {
+    memcpy(m_pHeader->m_uchMagic, "BCB", 3);
+    m_pHeader->m_dwSize = SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER));
+    m_pHeader->m_dwRingCount = BREADCRUMB_RING_COUNT;
+    m_pHeader->m_dwRingCapacity = BREADCRUMB_RING_CAPACITY;
+
+    // Remember how performance counter relates to wall clock time,
+    // so the reader can convert timestamps.
+    LARGE_INTEGER liFreq;
+    LARGE_INTEGER liCounter;
+    FILETIME ft;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liCounter);
+    GetSystemTimeAsFileTime(&ft);
+    m_pHeader->m_llQpcFrequency = liFreq.QuadPart;
+    m_pHeader->m_llQpcBase = liCounter.QuadPart;
+    m_pHeader->m_ullTimeBase = ((ULONG64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  }
+  else if (memcmp(m_pHeader->m_uchMagic, "BCB", 3) != 0 || m_pHeader->m_dwSize != SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER)) ||
+           m_pHeader->m_dwRingCount != BREADCRUMB_RING_COUNT || m_pHeader->m_dwRingCapacity != BREADCRUMB_RING_CAPACITY) {
+    // Buffer produced by an incompatible CrashRpt version
+    Destroy();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CBreadcrumbs::IsInitialized() {
+  return m_SharedMem.IsInitialized();
+}
+
+void CBreadcrumbs::Destroy() {
+  m_pHeader = NULL;
+  m_pRings = NULL;
+  m_SharedMem.Destroy();
+}
+
+CString CBreadcrumbs::GetName() {
+  return m_SharedMem.GetName();
+}
+
+void CBreadcrumbs::AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes) {
+  if (!m_SharedMem.IsInitialized())
+    return;
+
+  // Writers commit rings directly, so the committed size of the shared memory object
+  // only covers the first segment. Rings are claimed in order, so count up to the last one.
+  ULONG64 uRingsEnd = SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER)) + (ULONG64)GetRingsUsed() * sizeof(BREADCRUMB_RING);
+  uReservedBytes += m_SharedMem.GetReservedSize();
+  uCommittedBytes += max(m_SharedMem.GetSize(), (uRingsEnd + 4095) & ~(ULONG64)4095);
+}
+
+LONG CBreadcrumbs::GetRingsUsed() {
+  if (m_pHeader == NULL)
+    return 0;
+
+  LONG lRingsUsed = m_pHeader->m_lRingsUsed;
+  return min(lRingsUsed, (LONG)m_pHeader->m_dwRingCount);
+}
+
+BREADCRUMB_RING* CBreadcrumbs::CommitRing(LONG lRing) {
+  // Committing pages of the section directly is thread-safe, and pages
+  // already committed by another thread or process are left intact.
+  BREADCRUMB_RING* pRing = &m_pRings[lRing];
+  if (VirtualAlloc(pRing, sizeof(BREADCRUMB_RING), MEM_COMMIT, PAGE_READWRITE) == NULL)
+    return NULL;
+
+  return pRing;
+}
+
+BREADCRUMB_RING* CBreadcrumbs::GetThreadRing() {
+  if (t_pRingBuffer == m_pHeader)
+    return t_pRing;  // Already assigned
+
+  // Reuse a ring returned by an exited thread, its memory is already committed.
+  DWORD dwThreadId = GetCurrentThreadId();
+  BREADCRUMB_RING* pRing = NULL;
+  LONG lFreeRings = m_pHeader->m_lFreeRings;
+  while (lFreeRings != 0) {
+    DWORD dwRing = 0;
+    while ((lFreeRings & (LONG)(1UL << dwRing)) == 0)
+      dwRing++;
+
+    LONG lPrev = InterlockedCompareExchange(&m_pHeader->m_lFreeRings, lFreeRings & ~(LONG)(1UL << dwRing), lFreeRings);
+    if (lPrev == lFreeRings) {
+      pRing = &m_pRings[dwRing];
+      break;
+    }
+    lFreeRings = lPrev;
+  }
+
+  // Otherwise, take the next unused ring. When all rings are taken, the thread
+  // shares a ring with others; entries are still written consistently, but
+  // the history of such threads is shorter.
+  if (pRing == NULL) {
+    LONG lRing = InterlockedIncrement(&m_pHeader->m_lRingsUsed) - 1;
+    if (lRing < (LONG)m_pHeader->m_dwRingCount)
+      pRing = CommitRing(lRing);
+  }
+
+  if (pRing != NULL) {
+    InterlockedExchange(&pRing->m_lThreadId, (LONG)dwThreadId);
+  }
+  else {
+    // Shared ring may have been claimed, but not committed yet by its owner.
+    // The first ring is committed together with the header.
+    pRing = CommitRing(dwThreadId % m_pHeader->m_dwRingCount);
+    if (pRing == NULL)
+      pRing = &m_pRings[0];
+  }
+
+  t_pRingBuffer = m_pHeader;
+  t_pRing = pRing;
+  return pRing;
+}
+
+void CBreadcrumbs::ReleaseThreadRing() {
+  if (m_pHeader == NULL || t_pRingBuffer != m_pHeader)
+    return;  // The thread hasn't added any breadcrumbs yet
+
+  // Only the owner returns the ring, shared rings stay in use by other threads.
+  BREADCRUMB_RING* pRing = t_pRing;
+  LONG lThreadId = (LONG)GetCurrentThreadId();
+  if (InterlockedCompareExchange(&pRing->m_lThreadId, 0, lThreadId) == lThreadId) {
+    LONG lBit = (LONG)(1UL << (pRing - m_pRings));
+    LONG lFreeRings = m_pHeader->m_lFreeRings;
+    LONG lPrev;
+    while ((lPrev = InterlockedCompareExchange(&m_pHeader->m_lFreeRings, lFreeRings | lBit, lFreeRings)) != lFreeRings)
+      lFreeRings = lPrev;
+  }
+
+  t_pRingBuffer = NULL;
+  t_pRing = NULL;
+}
+
+BOOL CBreadcrumbs::Add(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel) {
+  if (m_pHeader == NULL)
+    return FALSE;
+
+  LARGE_INTEGER liCounter;
+  QueryPerformanceCounter(&liCounter);
+
+  // Reserve an entry. Usually the ring is owned by the caller thread, so there is no contention.
+  BREADCRUMB_RING* pRing = GetThreadRing();
+  LONGLONG llIndex = InterlockedIncrement64(&pRing->m_llHead) - 1;
+  BREADCRUMB_ENTRY* pEntry = &pRing->m_Entries[llIndex & (BREADCRUMB_RING_CAPACITY - 1)];
+
+  // Odd sequence marks the entry as being written
+  InterlockedExchange(&pEntry->m_lSeq, (LONG)(llIndex * 2 + 1));
+  pEntry->m_dwThreadId = GetCurrentThreadId();
+  pEntry->m_nLevel = nLevel;
+  pEntry->m_llTimestamp = liCounter.QuadPart;
+  CopyBoundedString(pEntry->m_szCategory, BREADCRUMB_MAX_CATEGORY, pszCategory != NULL ? pszCategory : L"");
+  CopyBoundedString(pEntry->m_szMessage, BREADCRUMB_MAX_MESSAGE, pszMessage != NULL ? pszMessage : L"");
+  InterlockedExchange(&pEntry->m_lSeq, (LONG)(llIndex * 2 + 2));
+
+  return TRUE;
+}
+
+int CBreadcrumbs::CopyThreadEntries(BREADCRUMB_ENTRY* pEntries, int nMaxCount) {
+  if (m_pHeader == NULL || t_pRingBuffer != m_pHeader)
+    return 0;  // The thread hasn't added any breadcrumbs yet
+
+  BREADCRUMB_RING* pRing = t_pRing;
+  DWORD dwThreadId = GetCurrentThreadId();
+  LONGLONG llHead = pRing->m_llHead;
+  LONGLONG llFirst = llHead > BREADCRUMB_RING_CAPACITY ? llHead - BREADCRUMB_RING_CAPACITY : 0;
+
+  // Walk back from the newest entry; a shared ring also holds entries of other threads.
+  int nCount = 0;
+  for (LONGLONG llIndex = llHead - 1; llIndex >= llFirst && nCount < nMaxCount; llIndex--) {
+    BREADCRUMB_ENTRY* pEntry = &pRing->m_Entries[llIndex & (BREADCRUMB_RING_CAPACITY - 1)];
+
+    LONG lSeq = pEntry->m_lSeq;
+    if (lSeq != (LONG)(llIndex * 2 + 2))
+      continue;
+
+    BREADCRUMB_ENTRY* pCopy = &pEntries[nCount];
+    MemoryBarrier();
+    memcpy(pCopy, pEntry, sizeof(BREADCRUMB_ENTRY));
+    MemoryBarrier();
+    if (pEntry->m_lSeq != lSeq || pCopy->m_dwThreadId != dwThreadId)
+      continue;
+
+    pCopy->m_szCategory[BREADCRUMB_MAX_CATEGORY - 1] = 0;
+    pCopy->m_szMessage[BREADCRUMB_MAX_MESSAGE - 1] = 0;
+    nCount++;
+  }
+
+  // Oldest first
+  std::reverse(pEntries, pEntries + nCount);
+  return nCount;
+}
+
+ULONG64 CBreadcrumbs::TimestampToTime(LONGLONG llTimestamp) {
+  if (m_pHeader == NULL || m_pHeader->m_llQpcFrequency == 0)
+    return 0;
+
+  return m_pHeader->m_ullTimeBase + (ULONG64)((double)(llTimestamp - m_pHeader->m_llQpcBase) * 10000000.0 / (double)m_pHeader->m_llQpcFrequency);
+}
+
+void CBreadcrumbs::Read(std::vector<BreadcrumbInfo>& aBreadcrumbs) {
+  aBreadcrumbs.clear();
+
+  if (m_pHeader == NULL || m_pHeader->m_llQpcFrequency == 0)
+    return;
+
+  // Rings that were never claimed are not committed.
+  LONG lRingsUsed = GetRingsUsed();
+  for (LONG r = 0; r < lRingsUsed; r++) {
+    // A ring may be claimed, but not committed yet by its owner thread.
+    if (!m_SharedMem.Commit(SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER)) + (r + 1) * sizeof(BREADCRUMB_RING)))
+      break;
+
+    BREADCRUMB_RING* pRing = &m_pRings[r];
+    LONGLONG llHead = pRing->m_llHead;
+    LONGLONG llFirst = llHead > BREADCRUMB_RING_CAPACITY ? llHead - BREADCRUMB_RING_CAPACITY : 0;
+
+    for (LONGLONG llIndex = llFirst; llIndex < llHead; llIndex++) {
+      BREADCRUMB_ENTRY* pEntry = &pRing->m_Entries[llIndex & (BREADCRUMB_RING_CAPACITY - 1)];
+
+      // Skip entries being written at the moment of crash and entries overwritten by a later lap.
+      LONG lSeq = pEntry->m_lSeq;
+      if (lSeq != (LONG)(llIndex * 2 + 2))
+        continue;
+
+      BREADCRUMB_ENTRY Copy;
+      MemoryBarrier();
+      memcpy(&Copy, pEntry, sizeof(BREADCRUMB_ENTRY));
+      MemoryBarrier();
+      if (pEntry->m_lSeq != lSeq)
+        continue;
+
+      Copy.m_szCategory[BREADCRUMB_MAX_CATEGORY - 1] = 0;
+      Copy.m_szMessage[BREADCRUMB_MAX_MESSAGE - 1] = 0;
+
+      BreadcrumbInfo bi;
+      bi.m_llTimestamp = Copy.m_llTimestamp;
+      bi.m_ullTime = TimestampToTime(Copy.m_llTimestamp);
+      bi.m_dwThreadId = Copy.m_dwThreadId;
+      bi.m_nLevel = Copy.m_nLevel;
+      bi.m_sCategory = Copy.m_szCategory;
+      bi.m_sMessage = Copy.m_szMessage;
+      aBreadcrumbs.push_back(bi);
+    }
+  }
+
+  // Merge rings by time
+  std::stable_sort(aBreadcrumbs.begin(), aBreadcrumbs.end(), BreadcrumbLess);
+}
+}  // namespace CrashReport
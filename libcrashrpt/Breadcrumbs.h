@@ -0,0 +1,124 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: Breadcrumbs.h
+// Description: Per-thread ring buffers of breadcrumbs (short event records) in shared memory.
+// Rings are written by CrashRpt.dll without locks and syscalls and read by CrashReport.exe after crash.
+
+#pragma once
+#include "stdafx.h"
+#include "SharedMem.h"
+
+namespace CrashReport {
+#define BREADCRUMB_RING_COUNT 32       /* Count of rings (at most 32, one bit per ring in the free mask); threads above this count share rings */
+#define BREADCRUMB_RING_CAPACITY 128   /* Count of entries in a ring, must be a power of two */
+#define BREADCRUMB_MAX_CATEGORY 20     /* Max category length (including terminating zero) */
+#define BREADCRUMB_MAX_MESSAGE 96      /* Max message length (including terminating zero) */
+
+  // Breadcrumb buffer header.
+  struct BREADCRUMB_HEADER {
+    BYTE m_uchMagic[3];           // Magic sequence "BCB"
+    BYTE m_uchReserved;           // Reserved, must be zero.
+    DWORD m_dwSize;               // Size of the header.
+    DWORD m_dwRingCount;          // Count of rings.
+    DWORD m_dwRingCapacity;       // Count of entries per ring.
+    volatile LONG m_lRingsUsed;   // Count of rings ever claimed (may exceed m_dwRingCount).
+    volatile LONG m_lFreeRings;   // Mask of claimed rings returned by exited threads.
+    LONGLONG m_llQpcFrequency;    // Performance counter frequency.
+    LONGLONG m_llQpcBase;         // Performance counter value at m_ullTimeBase.
+    ULONG64 m_ullTimeBase;        // UTC time (FILETIME) at creation.
+  };
+
+  // Breadcrumb entry. The sequence counter is odd while the entry is being written,
+  // even values identify the index the entry was written at (index * 2 + 2, truncated to 32 bits).
+  struct BREADCRUMB_ENTRY {
+    volatile LONG m_lSeq;                         // Sequence counter.
+    DWORD m_dwThreadId;                           // Writer thread ID.
+    int m_nLevel;                                 // Severity level.
+    DWORD m_dwReserved;                           // Reserved, must be zero.
+    LONGLONG m_llTimestamp;                       // Performance counter value.
+    WCHAR m_szCategory[BREADCRUMB_MAX_CATEGORY];  // Category.
+    WCHAR m_szMessage[BREADCRUMB_MAX_MESSAGE];    // Message.
+  };
+
+  // Ring of entries.
+  struct BREADCRUMB_RING {
+    volatile LONGLONG m_llHead;  // Count of entries ever written to the ring.
+    volatile LONG m_lThreadId;   // Owner thread ID (zero if the ring is free or shared).
+    BYTE m_uchPadding[52];       // Keeps heads of different rings on different cache lines.
+    BREADCRUMB_ENTRY m_Entries[BREADCRUMB_RING_CAPACITY];
+  };
+
+#define BREADCRUMB_BUFFER_SIZE (SHARED_MEM_ALIGN(sizeof(BREADCRUMB_HEADER)) + BREADCRUMB_RING_COUNT * sizeof(BREADCRUMB_RING))
+
+  // Breadcrumb as read by CrashReport.exe.
+  struct BreadcrumbInfo {
+    ULONG64 m_ullTime;     // UTC time (FILETIME).
+    LONGLONG m_llTimestamp;  // Performance counter value (used for ordering).
+    DWORD m_dwThreadId;    // Thread that added the breadcrumb.
+    int m_nLevel;          // Severity level.
+    CString m_sCategory;   // Category.
+    CString m_sMessage;    // Message.
+  };
+
+  // Set of breadcrumb rings placed into its own file mapping.
+  class CBreadcrumbs {
+  public:
+    // Construction/destruction
+    CBreadcrumbs();
+    ~CBreadcrumbs();
+
+    // Creates a new buffer or opens an existing one.
+    BOOL Init(LPCTSTR szName, BOOL bOpenExisting);
+
+    // Whether initialized or not
+    BOOL IsInitialized();
+
+    // Destroys the object
+    void Destroy();
+
+    // Returns file mapping name
+    CString GetName();
+
+    // Adds reserved and committed sizes of the file mapping to the counters.
+    void AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes);
+
+    // Adds a breadcrumb to the ring of the caller thread.
+    BOOL Add(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel);
+
+    // Returns the ring of the caller thread to the free mask, so another thread can reuse it.
+    // Entries already written stay readable until the ring is reused.
+    void ReleaseThreadRing();
+
+    // Copies up to nMaxCount most recent consistent entries of the caller thread, oldest first.
+    // Never allocates memory. Returns count of entries copied.
+    int CopyThreadEntries(BREADCRUMB_ENTRY* pEntries, int nMaxCount);
+
+    // Converts a performance counter value into UTC time (FILETIME).
+    ULONG64 TimestampToTime(LONGLONG llTimestamp);
+
+    // Reads all consistent entries of all rings ordered by time.
+    void Read(std::vector<BreadcrumbInfo>& aBreadcrumbs);
+
+  private:
+    // Returns the ring of the caller thread, assigning one on first call.
+    BREADCRUMB_RING* GetThreadRing();
+
+    // Commits memory of the ring. Returns NULL on failure.
+    BREADCRUMB_RING* CommitRing(LONG lRing);
+
+    // Returns count of rings that may have been committed.
+    LONG GetRingsUsed();
+
+    CSharedMem m_SharedMem;        // Shared memory the rings are placed in.
+    BREADCRUMB_HEADER* m_pHeader;  // Buffer header.
+    BREADCRUMB_RING* m_pRings;     // Array of rings.
+  };
+}  // namespace CrashReport
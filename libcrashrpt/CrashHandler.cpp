@@ -20,10 +20,21 @@ EXTERNC void* _ReturnAddress(void);
 
 #endif
 
+// Minimum count of characters reserved for a property value, so that
+// small updates can be done in place.
+#define PROP_VALUE_MIN_CAPACITY 32
+
+// Count of characters reserved for each of invalid parameter strings.
+// They are filled on crash without allocating memory, longer strings are truncated.
+#define INV_PARAM_CAPACITY 512
+
 namespace CrashReport {
 extern HANDLE g_hModuleCrashRpt;
 CCrashHandler* CCrashHandler::m_pProcessCrashHandler = NULL;
 
+// Exception handlers installed for the caller thread.
+static __declspec(thread) ThreadExceptionHandlers t_ThreadExceptionHandlers;
+
 CCrashHandler::CCrashHandler() {
   // Init member variables to their defaults
   m_bInitialized = FALSE;
@@ -36,11 +47,32 @@ CCrashHandler::CCrashHandler() {
   m_hEvent = NULL;
   m_hEvent2 = NULL;
   m_pCrashDesc = NULL;
+  m_dwWastedBytes = 0;
   m_hSenderProcess = NULL;
+  m_hStandbyProcess = NULL;
+  m_hStandbyEvent = NULL;
+  m_lCrashOwnerThreadId = 0;
+  m_lBackgroundThreadId = 0;
+  m_lCrashWaiting = 0;
+  m_lThreadHandlerCount = 0;
+  m_bReportPolicy = FALSE;
+  m_uFullReportsPerDay = 0;
+  m_uSamplePercent = 0;
+  memset(m_HeartbeatSlots, 0, sizeof(m_HeartbeatSlots));
+  m_hWatchdogThread = NULL;
+  m_hWatchdogStop = NULL;
+  m_dwHangThreadId = 0;
   m_pfnCallback2 = NULL;
   m_pCallbackParam = NULL;
   m_nCallbackRetCode = CR_CB_NOTIFY_NEXT_STAGE;
   m_bContinueExecution = TRUE;
+  m_szLaunchCmdLine[0] = 0;
+  m_szLaunchCurDir[0] = 0;
+  m_szErrorCaption[0] = 0;
+  memset(&m_CrashEvent, 0, sizeof(CRASH_JOURNAL_RECORD));
+  m_bCrashEventPending = FALSE;
+  m_hHeapPoisonLocked = NULL;
+  m_hHeapPoisonRelease = NULL;
 
   // Init exception handler pointers
   InitPrevExceptionHandlerPointers();
@@ -218,6 +250,34 @@ int CCrashHandler::Init(LPCWSTR lpcszAppName,
     return 1;
   }
 
+  // Prepare the strings used on crash, so the crash path doesn't have to format them.
+  StringCchPrintf(m_szErrorCaption, MAX_PATH, _T("%s has stopped working"), (LPCTSTR)Utility::getAppName());
+
+  // Map the signature table now, so counting a crash takes no file I/O. Not fatal, crashes are not sampled then.
+  m_SignatureTable.Init(m_sUnsentCrashReportsFolder + _T("\\signatures.dat"));
+
+  // Map the crash journal now, so recording a crash is a single copy. Not fatal, crashes are just not recorded then.
+  m_CrashJournal.Init(m_sUnsentCrashReportsFolder + _T("\\crashjournal.dat"));
+
+  // Create the table of typed properties. It lives in its own file mapping,
+  // so repacking of the crash description doesn't touch it.
+  CString sPropTableName;
+  Utility::GenerateGUID(sPropTableName);
+  sPropTableName += _T("-props");
+  if (!m_PropTable.Init(sPropTableName, FALSE)) {
+    crSetErrorMsg(L"Couldn't initialize property table.");
+    return 1;
+  }
+
+  // Create breadcrumb rings in the same manner.
+  CString sBreadcrumbsName;
+  Utility::GenerateGUID(sBreadcrumbsName);
+  sBreadcrumbsName += _T("-crumbs");
+  if (!m_Breadcrumbs.Init(sBreadcrumbsName, FALSE)) {
+    crSetErrorMsg(L"Couldn't initialize breadcrumb buffer.");
+    return 1;
+  }
+
   // Init some fields that should be reinitialized before each new crash.
   if (0 != PerCrashInit())
     return 1;
@@ -300,7 +360,7 @@ CRASH_DESCRIPTION* CCrashHandler::PackCrashInfoIntoSharedMem(CSharedMem* pShared
     }
   }
 
-  // Create memory view.
+  // Crash description header is located at the beginning of the persistent view.
   m_pTmpCrashDesc = (CRASH_DESCRIPTION*)pSharedMem->CreateView(0, sizeof(CRASH_DESCRIPTION));
   if (m_pTmpCrashDesc == NULL) {
     ATLASSERT(0);
@@ -311,8 +371,11 @@ CRASH_DESCRIPTION* CCrashHandler::PackCrashInfoIntoSharedMem(CSharedMem* pShared
   // Pack config information to shared memory
   memset(m_pTmpCrashDesc, 0, sizeof(CRASH_DESCRIPTION));
   memcpy(m_pTmpCrashDesc->m_uchMagic, "CRD", 3);
-  m_pTmpCrashDesc->m_wSize = sizeof(CRASH_DESCRIPTION);
-  m_pTmpCrashDesc->m_dwTotalSize = sizeof(CRASH_DESCRIPTION);
+  m_pTmpCrashDesc->m_dwSize = SHARED_MEM_ALIGN(sizeof(CRASH_DESCRIPTION));
+  m_pTmpCrashDesc->m_dwFormatVersion = CRASH_DESCRIPTION_VERSION;
+  m_pTmpCrashDesc->m_dwTotalSize = m_pTmpCrashDesc->m_dwSize;
+  m_pTmpCrashDesc->m_dwCommittedSize = (DWORD)pSharedMem->GetSize();
+  m_StringTable.clear();
   m_pTmpCrashDesc->m_dwInstallFlags = m_dwFlags;
   m_pTmpCrashDesc->m_MinidumpType = m_MinidumpType;
   m_pTmpCrashDesc->m_bAddScreenshot = m_bAddScreenshot;
@@ -331,6 +394,19 @@ CRASH_DESCRIPTION* CCrashHandler::PackCrashInfoIntoSharedMem(CSharedMem* pShared
   m_pTmpCrashDesc->m_dwRestartCmdLineOffs = PackString(m_sRestartCmdLine);
   m_pTmpCrashDesc->m_dwUnsentCrashReportsFolderOffs = PackString(m_sUnsentCrashReportsFolder);
   m_pTmpCrashDesc->m_dwCustomSenderIconOffs = PackString(m_sCustomSenderIcon);
+  m_pTmpCrashDesc->m_dwPropTableNameOffs = PackString(m_PropTable.GetName());
+  m_pTmpCrashDesc->m_dwBreadcrumbsNameOffs = PackString(m_Breadcrumbs.GetName());
+
+  // Reserve room for invalid parameter info, it is filled in place on crash.
+  m_pTmpCrashDesc->m_dwInvParamExprOffs = PackString(_T(""), INV_PARAM_CAPACITY);
+  m_pTmpCrashDesc->m_dwInvParamFunctionOffs = PackString(_T(""), INV_PARAM_CAPACITY);
+  m_pTmpCrashDesc->m_dwInvParamFileOffs = PackString(_T(""), INV_PARAM_CAPACITY);
+
+  // Offsets of property records are only tracked for the main shared memory
+  if (!bTempMem) {
+    m_PropOffsets.clear();
+    m_dwWastedBytes = 0;
+  }
 
   // Pack file items
   std::map<CString, FileItem>::iterator fit;
@@ -345,7 +421,9 @@ CRASH_DESCRIPTION* CCrashHandler::PackCrashInfoIntoSharedMem(CSharedMem* pShared
   std::map<CString, CString>::iterator pit;
   for (pit = m_props.begin(); pit != m_props.end(); pit++) {
     // Pack this prop into shared mem.
-    PackProperty(pit->first, pit->second);
+    DWORD dwPropOffs = PackProperty(pit->first, pit->second);
+    if (!bTempMem && dwPropOffs != 0)
+      m_PropOffsets[pit->first] = dwPropOffs;
   }
 
   // Pack reg keys
@@ -360,85 +438,220 @@ CRASH_DESCRIPTION* CCrashHandler::PackCrashInfoIntoSharedMem(CSharedMem* pShared
   return m_pTmpCrashDesc;
 }
 
+// Allocates a block in shared memory
+LPBYTE CCrashHandler::AllocBlock(DWORD dwSize) {
+  LPBYTE pBlock = m_pTmpSharedMem->Allocate(m_pTmpCrashDesc->m_dwTotalSize, dwSize);
+
+  // The allocation may have committed more memory, let the reader know.
+  m_pTmpCrashDesc->m_dwCommittedSize = (DWORD)m_pTmpSharedMem->GetSize();
+  return pBlock;
+}
+
 // Packs a string to shared memory
-DWORD CCrashHandler::PackString(CString str) {
+DWORD CCrashHandler::PackString(CString str, int nCapacity) {
+  // Strings without reserved capacity never change, so they are interned:
+  // a repeated string is packed once and shared by all records referencing it.
+  if (nCapacity == 0) {
+    std::map<CString, DWORD>::iterator it = m_StringTable.find(str);
+    if (it != m_StringTable.end())
+      return it->second;
+  }
+
   DWORD dwTotalSize = m_pTmpCrashDesc->m_dwTotalSize;
-  int nStrLen = str.GetLength() * sizeof(TCHAR);
-  WORD wLength = (WORD)(sizeof(STRING_DESC) + nStrLen);
+  DWORD dwStrLen = str.GetLength() * sizeof(TCHAR);
+  DWORD dwLength = (DWORD)(sizeof(STRING_DESC) + max(str.GetLength(), nCapacity) * sizeof(TCHAR));
+
+  // Write the block directly into the arena
+  LPBYTE pBlock = AllocBlock(dwLength);
+  if (pBlock == NULL)
+    return 0;  // No space left
 
-  LPBYTE pView = m_pTmpSharedMem->CreateView(dwTotalSize, wLength);
-  STRING_DESC* pStrDesc = (STRING_DESC*)pView;
+  STRING_DESC* pStrDesc = (STRING_DESC*)pBlock;
+  dwLength = m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize;
   memcpy(pStrDesc->m_uchMagic, "STR", 3);
-  pStrDesc->m_wSize = wLength;
-  memcpy(pView + sizeof(STRING_DESC), str.GetBuffer(0), nStrLen);
+  pStrDesc->m_uchReserved = 0;
+  pStrDesc->m_dwSize = dwLength;
+  memcpy(pBlock + sizeof(STRING_DESC), (LPCTSTR)str, dwStrLen);
+  // The tail is zero-filled, the reader stops at the first zero character.
+  memset(pBlock + sizeof(STRING_DESC) + dwStrLen, 0, dwLength - sizeof(STRING_DESC) - dwStrLen);
 
-  m_pTmpCrashDesc->m_dwTotalSize += wLength;
+  if (nCapacity == 0)
+    m_StringTable[str] = dwTotalSize;
 
-  m_pTmpSharedMem->DestroyView(pView);
   return dwTotalSize;
 }
 
+// Discards everything packed at or after the given offset
+void CCrashHandler::RollbackPack(DWORD dwOffset) {
+  m_pTmpCrashDesc->m_dwTotalSize = dwOffset;
+
+  // Forget interned strings that were discarded
+  std::map<CString, DWORD>::iterator it = m_StringTable.begin();
+  while (it != m_StringTable.end()) {
+    if (it->second >= dwOffset)
+      it = m_StringTable.erase(it);
+    else
+      it++;
+  }
+}
+
+// Overwrites a packed string in place
+BOOL CCrashHandler::UpdateString(DWORD dwOffset, CString str) {
+  STRING_DESC* pStrDesc = (STRING_DESC*)m_SharedMem.CreateView(dwOffset, sizeof(STRING_DESC));
+  if (pStrDesc == NULL || memcmp(pStrDesc->m_uchMagic, "STR", 3) != 0)
+    return FALSE;
+
+  DWORD dwStrLen = str.GetLength() * sizeof(TCHAR);
+  DWORD dwDataLen = pStrDesc->m_dwSize - sizeof(STRING_DESC);
+  if (dwStrLen > dwDataLen)
+    return FALSE;  // Doesn't fit into the reserved capacity
+
+  LPBYTE pData = (LPBYTE)pStrDesc + sizeof(STRING_DESC);
+  memcpy(pData, (LPCTSTR)str, dwStrLen);
+  memset(pData + dwStrLen, 0, dwDataLen - dwStrLen);
+  return TRUE;
+}
+
+// Copies a string into a preallocated string block
+void CCrashHandler::FillString(DWORD dwOffset, LPCWSTR pszValue) {
+  STRING_DESC* pStrDesc = (STRING_DESC*)m_SharedMem.CreateView(dwOffset, sizeof(STRING_DESC));
+  if (pStrDesc == NULL || memcmp(pStrDesc->m_uchMagic, "STR", 3) != 0 || pszValue == NULL)
+    return;
+
+  WCHAR* pData = (WCHAR*)((LPBYTE)pStrDesc + sizeof(STRING_DESC));
+  CopyBoundedString(pData, (pStrDesc->m_dwSize - sizeof(STRING_DESC)) / sizeof(WCHAR), pszValue);
+}
+
 // Packs file item to shared memory
 DWORD CCrashHandler::PackFileItem(FileItem& fi) {
   DWORD dwTotalSize = m_pTmpCrashDesc->m_dwTotalSize;
-  WORD wLength = sizeof(FILE_ITEM);
-  m_pTmpCrashDesc->m_dwTotalSize += wLength;
-  m_pTmpCrashDesc->m_uFileItems++;
-
-  LPBYTE pView = m_pTmpSharedMem->CreateView(dwTotalSize, wLength);
-  FILE_ITEM* pFileItem = (FILE_ITEM*)pView;
+  FILE_ITEM* pFileItem = (FILE_ITEM*)AllocBlock(sizeof(FILE_ITEM));
+  if (pFileItem == NULL)
+    return 0;  // No space left
 
   memcpy(pFileItem->m_uchMagic, "FIL", 3);
+  pFileItem->m_uchReserved = 0;
   pFileItem->m_dwSrcFilePathOffs = PackString(fi.m_sSrcFilePath);
   pFileItem->m_dwDstFileNameOffs = PackString(fi.m_sDstFileName);
   pFileItem->m_dwDescriptionOffs = PackString(fi.m_sDescription);
   pFileItem->m_bMakeCopy = fi.m_bMakeCopy;
   pFileItem->m_bAllowDelete = fi.m_bAllowDelete;
-  pFileItem->m_wSize = (WORD)(m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize);
 
-  m_pTmpSharedMem->DestroyView(pView);
+  if (pFileItem->m_dwSrcFilePathOffs == 0 || pFileItem->m_dwDstFileNameOffs == 0 || pFileItem->m_dwDescriptionOffs == 0) {
+    // Roll back the partially written record
+    RollbackPack(dwTotalSize);
+    return 0;
+  }
+
+  pFileItem->m_dwSize = m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize;
+  m_pTmpCrashDesc->m_uFileItems++;
+
   return dwTotalSize;
 }
 
 // Packs custom property to shared memory
 DWORD CCrashHandler::PackProperty(CString sName, CString sValue) {
   DWORD dwTotalSize = m_pTmpCrashDesc->m_dwTotalSize;
-  WORD wLength = sizeof(CUSTOM_PROP);
-  m_pTmpCrashDesc->m_dwTotalSize += wLength;
-  m_pTmpCrashDesc->m_uCustomProps++;
-
-  LPBYTE pView = m_pTmpSharedMem->CreateView(dwTotalSize, wLength);
-  CUSTOM_PROP* pProp = (CUSTOM_PROP*)pView;
+  CUSTOM_PROP* pProp = (CUSTOM_PROP*)AllocBlock(sizeof(CUSTOM_PROP));
+  if (pProp == NULL)
+    return 0;  // No space left
 
   memcpy(pProp->m_uchMagic, "CPR", 3);
+  pProp->m_uchReserved = 0;
   pProp->m_dwNameOffs = PackString(sName);
-  pProp->m_dwValueOffs = PackString(sValue);
-  pProp->m_wSize = (WORD)(m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize);
+  // Reserve some room for the value, so it can be updated in place later.
+  pProp->m_dwValueOffs = PackString(sValue, max(PROP_VALUE_MIN_CAPACITY, sValue.GetLength() + sValue.GetLength() / 2));
+
+  if (pProp->m_dwNameOffs == 0 || pProp->m_dwValueOffs == 0) {
+    // Roll back the partially written record
+    RollbackPack(dwTotalSize);
+    return 0;
+  }
+
+  pProp->m_dwSize = m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize;
+  m_pTmpCrashDesc->m_uCustomProps++;
 
-  m_pTmpSharedMem->DestroyView(pView);
   return dwTotalSize;
 }
 
 // Packs registry key to shared memory
 DWORD CCrashHandler::PackRegKey(CString sKeyName, RegKeyInfo& rki) {
   DWORD dwTotalSize = m_pTmpCrashDesc->m_dwTotalSize;
-  WORD wLength = sizeof(REG_KEY);
-  m_pTmpCrashDesc->m_dwTotalSize += wLength;
-  m_pTmpCrashDesc->m_uRegKeyEntries++;
-
-  LPBYTE pView = m_pTmpSharedMem->CreateView(dwTotalSize, wLength);
-  REG_KEY* pKey = (REG_KEY*)pView;
+  REG_KEY* pKey = (REG_KEY*)AllocBlock(sizeof(REG_KEY));
+  if (pKey == NULL)
+    return 0;  // No space left
 
   memcpy(pKey->m_uchMagic, "REG", 3);
+  pKey->m_uchReserved = 0;
   pKey->m_bAllowDelete = rki.m_bAllowDelete;
   pKey->m_dwRegKeyNameOffs = PackString(sKeyName);
   pKey->m_dwDstFileNameOffs = PackString(rki.m_sDstFileName);
-  pKey->m_wSize = (WORD)(m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize);
 
-  m_pTmpSharedMem->DestroyView(pView);
+  if (pKey->m_dwRegKeyNameOffs == 0 || pKey->m_dwDstFileNameOffs == 0) {
+    // Roll back the partially written record
+    RollbackPack(dwTotalSize);
+    return 0;
+  }
+
+  pKey->m_dwSize = m_pTmpCrashDesc->m_dwTotalSize - dwTotalSize;
+  m_pTmpCrashDesc->m_uRegKeyEntries++;
+
   return dwTotalSize;
 }
 
+// Reclaims space occupied by abandoned property values
+BOOL CCrashHandler::CompactSharedMem() {
+  if (m_dwWastedBytes == 0)
+    return FALSE;  // Nothing to reclaim
+
+  // Repack everything from scratch into a separate section, so a crash on another
+  // thread keeps seeing the old description while packing is in progress.
+  // The crash-specific fields are filled later, when a crash happens.
+  CString sCompactMemName;
+  sCompactMemName.Format(_T("%s-compact"), m_sCrashGUID);
+  CSharedMem CompactMem;
+  BOOL bCompacted = FALSE;
+  CRASH_DESCRIPTION* pCompactDesc = NULL;
+
+  // Packing rebuilds these, they are restored if the old description stays.
+  std::map<CString, DWORD> OldPropOffsets = m_PropOffsets;
+  std::map<CString, DWORD> OldStringTable = m_StringTable;
+  DWORD dwOldWastedBytes = m_dwWastedBytes;
+
+  if (!CompactMem.Init(sCompactMemName, FALSE, SHARED_MEM_MAX_SIZE))
+    goto cleanup;
+
+  // The section has the same layout as the main one, so offsets stay valid after copying.
+  pCompactDesc = PackCrashInfoIntoSharedMem(&CompactMem, FALSE);
+  if (pCompactDesc == NULL || !m_SharedMem.Commit(pCompactDesc->m_dwTotalSize))
+    goto cleanup;
+
+  // A crash in progress owns the description, leave it alone.
+  if (!TryCrashLock(FALSE))
+    goto cleanup;
+
+  memcpy(m_SharedMem.GetBasePtr(), CompactMem.GetBasePtr(), pCompactDesc->m_dwTotalSize);
+  m_pCrashDesc = (CRASH_DESCRIPTION*)m_SharedMem.GetBasePtr();
+  m_pCrashDesc->m_dwCommittedSize = (DWORD)m_SharedMem.GetSize();
+  bCompacted = TRUE;
+
+  CrashLock(FALSE);
+
+cleanup:
+
+  if (!bCompacted) {
+    m_PropOffsets = OldPropOffsets;
+    m_StringTable = OldStringTable;
+    m_dwWastedBytes = dwOldWastedBytes;
+  }
+
+  // Further packing goes to the main shared memory again.
+  m_pTmpSharedMem = &m_SharedMem;
+  m_pTmpCrashDesc = m_pCrashDesc;
+
+  return bCompacted;
+}
+
 // Returns TRUE if initialized, otherwise FALSE
 BOOL CCrashHandler::IsInitialized() {
   return m_bInitialized;
@@ -453,10 +666,19 @@ int CCrashHandler::Destroy() {
     return 1;
   }
 
+  // The watchdog may generate a report, so stop it first.
+  StopWatchdog();
+
+  // Write the remaining snapshots.
+  m_SnapshotQueue.Destroy();
+
   // Free handle to CrashSender.exe process.
   if (m_hSenderProcess != NULL)
     CloseHandle(m_hSenderProcess);
 
+  // Standby CrashSender.exe is not needed anymore.
+  DestroyStandbySender();
+
   // Free events
   if (m_hEvent) {
     CloseHandle(m_hEvent);
@@ -477,10 +699,7 @@ int CCrashHandler::Destroy() {
   // All installed per-thread C++ exception handlers should be uninstalled
   // using crUninstallFromCurrentThread() before calling Destroy()
 
-  {
-    CAutoLock lock(&m_csThreadExceptionHandlers);
-    ATLASSERT(m_ThreadExceptionHandlers.size() == 0);
-  }
+  ATLASSERT(m_lThreadHandlerCount == 0);
 
   //
   m_pProcessCrashHandler = NULL;
@@ -644,22 +863,16 @@ int CCrashHandler::SetThreadExceptionHandlers(DWORD dwFlags) {
   if ((dwFlags & CR_INST_ALL_POSSIBLE_HANDLERS) == 0)
     dwFlags |= CR_INST_ALL_POSSIBLE_HANDLERS;
 
-  // Get current thread ID.
-  DWORD dwThreadId = GetCurrentThreadId();
-
-  // Lock the critical section.
-  CAutoLock lock(&m_csThreadExceptionHandlers);
-
-  // Try and find our thread ID in the list of threads.
-  std::map<DWORD, ThreadExceptionHandlers>::iterator it = m_ThreadExceptionHandlers.find(dwThreadId);
+  // Handlers of the caller thread are only touched by the thread itself, so no lock is needed.
+  ThreadExceptionHandlers& handlers = t_ThreadExceptionHandlers;
 
-  if (it != m_ThreadExceptionHandlers.end()) {
+  if (handlers.m_pOwner == this) {
     // handlers are already set for the thread
     crSetErrorMsg(L"Can't install handlers for current thread twice.");
     return 1;  // failed
   }
 
-  ThreadExceptionHandlers handlers;
+  memset(&handlers, 0, sizeof(ThreadExceptionHandlers));
 
   if (dwFlags & CR_INST_TERMINATE_HANDLER) {
     // Catch terminate() calls.
@@ -695,8 +908,9 @@ int CCrashHandler::SetThreadExceptionHandlers(DWORD dwFlags) {
     handlers.m_prevSigSEGV = signal(SIGSEGV, SigsegvHandler);
   }
 
-  // Insert the structure to the list of handlers
-  m_ThreadExceptionHandlers[dwThreadId] = handlers;
+  // Mark the handlers as installed
+  handlers.m_pOwner = this;
+  InterlockedIncrement(&m_lThreadHandlerCount);
 
   // OK.
   crSetErrorMsg(L"Success.");
@@ -707,20 +921,14 @@ int CCrashHandler::SetThreadExceptionHandlers(DWORD dwFlags) {
 int CCrashHandler::UnSetThreadExceptionHandlers() {
   crSetErrorMsg(L"Unspecified error.");
 
-  DWORD dwThreadId = GetCurrentThreadId();
+  ThreadExceptionHandlers* handlers = &t_ThreadExceptionHandlers;
 
-  CAutoLock lock(&m_csThreadExceptionHandlers);
-
-  std::map<DWORD, ThreadExceptionHandlers>::iterator it = m_ThreadExceptionHandlers.find(dwThreadId);
-
-  if (it == m_ThreadExceptionHandlers.end()) {
+  if (handlers->m_pOwner != this) {
     // No exception handlers were installed for the caller thread?
     crSetErrorMsg(L"Crash handler wasn't previously installed for current thread.");
     return 1;
   }
 
-  ThreadExceptionHandlers* handlers = &(it->second);
-
   if (handlers->m_prevTerm != NULL)
     set_terminate(handlers->m_prevTerm);
 
@@ -731,13 +939,14 @@ int CCrashHandler::UnSetThreadExceptionHandlers() {
     signal(SIGFPE, handlers->m_prevSigFPE);
 
   if (handlers->m_prevSigILL != NULL)
-    signal(SIGINT, handlers->m_prevSigILL);
+    signal(SIGILL, handlers->m_prevSigILL);
 
   if (handlers->m_prevSigSEGV != NULL)
     signal(SIGSEGV, handlers->m_prevSigSEGV);
 
-  // Remove from the list
-  m_ThreadExceptionHandlers.erase(it);
+  // Mark the handlers as uninstalled
+  memset(handlers, 0, sizeof(ThreadExceptionHandlers));
+  InterlockedDecrement(&m_lThreadHandlerCount);
 
   // OK.
   crSetErrorMsg(L"Success.");
@@ -748,6 +957,8 @@ int CCrashHandler::UnSetThreadExceptionHandlers() {
 int CCrashHandler::AddFile(LPCTSTR pszFile, LPCTSTR pszDestFile, LPCTSTR pszDesc, DWORD dwFlags) {
   crSetErrorMsg(L"Unspecified error.");
 
+  CAutoLock lock(&m_csSharedMem);
+
   // Check if source file name or search pattern is specified
   if (pszFile == NULL) {
     crSetErrorMsg(L"Invalid file name specified.");
@@ -807,10 +1018,13 @@ int CCrashHandler::AddFile(LPCTSTR pszFile, LPCTSTR pszDestFile, LPCTSTR pszDesc
       return 1;
     }
 
-    m_files[fi.m_sDstFileName] = fi;
-
     // Pack this file item into shared mem.
-    PackFileItem(fi);
+    if (PackFileItem(fi) == 0 && (!CompactSharedMem() || PackFileItem(fi) == 0)) {
+      crSetErrorMsg(L"Not enough space in shared memory.");
+      return 1;
+    }
+
+    m_files[fi.m_sDstFileName] = fi;
   }
   else  // Search pattern
   {
@@ -821,10 +1035,13 @@ int CCrashHandler::AddFile(LPCTSTR pszFile, LPCTSTR pszDestFile, LPCTSTR pszDesc
     fi.m_sDstFileName = Utility::GetFileName(pszFile);
     fi.m_bMakeCopy = (dwFlags & CR_AF_MAKE_FILE_COPY) != 0;
     fi.m_bAllowDelete = false;
-    m_files[fi.m_sDstFileName] = fi;
-
     // Pack this file item into shared mem.
-    PackFileItem(fi);
+    if (PackFileItem(fi) == 0 && (!CompactSharedMem() || PackFileItem(fi) == 0)) {
+      crSetErrorMsg(L"Not enough space in shared memory.");
+      return 1;
+    }
+
+    m_files[fi.m_sDstFileName] = fi;
   }
 
   // OK.
@@ -836,20 +1053,170 @@ int CCrashHandler::AddFile(LPCTSTR pszFile, LPCTSTR pszDestFile, LPCTSTR pszDesc
 int CCrashHandler::AddProperty(CString sPropName, CString sPropValue) {
   crSetErrorMsg(L"Unspecified error.");
 
+  CAutoLock lock(&m_csSharedMem);
+
   if (sPropName.IsEmpty()) {
     crSetErrorMsg(L"Invalid property name specified.");
     return 1;
   }
 
-  m_props[sPropName] = sPropValue;
+  std::map<CString, DWORD>::iterator it = m_PropOffsets.find(sPropName);
+  if (it != m_PropOffsets.end()) {
+    // The property is already packed, try to overwrite its value in place.
+    CUSTOM_PROP* pProp = (CUSTOM_PROP*)m_SharedMem.CreateView(it->second, sizeof(CUSTOM_PROP));
+    if (!UpdateString(pProp->m_dwValueOffs, sPropValue)) {
+      // The value has outgrown its slot, relocate it. The old slot stays
+      // inside of the property record and is reclaimed by compaction.
+      STRING_DESC* pOldValue = (STRING_DESC*)m_SharedMem.CreateView(pProp->m_dwValueOffs, sizeof(STRING_DESC));
+      DWORD dwOldSize = pOldValue->m_dwSize;
+      DWORD dwValueOffs = PackString(sPropValue, max(PROP_VALUE_MIN_CAPACITY, sPropValue.GetLength() * 2));
+      if (dwValueOffs == 0) {
+        // Out of space; compaction repacks the old value, so retry from scratch.
+        if (!CompactSharedMem()) {
+          crSetErrorMsg(L"Not enough space in shared memory.");
+          return 1;
+        }
+        return AddProperty(sPropName, sPropValue);
+      }
 
-  PackProperty(sPropName, sPropValue);
+      pProp->m_dwValueOffs = dwValueOffs;
+      m_dwWastedBytes += dwOldSize;
+    }
+
+    m_props[sPropName] = sPropValue;
+
+    // Don't let abandoned slots take more than a half of used space
+    if (m_dwWastedBytes > m_pCrashDesc->m_dwTotalSize / 2)
+      CompactSharedMem();
+  }
+  else {
+    DWORD dwPropOffs = PackProperty(sPropName, sPropValue);
+    if (dwPropOffs == 0 && CompactSharedMem())
+      dwPropOffs = PackProperty(sPropName, sPropValue);
+
+    if (dwPropOffs == 0) {
+      crSetErrorMsg(L"Not enough space in shared memory.");
+      return 1;
+    }
+
+    m_props[sPropName] = sPropValue;
+    m_PropOffsets[sPropName] = dwPropOffs;
+  }
 
   // OK.
   crSetErrorMsg(L"Success.");
   return 0;
 }
 
+// Sets a typed property. Unlike AddProperty(), this doesn't touch the crash
+// description, so it neither takes locks nor formats the value.
+int CCrashHandler::SetPropertyInt64(LPCWSTR pszPropName, LONGLONG llValue) {
+  return m_PropTable.SetInt64(pszPropName, llValue);
+}
+
+int CCrashHandler::SetPropertyDouble(LPCWSTR pszPropName, double dValue) {
+  return m_PropTable.SetDouble(pszPropName, dValue);
+}
+
+int CCrashHandler::SetPropertyString(LPCWSTR pszPropName, LPCWSTR pszValue) {
+  return m_PropTable.SetString(pszPropName, pszValue);
+}
+
+// Adds a breadcrumb. This is lock-free and doesn't make syscalls
+// (except committing a ring on the first call of a thread).
+int CCrashHandler::AddBreadcrumb(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel) {
+  return m_Breadcrumbs.Add(pszCategory, pszMessage, nLevel) ? 0 : 1;
+}
+
+void CCrashHandler::ReleaseThreadBreadcrumbs() {
+  m_Breadcrumbs.ReleaseThreadRing();
+}
+
+int CCrashHandler::SetReportPolicy(UINT uFullReportsPerDay, UINT uSamplePercent) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  if (uSamplePercent > 100) {
+    crSetErrorMsg(L"Invalid sample percentage.");
+    return 1;
+  }
+
+  m_uFullReportsPerDay = uFullReportsPerDay;
+  m_uSamplePercent = uSamplePercent;
+  m_bReportPolicy = TRUE;
+
+  crSetErrorMsg(L"Success.");
+  return 0;
+}
+
+int CCrashHandler::SetHeartbeatDeadline(UINT uSlot, DWORD dwTimeoutMs) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  if (uSlot >= HEARTBEAT_SLOT_COUNT) {
+    crSetErrorMsg(L"Invalid heartbeat slot.");
+    return 1;
+  }
+
+  if (dwTimeoutMs > LONG_MAX) {
+    crSetErrorMsg(L"Invalid heartbeat timeout.");
+    return 1;
+  }
+
+  HEARTBEAT_SLOT* pSlot = &m_HeartbeatSlots[uSlot];
+
+  if (dwTimeoutMs == 0) {
+    // Disarm the slot
+    InterlockedExchange(&pSlot->m_lTimeoutMs, 0);
+    crSetErrorMsg(L"Success.");
+    return 0;
+  }
+
+  if (StartWatchdog() != 0) {
+    crSetErrorMsg(L"Error starting watchdog thread.");
+    return 2;
+  }
+
+  // The slot is armed last, so the watchdog never sees a stale beat of the previous owner.
+  InterlockedExchange(&pSlot->m_lTimeoutMs, 0);
+  InterlockedExchange(&pSlot->m_lThreadId, (LONG)GetCurrentThreadId());
+  InterlockedExchange(&pSlot->m_lLastBeat, (LONG)GetTickCount());
+  InterlockedExchange(&pSlot->m_lTimeoutMs, (LONG)dwTimeoutMs);
+
+  crSetErrorMsg(L"Success.");
+  return 0;
+}
+
+int CCrashHandler::Heartbeat(UINT uSlot) {
+  if (uSlot >= HEARTBEAT_SLOT_COUNT)
+    return 1;
+
+  // GetTickCount() reads the shared user data page, it is not a system call.
+  // An aligned 32-bit store is atomic, the watchdog doesn't need it ordered with anything else.
+  m_HeartbeatSlots[uSlot].m_lLastBeat = (LONG)GetTickCount();
+  return 0;
+}
+
+int CCrashHandler::CaptureSnapshot(LPCWSTR pszReason) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  if (!m_SnapshotQueue.IsInitialized()) {
+    CAutoLock lock(&m_csSnapshotQueue);
+    if (!m_SnapshotQueue.IsInitialized() &&
+        !m_SnapshotQueue.Init(m_sUnsentCrashReportsFolder + _T("\\Snapshots"), m_sAppName, m_sAppVersion, &m_PropTable, &m_Breadcrumbs)) {
+      crSetErrorMsg(L"Error initializing snapshot queue.");
+      return 1;
+    }
+  }
+
+  // Skip this method and crCaptureSnapshot() in the captured stack
+  if (!m_SnapshotQueue.Capture(pszReason, 2)) {
+    crSetErrorMsg(L"Snapshot queue is full.");
+    return 2;
+  }
+
+  crSetErrorMsg(L"Success.");
+  return 0;
+}
+
 // Adds a screen shot to the error report
 int CCrashHandler::AddScreenshot(DWORD dwFlags, int nJpegQuality) {
   crSetErrorMsg(L"Unspecified error.");
@@ -889,22 +1256,37 @@ int CCrashHandler::GenerateErrorReport(PCR_EXCEPTION_INFO pExceptionInfo) {
     return 1;
   }
 
+  // A crash waiting for the lock takes precedence over a hang report.
+  // Give up before the crash description is touched or the client is notified.
+  if (pExceptionInfo->exctype == CR_HANG && m_lCrashWaiting != 0) {
+    crSetErrorMsg(L"Hang report was abandoned in favor of a crash report.");
+    return 4;
+  }
+
+  // Remember when the crash happened, CrashSender.exe measures its reaction time from this moment.
+  LARGE_INTEGER liCrashTime;
+  QueryPerformanceCounter(&liCrashTime);
+  m_pCrashDesc->m_llCrashTimestamp = liCrashTime.QuadPart;
+
   // Get exception pointers if they were not provided by the caller.
   if (pExceptionInfo->pexcptrs == NULL) {
     GetExceptionPointers(pExceptionInfo->code, &ExceptionPointers);
     pExceptionInfo->pexcptrs = &ExceptionPointers;
   }
 
-  // If error report is being generated manually,
-  // temporarily disable app restart feature.
-  if (pExceptionInfo->bManual) {
+  // If error report is being generated manually or for a hang,
+  // the app keeps running, so temporarily disable app restart feature.
+  if (pExceptionInfo->bManual || pExceptionInfo->exctype == CR_HANG) {
     // Force disable app restart.
     m_pCrashDesc->m_dwInstallFlags &= ~CR_INST_APP_RESTART;
   }
-  else {
-      if (RecordCrashEvent(pExceptionInfo) != 0) {
-          crSetErrorMsg(L"Error record crash event.");
-      }
+
+  if (!pExceptionInfo->bManual) {
+    // Journal the crash first, so it is recorded even if the callback cancels
+    // the report or launching CrashSender.exe fails.
+    FormatCrashEvent(pExceptionInfo);
+    if (RecordCrashEvent() != 0)
+      crSetErrorMsg(L"Error record crash event.");
   }
 
   // Set "client app crashed" flag.
@@ -912,7 +1294,8 @@ int CCrashHandler::GenerateErrorReport(PCR_EXCEPTION_INFO pExceptionInfo) {
 
   // Save current process ID, thread ID and exception pointers address to shared mem.
   m_pCrashDesc->m_dwProcessId = GetCurrentProcessId();
-  m_pCrashDesc->m_dwThreadId = GetCurrentThreadId();
+  // For a hang, the report is generated by the watchdog thread on behalf of the stalled thread.
+  m_pCrashDesc->m_dwThreadId = pExceptionInfo->exctype == CR_HANG ? m_dwHangThreadId : GetCurrentThreadId();
   m_pCrashDesc->m_pExceptionPtrs = pExceptionInfo->pexcptrs;
   m_pCrashDesc->m_nExceptionType = pExceptionInfo->exctype;
 
@@ -926,9 +1309,9 @@ int CCrashHandler::GenerateErrorReport(PCR_EXCEPTION_INFO pExceptionInfo) {
   }
   else if (pExceptionInfo->exctype == CR_CPP_INVALID_PARAMETER) {
     // Set invalid parameter exception info fields
-    m_pCrashDesc->m_dwInvParamExprOffs = PackString(pExceptionInfo->expression);
-    m_pCrashDesc->m_dwInvParamFunctionOffs = PackString(pExceptionInfo->function);
-    m_pCrashDesc->m_dwInvParamFileOffs = PackString(pExceptionInfo->file);
+    FillString(m_pCrashDesc->m_dwInvParamExprOffs, pExceptionInfo->expression);
+    FillString(m_pCrashDesc->m_dwInvParamFunctionOffs, pExceptionInfo->function);
+    FillString(m_pCrashDesc->m_dwInvParamFileOffs, pExceptionInfo->file);
     m_pCrashDesc->m_uInvParamLine = pExceptionInfo->line;
   }
 
@@ -950,7 +1333,29 @@ int CCrashHandler::GenerateErrorReport(PCR_EXCEPTION_INFO pExceptionInfo) {
 
   int result = 0;  // result of launching CrashSender.exe
 
-  result = LaunchCrashReport(m_sCrashGUID, TRUE, &pExceptionInfo->hCrashReportProcess);
+  // The crash may have started waiting while the client handled the first stage. Nothing is
+  // launched yet, and the crash overwrites the crash-specific fields, so only the hang-specific
+  // flags are restored. The client gets the second stage it expects, but it can't terminate the
+  // process on behalf of the hang; the callback state is reset for the crash.
+  if (pExceptionInfo->exctype == CR_HANG && m_lCrashWaiting != 0) {
+    m_pCrashDesc->m_dwInstallFlags = m_dwFlags;
+    CallBack(CR_CB_STAGE_FINISH, pExceptionInfo);
+    m_nCallbackRetCode = CR_CB_NOTIFY_NEXT_STAGE;
+    m_bContinueExecution = TRUE;
+    crSetErrorMsg(L"Hang report was abandoned in favor of a crash report.");
+    return 4;
+  }
+
+  // Everything above must work without touching the heap. In test mode, this is where the heap gets unlocked.
+  ReleaseProcessHeap();
+
+  // Decide how much to collect. The signature table is mapped, so this is a few interlocked operations.
+  int nReportLevel = REPORT_LEVEL_FULL;
+  if (!pExceptionInfo->bManual)
+    nReportLevel = ApplyReportPolicy(pExceptionInfo);
+
+  if (nReportLevel != REPORT_LEVEL_COUNT_ONLY)
+    result = LaunchCrashReport(TRUE, &pExceptionInfo->hCrashReportProcess);
 
   // New-style callback. Notify client about the second stage
   // (CR_CB_STAGE_FINISH) of crash report generation.
@@ -970,11 +1375,7 @@ int CCrashHandler::GenerateErrorReport(PCR_EXCEPTION_INFO pExceptionInfo) {
 
     // Failed to launch crash sender process.
     // Try notifying user about crash using message box.
-    CString szCaption;
-    szCaption.Format(_T("%s has stopped working"), Utility::getAppName());
-    CString szMessage;
-    szMessage.Format(_T("Error launching CrashReport.exe"));
-    MessageBox(NULL, szMessage, szCaption, MB_OK | MB_ICONERROR);
+    MessageBox(NULL, _T("Error launching CrashReport.exe"), m_szErrorCaption, MB_OK | MB_ICONERROR);
     return 3;
   }
 
@@ -1043,9 +1444,14 @@ int CCrashHandler::AddRegKey(LPCTSTR szRegKey, LPCTSTR szDstFileName, DWORD dwFl
   rki.m_sDstFileName = sDstFileName;
   rki.m_bAllowDelete = false;
 
-  m_RegKeys[CString(szRegKey)] = rki;
+  CAutoLock lock(&m_csSharedMem);
 
-  PackRegKey(szRegKey, rki);
+  if (PackRegKey(szRegKey, rki) == 0 && (!CompactSharedMem() || PackRegKey(szRegKey, rki) == 0)) {
+    crSetErrorMsg(L"Not enough space in shared memory.");
+    return 1;
+  }
+
+  m_RegKeys[CString(szRegKey)] = rki;
 
   // OK
   crSetErrorMsg(L"Success.");
@@ -1105,42 +1511,42 @@ void CCrashHandler::GetExceptionPointers(DWORD dwExceptionCode, EXCEPTION_POINTE
   pExceptionPointers->ExceptionRecord->ExceptionAddress = _ReturnAddress();
 }
 
-int CCrashHandler::LaunchCrashReport(LPCTSTR szCmdLineParams, BOOL bWait, HANDLE* phProcess) {
+int CCrashHandler::LaunchCrashReport(BOOL bWait, HANDLE* phProcess) {
   crSetErrorMsg(L"Unspecified error.");
 
-  STARTUPINFO si;
-  memset(&si, 0, sizeof(STARTUPINFO));
-  si.cb = sizeof(STARTUPINFO);
-
   PROCESS_INFORMATION pi;
   memset(&pi, 0, sizeof(PROCESS_INFORMATION));
 
-  // Format command line
-  TCHAR szCmdLine[_MAX_PATH] = _T("");
-  _tcscat_s(szCmdLine, _MAX_PATH, _T("\""));
-  _tcscat_s(szCmdLine, _MAX_PATH, m_sPathToCrashReport.GetBuffer(0));
-  _tcscat_s(szCmdLine, _MAX_PATH, _T("\" \""));
-  _tcscat_s(szCmdLine, _MAX_PATH, szCmdLineParams);
-  _tcscat_s(szCmdLine, _MAX_PATH, _T("\""));
-
-  TCHAR szCurDir[MAX_PATH] = {0};
-  StringCchCopy(szCurDir, MAX_PATH, m_sPathToCrashReport);
-  PathRemoveFileSpec(szCurDir);
-
-  BOOL bCreateProcess = CreateProcess(m_sPathToCrashReport, szCmdLine, NULL, NULL, FALSE, 0, NULL, szCurDir, &si, &pi);
-  if (pi.hThread) {
-    CloseHandle(pi.hThread);
-    pi.hThread = NULL;
+  if (m_hStandbyProcess != NULL && WaitForSingleObject(m_hStandbyProcess, 0) == WAIT_TIMEOUT) {
+    // Standby CrashSender.exe is already running and its DLLs are loaded,
+    // so just wake it up. From now on, it is the process generating the report.
+    SetEvent(m_hStandbyEvent);
+    pi.hProcess = m_hStandbyProcess;
+    m_hStandbyProcess = NULL;
   }
-  if (!bCreateProcess) {
-    ATLASSERT(bCreateProcess);
-    crSetErrorMsg(L"Error creating CrashReport process.");
-    return 1;
+  else {
+    STARTUPINFO si;
+    memset(&si, 0, sizeof(STARTUPINFO));
+    si.cb = sizeof(STARTUPINFO);
+
+    // Command line and current directory are formatted by PerCrashInit()
+    BOOL bCreateProcess = CreateProcess(m_sPathToCrashReport, m_szLaunchCmdLine, NULL, NULL, FALSE, 0, NULL, m_szLaunchCurDir, &si, &pi);
+    if (pi.hThread) {
+      CloseHandle(pi.hThread);
+      pi.hThread = NULL;
+    }
+    if (!bCreateProcess) {
+      ATLASSERT(bCreateProcess);
+      crSetErrorMsg(L"Error creating CrashReport process.");
+      return 1;
+    }
   }
 
   if (bWait) {
     // Wait until CrashReport finishes with making screenshot, copying files, creating minidump.
-    WaitForSingleObject(m_hEvent, INFINITE);
+    // Don't hang if it exits before signaling the event (for example, if another instance is running).
+    HANDLE hWaitHandles[2] = {m_hEvent, pi.hProcess};
+    WaitForMultipleObjects(2, hWaitHandles, FALSE, INFINITE);
   }
 
   // Return handle to the CrashReport.exe process.
@@ -1158,57 +1564,372 @@ int CCrashHandler::LaunchCrashReport(LPCTSTR szCmdLineParams, BOOL bWait, HANDLE
   return 0;
 }
 
-int CCrashHandler::RecordCrashEvent(PCR_EXCEPTION_INFO pExceptionInfo) {
-    if (!pExceptionInfo) {
-        return 1;
+// Adds bytes to FNV-1a hash.
+static ULONG64 HashBytes(ULONG64 ullHash, const void* pData, size_t nSize) {
+  const BYTE* p = (const BYTE*)pData;
+  for (size_t i = 0; i < nSize; i++) {
+    ullHash ^= p[i];
+    ullHash *= 1099511628211ULL;
+  }
+  return ullHash;
+}
+
+ULONG64 CCrashHandler::ComputeCrashSignature(PCR_EXCEPTION_INFO pExceptionInfo) {
+  PEXCEPTION_RECORD pRecord = pExceptionInfo->pexcptrs != NULL ? pExceptionInfo->pexcptrs->ExceptionRecord : NULL;
+  DWORD dwCode = pRecord != NULL ? pRecord->ExceptionCode : 0;
+  ULONG_PTR uAddress = pRecord != NULL ? (ULONG_PTR)pRecord->ExceptionAddress : 0;
+
+  // Module-relative offset doesn't depend on the load address.
+  WCHAR szModule[MAX_PATH] = L"";
+  ULONG_PTR uOffset = uAddress;
+  HMODULE hModule = NULL;
+  if (uAddress != 0 &&
+      GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)uAddress, &hModule)) {
+    GetModuleFileNameW(hModule, szModule, MAX_PATH);
+    uOffset = uAddress - (ULONG_PTR)hModule;
+  }
+
+  ULONG64 ullHash = 14695981039346656037ULL;
+  ullHash = HashBytes(ullHash, &pExceptionInfo->exctype, sizeof(int));
+  ullHash = HashBytes(ullHash, &dwCode, sizeof(DWORD));
+  ullHash = HashBytes(ullHash, &uOffset, sizeof(ULONG_PTR));
+
+  // Only the lowercase file name of the module counts, the app may be installed to different folders.
+  for (LPCWSTR p = PathFindFileNameW(szModule); *p != 0; p++) {
+    WCHAR c = (*p >= L'A' && *p <= L'Z') ? *p + (L'a' - L'A') : *p;
+    ullHash = HashBytes(ullHash, &c, sizeof(WCHAR));
+  }
+
+  return ullHash != 0 ? ullHash : 1;  // Zero means no signature
+}
+
+int CCrashHandler::ApplyReportPolicy(PCR_EXCEPTION_INFO pExceptionInfo) {
+  if (!m_bReportPolicy)
+    return REPORT_LEVEL_FULL;
+
+  // The signature is computed along with the crash journal record.
+  ULONG64 ullSignature = m_CrashEvent.m_ullSignature;
+  SIGNATURE_ENTRY se;
+  if (m_SignatureTable.CountCrash(ullSignature, &se) != 0)
+    return REPORT_LEVEL_FULL;  // Better a duplicate report than a lost one
+
+  int nReportLevel = REPORT_LEVEL_FULL;
+  if (se.m_dwCountToday > m_uFullReportsPerDay) {
+    // Sample the rest. Low bits of the crash timestamp are random enough.
+    DWORD dwRandom = (DWORD)(((ULONG64)m_pCrashDesc->m_llCrashTimestamp * 0x9E3779B97F4A7C15ULL) >> 32);
+    nReportLevel = (dwRandom % 100 < m_uSamplePercent) ? REPORT_LEVEL_SUMMARY : REPORT_LEVEL_COUNT_ONLY;
+  }
+
+  if (nReportLevel == REPORT_LEVEL_SUMMARY) {
+    // Summary report is the crash description and user files only
+    m_pCrashDesc->m_dwInstallFlags |= CR_INST_NO_MINIDUMP;
+    m_pCrashDesc->m_bAddScreenshot = FALSE;
+  }
+
+  m_pCrashDesc->m_ullCrashSignature = ullSignature;
+  m_pCrashDesc->m_dwSignatureCountToday = se.m_dwCountToday;
+  m_pCrashDesc->m_dwSignatureCountTotal = (DWORD)se.m_lCountTotal;
+  m_pCrashDesc->m_nReportLevel = nReportLevel;
+  return nReportLevel;
+}
+
+void CCrashHandler::FormatCrashEvent(PCR_EXCEPTION_INFO pExceptionInfo) {
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+
+  memset(&m_CrashEvent, 0, sizeof(CRASH_JOURNAL_RECORD));
+  m_CrashEvent.m_ullTime = ((ULONG64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  m_CrashEvent.m_nExceptionType = pExceptionInfo->exctype;
+  m_CrashEvent.m_dwExceptionCode = pExceptionInfo->code;
+  if (pExceptionInfo->pexcptrs != NULL && pExceptionInfo->pexcptrs->ExceptionRecord != NULL)
+    m_CrashEvent.m_dwExceptionCode = pExceptionInfo->pexcptrs->ExceptionRecord->ExceptionCode;
+  m_CrashEvent.m_dwProcessId = GetCurrentProcessId();
+  m_CrashEvent.m_ullSignature = ComputeCrashSignature(pExceptionInfo);
+  CopyBoundedString(m_CrashEvent.m_szAppVersion, CRASH_JOURNAL_MAX_VERSION, m_sAppVersion);
+  m_bCrashEventPending = TRUE;
+}
+
+int CCrashHandler::RecordCrashEvent() {
+  if (!m_bCrashEventPending)
+    return 1;  // Nothing to record
+
+  m_bCrashEventPending = FALSE;
+  return m_CrashJournal.Append(&m_CrashEvent) ? 0 : 1;
+}
+
+int CCrashHandler::GetCrashHistory(PCR_CRASH_RECORD pRecords, UINT uMaxRecords, UINT* puRecordCount) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  if (puRecordCount == NULL) {
+    crSetErrorMsg(L"Invalid record count pointer.");
+    return 1;
+  }
+  *puRecordCount = 0;
+
+  if (!m_CrashJournal.IsInitialized()) {
+    crSetErrorMsg(L"Crash journal is not available.");
+    return 2;
+  }
+
+  // Count committed records first, to know how many of the oldest ones to skip.
+  CRASH_JOURNAL_RECORD rec;
+  UINT uRecordCount = m_CrashJournal.GetRecordCount();
+  UINT uCommitted = 0;
+  UINT i;
+  for (i = 0; i < uRecordCount; i++) {
+    if (m_CrashJournal.GetRecord(i, &rec))
+      uCommitted++;
+  }
+
+  if (pRecords == NULL) {
+    *puRecordCount = uCommitted;
+    crSetErrorMsg(L"Success.");
+    return 0;
+  }
+
+  UINT uSkip = uCommitted > uMaxRecords ? uCommitted - uMaxRecords : 0;
+  UINT uCopied = 0;
+  for (i = 0; i < uRecordCount && uCopied < uMaxRecords; i++) {
+    if (!m_CrashJournal.GetRecord(i, &rec))
+      continue;
+    if (uSkip > 0) {
+      uSkip--;
+      continue;
     }
 
-  HKEY hKey = NULL;
-  DWORD dwDisposition = 0;
+    PCR_CRASH_RECORD pRecord = &pRecords[uCopied++];
+    pRecord->ullTime = rec.m_ullTime;
+    pRecord->nExceptionType = rec.m_nExceptionType;
+    pRecord->dwExceptionCode = rec.m_dwExceptionCode;
+    pRecord->dwProcessId = rec.m_dwProcessId;
+    pRecord->ullSignature = rec.m_ullSignature;
+    StringCchCopyW(pRecord->szAppVersion, 24, rec.m_szAppVersion);
+  }
 
-  CString strSubKey = CString(L"CrashReport\\Record\\") + m_sAppName + L"\\";
-  if (RegCreateKeyExW(HKEY_CURRENT_USER, strSubKey, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, &dwDisposition) != S_OK) {
-      return 1;
+  *puRecordCount = uCopied;
+  crSetErrorMsg(L"Success.");
+  return 0;
+}
+
+int CCrashHandler::StartWatchdog() {
+  CAutoLock lock(&m_csWatchdog);
+
+  if (m_hWatchdogThread != NULL)
+    return 0;  // Already running
+
+  m_hWatchdogStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (m_hWatchdogStop == NULL)
+    return 1;
+
+  m_hWatchdogThread = CreateThread(NULL, 0, WatchdogThreadFunction, this, 0, NULL);
+  if (m_hWatchdogThread == NULL) {
+    CloseHandle(m_hWatchdogStop);
+    m_hWatchdogStop = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+void CCrashHandler::StopWatchdog() {
+  CAutoLock lock(&m_csWatchdog);
+
+  if (m_hWatchdogThread != NULL) {
+    SetEvent(m_hWatchdogStop);
+    WaitForSingleObject(m_hWatchdogThread, INFINITE);
+    CloseHandle(m_hWatchdogThread);
+    m_hWatchdogThread = NULL;
   }
 
-  union {
-      int64_t ns100;
-      FILETIME ft;
-  } fileTime;
-  GetSystemTimeAsFileTime(&fileTime.ft);
+  if (m_hWatchdogStop != NULL) {
+    CloseHandle(m_hWatchdogStop);
+    m_hWatchdogStop = NULL;
+  }
+}
 
-  // 116444736000000000 is the number of total 100 nanoseconds that from 1601/1/1 00:00:00:000 to 1970/1/1 00:00:00:000
-  int64_t lNowMS = (long long)((fileTime.ns100 - 116444736000000000LL) / 10000LL);
+DWORD WINAPI CCrashHandler::WatchdogThreadFunction(LPVOID lpParameter) {
+  CCrashHandler* pCrashHandler = (CCrashHandler*)lpParameter;
 
-  WCHAR szTS[100] = { 0 };
-  _i64tow_s(lNowMS, szTS, 100, 10);
+  while (WaitForSingleObject(pCrashHandler->m_hWatchdogStop, HEARTBEAT_CHECK_INTERVAL) == WAIT_TIMEOUT) {
+    DWORD dwNow = GetTickCount();
 
-  WCHAR szData[1024] = { 0 };
-  StringCchPrintfW(szData, 1024, L"version=%s;exc_type=%d;code=%d;fpe_subcode=%d;expression=%s", 
-      m_sAppVersion.GetBuffer(), 
-      pExceptionInfo->exctype,
-      pExceptionInfo->code,
-      pExceptionInfo->fpe_subcode,
-      pExceptionInfo->expression ? pExceptionInfo->expression : L""
-  );
-  m_sAppVersion.ReleaseBuffer();
+    for (UINT i = 0; i < HEARTBEAT_SLOT_COUNT; i++) {
+      HEARTBEAT_SLOT* pSlot = &pCrashHandler->m_HeartbeatSlots[i];
+      LONG lTimeoutMs = pSlot->m_lTimeoutMs;
+      if (lTimeoutMs == 0)
+        continue;  // Disarmed
 
-  if (RegSetValueExW(hKey, szTS, 0, REG_SZ, (const BYTE*)szData, wcslen(szData) * sizeof(WCHAR)) != S_OK) {
-      RegCloseKey(hKey);
-      return 1;
+      LONG lLastBeat = pSlot->m_lLastBeat;
+      if (pSlot->m_bReported && pSlot->m_lReportedBeat == lLastBeat)
+        continue;  // This stall is already reported
+
+      // Unsigned difference stays correct when the tick count wraps around.
+      if (dwNow - (DWORD)lLastBeat > (DWORD)lTimeoutMs) {
+        pSlot->m_lReportedBeat = lLastBeat;
+        pSlot->m_bReported = TRUE;
+
+        // Retry on the next check if a crash or another report is in progress.
+        if (!pCrashHandler->ReportHang(i))
+          pSlot->m_bReported = FALSE;
+      }
+    }
   }
 
-  RegCloseKey(hKey);
   return 0;
 }
 
+BOOL CCrashHandler::ReportHang(UINT uSlot) {
+  // Real crashes take precedence: a hang is not reported while a crash is being handled,
+  // and it is not recorded as a secondary crash either.
+  if (!TryCrashLock(FALSE))
+    return FALSE;
+
+  m_dwHangThreadId = (DWORD)m_HeartbeatSlots[uSlot].m_lThreadId;
+
+  // Fill in the exception info
+  CR_EXCEPTION_INFO ei;
+  memset(&ei, 0, sizeof(CR_EXCEPTION_INFO));
+  ei.cb = sizeof(CR_EXCEPTION_INFO);
+  ei.exctype = CR_HANG;
+
+  // A hang is not critical by default, the process keeps running.
+  m_bContinueExecution = TRUE;
+
+  // Generate error report.
+  GenerateErrorReport(&ei);
+
+  if (!m_bContinueExecution) {
+    // Terminate process
+    TerminateProcess(GetCurrentProcess(), 1);
+  }
+
+  if (ei.hCrashReportProcess != NULL)
+    CloseHandle(ei.hCrashReportProcess);
+
+  // Free lock
+  CrashLock(FALSE);
+  return TRUE;
+}
+
+DWORD WINAPI CCrashHandler::HeapPoisonThreadFunction(LPVOID lpParameter) {
+  CCrashHandler* pCrashHandler = (CCrashHandler*)lpParameter;
+
+  // Hold the heap lock until the crash handler is about to launch CrashSender.exe
+  HeapLock(GetProcessHeap());
+  SetEvent(pCrashHandler->m_hHeapPoisonLocked);
+  WaitForSingleObject(pCrashHandler->m_hHeapPoisonRelease, INFINITE);
+  HeapUnlock(GetProcessHeap());
+  SetEvent(pCrashHandler->m_hHeapPoisonLocked);
+  return 0;
+}
+
+int CCrashHandler::PoisonProcessHeap() {
+  if (m_hHeapPoisonRelease != NULL)
+    return 1;  // Already poisoned
+
+  m_hHeapPoisonLocked = CreateEvent(NULL, FALSE, FALSE, NULL);
+  m_hHeapPoisonRelease = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (m_hHeapPoisonLocked == NULL || m_hHeapPoisonRelease == NULL)
+    return 1;
+
+  HANDLE hThread = CreateThread(NULL, 0, HeapPoisonThreadFunction, this, 0, NULL);
+  if (hThread == NULL)
+    return 1;
+  CloseHandle(hThread);
+
+  // Wait until the heap is locked
+  WaitForSingleObject(m_hHeapPoisonLocked, INFINITE);
+  return 0;
+}
+
+void CCrashHandler::ReleaseProcessHeap() {
+  if (m_hHeapPoisonRelease == NULL)
+    return;  // Not in test mode
+
+  // Wait until the helper thread unlocks the heap
+  SetEvent(m_hHeapPoisonRelease);
+  WaitForSingleObject(m_hHeapPoisonLocked, INFINITE);
+  CloseHandle(m_hHeapPoisonRelease);
+  CloseHandle(m_hHeapPoisonLocked);
+  m_hHeapPoisonRelease = NULL;
+  m_hHeapPoisonLocked = NULL;
+}
+
 // Acquires the crash lock. Other threads that may crash while we are
 // inside of a crash handler function, will wait until we unlock.
-void CCrashHandler::CrashLock(BOOL bLock) {
-  if (bLock)
+// Such threads are recorded into the crash description first, so a single
+// report covers all of them. Usually the process is terminated before they get the lock.
+void CCrashHandler::CrashLock(BOOL bLock, int nExcType, PEXCEPTION_POINTERS pExceptionPtrs) {
+  LONG lThreadId = (LONG)GetCurrentThreadId();
+
+  if (bLock) {
+    // A background owner (see TryCrashLock()) is not a crash, just wait for it.
+    // A hang report in progress gives way to the waiting crash (see GenerateErrorReport()).
+    LONG lOwner = InterlockedCompareExchange(&m_lCrashOwnerThreadId, lThreadId, 0);
+    BOOL bBackgroundOwner = lOwner == CRASH_OWNER_BACKGROUND;
+    if (lOwner != 0 && lOwner != lThreadId && !bBackgroundOwner)
+      RecordSecondaryCrash(nExcType, pExceptionPtrs);
+
+    if (bBackgroundOwner)
+      InterlockedIncrement(&m_lCrashWaiting);
     m_csCrashLock.Lock();
-  else
+    if (bBackgroundOwner)
+      InterlockedDecrement(&m_lCrashWaiting);
+    InterlockedExchange(&m_lCrashOwnerThreadId, lThreadId);
+  }
+  else {
+    InterlockedExchange(&m_lBackgroundThreadId, 0);
+    InterlockedExchange(&m_lCrashOwnerThreadId, 0);
     m_csCrashLock.Unlock();
+  }
+}
+
+// Acquires the crash lock for a task that is not a crash (compaction, hang or manual report).
+// Such a task is never recorded as a secondary crash. Release the lock with CrashLock(FALSE).
+BOOL CCrashHandler::TryCrashLock(BOOL bWait) {
+  LONG lThreadId = (LONG)GetCurrentThreadId();
+
+  for (;;) {
+    LONG lOwner = InterlockedCompareExchange(&m_lCrashOwnerThreadId, CRASH_OWNER_BACKGROUND, 0);
+    if (lOwner == 0)
+      break;
+
+    // The caller thread already owns the lock (for example, a report is generated from
+    // the crash callback), or it shouldn't wait for a crash being handled.
+    if (!bWait || lOwner == lThreadId || (lOwner == CRASH_OWNER_BACKGROUND && m_lBackgroundThreadId == lThreadId))
+      return FALSE;
+
+    Sleep(10);
+  }
+
+  // The previous owner may have not left the critical section yet.
+  m_csCrashLock.Lock();
+  InterlockedExchange(&m_lBackgroundThreadId, lThreadId);
+  return TRUE;
+}
+
+void CCrashHandler::RecordSecondaryCrash(int nExcType, PEXCEPTION_POINTERS pExceptionPtrs) {
+  // No locks here: the thread may have crashed while holding one. Slots are in the
+  // fixed part of the crash description, and compaction doesn't touch the description
+  // while a crash is being handled, so the slot stays valid.
+  CRASH_DESCRIPTION* pCrashDesc = m_pCrashDesc;
+  if (pCrashDesc == NULL)
+    return;
+
+  // Claim a slot. Threads above the capacity are only counted.
+  LONG lSlot = InterlockedIncrement(&pCrashDesc->m_lSecondaryCrashCount) - 1;
+  if (lSlot >= MAX_SECONDARY_CRASHES)
+    return;
+
+  SECONDARY_CRASH* pSlot = &pCrashDesc->m_SecondaryCrashes[lSlot];
+  pSlot->m_nExceptionType = nExcType;
+  if (pExceptionPtrs != NULL && pExceptionPtrs->ExceptionRecord != NULL) {
+    pSlot->m_dwExceptionCode = pExceptionPtrs->ExceptionRecord->ExceptionCode;
+    pSlot->m_ullExceptionAddress = (ULONG64)pExceptionPtrs->ExceptionRecord->ExceptionAddress;
+  }
+
+  // Publish the slot
+  InterlockedExchange(&pSlot->m_lThreadId, (LONG)GetCurrentThreadId());
 }
 
 int CCrashHandler::PerCrashInit() {
@@ -1236,6 +1957,11 @@ int CCrashHandler::PerCrashInit() {
   sEventName.Format(_T("Local\\CrashRptEvent_%s"), m_sCrashGUID);
   m_hEvent = CreateEvent(NULL, FALSE, FALSE, sEventName);
 
+  // Format CrashSender.exe command line for the next crash report.
+  StringCchPrintf(m_szLaunchCmdLine, 2 * MAX_PATH, _T("\"%s\" \"%s\""), (LPCTSTR)m_sPathToCrashReport, (LPCTSTR)m_sCrashGUID);
+  StringCchCopy(m_szLaunchCurDir, MAX_PATH, m_sPathToCrashReport);
+  PathRemoveFileSpec(m_szLaunchCurDir);
+
   // Format error report dir name for the next crash report.
   CString sErrorReportDirName;
   sErrorReportDirName.Format(_T("%s\\%s_%s\\%s"), m_sUnsentCrashReportsFolder.GetBuffer(0), m_sAppName.GetBuffer(0), m_sAppVersion.GetBuffer(0), m_sCrashGUID.GetBuffer(0));
@@ -1244,6 +1970,8 @@ int CCrashHandler::PerCrashInit() {
   strconv_t strconv;
   m_sErrorReportDirW = strconv.t2w(sErrorReportDirName);
 
+  CAutoLock lock(&m_csSharedMem);
+
   // Reset shared memory
   if (m_SharedMem.IsInitialized()) {
     m_SharedMem.Destroy();
@@ -1254,17 +1982,69 @@ int CCrashHandler::PerCrashInit() {
   // It will be passed to CrashSender.exe later.
   m_pCrashDesc = PackCrashInfoIntoSharedMem(&m_SharedMem, FALSE);
 
+  // Replace the standby CrashSender.exe, the old one waits for the previous GUID.
+  if (m_dwFlags & CR_INST_PRESPAWN_SENDER) {
+    DestroyStandbySender();
+    if (0 != SpawnStandbySender())
+      crSetErrorMsg(L"Error starting standby CrashReport process.");  // Not fatal, CrashReport.exe is launched on crash.
+  }
+
   // OK
   return 0;
 }
 
+int CCrashHandler::SpawnStandbySender() {
+  // Create the event before the process, so the standby can't miss it.
+  CString sEventName;
+  sEventName.Format(_T("Local\\CrashRptStandby_%s"), m_sCrashGUID);
+  m_hStandbyEvent = CreateEvent(NULL, FALSE, FALSE, sEventName);
+  if (m_hStandbyEvent == NULL)
+    return 1;
+
+  // The standby waits for the event or for this process to exit.
+  CString sCmdLine;
+  sCmdLine.Format(_T("\"%s\" /standby \"%s\" %lu"), m_sPathToCrashReport, m_sCrashGUID, GetCurrentProcessId());
+
+  STARTUPINFO si;
+  memset(&si, 0, sizeof(STARTUPINFO));
+  si.cb = sizeof(STARTUPINFO);
+
+  PROCESS_INFORMATION pi;
+  memset(&pi, 0, sizeof(PROCESS_INFORMATION));
+
+  BOOL bCreateProcess = CreateProcess(m_sPathToCrashReport, sCmdLine.GetBuffer(0), NULL, NULL, FALSE, 0, NULL, m_szLaunchCurDir, &si, &pi);
+  sCmdLine.ReleaseBuffer();
+  if (!bCreateProcess) {
+    CloseHandle(m_hStandbyEvent);
+    m_hStandbyEvent = NULL;
+    return 1;
+  }
+
+  CloseHandle(pi.hThread);
+  m_hStandbyProcess = pi.hProcess;
+  return 0;
+}
+
+void CCrashHandler::DestroyStandbySender() {
+  // The standby that was woken up is owned by the caller of LaunchCrashReport(),
+  // so only an idle one is terminated here. It hasn't done anything yet.
+  if (m_hStandbyProcess != NULL) {
+    TerminateProcess(m_hStandbyProcess, 0);
+    CloseHandle(m_hStandbyProcess);
+    m_hStandbyProcess = NULL;
+  }
+
+  if (m_hStandbyEvent != NULL) {
+    CloseHandle(m_hStandbyEvent);
+    m_hStandbyEvent = NULL;
+  }
+}
+
 int CCrashHandler::CallBack(int nStage, CR_EXCEPTION_INFO* pExInfo) {
   // This method calls the new-style crash callback function.
   // The client (calee) is able to either permit crash report generation (return CR_CB_DODEFAULT)
   // or prevent it (return CR_CB_CANCEL).
 
-  strconv_t strconv;
-
   if (m_nCallbackRetCode != CR_CB_NOTIFY_NEXT_STAGE)
     return CR_CB_DODEFAULT;
 
@@ -1313,7 +2093,7 @@ LONG WINAPI CCrashHandler::SehHandler(PEXCEPTION_POINTERS pExceptionPtrs) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_SEH_EXCEPTION, pExceptionPtrs);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1349,7 +2129,7 @@ DWORD WINAPI CCrashHandler::StackOverflowThreadFunction(LPVOID lpParameter) {
 
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we	are inside.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_SEH_EXCEPTION, pExceptionPtrs);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1384,7 +2164,7 @@ void __cdecl CCrashHandler::TerminateHandler() {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_TERMINATE_CALL, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1418,7 +2198,7 @@ void __cdecl CCrashHandler::UnexpectedHandler() {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_UNEXPECTED_CALL, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1453,7 +2233,7 @@ void __cdecl CCrashHandler::PureCallHandler() {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_PURE_CALL, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1492,7 +2272,7 @@ void __cdecl CCrashHandler::SecurityHandler(int code, void* x) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SECURITY_ERROR, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1529,7 +2309,7 @@ void __cdecl CCrashHandler::InvalidParameterHandler(const wchar_t* expression, c
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_INVALID_PARAMETER, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1569,7 +2349,7 @@ int __cdecl CCrashHandler::NewHandler(size_t) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_NEW_OPERATOR_ERROR, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1608,7 +2388,7 @@ void CCrashHandler::SigabrtHandler(int) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGABRT, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1641,7 +2421,7 @@ void CCrashHandler::SigfpeHandler(int /*code*/, int subcode) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGFPE, (PEXCEPTION_POINTERS)_pxcptinfoptrs);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1677,7 +2457,7 @@ void CCrashHandler::SigillHandler(int) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGILL, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1711,7 +2491,7 @@ void CCrashHandler::SigintHandler(int) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGINT, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1744,7 +2524,7 @@ void CCrashHandler::SigsegvHandler(int) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGSEGV, (PEXCEPTION_POINTERS)_pxcptinfoptrs);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1779,7 +2559,7 @@ void CCrashHandler::SigtermHandler(int) {
   if (pCrashHandler != NULL) {
     // Acquire lock to avoid other threads (if exist) to crash while we are
     // inside. We do not unlock, because process is to be terminated.
-    pCrashHandler->CrashLock(TRUE);
+    pCrashHandler->CrashLock(TRUE, CR_CPP_SIGTERM, NULL);
 
     // Treat this type of crash critical by default
     pCrashHandler->m_bContinueExecution = FALSE;
@@ -1806,4 +2586,18 @@ void CCrashHandler::SigtermHandler(int) {
 DWORD CCrashHandler::GetFlags() {
   return m_dwFlags;
 }
+
+void CCrashHandler::GetMemoryFootprint(PCR_MEMORY_FOOTPRINT pFootprint) {
+  pFootprint->uReservedBytes = m_SharedMem.GetReservedSize();
+  pFootprint->uCommittedBytes = m_SharedMem.GetSize();
+
+  // Typed properties, breadcrumbs, the crash journal, the signature table and the snapshot queue live in their own memory.
+  m_PropTable.AddFootprint(pFootprint->uReservedBytes, pFootprint->uCommittedBytes);
+  m_Breadcrumbs.AddFootprint(pFootprint->uReservedBytes, pFootprint->uCommittedBytes);
+  m_CrashJournal.AddFootprint(pFootprint->uReservedBytes, pFootprint->uCommittedBytes);
+  m_SignatureTable.AddFootprint(pFootprint->uReservedBytes, pFootprint->uCommittedBytes);
+  m_SnapshotQueue.AddFootprint(pFootprint->uReservedBytes, pFootprint->uCommittedBytes);
+
+  pFootprint->uUsedBytes = m_pCrashDesc != NULL ? m_pCrashDesc->m_dwTotalSize : 0;
+}
 }  // namespace CrashReport
\ No newline at end of file
@@ -4,20 +4,21 @@
 #include "Utility.h"
 #include "CritSec.h"
 #include "SharedMem.h"
+#include "PropertyTable.h"
+#include "Breadcrumbs.h"
+#include "SignatureTable.h"
+#include "CrashJournal.h"
+#include "SnapshotQueue.h"
 #include "Prefastdef.h"
 
 namespace CrashReport {
 
-/* This structure contains pointer to the exception handlers for a thread.*/
-struct ThreadExceptionHandlers {
-  ThreadExceptionHandlers() {
-    m_prevTerm = NULL;
-    m_prevUnexp = NULL;
-    m_prevSigFPE = NULL;
-    m_prevSigILL = NULL;
-    m_prevSigSEGV = NULL;
-  }
+class CCrashHandler;
 
+/* This structure contains pointer to the exception handlers for a thread.
+   It is kept in thread-local storage, so it has no constructor (TLS is zero-initialized).*/
+struct ThreadExceptionHandlers {
+  CCrashHandler* m_pOwner;            // Crash handler that installed the handlers (NULL if not installed).
   terminate_handler m_prevTerm;       // Previous terminate handler
   unexpected_handler m_prevUnexp;     // Previous unexpected handler
   void(__cdecl* m_prevSigFPE)(int);   // Previous FPE handler
@@ -25,8 +26,23 @@ struct ThreadExceptionHandlers {
   void(__cdecl* m_prevSigSEGV)(int);  // Previous illegal storage access handler
 };
 
+#define CRASH_OWNER_BACKGROUND ((LONG)-1) /* Crash lock owner value while a background task holds the lock */
+
+#define HEARTBEAT_SLOT_COUNT 64        /* Count of heartbeat slots */
+#define HEARTBEAT_CHECK_INTERVAL 250   /* How often the watchdog checks heartbeat slots (in milliseconds) */
+
+// Heartbeat slot watched for hangs. Each slot is on its own cache line,
+// so threads beating different slots don't slow each other down.
+struct __declspec(align(64)) HEARTBEAT_SLOT {
+  volatile LONG m_lLastBeat;   // Tick count of the last heartbeat (only the owner thread writes it).
+  volatile LONG m_lTimeoutMs;  // Max interval between heartbeats (zero if the slot is disarmed).
+  volatile LONG m_lThreadId;   // Owner thread.
+  LONG m_lReportedBeat;        // Heartbeat already reported as stale (only the watchdog uses it).
+  BOOL m_bReported;            // Whether m_lReportedBeat is valid.
+};
+
 // Sets the last error message (for the caller thread).
-int crSetErrorMsg(PWSTR pszErrorMsg);
+int crSetErrorMsg(LPCWSTR pszErrorMsg);
 
 // This structure describes a file item (a file included into crash report).
 struct FileItem {
@@ -91,6 +107,32 @@ class CCrashHandler {
   // Adds a named text property to the report.
   int AddProperty(CString sPropName, CString sPropValue);
 
+  // Sets a typed property (lock-free, the value is formatted by CrashSender.exe).
+  int SetPropertyInt64(LPCWSTR pszPropName, LONGLONG llValue);
+  int SetPropertyDouble(LPCWSTR pszPropName, double dValue);
+  int SetPropertyString(LPCWSTR pszPropName, LPCWSTR pszValue);
+
+  // Adds a breadcrumb to the ring of the caller thread.
+  int AddBreadcrumb(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel);
+
+  // Returns the breadcrumb ring of the caller thread, so an exiting thread doesn't keep it.
+  void ReleaseThreadBreadcrumbs();
+
+  // Sets the policy deciding how much is collected for repeated crashes.
+  int SetReportPolicy(UINT uFullReportsPerDay, UINT uSamplePercent);
+
+  // Reads crash records from the crash journal.
+  int GetCrashHistory(PCR_CRASH_RECORD pRecords, UINT uMaxRecords, UINT* puRecordCount);
+
+  // Arms/disarms a heartbeat slot for the caller thread.
+  int SetHeartbeatDeadline(UINT uSlot, DWORD dwTimeoutMs);
+
+  // Stores the current tick count into a heartbeat slot (lock-free, doesn't set the error message).
+  int Heartbeat(UINT uSlot);
+
+  // Queues a lightweight snapshot of the caller thread (starts the snapshot queue on first call).
+  int CaptureSnapshot(LPCWSTR pszReason);
+
   // Adds desktop screenshot of crash into error report.
   int AddScreenshot(DWORD dwFlags, int nJpegQuality);
 
@@ -111,6 +153,9 @@ class CCrashHandler {
   // Returns flags.
   DWORD GetFlags();
 
+  // Returns shared memory usage of this process.
+  void GetMemoryFootprint(PCR_MEMORY_FOOTPRINT pFootprint);
+
   // Returns the crash handler object (singleton).
   static CCrashHandler* GetCurrentProcessCrashHandler();
 
@@ -162,20 +207,65 @@ class CCrashHandler {
 
   // Packs crash description into shared memory.
   CRASH_DESCRIPTION* PackCrashInfoIntoSharedMem(__in CSharedMem* pSharedMem, BOOL bTempMem);
-  // Packs a string.
-  DWORD PackString(CString str);
+  // Allocates a block in shared memory (commits more memory when needed).
+  LPBYTE AllocBlock(DWORD dwSize);
+  // Packs a string, reserving room for at least nCapacity characters.
+  DWORD PackString(CString str, int nCapacity = 0);
+  // Overwrites a packed string in place. Returns FALSE if the string doesn't fit.
+  BOOL UpdateString(DWORD dwOffset, CString str);
+  // Copies a string into a preallocated string block, truncating it if needed (never allocates memory).
+  void FillString(DWORD dwOffset, LPCWSTR pszValue);
+  // Discards the packed data starting at the given offset.
+  void RollbackPack(DWORD dwOffset);
   // Packs a file item.
   DWORD PackFileItem(FileItem& fi);
   // Packs a custom user property.
   DWORD PackProperty(CString sName, CString sValue);
   // Packs a registry key.
   DWORD PackRegKey(CString sKeyName, RegKeyInfo& rki);
+  // Repacks crash description to reclaim space occupied by relocated property values.
+  BOOL CompactSharedMem();
+
+  // Launches the CrashSender.exe process (with the command line preformatted by PerCrashInit()).
+  // If a standby CrashSender.exe is waiting, it is woken up instead.
+  int LaunchCrashReport(BOOL bWait, __out_opt HANDLE* phProcess);
+
+  // Starts a standby CrashSender.exe waiting for a crash with the current GUID (CR_INST_PRESPAWN_SENDER).
+  int SpawnStandbySender();
+
+  // Terminates the standby CrashSender.exe if it hasn't been woken up.
+  void DestroyStandbySender();
+
+  // Computes the signature of a crash (exception type and code, faulting module and offset).
+  ULONG64 ComputeCrashSignature(PCR_EXCEPTION_INFO pExceptionInfo);
+
+  // Counts the crash in the signature table and decides how much to collect (one of REPORT_LEVEL_* values).
+  int ApplyReportPolicy(PCR_EXCEPTION_INFO pExceptionInfo);
+
+  // Fills the crash journal record, including the crash signature (never allocates memory).
+  void FormatCrashEvent(PCR_EXCEPTION_INFO pExceptionInfo);
 
-  // Launches the CrashSender.exe process.
-  int LaunchCrashReport(LPCTSTR szCmdLineParams, BOOL bWait, __out_opt HANDLE* phProcess);
+  // Appends the crash journal record.
+  int RecordCrashEvent();
 
-  // Record crash event to registry.
-  int RecordCrashEvent(PCR_EXCEPTION_INFO pExceptionInfo);
+  // Starts the watchdog thread checking heartbeat slots (if not started yet).
+  int StartWatchdog();
+
+  // Stops the watchdog thread.
+  void StopWatchdog();
+
+  // Generates a CR_HANG error report for a stale heartbeat slot.
+  // Returns FALSE if the report is postponed because a crash or another report is in progress.
+  BOOL ReportHang(UINT uSlot);
+  static DWORD WINAPI WatchdogThreadFunction(LPVOID lpParameter);
+
+  // Test mode: locks the process heap from a helper thread, so any heap
+  // allocation made by the crash handler before launching CrashSender.exe hangs.
+  int PoisonProcessHeap();
+
+  // Releases the process heap locked by PoisonProcessHeap().
+  void ReleaseProcessHeap();
+  static DWORD WINAPI HeapPoisonThreadFunction(LPVOID lpParameter);
 
   // Returns TRUE if CrashSender.exe process is still alive.
   BOOL IsSenderProcessAlive();
@@ -186,8 +276,16 @@ class CCrashHandler {
   // Initializes several internal fields before each crash.
   int PerCrashInit();
 
-  // Acqure exclusive access to this crash handler.
-  void CrashLock(BOOL bLock);
+  // Acqure exclusive access to this crash handler. A thread that crashes while
+  // another one owns the lock is recorded as a secondary crash before waiting.
+  void CrashLock(BOOL bLock, int nExcType = 0, PEXCEPTION_POINTERS pExceptionPtrs = NULL);
+
+  // Acquires the crash lock for a task that is not a crash, waiting for a crash
+  // being handled only if bWait is TRUE. Returns FALSE if the lock is not acquired.
+  BOOL TryCrashLock(BOOL bWait);
+
+  // Records the caller thread into a secondary crash slot of the crash description (lock-free).
+  void RecordSecondaryCrash(int nExcType, PEXCEPTION_POINTERS pExceptionPtrs);
 
   // Calls the crash callback function (if the callback function was specified by user).
   int CallBack(int nStage, CR_EXCEPTION_INFO* pExInfo);
@@ -217,9 +315,8 @@ class CCrashHandler {
   void(__cdecl* m_prevSigINT)(int);   // Previous SIGINT handler.
   void(__cdecl* m_prevSigTERM)(int);  // Previous SIGTERM handler.
 
-  // List of exception handlers installed for worker threads of this process.
-  std::map<DWORD, ThreadExceptionHandlers> m_ThreadExceptionHandlers;
-  CCritSec m_csThreadExceptionHandlers;  // Synchronization lock for m_ThreadExceptionHandlers.
+  // Count of worker threads having exception handlers installed (each thread keeps its own in TLS).
+  volatile LONG m_lThreadHandlerCount;
 
   BOOL m_bInitialized;                      // Flag telling if this object was initialized.
   CString m_sAppName;                       // Application name.
@@ -241,7 +338,28 @@ class CCrashHandler {
   std::map<CString, FileItem> m_files;      // File items to include.
   std::map<CString, CString> m_props;       // User-defined properties to include.
   std::map<CString, RegKeyInfo> m_RegKeys;  // Registry keys to dump.
+  std::map<CString, DWORD> m_PropOffsets;   // Offsets of packed property records (used for in-place updates).
+  std::map<CString, DWORD> m_StringTable;   // Offsets of interned (immutable) strings packed to shared mem.
+  DWORD m_dwWastedBytes;                    // Shared mem bytes occupied by abandoned property values.
   CCritSec m_csCrashLock;                   // Critical section used to synchronize thread access to this object.
+  volatile LONG m_lCrashOwnerThreadId;      // Thread generating the crash report (zero if none).
+  volatile LONG m_lBackgroundThreadId;      // Thread owning the crash lock as CRASH_OWNER_BACKGROUND (zero if none).
+  volatile LONG m_lCrashWaiting;            // Count of crashes waiting for a background owner of the crash lock.
+  CCritSec m_csSharedMem;                   // Synchronizes packing of file items, properties and reg keys.
+  CPropertyTable m_PropTable;               // Typed properties updated without locks.
+  CBreadcrumbs m_Breadcrumbs;               // Per-thread breadcrumb rings.
+  CSignatureTable m_SignatureTable;         // Crash counters per signature.
+  CCrashJournal m_CrashJournal;             // Crash event journal.
+  BOOL m_bReportPolicy;                     // Whether the report policy is set.
+  UINT m_uFullReportsPerDay;                // Report policy: full reports per signature per day.
+  UINT m_uSamplePercent;                    // Report policy: percentage of other crashes producing summary reports.
+  HEARTBEAT_SLOT m_HeartbeatSlots[HEARTBEAT_SLOT_COUNT];  // Heartbeat slots.
+  CCritSec m_csWatchdog;                    // Synchronizes starting/stopping the watchdog thread.
+  HANDLE m_hWatchdogThread;                 // Watchdog thread checking heartbeat slots.
+  HANDLE m_hWatchdogStop;                   // Event signaled to stop the watchdog thread.
+  DWORD m_dwHangThreadId;                   // Owner of the stale slot being reported.
+  CSnapshotQueue m_SnapshotQueue;           // Snapshots of non-fatal errors.
+  CCritSec m_csSnapshotQueue;               // Synchronizes starting the snapshot queue.
   HANDLE m_hEvent;                          // Event used to synchronize CrashRpt.dll with CrashSender.exe.
   HANDLE m_hEvent2;                         // Another event used to synchronize CrashRpt.dll with CrashSender.exe.
   CSharedMem m_SharedMem;                   // Shared memory.
@@ -249,10 +367,21 @@ class CCrashHandler {
   CSharedMem* m_pTmpSharedMem;              // Used temporarily
   CRASH_DESCRIPTION* m_pTmpCrashDesc;       // Used temporarily
   HANDLE m_hSenderProcess;                  // Handle to CrashSender.exe process.
+  HANDLE m_hStandbyProcess;                 // Standby CrashSender.exe waiting for a crash.
+  HANDLE m_hStandbyEvent;                   // Event used to wake up the standby CrashSender.exe.
   PFNCRASHCALLBACK m_pfnCallback2;          // Client crash callback.
   LPVOID m_pCallbackParam;                  // User-specified argument for callback function.
   std::wstring m_sErrorReportDirW;          // Error report directory name (wide-char).
   int m_nCallbackRetCode;                   // Return code of the callback function.
   BOOL m_bContinueExecution;                // Whether to terminate process (the default) or to continue execution after crash.
+
+  // Buffers prepared in advance, so the crash path doesn't need to allocate memory.
+  TCHAR m_szLaunchCmdLine[2 * MAX_PATH];    // CrashSender.exe command line.
+  TCHAR m_szLaunchCurDir[MAX_PATH];         // CrashSender.exe current directory.
+  TCHAR m_szErrorCaption[MAX_PATH];         // Caption of the message box shown if CrashSender.exe can't be launched.
+  CRASH_JOURNAL_RECORD m_CrashEvent;        // Crash journal record.
+  BOOL m_bCrashEventPending;                // Whether m_CrashEvent is filled, but not appended yet.
+  HANDLE m_hHeapPoisonLocked;               // Test mode: signaled when the helper thread locks/unlocks the heap.
+  HANDLE m_hHeapPoisonRelease;              // Test mode: signaled to let the helper thread unlock the heap.
 };
 }  // namespace CrashReport
\ No newline at end of file
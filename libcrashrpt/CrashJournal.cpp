@@ -0,0 +1,159 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "CrashJournal.h"
+
+namespace CrashReport {
+CCrashJournal::CCrashJournal() {
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hFileMapping = NULL;
+  m_pHeader = NULL;
+  m_pRecords = NULL;
+}
+
+CCrashJournal::~CCrashJournal() {
+  Destroy();
+}
+
+BOOL CCrashJournal::Init(LPCTSTR szFilePath) {
+  if (IsInitialized())
+    return FALSE;  // Already initialized
+
+  Repair(szFilePath);
+
+  m_hFile = CreateFile(szFilePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  // The mapping extends a new file to the full size, filling it with zeroes.
+  m_hFileMapping = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, 0, (DWORD)CRASH_JOURNAL_SIZE, NULL);
+  if (m_hFileMapping == NULL) {
+    Destroy();
+    return FALSE;
+  }
+
+  m_pHeader = (CRASH_JOURNAL_HEADER*)MapViewOfFile(m_hFileMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, CRASH_JOURNAL_SIZE);
+  if (m_pHeader == NULL) {
+    Destroy();
+    return FALSE;
+  }
+  m_pRecords = (CRASH_JOURNAL_RECORD*)(m_pHeader + 1);
+
+  if (memcmp(m_pHeader->m_uchMagic, "CRJ", 3) != 0) {
+    // New file. Another process may be doing the same, but it writes the same values.
+    m_pHeader->m_dwSize = sizeof(CRASH_JOURNAL_HEADER);
+    m_pHeader->m_dwCapacity = CRASH_JOURNAL_CAPACITY;
+    memcpy(m_pHeader->m_uchMagic, "CRJ", 3);
+  }
+  else if (m_pHeader->m_dwSize != sizeof(CRASH_JOURNAL_HEADER) || m_pHeader->m_dwCapacity != CRASH_JOURNAL_CAPACITY) {
+    // Journal produced by an incompatible CrashRpt version
+    Destroy();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CCrashJournal::IsInitialized() {
+  return m_pHeader != NULL;
+}
+
+void CCrashJournal::AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes) {
+  if (m_pHeader == NULL)
+    return;
+
+  uReservedBytes += CRASH_JOURNAL_SIZE;
+  uCommittedBytes += CRASH_JOURNAL_SIZE;
+}
+
+void CCrashJournal::Destroy() {
+  if (m_pHeader != NULL) {
+    UnmapViewOfFile(m_pHeader);
+    m_pHeader = NULL;
+    m_pRecords = NULL;
+  }
+
+  if (m_hFileMapping != NULL) {
+    CloseHandle(m_hFileMapping);
+    m_hFileMapping = NULL;
+  }
+
+  if (m_hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+  }
+}
+
+void CCrashJournal::Repair(LPCTSTR szFilePath) {
+  // Only touch the file nobody else has open
+  HANDLE hFile = CreateFile(szFilePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return;
+
+  CRASH_JOURNAL_HEADER Header;
+  DWORD dwBytesRead = 0;
+  LARGE_INTEGER liFileSize;
+  if (!GetFileSizeEx(hFile, &liFileSize) || liFileSize.QuadPart != CRASH_JOURNAL_SIZE ||
+      !ReadFile(hFile, &Header, sizeof(CRASH_JOURNAL_HEADER), &dwBytesRead, NULL) || dwBytesRead != sizeof(CRASH_JOURNAL_HEADER) ||
+      memcmp(Header.m_uchMagic, "CRJ", 3) != 0 || Header.m_dwSize != sizeof(CRASH_JOURNAL_HEADER) || Header.m_dwCapacity != CRASH_JOURNAL_CAPACITY) {
+    // Truncated or foreign file, it will be recreated by Init()
+    SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+    SetEndOfFile(hFile);
+  }
+
+  CloseHandle(hFile);
+}
+
+BOOL CCrashJournal::Append(const CRASH_JOURNAL_RECORD* pRecord) {
+  if (m_pHeader == NULL)
+    return FALSE;
+
+  // The slot may hold the oldest record, readers tell them apart by the record number.
+  LONG lIndex = InterlockedIncrement(&m_pHeader->m_lCount) - 1;
+  CRASH_JOURNAL_RECORD* pSlot = &m_pRecords[lIndex % CRASH_JOURNAL_CAPACITY];
+  InterlockedExchange(&pSlot->m_lCommitted, 0);
+  memcpy((LPBYTE)pSlot + sizeof(LONG), (const BYTE*)pRecord + sizeof(LONG), sizeof(CRASH_JOURNAL_RECORD) - sizeof(LONG));
+  InterlockedExchange(&pSlot->m_lCommitted, lIndex + 1);
+  return TRUE;
+}
+
+UINT CCrashJournal::GetRecordCount() {
+  if (m_pHeader == NULL)
+    return 0;
+
+  return (UINT)min(m_pHeader->m_lCount, (LONG)CRASH_JOURNAL_CAPACITY);
+}
+
+BOOL CCrashJournal::GetRecord(UINT uIndex, CRASH_JOURNAL_RECORD* pRecord) {
+  if (m_pHeader == NULL)
+    return FALSE;
+
+  LONG lCount = m_pHeader->m_lCount;
+  LONG lFirst = lCount > CRASH_JOURNAL_CAPACITY ? lCount - CRASH_JOURNAL_CAPACITY : 0;
+  LONG lIndex = lFirst + (LONG)uIndex;
+  if (lIndex >= lCount)
+    return FALSE;
+
+  CRASH_JOURNAL_RECORD* pSlot = &m_pRecords[lIndex % CRASH_JOURNAL_CAPACITY];
+  if (pSlot->m_lCommitted != lIndex + 1)
+    return FALSE;
+
+  // The record may be overwritten by a writer while we copy it, check it is still the same one.
+  MemoryBarrier();
+  memcpy(pRecord, pSlot, sizeof(CRASH_JOURNAL_RECORD));
+  MemoryBarrier();
+  if (pSlot->m_lCommitted != lIndex + 1)
+    return FALSE;
+
+  pRecord->m_szAppVersion[CRASH_JOURNAL_MAX_VERSION - 1] = 0;
+  return TRUE;
+}
+}  // namespace CrashReport
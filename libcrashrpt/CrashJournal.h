@@ -0,0 +1,84 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: CrashJournal.h
+// Description: Memory-mapped journal of crash events with fixed-size records.
+// Records are appended on crash with a single copy into the mapped file. When the journal
+// is full, the oldest records are overwritten.
+
+#pragma once
+#include "stdafx.h"
+
+namespace CrashReport {
+#define CRASH_JOURNAL_CAPACITY 1024      /* Count of records the journal file can hold */
+#define CRASH_JOURNAL_MAX_VERSION 24     /* Max app version length (including terminating zero) */
+
+  // Journal file header.
+  struct CRASH_JOURNAL_HEADER {
+    BYTE m_uchMagic[3];     // Magic sequence "CRJ"
+    BYTE m_uchReserved;     // Reserved, must be zero.
+    DWORD m_dwSize;         // Size of the header.
+    DWORD m_dwCapacity;     // Count of records following the header.
+    volatile LONG m_lCount; // Count of records ever claimed (record N is in slot N % capacity).
+  };
+
+  // Crash event record.
+  struct CRASH_JOURNAL_RECORD {
+    volatile LONG m_lCommitted;                       // Record number + 1 once the record is completely written.
+    int m_nExceptionType;                             // Exception type.
+    DWORD m_dwExceptionCode;                          // SEH exception code.
+    DWORD m_dwProcessId;                              // Crashed process ID.
+    ULONG64 m_ullTime;                                // UTC time (FILETIME).
+    ULONG64 m_ullSignature;                           // Crash signature.
+    WCHAR m_szAppVersion[CRASH_JOURNAL_MAX_VERSION];  // Application version.
+  };
+
+#define CRASH_JOURNAL_SIZE (sizeof(CRASH_JOURNAL_HEADER) + CRASH_JOURNAL_CAPACITY * sizeof(CRASH_JOURNAL_RECORD))
+
+  // Journal file mapped into memory for the whole lifetime of the crash handler.
+  // Several processes of the same application may append to it concurrently.
+  class CCrashJournal {
+  public:
+    // Construction/destruction
+    CCrashJournal();
+    ~CCrashJournal();
+
+    // Opens (or creates) and maps the journal file.
+    BOOL Init(LPCTSTR szFilePath);
+
+    // Whether initialized or not
+    BOOL IsInitialized();
+
+    // Unmaps the file.
+    void Destroy();
+
+    // Adds size of the mapped file to the counters (the whole file is mapped).
+    void AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes);
+
+    // Appends a record, overwriting the oldest one if the journal is full. Never allocates memory.
+    BOOL Append(const CRASH_JOURNAL_RECORD* pRecord);
+
+    // Returns count of records kept (committed or not).
+    UINT GetRecordCount();
+
+    // Copies a committed record, the oldest one has zero index. Returns FALSE
+    // if the record is being written or has just been overwritten.
+    BOOL GetRecord(UINT uIndex, CRASH_JOURNAL_RECORD* pRecord);
+
+  private:
+    // Truncates a damaged or foreign journal file if no other process uses it, so Init() recreates it.
+    static void Repair(LPCTSTR szFilePath);
+
+    HANDLE m_hFile;                   // Journal file.
+    HANDLE m_hFileMapping;            // File mapping.
+    CRASH_JOURNAL_HEADER* m_pHeader;  // Mapped header.
+    CRASH_JOURNAL_RECORD* m_pRecords; // Mapped records.
+  };
+}  // namespace CrashReport
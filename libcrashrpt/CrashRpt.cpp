@@ -6,9 +6,13 @@
 
 namespace CrashReport {
 
-HANDLE g_hModuleCrashRpt = NULL;       // Handle to CrashRpt.dll module.
-CComAutoCriticalSection g_cs;          // Critical section for thread-safe accessing error messages.
-std::map<DWORD, CString> g_sErrorMsg;  // Last error messages for each calling thread.
+#define ERROR_MSG_MAX_LENGTH 256  // Max length of the last error message (including terminating zero).
+
+HANDLE g_hModuleCrashRpt = NULL;  // Handle to CrashRpt.dll module.
+
+// Last error message of the calling thread (empty if there is no message).
+// Each thread has its own buffer, so setting the message takes no locks and allocates nothing.
+static __declspec(thread) WCHAR t_szErrorMsg[ERROR_MSG_MAX_LENGTH];
 
 // Forward declaration.
 int crClearErrorMsg();
@@ -102,10 +106,8 @@ CRASHRPTAPI(int) crUninstall() {
   // Free the crash handler object.
   delete pCrashHandler;
 
-  // Clear last error message list.
-  g_cs.Lock();
-  g_sErrorMsg.clear();
-  g_cs.Unlock();
+  // Clear last error message of this thread.
+  crClearErrorMsg();
 
   return 0;
 }
@@ -141,6 +143,9 @@ CRASHRPTAPI(int) crUninstallFromCurrentThread() {
     return 1;  // Invalid parameter?
   }
 
+  // The thread is done with its breadcrumb ring.
+  pCrashHandler->ReleaseThreadBreadcrumbs();
+
   int nResult = pCrashHandler->UnSetThreadExceptionHandlers();
   if (nResult != 0)
     return 2;  // Error?
@@ -223,12 +228,147 @@ CRASHRPTAPI(int) crAddProperty(LPCWSTR pszPropName, LPCWSTR pszPropValue) {
   }
 
   int nResult = pCrashHandler->AddProperty(CString(pszPropNameT), CString(pszPropValueT));
-  if (nResult != 0) {
+  if (nResult != 0)
+    return 2;  // Failed to add the property (the error message is set by AddProperty)
+
+  crSetErrorMsg(L"Success.");
+  return 0;
+}
+
+// Typed property setters are called at high rate, so they only touch
+// the last error message when something goes wrong.
+static int SetTypedPropertyResult(int nResult) {
+  if (nResult == 1)
     crSetErrorMsg(L"Invalid property name specified.");
-    return 2;  // Failed to add the property
+  else if (nResult == 2)
+    crSetErrorMsg(L"Property table is full.");
+  return nResult;
+}
+
+CRASHRPTAPI(int) crSetPropertyInt64(LPCWSTR pszPropName, LONGLONG llValue) {
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 3;  // No handler installed for current process?
   }
 
-  crSetErrorMsg(L"Success.");
+  return SetTypedPropertyResult(pCrashHandler->SetPropertyInt64(pszPropName, llValue));
+}
+
+CRASHRPTAPI(int) crSetPropertyDouble(LPCWSTR pszPropName, double dValue) {
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 3;  // No handler installed for current process?
+  }
+
+  return SetTypedPropertyResult(pCrashHandler->SetPropertyDouble(pszPropName, dValue));
+}
+
+CRASHRPTAPI(int) crSetPropertyString(LPCWSTR pszPropName, LPCWSTR pszPropValue) {
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 3;  // No handler installed for current process?
+  }
+
+  return SetTypedPropertyResult(pCrashHandler->SetPropertyString(pszPropName, pszPropValue));
+}
+
+CRASHRPTAPI(int) crAddBreadcrumb(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel) {
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 1;  // No handler installed for current process?
+  }
+
+  // Called at high rate, so the last error message is updated on failure only.
+  if (pCrashHandler->AddBreadcrumb(pszCategory, pszMessage, nLevel) != 0) {
+    crSetErrorMsg(L"Breadcrumb buffer is not initialized.");
+    return 2;
+  }
+
+  return 0;
+}
+
+CRASHRPTAPI(int) crSetReportPolicy(UINT uFullReportsPerDay, UINT uSamplePercent) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 1;  // No handler installed for current process?
+  }
+
+  // SetReportPolicy() sets the error message
+  if (pCrashHandler->SetReportPolicy(uFullReportsPerDay, uSamplePercent) != 0)
+    return 2;
+
+  return 0;
+}
+
+CRASHRPTAPI(int) crGetCrashHistory(PCR_CRASH_RECORD pRecords, UINT uMaxRecords, UINT* puRecordCount) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 1;  // No handler installed for current process?
+  }
+
+  // GetCrashHistory() sets the error message
+  if (pCrashHandler->GetCrashHistory(pRecords, uMaxRecords, puRecordCount) != 0)
+    return 2;
+
+  return 0;
+}
+
+CRASHRPTAPI(int) crSetHeartbeatDeadline(UINT uSlot, DWORD dwTimeoutMs) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 1;  // No handler installed for current process?
+  }
+
+  // SetHeartbeatDeadline() sets the error message
+  if (pCrashHandler->SetHeartbeatDeadline(uSlot, dwTimeoutMs) != 0)
+    return 2;
+
+  return 0;
+}
+
+CRASHRPTAPI(int) crHeartbeat(UINT uSlot) {
+  // Called from hot loops, so the error message is not touched.
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+  if (pCrashHandler == NULL)
+    return 1;
+
+  return pCrashHandler->Heartbeat(uSlot);
+}
+
+CRASHRPTAPI(int) crCaptureSnapshot(LPCWSTR pszReason) {
+  crSetErrorMsg(L"Unspecified error.");
+
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 1;  // No handler installed for current process?
+  }
+
+  // CaptureSnapshot() sets the error message
+  if (pCrashHandler->CaptureSnapshot(pszReason) != 0)
+    return 2;
+
   return 0;
 }
 
@@ -273,57 +413,62 @@ CRASHRPTAPI(int) crGenerateErrorReport(CR_EXCEPTION_INFO* pExceptionInfo) {
     return 2;
   }
 
-  return pCrashHandler->GenerateErrorReport(pExceptionInfo);
+  // Don't mix with a crash or hang report being generated by another thread.
+  // Reports generated from the crash callback already own the lock.
+  BOOL bLocked = pCrashHandler->TryCrashLock(TRUE);
+  int nResult = pCrashHandler->GenerateErrorReport(pExceptionInfo);
+  if (bLocked)
+    pCrashHandler->CrashLock(FALSE);
+
+  return nResult;
 }
 
 CRASHRPTAPI(int) crGetLastErrorMsg(LPWSTR pszBuffer, UINT uBuffSize) {
   if (pszBuffer == NULL || uBuffSize == 0)
     return -1;  // Null pointer to buffer
 
-  strconv_t strconv;
+  // No error message for current thread?
+  LPCWSTR pwszErrorMsg = t_szErrorMsg[0] != 0 ? t_szErrorMsg : L"No error.";
 
-  g_cs.Lock();
+  int size = min((int)wcslen(pwszErrorMsg), (int)uBuffSize - 1);
+  WCSNCPY_S(pszBuffer, uBuffSize, pwszErrorMsg, size);
+  pszBuffer[size] = 0;  // Zero terminator
+  return size;
+}
 
-  DWORD dwThreadId = GetCurrentThreadId();
-  std::map<DWORD, CString>::iterator it = g_sErrorMsg.find(dwThreadId);
+CRASHRPTAPI(int) crGetMemoryFootprint(PCR_MEMORY_FOOTPRINT pFootprint) {
+  crSetErrorMsg(L"Unspecified error.");
 
-  if (it == g_sErrorMsg.end()) {
-    // No error message for current thread.
-    CString sErrorMsg = _T("No error.");
-    LPCWSTR pwszErrorMsg = strconv.t2w(sErrorMsg.GetBuffer(0));
-    int size = min(sErrorMsg.GetLength(), (int)uBuffSize - 1);
-    WCSNCPY_S(pszBuffer, uBuffSize, pwszErrorMsg, size);
-    g_cs.Unlock();
-    return size;
+  if (pFootprint == NULL || pFootprint->cb != sizeof(CR_MEMORY_FOOTPRINT)) {
+    crSetErrorMsg(L"pFootprint is NULL or pFootprint->cb member is not valid.");
+    return 1;
   }
 
-  LPCWSTR pwszErrorMsg = strconv.t2w(it->second.GetBuffer(0));
-  int size = min((int)wcslen(pwszErrorMsg), (int)uBuffSize - 1);
-  WCSNCPY_S(pszBuffer, uBuffSize, pwszErrorMsg, size);
-  pszBuffer[uBuffSize - 1] = 0;  // Zero terminator
-  g_cs.Unlock();
-  return size;
+  CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+
+  if (pCrashHandler == NULL) {
+    crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+    return 2;  // No handler installed for current process?
+  }
+
+  pCrashHandler->GetMemoryFootprint(pFootprint);
+
+  crSetErrorMsg(L"Success.");
+  return 0;
 }
 
-int crSetErrorMsg(PWSTR pszErrorMsg) {
-  g_cs.Lock();
-  DWORD dwThreadId = GetCurrentThreadId();
-  g_sErrorMsg[dwThreadId] = pszErrorMsg;
-  g_cs.Unlock();
+int crSetErrorMsg(LPCWSTR pszErrorMsg) {
+  // Copy the message to the buffer of the caller thread, truncating too long messages.
+  int i = 0;
+  for (; i < ERROR_MSG_MAX_LENGTH - 1 && pszErrorMsg[i] != 0; i++)
+    t_szErrorMsg[i] = pszErrorMsg[i];
+  t_szErrorMsg[i] = 0;
   return 0;
 }
 
 int crClearErrorMsg() {
   // This method erases the error message for the caller thread.
-  // This may be required to avoid "memory leaks".
-
-  g_cs.Lock();
-  DWORD dwThreadId = GetCurrentThreadId();
-  std::map<DWORD, CString>::iterator itMsg = g_sErrorMsg.find(dwThreadId);
-  if (itMsg == g_sErrorMsg.end()) {
-    g_sErrorMsg.erase(itMsg);
-  }
-  g_cs.Unlock();
+  t_szErrorMsg[0] = 0;
   return 0;
 }
 
@@ -344,7 +489,10 @@ CRASHRPTAPI(int) crExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS
   ei.pexcptrs = ep;
   ei.code = code;
 
+  // This is a crash, so other threads crashing meanwhile are recorded as secondary crashes.
+  pCrashHandler->CrashLock(TRUE, CR_SEH_EXCEPTION, ep);
   int res = pCrashHandler->GenerateErrorReport(&ei);
+  pCrashHandler->CrashLock(FALSE);
   if (res != 0) {
     // If goes here than GenerateErrorReport() failed
     return EXCEPTION_CONTINUE_SEARCH;
@@ -543,6 +691,24 @@ CRASHRPTAPI(int) crEmulateCrash(unsigned ExceptionType) throw(...) {
       // Throw typed C++ exception.
       throw 13;
     } break;
+    case CR_HEAP_POISONED_CRASH: {
+      // Lock the heap, then cause access violation
+      CCrashHandler* pCrashHandler = CCrashHandler::GetCurrentProcessCrashHandler();
+      if (pCrashHandler == NULL) {
+        crSetErrorMsg(L"Crash handler wasn't previously installed for current process.");
+        return 1;
+      }
+
+      if (pCrashHandler->PoisonProcessHeap() != 0) {
+        crSetErrorMsg(L"Error locking process heap.");
+        return 1;
+      }
+
+      int* p = 0;
+#pragma warning(disable : 6011)  // warning C6011: Dereferencing NULL pointer 'p'
+      *p = 0;
+#pragma warning(default : 6011)
+    } break;
     case CR_STACK_OVERFLOW: {
       // Infinite recursion and stack overflow.
       CauseStackOverflow();
@@ -570,8 +736,12 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID /*lpReserved*/) {
   else if (dwReason == DLL_THREAD_DETACH) {
     // A thread is exiting cleanly.
     CrashReport::CCrashHandler* pCrashHandler = CrashReport::CCrashHandler::GetCurrentProcessCrashHandler();
-    if (pCrashHandler != NULL && pCrashHandler->IsInitialized() && (pCrashHandler->GetFlags() & CR_INST_AUTO_THREAD_HANDLERS) != 0) {
-      pCrashHandler->UnSetThreadExceptionHandlers();
+    if (pCrashHandler != NULL && pCrashHandler->IsInitialized()) {
+      // Let another thread reuse the breadcrumb ring.
+      pCrashHandler->ReleaseThreadBreadcrumbs();
+
+      if ((pCrashHandler->GetFlags() & CR_INST_AUTO_THREAD_HANDLERS) != 0)
+        pCrashHandler->UnSetThreadExceptionHandlers();
     }
   }
 
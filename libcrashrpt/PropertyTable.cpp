@@ -0,0 +1,232 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "PropertyTable.h"
+
+// How many times a reader retries to get a consistent copy of a slot value.
+#define PROP_TABLE_READ_RETRIES 1000
+
+namespace CrashReport {
+CPropertyTable::CPropertyTable() {
+  m_pHeader = NULL;
+  m_pSlots = NULL;
+}
+
+CPropertyTable::~CPropertyTable() {
+  Destroy();
+}
+
+BOOL CPropertyTable::Init(LPCTSTR szName, BOOL bOpenExisting) {
+  if (m_SharedMem.IsInitialized())
+    return FALSE;  // Already initialized
+
+  if (!m_SharedMem.Init(szName, bOpenExisting, PROP_TABLE_SIZE))
+    return FALSE;
+
+  // The table is small, so commit it entirely once. Writers never have to commit memory.
+  if (!m_SharedMem.Commit(PROP_TABLE_SIZE)) {
+    Destroy();
+    return FALSE;
+  }
+
+  m_pHeader = (PROP_TABLE_HEADER*)m_SharedMem.CreateView(0, sizeof(PROP_TABLE_HEADER));
+  m_pSlots = (PROP_SLOT*)(m_SharedMem.GetBasePtr() + SHARED_MEM_ALIGN(sizeof(PROP_TABLE_HEADER)));
+
+  if (!bOpenExisting) {
+    // Fresh file mapping is zero-filled, so all slots are free.
+    memcpy(m_pHeader->m_uchMagic, "PTB", 3);
+    m_pHeader->m_dwSize = SHARED_MEM_ALIGN(sizeof(PROP_TABLE_HEADER));
+    m_pHeader->m_dwCapacity = PROP_TABLE_CAPACITY;
+  }
+  else if (memcmp(m_pHeader->m_uchMagic, "PTB", 3) != 0 || m_pHeader->m_dwSize != SHARED_MEM_ALIGN(sizeof(PROP_TABLE_HEADER)) ||
+           m_pHeader->m_dwCapacity != PROP_TABLE_CAPACITY) {
+    // Table produced by an incompatible CrashRpt version
+    Destroy();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CPropertyTable::IsInitialized() {
+  return m_SharedMem.IsInitialized();
+}
+
+void CPropertyTable::Destroy() {
+  m_pHeader = NULL;
+  m_pSlots = NULL;
+  m_SharedMem.Destroy();
+}
+
+CString CPropertyTable::GetName() {
+  return m_SharedMem.GetName();
+}
+
+void CPropertyTable::AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes) {
+  if (!m_SharedMem.IsInitialized())
+    return;
+
+  uReservedBytes += m_SharedMem.GetReservedSize();
+  uCommittedBytes += m_SharedMem.GetSize();
+}
+
+int CPropertyTable::GetCapacity() {
+  return m_pHeader != NULL ? (int)m_pHeader->m_dwCapacity : 0;
+}
+
+PROP_SLOT* CPropertyTable::FindSlot(LPCWSTR pszName) {
+  // Calculate FNV-1a hash of the name
+  DWORD dwHash = 2166136261U;
+  for (LPCWSTR p = pszName; *p != 0; p++) {
+    dwHash ^= *p;
+    dwHash *= 16777619U;
+  }
+
+  // Linear probing
+  DWORD dwMask = m_pHeader->m_dwCapacity - 1;
+  for (DWORD i = 0; i < m_pHeader->m_dwCapacity; i++) {
+    PROP_SLOT* pSlot = &m_pSlots[(dwHash + i) & dwMask];
+
+    if (pSlot->m_lState == PROP_SLOT_FREE &&
+        InterlockedCompareExchange(&pSlot->m_lState, PROP_SLOT_CLAIMED, PROP_SLOT_FREE) == PROP_SLOT_FREE) {
+      // We own this slot, publish the name
+      pSlot->m_dwHash = dwHash;
+      CopyBoundedString(pSlot->m_szName, PROP_TABLE_MAX_NAME, pszName);
+      InterlockedIncrement(&m_pHeader->m_lUsed);
+      InterlockedExchange(&pSlot->m_lState, PROP_SLOT_READY);
+      return pSlot;
+    }
+
+    // Another writer may be publishing a name into this slot right now
+    while (pSlot->m_lState == PROP_SLOT_CLAIMED)
+      YieldProcessor();
+
+    if (pSlot->m_dwHash == dwHash && wcscmp(pSlot->m_szName, pszName) == 0)
+      return pSlot;
+  }
+
+  return NULL;  // Table is full
+}
+
+void CPropertyTable::BeginWrite(PROP_SLOT* pSlot) {
+  // Make the sequence counter odd. Concurrent writers of the same
+  // property wait for each other, writers of other properties don't.
+  for (;;) {
+    LONG lSeq = pSlot->m_lSeq;
+    if ((lSeq & 1) == 0 && InterlockedCompareExchange(&pSlot->m_lSeq, lSeq + 1, lSeq) == lSeq)
+      break;
+    YieldProcessor();
+  }
+}
+
+void CPropertyTable::EndWrite(PROP_SLOT* pSlot) {
+  // Make the sequence counter even again (full barrier)
+  InterlockedIncrement(&pSlot->m_lSeq);
+}
+
+int CPropertyTable::SetInt64(LPCWSTR pszName, LONGLONG llValue) {
+  if (m_pHeader == NULL || pszName == NULL || pszName[0] == 0 || wcslen(pszName) >= PROP_TABLE_MAX_NAME)
+    return 1;
+
+  PROP_SLOT* pSlot = FindSlot(pszName);
+  if (pSlot == NULL)
+    return 2;
+
+  BeginWrite(pSlot);
+  pSlot->m_dwType = PROP_TYPE_INT64;
+  pSlot->m_llValue = llValue;
+  EndWrite(pSlot);
+  return 0;
+}
+
+int CPropertyTable::SetDouble(LPCWSTR pszName, double dValue) {
+  if (m_pHeader == NULL || pszName == NULL || pszName[0] == 0 || wcslen(pszName) >= PROP_TABLE_MAX_NAME)
+    return 1;
+
+  PROP_SLOT* pSlot = FindSlot(pszName);
+  if (pSlot == NULL)
+    return 2;
+
+  BeginWrite(pSlot);
+  pSlot->m_dwType = PROP_TYPE_DOUBLE;
+  pSlot->m_dValue = dValue;
+  EndWrite(pSlot);
+  return 0;
+}
+
+int CPropertyTable::SetString(LPCWSTR pszName, LPCWSTR pszValue) {
+  if (m_pHeader == NULL || pszName == NULL || pszName[0] == 0 || wcslen(pszName) >= PROP_TABLE_MAX_NAME)
+    return 1;
+
+  PROP_SLOT* pSlot = FindSlot(pszName);
+  if (pSlot == NULL)
+    return 2;
+
+  // Too long values are truncated
+  BeginWrite(pSlot);
+  pSlot->m_dwType = PROP_TYPE_STRING;
+  CopyBoundedString(pSlot->m_szValue, PROP_TABLE_MAX_VALUE, pszValue != NULL ? pszValue : L"");
+  EndWrite(pSlot);
+  return 0;
+}
+
+BOOL CPropertyTable::GetProperty(int nSlot, CString& sName, CString& sValue) {
+  sName.Empty();
+  sValue.Empty();
+
+  if (m_pHeader == NULL || nSlot < 0 || nSlot >= (int)m_pHeader->m_dwCapacity)
+    return FALSE;
+
+  PROP_SLOT* pSlot = &m_pSlots[nSlot];
+  if (pSlot->m_lState != PROP_SLOT_READY)
+    return FALSE;  // Empty slot
+
+  // Take a consistent copy of the value. The writer may have been
+  // interrupted by the crash in the middle of an update, so give up after a while.
+  PROP_SLOT Copy;
+  int nRetry;
+  for (nRetry = 0; nRetry < PROP_TABLE_READ_RETRIES; nRetry++) {
+    LONG lSeq = pSlot->m_lSeq;
+    if ((lSeq & 1) == 0) {
+      MemoryBarrier();
+      memcpy(&Copy, pSlot, sizeof(PROP_SLOT));
+      MemoryBarrier();
+      if (pSlot->m_lSeq == lSeq)
+        break;
+    }
+    Sleep(0);
+  }
+
+  if (nRetry == PROP_TABLE_READ_RETRIES)
+    return FALSE;  // Torn value
+
+  Copy.m_szName[PROP_TABLE_MAX_NAME - 1] = 0;
+  Copy.m_szValue[PROP_TABLE_MAX_VALUE - 1] = 0;
+  sName = Copy.m_szName;
+
+  // Format the value now, so writers never have to.
+  switch (Copy.m_dwType) {
+    case PROP_TYPE_INT64:
+      sValue.Format(_T("%I64d"), Copy.m_llValue);
+      break;
+    case PROP_TYPE_DOUBLE:
+      sValue.Format(_T("%.17g"), Copy.m_dValue);
+      break;
+    case PROP_TYPE_STRING:
+      sValue = Copy.m_szValue;
+      break;
+    default:
+      return FALSE;  // Name claimed, but no value assigned yet
+  }
+
+  return TRUE;
+}
+}  // namespace CrashReport
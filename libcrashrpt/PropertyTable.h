@@ -0,0 +1,113 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: PropertyTable.h
+// Description: Fixed-capacity table of typed properties living in shared memory.
+// The table is written by CrashRpt.dll without locks and read by CrashReport.exe after crash.
+
+#pragma once
+#include "stdafx.h"
+#include "SharedMem.h"
+
+namespace CrashReport {
+#define PROP_TABLE_CAPACITY 256  /* Count of slots, must be a power of two */
+#define PROP_TABLE_MAX_NAME 64   /* Max property name length (including terminating zero) */
+#define PROP_TABLE_MAX_VALUE 128 /* Max string value length (including terminating zero) */
+
+  // Type of value stored in a slot.
+  enum PROP_TYPE {
+    PROP_TYPE_NONE = 0,    // No value assigned yet.
+    PROP_TYPE_INT64 = 1,   // 64-bit signed integer.
+    PROP_TYPE_DOUBLE = 2,  // Double precision float.
+    PROP_TYPE_STRING = 3   // Wide-char string.
+  };
+
+  // Slot states.
+  enum PROP_SLOT_STATE {
+    PROP_SLOT_FREE = 0,     // Slot is not used.
+    PROP_SLOT_CLAIMED = 1,  // A writer is publishing the name.
+    PROP_SLOT_READY = 2     // Name is published and never changes afterwards.
+  };
+
+  // Property table header.
+  struct PROP_TABLE_HEADER {
+    BYTE m_uchMagic[3];       // Magic sequence "PTB"
+    BYTE m_uchReserved;       // Reserved, must be zero.
+    DWORD m_dwSize;           // Size of the header.
+    DWORD m_dwCapacity;       // Count of slots following the header.
+    volatile LONG m_lUsed;    // Count of claimed slots.
+  };
+
+  // Property slot. The name is written once when the slot is claimed,
+  // the value is protected by a sequence counter (seqlock): it is odd while
+  // a writer updates the value, so a reader can detect a torn copy and retry.
+  struct PROP_SLOT {
+    volatile LONG m_lState;  // One of PROP_SLOT_STATE values.
+    volatile LONG m_lSeq;    // Sequence counter.
+    DWORD m_dwHash;          // Hash of the name.
+    DWORD m_dwType;          // One of PROP_TYPE values.
+    union {
+      LONGLONG m_llValue;  // Integer value.
+      double m_dValue;     // Float value.
+    };
+    WCHAR m_szName[PROP_TABLE_MAX_NAME];     // Property name.
+    WCHAR m_szValue[PROP_TABLE_MAX_VALUE];  // String value.
+  };
+
+#define PROP_TABLE_SIZE (SHARED_MEM_ALIGN(sizeof(PROP_TABLE_HEADER)) + PROP_TABLE_CAPACITY * sizeof(PROP_SLOT))
+
+  // Typed property table placed into its own file mapping, so it survives
+  // repacking of the crash description.
+  class CPropertyTable {
+  public:
+    // Construction/destruction
+    CPropertyTable();
+    ~CPropertyTable();
+
+    // Creates a new table or opens an existing one.
+    BOOL Init(LPCTSTR szName, BOOL bOpenExisting);
+
+    // Whether initialized or not
+    BOOL IsInitialized();
+
+    // Destroys the object
+    void Destroy();
+
+    // Returns file mapping name
+    CString GetName();
+
+    // Adds reserved and committed sizes of the file mapping to the counters.
+    void AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes);
+
+    // Set property values. Return 0 on success, 1 on invalid name, 2 if the table is full.
+    int SetInt64(LPCWSTR pszName, LONGLONG llValue);
+    int SetDouble(LPCWSTR pszName, double dValue);
+    int SetString(LPCWSTR pszName, LPCWSTR pszValue);
+
+    // Returns count of slots.
+    int GetCapacity();
+
+    // Reads the n-th slot and formats its value. Returns FALSE if the slot
+    // is empty or its value couldn't be read consistently.
+    BOOL GetProperty(int nSlot, CString& sName, CString& sValue);
+
+  private:
+    // Finds the slot for the name, claiming a free one if needed.
+    PROP_SLOT* FindSlot(LPCWSTR pszName);
+
+    // Seqlock writer side.
+    void BeginWrite(PROP_SLOT* pSlot);
+    void EndWrite(PROP_SLOT* pSlot);
+
+    CSharedMem m_SharedMem;        // Shared memory the table is placed in.
+    PROP_TABLE_HEADER* m_pHeader;  // Table header.
+    PROP_SLOT* m_pSlots;           // Array of slots.
+  };
+}  // namespace CrashReport
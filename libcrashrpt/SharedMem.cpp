@@ -15,12 +15,9 @@ namespace CrashReport {
 CSharedMem::CSharedMem() {
   // Set internal variables to their default state
   m_uSize = 0;
+  m_uReservedSize = 0;
   m_hFileMapping = NULL;
-
-  // Determine memory granularity (needed for file mapping).
-  SYSTEM_INFO si;
-  GetSystemInfo(&si);
-  m_dwAllocGranularity = si.dwAllocationGranularity;
+  m_pView = NULL;
 }
 
 CSharedMem::~CSharedMem() {
@@ -37,7 +34,8 @@ BOOL CSharedMem::Init(LPCTSTR szName, BOOL bOpenExisting, ULONG64 uSize) {
   if (!bOpenExisting) {
     ULARGE_INTEGER i;
     i.QuadPart = uSize;
-    m_hFileMapping = CreateFileMapping(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, i.HighPart, i.LowPart, szName);
+    // Only reserve the memory, pages are committed on demand.
+    m_hFileMapping = CreateFileMapping(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE | SEC_RESERVE, i.HighPart, i.LowPart, szName);
   }
   else {
     m_hFileMapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, szName);
@@ -45,12 +43,37 @@ BOOL CSharedMem::Init(LPCTSTR szName, BOOL bOpenExisting, ULONG64 uSize) {
 
   // Save name and size of the file mapping
   m_sName = szName;
-  m_uSize = uSize;
+  m_uSize = 0;
+  m_uReservedSize = uSize;
 
   // Check file mapping is valid
   if (m_hFileMapping == NULL) {
     // Failure
-    m_uSize = 0;
+    m_uReservedSize = 0;
+    return FALSE;
+  }
+
+  // Map the whole file mapping once. All subsequent accesses are plain pointer
+  // arithmetics, so packing and unpacking don't need a syscall per block.
+  m_pView = (LPBYTE)MapViewOfFile(m_hFileMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+  if (m_pView == NULL) {
+    Destroy();
+    return FALSE;
+  }
+
+  if (bOpenExisting) {
+    // Size of an existing mapping is not known in advance, so sum up
+    // the regions of the view.
+    MEMORY_BASIC_INFORMATION mbi;
+    m_uReservedSize = 0;
+    while (VirtualQuery(m_pView + m_uReservedSize, &mbi, sizeof(MEMORY_BASIC_INFORMATION)) != 0 && mbi.AllocationBase == m_pView) {
+      m_uReservedSize += mbi.RegionSize;
+    }
+  }
+
+  // The first segment is always committed, so the header is accessible.
+  if (!Commit(SHARED_MEM_COMMIT_SEGMENT)) {
+    Destroy();
     return FALSE;
   }
 
@@ -63,12 +86,11 @@ BOOL CSharedMem::IsInitialized() {
 }
 
 BOOL CSharedMem::Destroy() {
-  // Release all views of the file mapping
-  std::map<LPBYTE, LPBYTE>::iterator it;
-  for (it = m_aViewStartPtrs.begin(); it != m_aViewStartPtrs.end(); it++) {
-    UnmapViewOfFile(it->second);
+  // Release the view of the file mapping
+  if (m_pView != NULL) {
+    UnmapViewOfFile(m_pView);
+    m_pView = NULL;
   }
-  m_aViewStartPtrs.clear();
 
   // Destroy file mapping
   if (m_hFileMapping != NULL) {
@@ -77,6 +99,7 @@ BOOL CSharedMem::Destroy() {
 
   m_hFileMapping = NULL;
   m_uSize = 0;
+  m_uReservedSize = 0;
 
   return TRUE;
 }
@@ -87,29 +110,55 @@ CString CSharedMem::GetName() {
 }
 
 ULONG64 CSharedMem::GetSize() {
-  // Return file mapping size
+  // Return committed size
   return m_uSize;
 }
 
-LPBYTE CSharedMem::CreateView(DWORD dwOffset, DWORD dwLength) {
-  // Create view with specified offset from the beginning of the file mapping
-  // and return pointer to the view
-  DWORD dwBaseOffs = dwOffset - dwOffset % m_dwAllocGranularity;
-  DWORD dwDiff = dwOffset - dwBaseOffs;
-  LPBYTE pPtr = NULL;
+ULONG64 CSharedMem::GetReservedSize() {
+  return m_uReservedSize;
+}
+
+BOOL CSharedMem::Commit(ULONG64 uSize) {
+  if (uSize <= m_uSize)
+    return TRUE;  // Already committed
 
-  pPtr = (LPBYTE)MapViewOfFile(m_hFileMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, dwBaseOffs, dwLength + dwDiff);
-  m_aViewStartPtrs[pPtr + dwDiff] = pPtr;
+  // Grow by whole segments, but not beyond the reserved size
+  ULONG64 uNewSize = (uSize + SHARED_MEM_COMMIT_SEGMENT - 1) / SHARED_MEM_COMMIT_SEGMENT * SHARED_MEM_COMMIT_SEGMENT;
+  if (uNewSize > m_uReservedSize)
+    uNewSize = m_uReservedSize;
+  if (m_pView == NULL || uNewSize < uSize)
+    return FALSE;  // Doesn't fit into the reserved address space
 
-  return (pPtr + dwDiff);
+  // Committing pages that are already committed through another view is harmless.
+  if (VirtualAlloc(m_pView + m_uSize, (SIZE_T)(uNewSize - m_uSize), MEM_COMMIT, PAGE_READWRITE) == NULL)
+    return FALSE;
+
+  m_uSize = uNewSize;
+  return TRUE;
 }
 
-void CSharedMem::DestroyView(LPBYTE pViewPtr) {
-  // Release the view having specified starting pointer
-  std::map<LPBYTE, LPBYTE>::iterator it = m_aViewStartPtrs.find(pViewPtr);
-  if (it != m_aViewStartPtrs.end()) {
-    UnmapViewOfFile(it->second);
-    m_aViewStartPtrs.erase(it);
-  }
+LPBYTE CSharedMem::GetBasePtr() {
+  return m_pView;
+}
+
+LPBYTE CSharedMem::CreateView(DWORD dwOffset, DWORD dwLength) {
+  // Return pointer to the requested range of the persistent view
+  if (m_pView == NULL || (ULONG64)dwOffset + dwLength > m_uSize)
+    return NULL;
+
+  return m_pView + dwOffset;
+}
+
+LPBYTE CSharedMem::Allocate(DWORD& dwCursor, DWORD dwSize) {
+  // Keep every block 8-byte aligned
+  dwSize = SHARED_MEM_ALIGN(dwSize);
+
+  // Check there is enough space left in the mapping
+  if (m_pView == NULL || !Commit((ULONG64)dwCursor + dwSize))
+    return NULL;
+
+  LPBYTE pPtr = m_pView + dwCursor;
+  dwCursor += dwSize;
+  return pPtr;
 }
-}  // namespace CrashReport
\ No newline at end of file
+}  // namespace CrashReport
@@ -3,23 +3,34 @@
 #include "CritSec.h"
 
 namespace CrashReport {
+// Version of the crash description layout. CrashRpt.dll and CrashReport.exe must use the same version.
+#define CRASH_DESCRIPTION_VERSION 7
+
+// All blocks are aligned on 8-byte boundary.
+#define SHARED_MEM_ALIGNMENT 8
+#define SHARED_MEM_ALIGN(x) (((x) + SHARED_MEM_ALIGNMENT - 1) & ~(SHARED_MEM_ALIGNMENT - 1))
+
   // Generic block header.
   struct GENERIC_HEADER {
     BYTE m_uchMagic[3];  // Magic sequence.
-    WORD m_wSize;        // Total bytes occupied by this block.
+    BYTE m_uchReserved;  // Reserved, must be zero.
+    DWORD m_dwSize;      // Total bytes occupied by this block (including alignment padding).
   };
 
   // String block description.
   struct STRING_DESC {
     BYTE m_uchMagic[3];  // Magic sequence "STR".
-    WORD m_wSize;        // Total bytes occupied by this block.
-    // This structure is followed by (m_wSize-sizeof(STRING_DESC) bytes of string data.
+    BYTE m_uchReserved;  // Reserved, must be zero.
+    DWORD m_dwSize;      // Total bytes occupied by this block.
+    // This structure is followed by (m_dwSize-sizeof(STRING_DESC) bytes of string data.
+    // The data is padded with zero characters (for alignment and to reserve room for in-place updates).
   };
 
   // File item entry.
   struct FILE_ITEM {
     BYTE m_uchMagic[3];         // Magic sequence "FIL"
-    WORD m_wSize;               // Total bytes occupied by this block.
+    BYTE m_uchReserved;         // Reserved, must be zero.
+    DWORD m_dwSize;             // Total bytes occupied by this block.
     DWORD m_dwSrcFilePathOffs;  // Path to the original file.
     DWORD m_dwDstFileNameOffs;  // Name of the destination file.
     DWORD m_dwDescriptionOffs;  // File description.
@@ -30,7 +41,8 @@ namespace CrashReport {
   // Registry key entry.
   struct REG_KEY {
     BYTE m_uchMagic[3];         // Magic sequence "REG"
-    WORD m_wSize;               // Total bytes occupied by this block.
+    BYTE m_uchReserved;         // Reserved, must be zero.
+    DWORD m_dwSize;             // Total bytes occupied by this block.
     BOOL m_bAllowDelete;        // Should allow user to delete the file from crash report?
     DWORD m_dwRegKeyNameOffs;   // Registry key name.
     DWORD m_dwDstFileNameOffs;  // Destination file name.
@@ -39,16 +51,37 @@ namespace CrashReport {
   // User-defined property.
   struct CUSTOM_PROP {
     BYTE m_uchMagic[3];   // Magic sequence "CPR"
-    WORD m_wSize;         // Total bytes occupied by this block.
+    BYTE m_uchReserved;   // Reserved, must be zero.
+    DWORD m_dwSize;       // Total bytes occupied by this block.
     DWORD m_dwNameOffs;   // Property name.
     DWORD m_dwValueOffs;  // Property value.
   };
 
+// How much is collected for a crash (decided by the report policy).
+#define REPORT_LEVEL_FULL 0        /* Full error report */
+#define REPORT_LEVEL_SUMMARY 1     /* Error report without minidump and screenshot */
+#define REPORT_LEVEL_COUNT_ONLY 2  /* No error report, only crash counters are updated */
+
+#define MAX_SECONDARY_CRASHES 16 /* Count of threads that can be recorded as crashed during another crash */
+
+  // Thread that crashed while another thread was generating the report.
+  // The slot is published by writing a non-zero thread ID last.
+  struct SECONDARY_CRASH {
+    volatile LONG m_lThreadId;      // Thread ID (zero while the slot is being written).
+    int m_nExceptionType;           // Exception type.
+    DWORD m_dwExceptionCode;        // SEH exception code.
+    DWORD m_dwReserved;             // Reserved, must be zero.
+    ULONG64 m_ullExceptionAddress;  // Exception address (SEH exceptions only).
+  };
+
   // Crash description.
   struct CRASH_DESCRIPTION {
     BYTE m_uchMagic[3];            // Magic sequence "CRD"
-    WORD m_wSize;                  // Total bytes occupied by this block.
+    BYTE m_uchReserved;            // Reserved, must be zero.
+    DWORD m_dwSize;                // Total bytes occupied by this block.
+    DWORD m_dwFormatVersion;       // Layout version (CRASH_DESCRIPTION_VERSION).
     DWORD m_dwTotalSize;           // Total size of the whole used shared mem.
+    DWORD m_dwCommittedSize;       // Size of the committed (accessible) part of shared mem.
     UINT m_uFileItems;             // Count of file item records.
     UINT m_uRegKeyEntries;         // Count of registry key entries.
     UINT m_uCustomProps;           // Count of user-defined properties.
@@ -71,6 +104,8 @@ namespace CrashReport {
     DWORD m_dwPathToDebugHelpDllOffs;        // Offset of dbghelp path.
     DWORD m_dwCustomSenderIconOffs;        // Offset of custom Error Report dialog icon resource name.
     DWORD m_dwImageNameOffs;               // Offset to image name.
+    DWORD m_dwPropTableNameOffs;           // Offset to name of typed property table file mapping.
+    DWORD m_dwBreadcrumbsNameOffs;         // Offset to name of breadcrumb rings file mapping.
     DWORD m_dwProcessId;                   // Process ID.
     DWORD m_dwThreadId;                    // Thread ID.
     int m_nExceptionType;                  // Exception type.
@@ -81,11 +116,29 @@ namespace CrashReport {
     UINT m_uInvParamLine;                  // Invalid parameter line.
     UINT m_uFPESubcode;                    // FPE subcode.
     PEXCEPTION_POINTERS m_pExceptionPtrs;  // Exception pointers.
+    LONGLONG m_llCrashTimestamp;           // Performance counter value at the moment of crash.
+    volatile LONG m_lSecondaryCrashCount;  // Count of claimed secondary crash slots (may exceed MAX_SECONDARY_CRASHES).
+    SECONDARY_CRASH m_SecondaryCrashes[MAX_SECONDARY_CRASHES];  // Threads crashed while the report was in flight.
+    ULONG64 m_ullCrashSignature;           // Crash signature (zero if no report policy is set).
+    DWORD m_dwSignatureCountToday;         // Crashes with this signature today.
+    DWORD m_dwSignatureCountTotal;         // Crashes with this signature in total.
+    int m_nReportLevel;                    // One of REPORT_LEVEL_* values.
     BOOL
       m_bClientAppCrashed;  // If TRUE, the client app has crashed; otherwise the client has exited without crash.
   };
 
-#define SHARED_MEM_MAX_SIZE 10 * 1024 * 1024 /* 10 MB */
+  // Copies a string into a fixed-size shared memory field, truncating it to nMaxCount
+  // characters (including terminating zero). The tail of the field is zero-filled.
+  inline void CopyBoundedString(WCHAR* pszDst, int nMaxCount, LPCWSTR pszSrc) {
+    int nLen = 0;
+    while (nLen < nMaxCount - 1 && pszSrc[nLen] != 0)
+      nLen++;
+    memcpy(pszDst, pszSrc, nLen * sizeof(WCHAR));
+    memset(pszDst + nLen, 0, (nMaxCount - nLen) * sizeof(WCHAR));
+  }
+
+#define SHARED_MEM_MAX_SIZE 10 * 1024 * 1024 /* 10 MB of address space, committed on demand */
+#define SHARED_MEM_COMMIT_SEGMENT 64 * 1024 /* Shared memory is committed by 64 KB segments */
 
   // Used to share memory between CrashRpt.dll and CrashSender.exe
   class CSharedMem {
@@ -94,7 +147,8 @@ namespace CrashReport {
     CSharedMem();
     ~CSharedMem();
 
-    // Initializes shared memory
+    // Initializes shared memory. A new file mapping only reserves uSize bytes,
+    // the memory is committed on demand by SHARED_MEM_COMMIT_SEGMENT-sized segments.
     BOOL Init(LPCTSTR szName, BOOL bOpenExisting, ULONG64 uSize);
 
     // Whether initialized or not
@@ -106,20 +160,31 @@ namespace CrashReport {
     // Returns file mapping name
     CString GetName();
 
-    // Returns file mapping size
+    // Returns size of the committed (accessible) part of the file mapping
     ULONG64 GetSize();
 
-    // Creates a view and returns its start pointer
+    // Returns reserved size of the file mapping
+    ULONG64 GetReservedSize();
+
+    // Commits memory so that at least uSize bytes are accessible
+    BOOL Commit(ULONG64 uSize);
+
+    // Returns start pointer of the persistent view of the whole file mapping
+    LPBYTE GetBasePtr();
+
+    // Returns pointer to the specified range (the range is checked against the mapping size)
     LPBYTE CreateView(DWORD dwOffset, DWORD dwLength);
 
-    // Destroys a view
-    void DestroyView(LPBYTE pViewPtr);
+    // Bump-pointer allocation: reserves dwSize bytes (rounded up to SHARED_MEM_ALIGNMENT)
+    // at dwCursor and advances the cursor, committing more memory if needed.
+    // Returns NULL if the block doesn't fit into the mapping.
+    LPBYTE Allocate(DWORD& dwCursor, DWORD dwSize);
 
   private:
-    CString m_sName;                            // Name of the file mapping.
-    HANDLE m_hFileMapping;                      // Memory mapped object
-    DWORD m_dwAllocGranularity;                 // System allocation granularity
-    ULONG64 m_uSize;                            // Size of the file mapping.
-    std::map<LPBYTE, LPBYTE> m_aViewStartPtrs;  // Base of the view of the file mapping.
+    CString m_sName;        // Name of the file mapping.
+    HANDLE m_hFileMapping;  // Memory mapped object
+    ULONG64 m_uSize;        // Size of the committed part of the file mapping.
+    ULONG64 m_uReservedSize;  // Reserved size of the file mapping.
+    LPBYTE m_pView;         // Persistent view of the whole file mapping.
   };
 }
\ No newline at end of file
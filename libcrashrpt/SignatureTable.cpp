@@ -0,0 +1,152 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "SignatureTable.h"
+
+namespace CrashReport {
+CSignatureTable::CSignatureTable() {
+  m_hFile = INVALID_HANDLE_VALUE;
+  m_hFileMapping = NULL;
+  m_pTable = NULL;
+}
+
+CSignatureTable::~CSignatureTable() {
+  Destroy();
+}
+
+BOOL CSignatureTable::Init(LPCWSTR pszFilePath) {
+  if (IsInitialized())
+    return FALSE;  // Already initialized
+
+  m_hFile = CreateFileW(pszFilePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hFile == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  // The mapping extends a new file to the full size, filling it with zeroes.
+  m_hFileMapping = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, 0, (DWORD)sizeof(SIGNATURE_TABLE), NULL);
+  if (m_hFileMapping == NULL) {
+    Destroy();
+    return FALSE;
+  }
+
+  m_pTable = (SIGNATURE_TABLE*)MapViewOfFile(m_hFileMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(SIGNATURE_TABLE));
+  if (m_pTable == NULL) {
+    Destroy();
+    return FALSE;
+  }
+
+  SIGNATURE_TABLE_HEADER* pHeader = &m_pTable->m_Header;
+  if (memcmp(pHeader->m_uchMagic, "SIG", 3) != 0) {
+    // New file. Another process may be doing the same, but it writes the same values.
+    pHeader->m_dwSize = sizeof(SIGNATURE_TABLE_HEADER);
+    pHeader->m_dwCapacity = SIGNATURE_TABLE_CAPACITY;
+    memcpy(pHeader->m_uchMagic, "SIG", 3);
+  }
+  else if (pHeader->m_dwSize != sizeof(SIGNATURE_TABLE_HEADER) || pHeader->m_dwCapacity != SIGNATURE_TABLE_CAPACITY) {
+    // Table produced by an incompatible CrashRpt version
+    Destroy();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CSignatureTable::IsInitialized() {
+  return m_pTable != NULL;
+}
+
+void CSignatureTable::AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes) {
+  if (m_pTable == NULL)
+    return;
+
+  uReservedBytes += sizeof(SIGNATURE_TABLE);
+  uCommittedBytes += sizeof(SIGNATURE_TABLE);
+}
+
+void CSignatureTable::Destroy() {
+  if (m_pTable != NULL) {
+    UnmapViewOfFile(m_pTable);
+    m_pTable = NULL;
+  }
+
+  if (m_hFileMapping != NULL) {
+    CloseHandle(m_hFileMapping);
+    m_hFileMapping = NULL;
+  }
+
+  if (m_hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+  }
+}
+
+SIGNATURE_ENTRY* CSignatureTable::FindEntry(LONGLONG llSignature, DWORD dwDay) {
+  for (;;) {
+    // Prefer free entries (the first one, so processes adding the same signature
+    // compete for the same entry), then the least recently seen ones.
+    SIGNATURE_ENTRY* pVictim = NULL;
+    for (int i = 0; i < SIGNATURE_TABLE_CAPACITY; i++) {
+      SIGNATURE_ENTRY* pEntry = &m_pTable->m_Entries[i];
+      LONGLONG llEntrySignature = pEntry->m_llSignature;
+      if (llEntrySignature == llSignature)
+        return pEntry;
+
+      if (pVictim == NULL || (pVictim->m_llSignature != 0 && (llEntrySignature == 0 || pEntry->m_dwDay < pVictim->m_dwDay)))
+        pVictim = pEntry;
+    }
+
+    // Claim the victim. If another process has changed it meanwhile, look again.
+    LONGLONG llVictimSignature = pVictim->m_llSignature;
+    if (InterlockedCompareExchange64(&pVictim->m_llSignature, llSignature, llVictimSignature) != llVictimSignature)
+      continue;
+
+    // Counters of the evicted signature start over.
+    InterlockedExchange64(&pVictim->m_llDayCount, dwDay);
+    InterlockedExchange(&pVictim->m_lCountTotal, 0);
+    return pVictim;
+  }
+}
+
+int CSignatureTable::CountCrash(ULONG64 ullSignature, SIGNATURE_ENTRY* pEntry) {
+  if (m_pTable == NULL)
+    return 1;
+
+  // Current UTC day
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  DWORD dwDay = (DWORD)((((ULONG64)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / (10000000ULL * 60 * 60 * 24));
+
+  SIGNATURE_ENTRY* pFound = FindEntry((LONGLONG)ullSignature, dwDay);
+
+  // Day and today's count change at once, so a new day resets the count exactly once.
+  LONGLONG llDayCount = pFound->m_llDayCount;
+  LONGLONG llNewDayCount;
+  for (;;) {
+    SIGNATURE_ENTRY Current;
+    Current.m_llDayCount = llDayCount;
+    Current.m_dwCountToday = Current.m_dwDay == dwDay ? Current.m_dwCountToday + 1 : 1;
+    Current.m_dwDay = dwDay;
+    llNewDayCount = Current.m_llDayCount;
+
+    LONGLONG llPrev = InterlockedCompareExchange64(&pFound->m_llDayCount, llNewDayCount, llDayCount);
+    if (llPrev == llDayCount)
+      break;
+    llDayCount = llPrev;
+  }
+  LONG lCountTotal = InterlockedIncrement(&pFound->m_lCountTotal);
+
+  pEntry->m_llSignature = (LONGLONG)ullSignature;
+  pEntry->m_llDayCount = llNewDayCount;
+  pEntry->m_lCountTotal = lCountTotal;
+  pEntry->m_dwReserved = 0;
+  return 0;
+}
+}  // namespace CrashReport
@@ -0,0 +1,83 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: SignatureTable.h
+// Description: Small memory-mapped table counting crashes per crash signature.
+// It is updated by the crash handler to decide how much to collect for repeated crashes.
+
+#pragma once
+#include "stdafx.h"
+
+namespace CrashReport {
+#define SIGNATURE_TABLE_CAPACITY 256 /* Count of signatures remembered; the least recently seen is evicted */
+
+  // Signature table file header.
+  struct SIGNATURE_TABLE_HEADER {
+    BYTE m_uchMagic[3];   // Magic sequence "SIG"
+    BYTE m_uchReserved;   // Reserved, must be zero.
+    DWORD m_dwSize;       // Size of the header.
+    DWORD m_dwCapacity;   // Count of entries following the header.
+    DWORD m_dwReserved;   // Reserved, must be zero.
+  };
+
+  // Crash counters of a signature.
+  struct SIGNATURE_ENTRY {
+    volatile LONGLONG m_llSignature;  // Crash signature (zero if the entry is free).
+    union {
+      struct {
+        DWORD m_dwDay;                // Day the signature was last seen (days since 1601-01-01 UTC).
+        DWORD m_dwCountToday;         // Crashes with this signature on that day.
+      };
+      volatile LONGLONG m_llDayCount;  // Both of the above, updated at once.
+    };
+    volatile LONG m_lCountTotal;      // Crashes with this signature since the entry was created.
+    DWORD m_dwReserved;               // Reserved, must be zero.
+  };
+
+  // Whole signature table file.
+  struct SIGNATURE_TABLE {
+    SIGNATURE_TABLE_HEADER m_Header;
+    SIGNATURE_ENTRY m_Entries[SIGNATURE_TABLE_CAPACITY];
+  };
+
+  // Signature table file mapped into memory for the whole lifetime of the crash handler.
+  // Several processes of the same application may count crashes concurrently, entries
+  // are updated with interlocked operations, so counting on crash takes no locks and does no file I/O.
+  class CSignatureTable {
+  public:
+    // Construction/destruction
+    CSignatureTable();
+    ~CSignatureTable();
+
+    // Opens (or creates) and maps the table file.
+    BOOL Init(LPCWSTR pszFilePath);
+
+    // Whether initialized or not
+    BOOL IsInitialized();
+
+    // Unmaps the file.
+    void Destroy();
+
+    // Adds size of the mapped file to the counters (the whole file is mapped).
+    void AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes);
+
+    // Counts one more crash with the given signature. On success, returns 0
+    // and copies the updated counters into *pEntry.
+    int CountCrash(ULONG64 ullSignature, SIGNATURE_ENTRY* pEntry);
+
+  private:
+    // Returns the entry for the signature, claiming a free or the least recently seen entry if needed.
+    SIGNATURE_ENTRY* FindEntry(LONGLONG llSignature, DWORD dwDay);
+
+    HANDLE m_hFile;             // Table file.
+    HANDLE m_hFileMapping;      // File mapping.
+    SIGNATURE_TABLE* m_pTable;  // Mapped table.
+  };
+}  // namespace CrashReport
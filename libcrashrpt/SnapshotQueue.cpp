@@ -0,0 +1,311 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+#include "stdafx.h"
+#include "SnapshotQueue.h"
+#include "Utility.h"
+#include "strconv.h"
+
+namespace CrashReport {
+// Formats UTC time (FILETIME) as ISO 8601 string with milliseconds.
+static CString FormatTime(ULONG64 ullTime) {
+  FILETIME ft;
+  ft.dwLowDateTime = (DWORD)ullTime;
+  ft.dwHighDateTime = (DWORD)(ullTime >> 32);
+
+  SYSTEMTIME st;
+  memset(&st, 0, sizeof(SYSTEMTIME));
+  FileTimeToSystemTime(&ft, &st);
+
+  CString sTime;
+  sTime.Format(_T("%04u-%02u-%02uT%02u:%02u:%02u.%03uZ"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+  return sTime;
+}
+
+CSnapshotQueue::CSnapshotQueue() {
+  m_pRecords = NULL;
+  m_lEnqueuePos = 0;
+  m_lDequeuePos = 0;
+  m_lDropped = 0;
+  m_lCaptures = 0;
+  m_lStopped = 0;
+  m_lFileSeq = 0;
+  m_hFlushThread = NULL;
+  m_hFlushEvent = NULL;
+  m_hStopEvent = NULL;
+  m_pPropTable = NULL;
+  m_pBreadcrumbs = NULL;
+}
+
+CSnapshotQueue::~CSnapshotQueue() {
+  Destroy();
+}
+
+BOOL CSnapshotQueue::Init(LPCWSTR pszFolder, LPCWSTR pszAppName, LPCWSTR pszAppVersion, CPropertyTable* pPropTable, CBreadcrumbs* pBreadcrumbs) {
+  if (IsInitialized())
+    return FALSE;  // Already initialized
+
+  m_sFolder = pszFolder;
+  m_sAppName = pszAppName;
+  m_sAppVersion = pszAppVersion;
+  m_pPropTable = pPropTable;
+  m_pBreadcrumbs = pBreadcrumbs;
+
+  if (!Utility::CreateFolder(m_sFolder))
+    return FALSE;
+
+  SNAPSHOT_RECORD* pRecords =
+      (SNAPSHOT_RECORD*)VirtualAlloc(NULL, SNAPSHOT_QUEUE_CAPACITY * sizeof(SNAPSHOT_RECORD), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (pRecords == NULL)
+    return FALSE;
+
+  // Every record is free for the producer of the same position.
+  for (LONG i = 0; i < SNAPSHOT_QUEUE_CAPACITY; i++)
+    pRecords[i].m_lSeq = i;
+  m_lEnqueuePos = 0;
+  m_lDequeuePos = 0;
+  m_lDropped = 0;
+  m_lStopped = 0;
+
+  m_hFlushEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (m_hFlushEvent == NULL || m_hStopEvent == NULL) {
+    VirtualFree(pRecords, 0, MEM_RELEASE);
+    Destroy();
+    return FALSE;
+  }
+
+  // Producers check m_pRecords without locking, so the records must be visible first.
+  MemoryBarrier();
+  m_pRecords = pRecords;
+
+  m_hFlushThread = CreateThread(NULL, 0, FlushThreadFunction, this, 0, NULL);
+  if (m_hFlushThread == NULL) {
+    Destroy();
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL CSnapshotQueue::IsInitialized() {
+  return m_pRecords != NULL;
+}
+
+void CSnapshotQueue::AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes) {
+  if (m_pRecords == NULL)
+    return;
+
+  uReservedBytes += SNAPSHOT_QUEUE_CAPACITY * sizeof(SNAPSHOT_RECORD);
+  uCommittedBytes += SNAPSHOT_QUEUE_CAPACITY * sizeof(SNAPSHOT_RECORD);
+}
+
+void CSnapshotQueue::Destroy() {
+  if (m_hFlushThread != NULL) {
+    SetEvent(m_hStopEvent);
+    WaitForSingleObject(m_hFlushThread, INFINITE);
+    CloseHandle(m_hFlushThread);
+    m_hFlushThread = NULL;
+  }
+
+  if (m_pRecords != NULL) {
+    // Refuse new captures and wait for the ones in progress, they write to the records.
+    // Both sides use interlocked operations, so either a capture sees the flag or we see the capture.
+    InterlockedExchange(&m_lStopped, 1);
+    while (m_lCaptures != 0)
+      Sleep(1);
+
+    // Don't lose what is still queued
+    Flush();
+    VirtualFree(m_pRecords, 0, MEM_RELEASE);
+    m_pRecords = NULL;
+  }
+
+  if (m_hFlushEvent != NULL) {
+    CloseHandle(m_hFlushEvent);
+    m_hFlushEvent = NULL;
+  }
+
+  if (m_hStopEvent != NULL) {
+    CloseHandle(m_hStopEvent);
+    m_hStopEvent = NULL;
+  }
+}
+
+BOOL CSnapshotQueue::Capture(LPCWSTR pszReason, DWORD dwFramesToSkip) {
+  BOOL bCapture = FALSE;
+  SNAPSHOT_RECORD* pRecord = NULL;
+  LONG lPos = 0;
+  FILETIME ft;
+  PVOID aFrames[SNAPSHOT_MAX_FRAMES];
+  USHORT uFrameCount = 0;
+
+  // Keeps Destroy() from freeing the records until we are done.
+  InterlockedIncrement(&m_lCaptures);
+  if (m_lStopped != 0 || m_pRecords == NULL)
+    goto cleanup;
+
+  // Claim the record at the enqueue position. Positions wrap around, so they are compared by difference.
+  lPos = m_lEnqueuePos;
+  for (;;) {
+    pRecord = &m_pRecords[lPos & (SNAPSHOT_QUEUE_CAPACITY - 1)];
+    LONG lDiff = (LONG)((ULONG)pRecord->m_lSeq - (ULONG)lPos);
+    if (lDiff == 0) {
+      LONG lPrev = InterlockedCompareExchange(&m_lEnqueuePos, (LONG)((ULONG)lPos + 1), lPos);
+      if (lPrev == lPos)
+        break;  // Claimed
+      lPos = lPrev;
+    }
+    else if (lDiff < 0) {
+      // The flusher hasn't freed the record yet, so the queue is full.
+      InterlockedIncrement(&m_lDropped);
+      goto cleanup;
+    }
+    else {
+      lPos = m_lEnqueuePos;  // Another producer claimed it
+    }
+  }
+
+  GetSystemTimeAsFileTime(&ft);
+  pRecord->m_ullTime = ((ULONG64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  pRecord->m_dwThreadId = GetCurrentThreadId();
+  CopyBoundedString(pRecord->m_szReason, SNAPSHOT_MAX_REASON, pszReason != NULL ? pszReason : L"");
+
+  // Skip this function as well
+  uFrameCount = CaptureStackBackTrace(dwFramesToSkip + 1, SNAPSHOT_MAX_FRAMES, aFrames, NULL);
+  for (USHORT i = 0; i < uFrameCount; i++)
+    pRecord->m_ullFrames[i] = (ULONG64)(ULONG_PTR)aFrames[i];
+  pRecord->m_dwFrameCount = uFrameCount;
+
+  pRecord->m_dwBreadcrumbCount = m_pBreadcrumbs != NULL ? m_pBreadcrumbs->CopyThreadEntries(pRecord->m_Breadcrumbs, SNAPSHOT_MAX_BREADCRUMBS) : 0;
+
+  // Publish the record
+  InterlockedExchange(&pRecord->m_lSeq, (LONG)((ULONG)lPos + 1));
+
+  // Wake up the flusher early if the queue is getting full
+  if ((LONG)((ULONG)lPos - (ULONG)m_lDequeuePos) == SNAPSHOT_QUEUE_CAPACITY / 2)
+    SetEvent(m_hFlushEvent);
+
+  bCapture = TRUE;
+
+cleanup:
+
+  InterlockedDecrement(&m_lCaptures);
+  return bCapture;
+}
+
+CString CSnapshotQueue::FormatFrame(ULONG64 ullAddress, std::map<HMODULE, CString>& ModuleNames) {
+  CString sFrame;
+  HMODULE hModule = NULL;
+  if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)(ULONG_PTR)ullAddress,
+                          &hModule)) {
+    sFrame.Format(_T("0x%I64x"), ullAddress);
+    return sFrame;
+  }
+
+  std::map<HMODULE, CString>::iterator it = ModuleNames.find(hModule);
+  if (it == ModuleNames.end()) {
+    WCHAR szModule[MAX_PATH] = L"";
+    GetModuleFileNameW(hModule, szModule, MAX_PATH);
+    it = ModuleNames.insert(std::make_pair(hModule, CString(PathFindFileNameW(szModule)))).first;
+  }
+
+  sFrame.Format(_T("%s+0x%I64x"), it->second.GetString(), ullAddress - (ULONG64)(ULONG_PTR)hModule);
+  return sFrame;
+}
+
+void CSnapshotQueue::Flush() {
+  CAutoLock lock(&m_csFlush);
+
+  if (m_pRecords == NULL)
+    return;
+
+  CString sSnapshots;
+  CString sLine;
+  int nCount = 0;
+  std::map<HMODULE, CString> ModuleNames;
+  SNAPSHOT_RECORD Record;
+
+  for (;;) {
+    SNAPSHOT_RECORD* pRecord = &m_pRecords[m_lDequeuePos & (SNAPSHOT_QUEUE_CAPACITY - 1)];
+    if (pRecord->m_lSeq != (LONG)((ULONG)m_lDequeuePos + 1))
+      break;  // Not published yet
+
+    // Copy the record and give it back to producers as soon as possible
+    MemoryBarrier();
+    memcpy(&Record, pRecord, sizeof(SNAPSHOT_RECORD));
+    InterlockedExchange(&pRecord->m_lSeq, (LONG)((ULONG)m_lDequeuePos + SNAPSHOT_QUEUE_CAPACITY));
+    m_lDequeuePos = (LONG)((ULONG)m_lDequeuePos + 1);
+    nCount++;
+
+    Record.m_szReason[SNAPSHOT_MAX_REASON - 1] = 0;
+    sLine.Format(_T("\r\nSnapshot: %s thread=%u reason=%s\r\n"), FormatTime(Record.m_ullTime).GetString(), Record.m_dwThreadId, Record.m_szReason);
+    sSnapshots += sLine;
+
+    for (DWORD i = 0; i < Record.m_dwFrameCount && i < SNAPSHOT_MAX_FRAMES; i++)
+      sSnapshots += _T("  at ") + FormatFrame(Record.m_ullFrames[i], ModuleNames) + _T("\r\n");
+
+    for (DWORD i = 0; i < Record.m_dwBreadcrumbCount && i < SNAPSHOT_MAX_BREADCRUMBS; i++) {
+      BREADCRUMB_ENTRY& be = Record.m_Breadcrumbs[i];
+      sLine.Format(_T("  breadcrumb: %s level=%d %s: %s\r\n"), FormatTime(m_pBreadcrumbs->TimestampToTime(be.m_llTimestamp)).GetString(), be.m_nLevel,
+                   be.m_szCategory, be.m_szMessage);
+      sSnapshots += sLine;
+    }
+  }
+
+  LONG lDropped = InterlockedExchange(&m_lDropped, 0);
+  if (nCount == 0 && lDropped == 0)
+    return;  // Nothing to write
+
+  // Properties are process-wide, so they are written once per file rather than per snapshot.
+  CString sFile;
+  sFile.Format(_T("CrashRpt snapshots\r\nAppName: %s\r\nAppVersion: %s\r\nProcessId: %u\r\nSnapshots: %d\r\nDropped: %d\r\n"), m_sAppName.GetString(),
+               m_sAppVersion.GetString(), GetCurrentProcessId(), nCount, lDropped);
+
+  if (m_pPropTable != NULL) {
+    CString sName;
+    CString sValue;
+    for (int i = 0; i < m_pPropTable->GetCapacity(); i++) {
+      if (m_pPropTable->GetProperty(i, sName, sValue))
+        sFile += _T("Property: ") + sName + _T("=") + sValue + _T("\r\n");
+    }
+  }
+
+  sFile += sSnapshots;
+
+  // One file per batch, named after the time of flush. Two flushes may happen
+  // within the same millisecond (the last one is made by Destroy()), so the name has a sequence number too.
+  SYSTEMTIME st;
+  GetSystemTime(&st);
+  CString sFileName;
+  sFileName.Format(_T("%s\\snapshots_%04u%02u%02u-%02u%02u%02u%03u_%u_%d.txt"), m_sFolder.GetString(), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute,
+                   st.wSecond, st.wMilliseconds, GetCurrentProcessId(), m_lFileSeq++);
+
+  HANDLE hFile = CreateFile(sFileName, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return;
+
+  strconv_t strconv;
+  LPCSTR pszUtf8 = strconv.w2utf8(sFile);
+  DWORD dwBytesWritten = 0;
+  WriteFile(hFile, pszUtf8, (DWORD)strlen(pszUtf8), &dwBytesWritten, NULL);
+  CloseHandle(hFile);
+}
+
+DWORD WINAPI CSnapshotQueue::FlushThreadFunction(LPVOID lpParameter) {
+  CSnapshotQueue* pQueue = (CSnapshotQueue*)lpParameter;
+
+  HANDLE hWaitHandles[2] = {pQueue->m_hStopEvent, pQueue->m_hFlushEvent};
+  while (WaitForMultipleObjects(2, hWaitHandles, FALSE, SNAPSHOT_FLUSH_INTERVAL) != WAIT_OBJECT_0)
+    pQueue->Flush();
+
+  return 0;
+}
+}  // namespace CrashReport
@@ -0,0 +1,91 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: SnapshotQueue.h
+// Description: Bounded in-process queue of lightweight snapshots (stack, breadcrumbs) of non-fatal errors.
+// Any thread adds snapshots without locks; a background thread writes them to a file in batches.
+
+#pragma once
+#include "stdafx.h"
+#include "Breadcrumbs.h"
+#include "PropertyTable.h"
+#include "CritSec.h"
+
+namespace CrashReport {
+#define SNAPSHOT_QUEUE_CAPACITY 512     /* Count of records in the queue, must be a power of two */
+#define SNAPSHOT_MAX_FRAMES 32          /* Max count of stack frames in a snapshot */
+#define SNAPSHOT_MAX_REASON 64          /* Max reason length (including terminating zero) */
+#define SNAPSHOT_MAX_BREADCRUMBS 4      /* Count of the latest breadcrumbs of the thread copied into a snapshot */
+#define SNAPSHOT_FLUSH_INTERVAL 10000   /* How often queued snapshots are written to a file (in milliseconds) */
+
+  // Snapshot record. The sequence counter tells whose turn it is to use the record:
+  // it equals the queue position when the record is free for a producer, and position + 1
+  // when the record is filled and ready for the flusher.
+  struct SNAPSHOT_RECORD {
+    volatile LONG m_lSeq;                                        // Sequence counter.
+    DWORD m_dwThreadId;                                          // Thread that captured the snapshot.
+    ULONG64 m_ullTime;                                           // UTC time (FILETIME).
+    DWORD m_dwFrameCount;                                        // Count of stack frames.
+    DWORD m_dwBreadcrumbCount;                                   // Count of breadcrumbs.
+    ULONG64 m_ullFrames[SNAPSHOT_MAX_FRAMES];                    // Return addresses, innermost first.
+    WCHAR m_szReason[SNAPSHOT_MAX_REASON];                       // Reason given by the caller.
+    BREADCRUMB_ENTRY m_Breadcrumbs[SNAPSHOT_MAX_BREADCRUMBS];    // Latest breadcrumbs of the thread, oldest first.
+  };
+
+  // Queue of snapshots and its flusher thread.
+  class CSnapshotQueue {
+  public:
+    // Construction/destruction
+    CSnapshotQueue();
+    ~CSnapshotQueue();
+
+    // Allocates the queue and starts the flusher thread writing files to the given folder.
+    BOOL Init(LPCWSTR pszFolder, LPCWSTR pszAppName, LPCWSTR pszAppVersion, CPropertyTable* pPropTable, CBreadcrumbs* pBreadcrumbs);
+
+    // Whether initialized or not
+    BOOL IsInitialized();
+
+    // Stops the flusher thread, waits for captures in progress, writes the remaining snapshots and frees the queue.
+    void Destroy();
+
+    // Adds size of the record array to the counters (it is committed at once).
+    void AddFootprint(ULONG64& uReservedBytes, ULONG64& uCommittedBytes);
+
+    // Captures a snapshot of the caller thread, skipping dwFramesToSkip innermost frames.
+    // Never allocates memory and takes no locks. Returns FALSE if the queue is full.
+    BOOL Capture(LPCWSTR pszReason, DWORD dwFramesToSkip);
+
+  private:
+    // Writes all queued snapshots to a new file.
+    void Flush();
+
+    // Formats a return address as module+offset.
+    CString FormatFrame(ULONG64 ullAddress, std::map<HMODULE, CString>& ModuleNames);
+
+    static DWORD WINAPI FlushThreadFunction(LPVOID lpParameter);
+
+    SNAPSHOT_RECORD* m_pRecords;    // Array of records.
+    volatile LONG m_lEnqueuePos;    // Next position to be claimed by a producer.
+    volatile LONG m_lDequeuePos;    // Next position to be read by the flusher.
+    volatile LONG m_lDropped;       // Count of snapshots dropped because the queue was full.
+    volatile LONG m_lCaptures;      // Count of Capture() calls in progress, Destroy() waits for them.
+    volatile LONG m_lStopped;       // Set by Destroy(), new captures are refused.
+    LONG m_lFileSeq;                // Sequence number of the next file (only the flusher uses it).
+    CCritSec m_csFlush;             // Serializes Flush() calls of the flusher thread and Destroy().
+    HANDLE m_hFlushThread;          // Flusher thread.
+    HANDLE m_hFlushEvent;           // Signaled when the queue is half full.
+    HANDLE m_hStopEvent;            // Signaled to stop the flusher thread.
+    CString m_sFolder;              // Folder the files are written to.
+    CString m_sAppName;             // Application name.
+    CString m_sAppVersion;          // Application version.
+    CPropertyTable* m_pPropTable;   // Typed properties written once per file.
+    CBreadcrumbs* m_pBreadcrumbs;   // Used to convert breadcrumb timestamps.
+  };
+}  // namespace CrashReport
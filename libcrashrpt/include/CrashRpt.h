@@ -21,6 +21,10 @@
 #define __in_opt
 #endif
 
+#ifndef __out
+#define __out
+#endif
+
 #ifndef __out_ecount_z
 #define __out_ecount_z(x)
 #endif
@@ -47,6 +51,7 @@
 #define CR_CPP_SIGINT 10             // C++ SIGINT signal (CTRL+C).
 #define CR_CPP_SIGSEGV 11            // C++ SIGSEGV signal (invalid storage access).
 #define CR_CPP_SIGTERM 12            // C++ SIGTERM signal (termination request).
+#define CR_HANG 13                   // Hang detected by the heartbeat watchdog.
 
 namespace CrashReport {
 
@@ -82,6 +87,7 @@ namespace CrashReport {
   *     - CR_CPP_SIGINT                C++ SIGINT signal
   *     - CR_CPP_SIGSEGV               C++ invalid storage access
   *     - CR_CPP_SIGTERM               C++ termination request
+  *     - CR_HANG                      Hang detected by the heartbeat watchdog (see crSetHeartbeatDeadline())
   *
   *  code [in, optional]
   *      Used if exctype is CR_SEH_EXCEPTION and represents the SEH exception code.
@@ -282,6 +288,7 @@ CRASHRPTAPI(int) crSetCrashCallback(PFNCRASHCALLBACK pfnCallbackFunc, LPVOID lpP
 #define CR_INST_NO_MINIDUMP 0x20000            // Do not include minidump file to crash report.
 #define CR_INST_STORE_ZIP_ARCHIVES 0x80000     // CrashRpt should store both uncompressed error report files and ZIP archives.
 #define CR_INST_AUTO_THREAD_HANDLERS 0x800000  // If this flag is set, installs exception handlers for newly created threads automatically.
+#define CR_INST_PRESPAWN_SENDER 0x1000000      // Start CrashReport.exe in advance and keep it waiting for a crash.
 
 /*
 * This structure defines the general information used by crInstallW() function.
@@ -345,6 +352,12 @@ CRASHRPTAPI(int) crSetCrashCallback(PFNCRASHCALLBACK pfnCallbackFunc, LPVOID lpP
 *            all threads that will be created in the future. This flag only works if CrashRpt is compiled as a DLL, it does
 *            not work if you compile CrashRpt as static library.
 *
+*        CR_INST_PRESPAWN_SENDER
+*            Starts a standby CrashReport.exe process on install (and after each error report) that waits until
+*            the crash happens. On crash, the handler only signals an event instead of creating a new process,
+*            so the crash dump is taken sooner. The standby process exits when the application exits or crUninstall()
+*            is called. If the standby process is not running at the moment of crash, CrashReport.exe is launched as usual.
+*
 * pszDebugHelpDLL [in, optional]
 *     This parameter defines the location of the dbghelp.dll to load.
 *     If this parameter is NULL, the dbghelp.dll is searched using the default search sequence.
@@ -608,6 +621,170 @@ CRASHRPTAPI(int) crAddScreenshot(DWORD dwFlags, int nJpegQuality);
   */
 CRASHRPTAPI(int) crAddProperty(LPCWSTR pszPropName, LPCWSTR pszPropValue);
 
+/*
+  * Sets a typed property of the crash report.
+  * These functions return zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [in] pszPropName   Name of the property, required. Must be shorter than 64 characters.
+  *  [in] llValue, dValue, pszPropValue  Value of the property.
+  *
+  *  remarks:
+  *
+  *  These functions are intended for values updated at high rate, like counters or the current state of a worker.
+  *  Properties are stored in a fixed-size table of 256 entries in shared memory. Updating a property takes no locks
+  *  and doesn't format the value, formatting is done by CrashReport.exe when the crash report is generated.
+  *  Several threads may update properties concurrently. String values longer than 127 characters are truncated.
+  *
+  *  On success the last error message is not updated, to keep the calls cheap.
+  *
+  *  Typed properties are listed under \<CustomProps\> tag of the XML file together with properties added by crAddProperty().
+  *  If both functions are used with the same name, the typed value wins.
+  */
+CRASHRPTAPI(int) crSetPropertyInt64(LPCWSTR pszPropName, LONGLONG llValue);
+CRASHRPTAPI(int) crSetPropertyDouble(LPCWSTR pszPropName, double dValue);
+CRASHRPTAPI(int) crSetPropertyString(LPCWSTR pszPropName, LPCWSTR pszPropValue);
+
+// Breadcrumb levels used by crAddBreadcrumb()
+#define CR_BL_DEBUG 0    // Debug message.
+#define CR_BL_INFO 1     // Informational message.
+#define CR_BL_WARNING 2  // Warning.
+#define CR_BL_ERROR 3    // Error.
+
+/*
+  * Adds a breadcrumb (a short record of an event preceding the crash).
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [in] pszCategory  Category of the event, optional. Truncated to 19 characters.
+  *  [in] pszMessage   Event message, optional. Truncated to 95 characters.
+  *  [in] nLevel       Severity level, one of CR_BL_* constants.
+  *
+  *  remarks:
+  *
+  *  Breadcrumbs are written to per-thread ring buffers in shared memory, each thread keeps
+  *  its last 128 breadcrumbs (up to 32 threads get a ring of their own, other threads share rings).
+  *  The call takes no locks and makes no system calls, so it can be used on hot paths instead of logging.
+  *
+  *  When crash occurs, CrashReport.exe reads the rings, merges them by time and writes them
+  *  under \<Breadcrumbs\> tag of the crash description XML file.
+  *
+  *  On success the last error message is not updated, to keep the call cheap.
+  */
+CRASHRPTAPI(int) crAddBreadcrumb(LPCWSTR pszCategory, LPCWSTR pszMessage, int nLevel);
+
+/*
+  * Sets the policy deciding how much is collected for repeated crashes.
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [in] uFullReportsPerDay  Count of full error reports generated per crash signature per day.
+  *  [in] uSamplePercent      Percentage (0-100) of crashes above the daily limit that still produce a summary report.
+  *
+  *  remarks:
+  *
+  *  By default, every crash produces a full error report. Once a policy is set, the crash handler computes
+  *  a signature of each crash from the exception type, exception code, faulting module name and offset in the module.
+  *  Crash counters are kept per signature in the signatures.dat file located in the error report folder.
+  *
+  *  The first uFullReportsPerDay crashes with the same signature during a day (UTC) produce full error reports.
+  *  After that, uSamplePercent percent of crashes produce summary reports, which include neither the minidump
+  *  nor the screenshot. Other crashes only increment the counters and CrashReport.exe isn't launched at all.
+  *
+  *  The signature and counters are written to the crash description XML file as \<CrashSignature\>,
+  *  \<SignatureCountToday\>, \<SignatureCountTotal\> and \<ReportLevel\> tags.
+  *  Manually generated error reports are not affected by the policy.
+  */
+CRASHRPTAPI(int) crSetReportPolicy(UINT uFullReportsPerDay, UINT uSamplePercent);
+
+/*
+* This structure describes a crash event returned by crGetCrashHistory().
+*
+* ullTime is the UTC time of the crash (FILETIME).
+* nExceptionType and dwExceptionCode describe the exception the same way as CR_EXCEPTION_INFO does.
+* dwProcessId is the ID of the crashed process.
+* ullSignature is the crash signature (see crSetReportPolicy()).
+* szAppVersion is the application version, truncated to 23 characters.
+*/
+typedef struct tagCR_CRASH_RECORD {
+  ULONG64 ullTime;            // Crash time (UTC FILETIME).
+  int nExceptionType;         // Exception type.
+  DWORD dwExceptionCode;      // SEH exception code.
+  DWORD dwProcessId;          // Crashed process ID.
+  ULONG64 ullSignature;       // Crash signature.
+  WCHAR szAppVersion[24];     // Application version.
+} CR_CRASH_RECORD;
+
+typedef CR_CRASH_RECORD* PCR_CRASH_RECORD;
+
+/*
+  * Reads the history of crashes of the application.
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [out] pRecords      Array receiving the records, optional.
+  *  [in]  uMaxRecords   Count of elements in pRecords array.
+  *  [out] puRecordCount Receives the count of records copied, or the count of available records if pRecords is NULL. Required.
+  *
+  *  remarks:
+  *
+  *  Every crash is recorded to the crashjournal.dat file located in the error report folder, including crashes whose
+  *  report is canceled by the crash callback. The file is shared by all processes of the application and keeps up to
+  *  1024 records; the newest record overwrites the oldest one when it gets full.
+  *
+  *  Records are returned from the oldest to the newest. If uMaxRecords is less than the count of available records,
+  *  the newest uMaxRecords records are returned. Call the function with pRecords set to NULL to get the count of records.
+  */
+CRASHRPTAPI(int) crGetCrashHistory(PCR_CRASH_RECORD pRecords, UINT uMaxRecords, UINT* puRecordCount);
+
+/*
+  * Arms or disarms a heartbeat slot watched for hangs.
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [in] uSlot        Index of the heartbeat slot, from 0 to 63.
+  *  [in] dwTimeoutMs  Max interval between heartbeats in milliseconds, or 0 to disarm the slot.
+  *
+  *  remarks:
+  *
+  *  The calling thread becomes the owner of the slot and is expected to call crHeartbeat() with the same slot
+  *  more often than dwTimeoutMs. A watchdog thread, started on the first call of this function, checks armed slots.
+  *  If a slot isn't updated within its timeout, an error report with exception type CR_HANG is generated.
+  *  The minidump contains all threads of the process, the owner of the stale slot is written to the crash
+  *  description XML file as \<HangThreadId\> tag.
+  *
+  *  The process keeps running after a hang report, unless the crash callback sets bContinueExecution to FALSE.
+  *  A stalled slot is reported once; it is watched again after the next heartbeat.
+  */
+CRASHRPTAPI(int) crSetHeartbeatDeadline(UINT uSlot, DWORD dwTimeoutMs);
+
+/*
+  * Signals that the thread owning the heartbeat slot makes progress.
+  * This function returns zero if succeeded, and non-zero if the slot index is invalid.
+  *
+  *  [in] uSlot  Index of the heartbeat slot, from 0 to 63.
+  *
+  *  remarks:
+  *
+  *  The call only stores the current tick count to the slot. It takes no locks, makes no system calls and
+  *  doesn't update the last error message, so it can be called from latency-critical loops.
+  */
+CRASHRPTAPI(int) crHeartbeat(UINT uSlot);
+
+/*
+  * Records a lightweight snapshot of the calling thread for a non-fatal error.
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [in] pszReason  Short description of the error (truncated to 63 characters), may be NULL.
+  *
+  *  remarks:
+  *
+  *  Unlike crGenerateErrorReport(), this function doesn't launch CrashReport.exe and doesn't write a minidump.
+  *  It copies the call stack (up to 32 frames) and the 4 latest breadcrumbs of the calling thread into a bounded
+  *  in-process queue, which takes a few microseconds and never blocks. A background thread writes queued snapshots
+  *  every 10 seconds into one text file per batch in the Snapshots subfolder of the error report folder, together
+  *  with the current values of properties set by crSetProperty*() functions. Stack frames are written as module+offset.
+  *
+  *  If the queue (512 snapshots) is full, the snapshot is dropped, the function returns non-zero,
+  *  and the count of dropped snapshots is written to the next file.
+  */
+CRASHRPTAPI(int) crCaptureSnapshot(LPCWSTR pszReason);
+
 /*
   * Adds a registry key dump to the crash report.
   * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
@@ -706,6 +883,7 @@ CRASHRPTAPI(int) crExceptionFilter(unsigned int code, __in_opt struct _EXCEPTION
 #define CR_NONCONTINUABLE_EXCEPTION 32  // Non continuable software exception.
 #define CR_THROW 33                     // Throw C++ typed exception.
 #define CR_STACK_OVERFLOW 34            // Stack overflow.
+#define CR_HEAP_POISONED_CRASH 35       // Access violation with the process heap locked.
 
 /*
 * Emulates a predefined crash situation.
@@ -739,11 +917,17 @@ CRASHRPTAPI(int) crExceptionFilter(unsigned int code, __in_opt struct _EXCEPTION
 *    - CR_NONCONTINUABLE_EXCEPTION This raises a non-continuable software exception (expected result is the same as in CR_SEH_EXCEPTION).
 *    - CR_THROW This throws a C++ typed exception (expected result is the same as in CR_CPP_TERMINATE_CALL).
 *    - CR_STACK_OVERFLOW This causes stack overflow.
+*    - CR_HEAP_POISONED_CRASH This locks the process heap from a helper thread and then generates a null pointer exception.
 *
 *  The CR_SEH_EXCEPTION uses null pointer write operation to cause the access violation.
 *
 *  The CR_NONCONTINUABLE_EXCEPTION has the same effect as CR_SEH_EXCEPTION, but it uses RaiseException() WinAPI function to raise non-continuable software exception.
 *
+*  The CR_HEAP_POISONED_CRASH is intended for testing that the crash handler doesn't allocate memory before launching CrashReport.exe.
+*  The heap stays locked until the crash handler is about to launch CrashReport.exe, so any heap allocation made by the handler
+*  before that point hangs the process instead of producing a crash report. Crash callback (see crSetCrashCallback())
+*  is called while the heap is locked, so it must not allocate memory either.
+*
 *  The following example shows how to use crEmulateCrash() function.
 *
 *  // emulate null pointer exception (access violation)
@@ -767,6 +951,39 @@ CRASHRPTAPI(int) crEmulateCrash(unsigned ExceptionType) throw(...);
   */
 CRASHRPTAPI(int) crGetLastErrorMsg(__out_ecount_z(uBuffSize) LPWSTR pszBuffer, UINT uBuffSize);
 
+/*
+  *  This structure describes memory used by CrashRpt in the caller process.
+  *  It is filled by crGetMemoryFootprint() function.
+  *
+  *  cb [in]
+  *    This must contain the size of this structure in bytes.
+  *
+  *  uReservedBytes [out]
+  *    Address space reserved for shared memory that CrashRpt uses to pass crash information to CrashReport.exe
+  *    (crash description, typed properties, breadcrumbs), the mapped crash journal and signature table, and the snapshot queue.
+  *
+  *  uCommittedBytes [out]
+  *    Memory actually committed. Shared memory is committed on demand, so this is normally much less than uReservedBytes.
+  *
+  *  uUsedBytes [out]
+  *    Shared memory occupied by the crash description (configuration, files, properties and registry keys).
+  */
+typedef struct tagCR_MEMORY_FOOTPRINT {
+  WORD cb;                  // Size of this structure in bytes; should be initialized before using.
+  ULONG64 uReservedBytes;   // Reserved address space.
+  ULONG64 uCommittedBytes;  // Committed memory.
+  ULONG64 uUsedBytes;       // Memory occupied by crash description.
+} CR_MEMORY_FOOTPRINT;
+typedef CR_MEMORY_FOOTPRINT* PCR_MEMORY_FOOTPRINT;
+
+/*
+  * Retrieves memory footprint of CrashRpt in the caller process.
+  * This function returns zero if succeeded. Use crGetLastErrorMsg() to retrieve the error message on fail.
+  *
+  *  [out] pFootprint Pointer to the structure receiving the footprint; its cb member must be initialized.
+  */
+CRASHRPTAPI(int) crGetMemoryFootprint(__out PCR_MEMORY_FOOTPRINT pFootprint);
+
 // Helper wrapper classes
 #ifndef _CRASHRPT_NO_WRAPPERS
 class CrAutoInstallHelper {
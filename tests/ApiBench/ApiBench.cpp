@@ -0,0 +1,183 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: ApiBench.cpp
+// Description: Measures throughput of public API entry points called from 1 to 64 threads at once.
+// Most of them set the calling thread's last error message, so this also shows
+// whether the error message buffers scale with the thread count.
+// Usage: ApiBench [calls_per_thread]
+
+#include <windows.h>
+#include <stdio.h>
+#include <tchar.h>
+#include <strsafe.h>
+#include "CrashRpt.h"
+
+using namespace CrashReport;
+
+#define BENCH_MAX_THREADS 64         /* Largest thread count measured (at most one heartbeat slot per thread) */
+#define BENCH_DEFAULT_CALLS 50000    /* Calls made by each thread */
+#define BENCH_HEARTBEAT_TIMEOUT (10 * 60 * 1000)  /* Long enough not to report a hang while measuring */
+
+// Entry point measured.
+enum BENCH_CALL {
+  BENCH_GET_LAST_ERROR_MSG = 0,  // crGetLastErrorMsg()
+  BENCH_FAILING_CALL,            // crUninstallFromCurrentThread() without handlers (sets an error message)
+  BENCH_THREAD_HANDLERS,         // crInstallToCurrentThread() and crUninstallFromCurrentThread()
+  BENCH_ADD_BREADCRUMB,          // crAddBreadcrumb()
+  BENCH_HEARTBEAT,               // crHeartbeat()
+  BENCH_GET_FOOTPRINT,           // crGetMemoryFootprint()
+  BENCH_CALL_COUNT
+};
+
+static LPCSTR g_aszCallNames[BENCH_CALL_COUNT] = {"crGetLastErrorMsg", "failing call", "thread install/uninstall",
+                                                  "crAddBreadcrumb", "crHeartbeat", "crGetMemoryFootprint"};
+
+// Parameters and result of a benchmark thread.
+struct BenchThread {
+  HANDLE m_hStartEvent;  // Released when all threads are created.
+  BENCH_CALL m_Call;     // Entry point to call.
+  UINT m_uSlot;          // Heartbeat slot owned by the thread.
+  int m_nCalls;          // Count of calls to make.
+  int m_nFailures;       // Count of calls that returned an unexpected result.
+};
+
+static DWORD WINAPI BenchThreadProc(LPVOID lpParam) {
+  BenchThread* pThread = (BenchThread*)lpParam;
+  WCHAR szError[256];
+  CR_MEMORY_FOOTPRINT fp;
+  int i;
+
+  if (pThread->m_Call == BENCH_HEARTBEAT && crSetHeartbeatDeadline(pThread->m_uSlot, BENCH_HEARTBEAT_TIMEOUT) != 0)
+    pThread->m_nFailures++;
+
+  WaitForSingleObject(pThread->m_hStartEvent, INFINITE);
+
+  for (i = 0; i < pThread->m_nCalls; i++) {
+    BOOL bOk = TRUE;
+    switch (pThread->m_Call) {
+      case BENCH_GET_LAST_ERROR_MSG:
+        bOk = crGetLastErrorMsg(szError, _countof(szError)) > 0;
+        break;
+      case BENCH_FAILING_CALL:
+        bOk = crUninstallFromCurrentThread() != 0;
+        break;
+      case BENCH_THREAD_HANDLERS:
+        bOk = crInstallToCurrentThread(0) == 0 && crUninstallFromCurrentThread() == 0;
+        break;
+      case BENCH_ADD_BREADCRUMB:
+        bOk = crAddBreadcrumb(L"bench", L"call", CR_BL_DEBUG) == 0;
+        break;
+      case BENCH_HEARTBEAT:
+        bOk = crHeartbeat(pThread->m_uSlot) == 0;
+        break;
+      default:
+        fp.cb = sizeof(CR_MEMORY_FOOTPRINT);
+        bOk = crGetMemoryFootprint(&fp) == 0;
+        break;
+    }
+    if (!bOk)
+      pThread->m_nFailures++;
+  }
+
+  if (pThread->m_Call == BENCH_HEARTBEAT)
+    crSetHeartbeatDeadline(pThread->m_uSlot, 0);
+
+  return 0;
+}
+
+// Runs nThreads threads making nCalls calls each. Returns the elapsed time in seconds.
+static double RunBench(BENCH_CALL Call, int nThreads, int nCalls, int& nFailures) {
+  BenchThread aThreads[BENCH_MAX_THREADS];
+  HANDLE ahThreads[BENCH_MAX_THREADS];
+  HANDLE hStartEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  LARGE_INTEGER liFreq, liStart, liEnd;
+  int i;
+
+  for (i = 0; i < nThreads; i++) {
+    aThreads[i].m_hStartEvent = hStartEvent;
+    aThreads[i].m_Call = Call;
+    aThreads[i].m_uSlot = (UINT)i;
+    aThreads[i].m_nCalls = nCalls;
+    aThreads[i].m_nFailures = 0;
+    ahThreads[i] = CreateThread(NULL, 0, BenchThreadProc, &aThreads[i], 0, NULL);
+  }
+
+  // Give the threads time to arm their heartbeat slots before the clock starts
+  Sleep(100);
+
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+  SetEvent(hStartEvent);
+  WaitForMultipleObjects(nThreads, ahThreads, TRUE, INFINITE);
+  QueryPerformanceCounter(&liEnd);
+
+  nFailures = 0;
+  for (i = 0; i < nThreads; i++) {
+    nFailures += aThreads[i].m_nFailures;
+    CloseHandle(ahThreads[i]);
+  }
+  CloseHandle(hStartEvent);
+
+  return (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+}
+
+int main(int argc, char* argv[]) {
+  int nCalls = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_CALLS;
+  if (nCalls < 1)
+    nCalls = 1;
+
+  // Install crash reporting
+  CR_INSTALL_INFO info;
+  memset(&info, 0, sizeof(CR_INSTALL_INFO));
+  info.cb = sizeof(CR_INSTALL_INFO);
+  info.pszAppName = L"CrashRpt API Benchmark";
+  info.pszAppVersion = L"1.0.0";
+#ifdef _DEBUG
+  WCHAR szCurDir[MAX_PATH] = {0};
+  GetModuleFileNameW(NULL, szCurDir, _MAX_PATH);
+  WCHAR* ptr = wcsrchr(szCurDir, L'\\');
+  if (ptr != NULL)
+    *(ptr) = 0;  // remove executable name
+  WCHAR szCrashReportDebugPath[MAX_PATH];
+  StringCchPrintfW(szCrashReportDebugPath, MAX_PATH, L"%s\\%s", szCurDir, L"CrashReportd.exe");
+  info.pszCrashReportPath = szCrashReportDebugPath;
+#endif
+  info.dwFlags = CR_INST_ALL_POSSIBLE_HANDLERS;
+
+  if (crInstall(&info) != 0) {
+    WCHAR szError[256];
+    crGetLastErrorMsg(szError, 256);
+    wprintf(L"crInstall() failed: %s\n", szError);
+    return 1;
+  }
+
+  int nTotalFailures = 0;
+  printf("%-26s %8s %12s %14s\n", "Entry point", "Threads", "Seconds", "Calls/s");
+
+  int nCall;
+  for (nCall = 0; nCall < BENCH_CALL_COUNT; nCall++) {
+    int nThreads;
+    for (nThreads = 1; nThreads <= BENCH_MAX_THREADS; nThreads *= 2) {
+      int nFailures = 0;
+      double dSeconds = RunBench((BENCH_CALL)nCall, nThreads, nCalls, nFailures);
+      nTotalFailures += nFailures;
+
+      printf("%-26s %8d %12.3f %14.0f", g_aszCallNames[nCall], nThreads, dSeconds, (double)nThreads * nCalls / dSeconds);
+      if (nFailures != 0)
+        printf("  %d calls failed", nFailures);
+      printf("\n");
+    }
+  }
+
+  crUninstall();
+
+  return nTotalFailures == 0 ? 0 : 1;
+}
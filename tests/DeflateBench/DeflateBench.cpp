@@ -0,0 +1,188 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: DeflateBench.cpp
+// Description: Measures CParallelDeflate throughput at 1..N threads on a generated file
+// and checks that every output inflates back to the input size and CRC-32.
+// Usage: DeflateBench [size_in_MB] [max_threads]
+
+#include "stdafx.h"
+#include "ParallelDeflate.h"
+#include <stdio.h>
+
+#define BENCH_DEFAULT_SIZE_MB 3072      /* Size of the generated file */
+#define BENCH_CHUNK_SIZE (1024 * 1024)  /* Generator and verifier buffer size */
+
+// Fills the buffer with log-like words mixed with random bytes, so it compresses roughly like a minidump.
+static void GenerateChunk(LPBYTE pBuffer, DWORD dwSize, DWORD& dwSeed) {
+  static const char* aszWords[] = {"thread ", "module ", "0x00007ffe ", "exception ", "kernel32.dll ",
+                                   "stack ", "frame ", "heap ", "00000000 ", "\r\n"};
+  DWORD i = 0;
+  while (i < dwSize) {
+    dwSeed = dwSeed * 1103515245 + 12345;
+    if (((dwSeed >> 16) & 3) == 0) {
+      pBuffer[i++] = (BYTE)(dwSeed >> 24);
+      continue;
+    }
+
+    const char* szWord = aszWords[(dwSeed >> 20) % _countof(aszWords)];
+    for (; *szWord != 0 && i < dwSize; szWord++)
+      pBuffer[i++] = (BYTE)*szWord;
+  }
+}
+
+// Creates a temporary file deleted when its handle is closed.
+static HANDLE CreateTempFile() {
+  TCHAR szTempPath[MAX_PATH];
+  TCHAR szTempFile[MAX_PATH];
+  if (!GetTempPath(MAX_PATH, szTempPath) || !GetTempFileName(szTempPath, _T("cdb"), 0, szTempFile))
+    return INVALID_HANDLE_VALUE;
+
+  return CreateFile(szTempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+static BOOL Rewind(HANDLE hFile) {
+  LARGE_INTEGER liZero;
+  liZero.QuadPart = 0;
+  return SetFilePointerEx(hFile, liZero, NULL, FILE_BEGIN);
+}
+
+// Inflates the raw deflate stream in hFile, returns its size and CRC-32.
+static BOOL InflateFile(HANDLE hFile, ULONG64& ullSize, DWORD& dwCrc32) {
+  BOOL bStatus = FALSE;
+  std::vector<BYTE> aIn(BENCH_CHUNK_SIZE);
+  std::vector<BYTE> aOut(BENCH_CHUNK_SIZE);
+  z_stream zs;
+  int nResult = Z_OK;
+
+  ullSize = 0;
+  uLong ulCrc32 = crc32(0L, Z_NULL, 0);
+
+  memset(&zs, 0, sizeof(z_stream));
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    return FALSE;
+
+  if (!Rewind(hFile))
+    goto cleanup;
+
+  while (nResult != Z_STREAM_END) {
+    DWORD dwBytesRead = 0;
+    if (!ReadFile(hFile, &aIn[0], BENCH_CHUNK_SIZE, &dwBytesRead, NULL) || dwBytesRead == 0)
+      goto cleanup;  // Truncated stream
+
+    zs.next_in = &aIn[0];
+    zs.avail_in = dwBytesRead;
+    do {
+      zs.next_out = &aOut[0];
+      zs.avail_out = BENCH_CHUNK_SIZE;
+      nResult = inflate(&zs, Z_NO_FLUSH);
+      if (nResult != Z_OK && nResult != Z_STREAM_END)
+        goto cleanup;
+
+      DWORD dwOut = BENCH_CHUNK_SIZE - zs.avail_out;
+      ulCrc32 = crc32(ulCrc32, &aOut[0], dwOut);
+      ullSize += dwOut;
+    } while (zs.avail_out == 0 && nResult != Z_STREAM_END);
+  }
+
+  dwCrc32 = (DWORD)ulCrc32;
+  bStatus = TRUE;
+
+cleanup:
+
+  inflateEnd(&zs);
+  return bStatus;
+}
+
+int main(int argc, char* argv[]) {
+  ULONG64 ullSize = (ULONG64)(argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SIZE_MB) * 1024 * 1024;
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int nMaxThreads = argc > 2 ? atoi(argv[2]) : (int)si.dwNumberOfProcessors;
+  if (nMaxThreads < 1)
+    nMaxThreads = 1;
+
+  HANDLE hSrcFile = CreateTempFile();
+  HANDLE hDstFile = CreateTempFile();
+  if (hSrcFile == INVALID_HANDLE_VALUE || hDstFile == INVALID_HANDLE_VALUE) {
+    printf("Couldn't create temporary files.\n");
+    return 1;
+  }
+
+  // Generate the input once, it is reused by all runs
+  printf("Generating %I64u MB...\n", ullSize / (1024 * 1024));
+  std::vector<BYTE> aChunk(BENCH_CHUNK_SIZE);
+  DWORD dwSeed = 1;
+  uLong ulCrc32 = crc32(0L, Z_NULL, 0);
+  ULONG64 ullWritten;
+  for (ullWritten = 0; ullWritten < ullSize; ullWritten += BENCH_CHUNK_SIZE) {
+    DWORD dwChunk = ullSize - ullWritten < BENCH_CHUNK_SIZE ? (DWORD)(ullSize - ullWritten) : BENCH_CHUNK_SIZE;
+    GenerateChunk(&aChunk[0], dwChunk, dwSeed);
+    ulCrc32 = crc32(ulCrc32, &aChunk[0], dwChunk);
+    DWORD dwBytesWritten = 0;
+    if (!WriteFile(hSrcFile, &aChunk[0], dwChunk, &dwBytesWritten, NULL) || dwBytesWritten != dwChunk) {
+      printf("Couldn't write the input file (error %u).\n", GetLastError());
+      return 1;
+    }
+  }
+
+  LARGE_INTEGER liFreq;
+  QueryPerformanceFrequency(&liFreq);
+
+  int nFailures = 0;
+  printf("%8s %12s %12s %10s  %s\n", "Threads", "Seconds", "Output MB", "MB/s", "Check");
+
+  int nThreads = 1;
+  for (;;) {
+    if (!Rewind(hSrcFile) || !Rewind(hDstFile) || !SetEndOfFile(hDstFile)) {
+      printf("Couldn't rewind temporary files.\n");
+      return 1;
+    }
+
+    ULONG64 ullCompressed = 0;
+    CParallelDeflate deflater;
+    LARGE_INTEGER liStart, liEnd;
+    QueryPerformanceCounter(&liStart);
+    BOOL bCompress = deflater.Compress(hSrcFile, ullSize, Z_DEFAULT_COMPRESSION, nThreads,
+                                       [hDstFile, &ullCompressed](LPBYTE pData, DWORD dwSize) {
+                                         DWORD dwBytesWritten = 0;
+                                         if (!WriteFile(hDstFile, pData, dwSize, &dwBytesWritten, NULL) || dwBytesWritten != dwSize)
+                                           return FALSE;
+                                         ullCompressed += dwSize;
+                                         return TRUE;
+                                       },
+                                       nullptr);
+    QueryPerformanceCounter(&liEnd);
+    double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+
+    // The output must inflate to what was read, and the reported size and CRC must match the input
+    ULONG64 ullInflated = 0;
+    DWORD dwInflatedCrc32 = 0;
+    BOOL bCheck = bCompress &&
+                  deflater.GetUncompressedSize() == ullSize && deflater.GetCrc32() == (DWORD)ulCrc32 &&
+                  InflateFile(hDstFile, ullInflated, dwInflatedCrc32) &&
+                  ullInflated == ullSize && dwInflatedCrc32 == deflater.GetCrc32();
+    if (!bCheck)
+      nFailures++;
+
+    printf("%8d %12.2f %12.1f %10.1f  %s\n", nThreads, dSeconds, ullCompressed / (1024.0 * 1024.0),
+           ullSize / (1024.0 * 1024.0) / dSeconds, bCheck ? "OK" : "FAILED");
+
+    if (nThreads == nMaxThreads)
+      break;
+    nThreads = nThreads * 2 < nMaxThreads ? nThreads * 2 : nMaxThreads;
+  }
+
+  CloseHandle(hSrcFile);
+  CloseHandle(hDstFile);
+
+  return nFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: FileCopyTest.cpp
+// Description: Copies files of sizes around the buffer boundaries with CFileCopier::Copy(),
+// compares the copies byte by byte and prints throughput per size.
+// Usage: FileCopyTest [large_size_in_MB]
+
+#include "stdafx.h"
+#include "FileCopier.h"
+#include "zlib.h"
+#include <stdio.h>
+
+#define TEST_DEFAULT_LARGE_SIZE_MB 512  /* Size of the largest file copied */
+#define TEST_CHUNK_SIZE (1024 * 1024)   /* Generator and comparison buffer size */
+
+// File copied by the test.
+struct CopyTestCase {
+  ULONG64 m_ullFileSize;  // Size of the source file.
+  ULONG64 m_ullCopySize;  // Size passed to Copy(); larger than the file to hit the end of file early.
+};
+
+// Writes ullSize bytes of pseudo-random data to a new file.
+static BOOL GenerateFile(LPCTSTR szFileName, ULONG64 ullSize) {
+  HANDLE hFile = CreateFile(szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  std::vector<DWORD> aChunk(TEST_CHUNK_SIZE / sizeof(DWORD));
+  DWORD dwSeed = (DWORD)ullSize + 1;
+  BOOL bStatus = TRUE;
+  ULONG64 ullWritten;
+  for (ullWritten = 0; bStatus && ullWritten < ullSize; ullWritten += TEST_CHUNK_SIZE) {
+    size_t i;
+    for (i = 0; i < aChunk.size(); i++) {
+      dwSeed = dwSeed * 1103515245 + 12345;
+      aChunk[i] = dwSeed;
+    }
+
+    DWORD dwChunk = ullSize - ullWritten < TEST_CHUNK_SIZE ? (DWORD)(ullSize - ullWritten) : TEST_CHUNK_SIZE;
+    DWORD dwBytesWritten = 0;
+    bStatus = WriteFile(hFile, &aChunk[0], dwChunk, &dwBytesWritten, NULL) && dwBytesWritten == dwChunk;
+  }
+
+  CloseHandle(hFile);
+  return bStatus;
+}
+
+// Compares two files byte by byte, including their sizes.
+static BOOL CompareFiles(LPCTSTR szFileName1, LPCTSTR szFileName2) {
+  BOOL bStatus = FALSE;
+  std::vector<BYTE> aBuffer1(TEST_CHUNK_SIZE);
+  std::vector<BYTE> aBuffer2(TEST_CHUNK_SIZE);
+
+  HANDLE hFile1 = CreateFile(szFileName1, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  HANDLE hFile2 = CreateFile(szFileName2, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile1 == INVALID_HANDLE_VALUE || hFile2 == INVALID_HANDLE_VALUE)
+    goto cleanup;
+
+  for (;;) {
+    DWORD dwBytesRead1 = 0;
+    DWORD dwBytesRead2 = 0;
+    if (!ReadFile(hFile1, &aBuffer1[0], TEST_CHUNK_SIZE, &dwBytesRead1, NULL) ||
+        !ReadFile(hFile2, &aBuffer2[0], TEST_CHUNK_SIZE, &dwBytesRead2, NULL))
+      goto cleanup;
+
+    if (dwBytesRead1 != dwBytesRead2 || memcmp(&aBuffer1[0], &aBuffer2[0], dwBytesRead1) != 0)
+      goto cleanup;
+
+    if (dwBytesRead1 == 0)
+      break;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  if (hFile1 != INVALID_HANDLE_VALUE)
+    CloseHandle(hFile1);
+  if (hFile2 != INVALID_HANDLE_VALUE)
+    CloseHandle(hFile2);
+
+  return bStatus;
+}
+
+// Returns CRC-32 of the file.
+static DWORD GetFileCrc32(LPCTSTR szFileName) {
+  uLong ulCrc32 = crc32(0L, Z_NULL, 0);
+  HANDLE hFile = CreateFile(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return 0;
+
+  std::vector<BYTE> aBuffer(TEST_CHUNK_SIZE);
+  DWORD dwBytesRead = 0;
+  while (ReadFile(hFile, &aBuffer[0], TEST_CHUNK_SIZE, &dwBytesRead, NULL) && dwBytesRead != 0)
+    ulCrc32 = crc32(ulCrc32, &aBuffer[0], dwBytesRead);
+
+  CloseHandle(hFile);
+  return (DWORD)ulCrc32;
+}
+
+// Copies the source file to the destination the way CrashReport does and checks the result.
+static BOOL RunTestCase(const CopyTestCase& TestCase, LPCTSTR szSrcFile, LPCTSTR szDestFile, double& dSeconds) {
+  BOOL bStatus = FALSE;
+  HANDLE hSrcFile = INVALID_HANDLE_VALUE;
+  HANDLE hDestFile = INVALID_HANDLE_VALUE;
+  CFileCopier copier;
+  BOOL bCopy = FALSE;
+  uLong ulDataCrc32 = crc32(0L, Z_NULL, 0);
+  ULONG64 ullDataSize = 0;
+  ULONG64 ullProgress = 0;
+  LARGE_INTEGER liFreq, liStart, liEnd;
+
+  if (!GenerateFile(szSrcFile, TestCase.m_ullFileSize)) {
+    printf("Couldn't create the source file (error %u).\n", GetLastError());
+    goto cleanup;
+  }
+
+  hSrcFile = CreateFile(szSrcFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+  hDestFile = CreateFile(szDestFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+  if (hSrcFile == INVALID_HANDLE_VALUE || hDestFile == INVALID_HANDLE_VALUE) {
+    printf("Couldn't open the files (error %u).\n", GetLastError());
+    goto cleanup;
+  }
+
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+  bCopy = copier.Copy(hSrcFile, hDestFile, TestCase.m_ullCopySize,
+                      [&ulDataCrc32, &ullDataSize](LPBYTE pData, DWORD dwSize) {
+                        ulDataCrc32 = crc32(ulDataCrc32, pData, dwSize);
+                        ullDataSize += dwSize;
+                      },
+                      [&ullProgress](ULONG64 ullWritten) { ullProgress = ullWritten; },
+                      nullptr);
+  QueryPerformanceCounter(&liEnd);
+  dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+
+  CloseHandle(hSrcFile);
+  hSrcFile = INVALID_HANDLE_VALUE;
+  CloseHandle(hDestFile);
+  hDestFile = INVALID_HANDLE_VALUE;
+
+  if (!bCopy) {
+    printf("Copy() failed (error %u).\n", copier.GetLastError());
+    goto cleanup;
+  }
+
+  // Data must be passed on in file order and the progress must end at the file size
+  if (ullDataSize != TestCase.m_ullFileSize || ullProgress != TestCase.m_ullFileSize) {
+    printf("Copy() reported %I64u bytes of data and %I64u bytes written.\n", ullDataSize, ullProgress);
+    goto cleanup;
+  }
+
+  if ((DWORD)ulDataCrc32 != GetFileCrc32(szSrcFile)) {
+    printf("Data passed on by Copy() is out of order.\n");
+    goto cleanup;
+  }
+
+  if (!CompareFiles(szSrcFile, szDestFile)) {
+    printf("The copy differs from the source.\n");
+    goto cleanup;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  if (hSrcFile != INVALID_HANDLE_VALUE)
+    CloseHandle(hSrcFile);
+  if (hDestFile != INVALID_HANDLE_VALUE)
+    CloseHandle(hDestFile);
+
+  DeleteFile(szSrcFile);
+  DeleteFile(szDestFile);
+
+  return bStatus;
+}
+
+int main(int argc, char* argv[]) {
+  ULONG64 ullLargeSize = (ULONG64)(argc > 1 ? atoi(argv[1]) : TEST_DEFAULT_LARGE_SIZE_MB) * 1024 * 1024;
+
+  // Sizes around the smallest buffer, around a full rotation of the slots
+  // with the largest buffers, and files that turn out shorter than expected
+  const CopyTestCase aTestCases[] = {
+    {0, 0},
+    {1, 1},
+    {FILE_COPY_MIN_BUFFER_SIZE - 1, FILE_COPY_MIN_BUFFER_SIZE - 1},
+    {FILE_COPY_MIN_BUFFER_SIZE, FILE_COPY_MIN_BUFFER_SIZE},
+    {FILE_COPY_MIN_BUFFER_SIZE + 1, FILE_COPY_MIN_BUFFER_SIZE + 1},
+    {FILE_COPY_SLOT_COUNT * FILE_COPY_MIN_BUFFER_SIZE + 1, FILE_COPY_SLOT_COUNT * FILE_COPY_MIN_BUFFER_SIZE + 1},
+    {FILE_COPY_SLOT_COUNT * FILE_COPY_MAX_BUFFER_SIZE * 3 + 7, FILE_COPY_SLOT_COUNT * FILE_COPY_MAX_BUFFER_SIZE * 3 + 7},
+    {0, FILE_COPY_MIN_BUFFER_SIZE},
+    {FILE_COPY_MIN_BUFFER_SIZE + 1, 3 * FILE_COPY_MIN_BUFFER_SIZE},
+    {FILE_COPY_MAX_BUFFER_SIZE * 5 + 3, FILE_COPY_MAX_BUFFER_SIZE * 16},
+    {ullLargeSize, ullLargeSize},
+    {ullLargeSize - 1, ullLargeSize + FILE_COPY_MAX_BUFFER_SIZE}
+  };
+
+  TCHAR szTempPath[MAX_PATH];
+  if (!GetTempPath(MAX_PATH, szTempPath)) {
+    printf("Couldn't get the temporary directory.\n");
+    return 1;
+  }
+  CString sSrcFile = CString(szTempPath) + _T("FileCopyTest.src");
+  CString sDestFile = CString(szTempPath) + _T("FileCopyTest.dst");
+
+  int nFailures = 0;
+  printf("%14s %14s %10s %10s  %s\n", "File size", "Copy size", "Seconds", "MB/s", "Check");
+
+  int i;
+  for (i = 0; i < (int)_countof(aTestCases); i++) {
+    double dSeconds = 0;
+    BOOL bCheck = RunTestCase(aTestCases[i], sSrcFile, sDestFile, dSeconds);
+    if (!bCheck)
+      nFailures++;
+
+    double dMBps = dSeconds > 0 ? aTestCases[i].m_ullFileSize / (1024.0 * 1024.0) / dSeconds : 0;
+    printf("%14I64u %14I64u %10.3f %10.1f  %s\n", aTestCases[i].m_ullFileSize, aTestCases[i].m_ullCopySize,
+           dSeconds, dMBps, bCheck ? "OK" : "FAILED");
+  }
+
+  return nFailures == 0 ? 0 : 1;
+}
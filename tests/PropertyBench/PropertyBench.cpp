@@ -0,0 +1,163 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: PropertyBench.cpp
+// Description: Measures property update throughput at 1 to 64 threads, for the typed setters
+// (lock-free property table) and for crAddProperty() (shared memory under a lock).
+// Every thread updates its own property, or all threads update the same one.
+// Usage: PropertyBench [updates_per_thread]
+
+#include <windows.h>
+#include <stdio.h>
+#include <tchar.h>
+#include <strsafe.h>
+#include "CrashRpt.h"
+
+using namespace CrashReport;
+
+#define BENCH_MAX_THREADS 64               /* Largest thread count measured */
+#define BENCH_DEFAULT_UPDATES 20000        /* Updates made by each thread */
+
+// Property setter measured.
+enum BENCH_SETTER {
+  BENCH_SET_INT64 = 0,  // crSetPropertyInt64()
+  BENCH_SET_STRING,     // crSetPropertyString()
+  BENCH_ADD_PROPERTY,   // crAddProperty()
+  BENCH_SETTER_COUNT
+};
+
+static LPCSTR g_aszSetterNames[BENCH_SETTER_COUNT] = {"crSetPropertyInt64", "crSetPropertyString", "crAddProperty"};
+
+// Parameters and result of a benchmark thread.
+struct BenchThread {
+  HANDLE m_hStartEvent;  // Released when all threads are created.
+  BENCH_SETTER m_Setter; // Setter to call.
+  WCHAR m_szName[32];    // Property name.
+  int m_nUpdates;        // Count of updates to make.
+  int m_nFailures;       // Count of failed calls.
+};
+
+static DWORD WINAPI BenchThreadProc(LPVOID lpParam) {
+  BenchThread* pThread = (BenchThread*)lpParam;
+  WCHAR szValue[64];
+  int i;
+
+  WaitForSingleObject(pThread->m_hStartEvent, INFINITE);
+
+  for (i = 0; i < pThread->m_nUpdates; i++) {
+    int nResult = 0;
+    switch (pThread->m_Setter) {
+      case BENCH_SET_INT64:
+        nResult = crSetPropertyInt64(pThread->m_szName, i);
+        break;
+      case BENCH_SET_STRING:
+        StringCchPrintfW(szValue, _countof(szValue), L"value %d", i);
+        nResult = crSetPropertyString(pThread->m_szName, szValue);
+        break;
+      default:
+        StringCchPrintfW(szValue, _countof(szValue), L"value %d", i);
+        nResult = crAddProperty(pThread->m_szName, szValue);
+        break;
+    }
+    if (nResult != 0)
+      pThread->m_nFailures++;
+  }
+
+  return 0;
+}
+
+// Runs nThreads threads making nUpdates updates each. Returns the elapsed time in seconds.
+static double RunBench(BENCH_SETTER Setter, int nThreads, BOOL bSameName, int nUpdates, int& nFailures) {
+  BenchThread aThreads[BENCH_MAX_THREADS];
+  HANDLE ahThreads[BENCH_MAX_THREADS];
+  HANDLE hStartEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  LARGE_INTEGER liFreq, liStart, liEnd;
+  int i;
+
+  for (i = 0; i < nThreads; i++) {
+    aThreads[i].m_hStartEvent = hStartEvent;
+    aThreads[i].m_Setter = Setter;
+    aThreads[i].m_nUpdates = nUpdates;
+    aThreads[i].m_nFailures = 0;
+    StringCchPrintfW(aThreads[i].m_szName, _countof(aThreads[i].m_szName), L"Bench%d_%d", (int)Setter, bSameName ? 0 : i);
+    ahThreads[i] = CreateThread(NULL, 0, BenchThreadProc, &aThreads[i], 0, NULL);
+  }
+
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+  SetEvent(hStartEvent);
+  WaitForMultipleObjects(nThreads, ahThreads, TRUE, INFINITE);
+  QueryPerformanceCounter(&liEnd);
+
+  nFailures = 0;
+  for (i = 0; i < nThreads; i++) {
+    nFailures += aThreads[i].m_nFailures;
+    CloseHandle(ahThreads[i]);
+  }
+  CloseHandle(hStartEvent);
+
+  return (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+}
+
+int main(int argc, char* argv[]) {
+  int nUpdates = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_UPDATES;
+  if (nUpdates < 1)
+    nUpdates = 1;
+
+  // Install crash reporting
+  CR_INSTALL_INFO info;
+  memset(&info, 0, sizeof(CR_INSTALL_INFO));
+  info.cb = sizeof(CR_INSTALL_INFO);
+  info.pszAppName = L"CrashRpt Property Benchmark";
+  info.pszAppVersion = L"1.0.0";
+#ifdef _DEBUG
+  WCHAR szCurDir[MAX_PATH] = {0};
+  GetModuleFileNameW(NULL, szCurDir, _MAX_PATH);
+  WCHAR* ptr = wcsrchr(szCurDir, L'\\');
+  if (ptr != NULL)
+    *(ptr) = 0;  // remove executable name
+  WCHAR szCrashReportDebugPath[MAX_PATH];
+  StringCchPrintfW(szCrashReportDebugPath, MAX_PATH, L"%s\\%s", szCurDir, L"CrashReportd.exe");
+  info.pszCrashReportPath = szCrashReportDebugPath;
+#endif
+
+  if (crInstall(&info) != 0) {
+    WCHAR szError[256];
+    crGetLastErrorMsg(szError, 256);
+    wprintf(L"crInstall() failed: %s\n", szError);
+    return 1;
+  }
+
+  int nTotalFailures = 0;
+  printf("%-20s %-9s %8s %12s %14s\n", "Setter", "Names", "Threads", "Seconds", "Updates/s");
+
+  int nSetter;
+  for (nSetter = 0; nSetter < BENCH_SETTER_COUNT; nSetter++) {
+    int nSameName;
+    for (nSameName = 0; nSameName < 2; nSameName++) {
+      int nThreads;
+      for (nThreads = 1; nThreads <= BENCH_MAX_THREADS; nThreads *= 2) {
+        int nFailures = 0;
+        double dSeconds = RunBench((BENCH_SETTER)nSetter, nThreads, nSameName, nUpdates, nFailures);
+        nTotalFailures += nFailures;
+
+        printf("%-20s %-9s %8d %12.3f %14.0f", g_aszSetterNames[nSetter], nSameName ? "same" : "distinct",
+               nThreads, dSeconds, (double)nThreads * nUpdates / dSeconds);
+        if (nFailures != 0)
+          printf("  %d calls failed", nFailures);
+        printf("\n");
+      }
+    }
+  }
+
+  crUninstall();
+
+  return nTotalFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: ThreadBench.cpp
+// Description: Measures how many threads per second can be created and joined without CrashRpt,
+// with crInstall(), and with per-thread handlers installed explicitly or on thread attach
+// (CR_INST_AUTO_THREAD_HANDLERS). Several creator threads run at once, like a churning thread pool.
+// Usage: ThreadBench [threads_per_creator]
+
+#include <windows.h>
+#include <stdio.h>
+#include <tchar.h>
+#include <strsafe.h>
+#include "CrashRpt.h"
+
+using namespace CrashReport;
+
+#define BENCH_DEFAULT_THREADS 2000  /* Threads created by each creator */
+#define BENCH_MAX_CREATORS 16       /* Largest count of concurrent creators */
+
+// Setup measured.
+enum BENCH_MODE {
+  BENCH_NOT_INSTALLED = 0,  // crInstall() isn't called.
+  BENCH_INSTALLED,          // crInstall(), threads don't touch CrashRpt.
+  BENCH_THREAD_HANDLERS,    // crInstall(), threads call crInstallToCurrentThread()/crUninstallFromCurrentThread().
+  BENCH_AUTO_HANDLERS,      // crInstall() with CR_INST_AUTO_THREAD_HANDLERS.
+  BENCH_AUTO_BREADCRUMB,    // As above, and each thread leaves a breadcrumb (takes and releases a ring).
+  BENCH_MODE_COUNT
+};
+
+static LPCSTR g_aszModeNames[BENCH_MODE_COUNT] = {"no crInstall", "crInstall", "crInstallToCurrentThread",
+                                                  "auto thread handlers", "auto handlers + breadcrumb"};
+
+// Parameters of a creator thread.
+struct BenchCreator {
+  HANDLE m_hStartEvent;  // Released when all creators are running.
+  BENCH_MODE m_Mode;     // Setup measured.
+  int m_nThreads;        // Count of threads to create.
+  int m_nFailures;       // Count of threads that couldn't be created.
+};
+
+static DWORD WINAPI ChurnThreadProc(LPVOID lpParam) {
+  BENCH_MODE Mode = (BENCH_MODE)(INT_PTR)lpParam;
+
+  if (Mode == BENCH_THREAD_HANDLERS) {
+    crInstallToCurrentThread(0);
+    crUninstallFromCurrentThread();
+  }
+  else if (Mode == BENCH_AUTO_BREADCRUMB) {
+    crAddBreadcrumb(L"bench", L"thread started", CR_BL_INFO);
+  }
+
+  return 0;
+}
+
+static DWORD WINAPI CreatorThreadProc(LPVOID lpParam) {
+  BenchCreator* pCreator = (BenchCreator*)lpParam;
+  int i;
+
+  WaitForSingleObject(pCreator->m_hStartEvent, INFINITE);
+
+  for (i = 0; i < pCreator->m_nThreads; i++) {
+    HANDLE hThread = CreateThread(NULL, 0, ChurnThreadProc, (LPVOID)(INT_PTR)pCreator->m_Mode, 0, NULL);
+    if (hThread == NULL) {
+      pCreator->m_nFailures++;
+      continue;
+    }
+    WaitForSingleObject(hThread, INFINITE);
+    CloseHandle(hThread);
+  }
+
+  return 0;
+}
+
+// Runs nCreators creator threads. Returns the elapsed time in seconds.
+static double RunBench(BENCH_MODE Mode, int nCreators, int nThreads, int& nFailures) {
+  BenchCreator aCreators[BENCH_MAX_CREATORS];
+  HANDLE ahCreators[BENCH_MAX_CREATORS];
+  HANDLE hStartEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  LARGE_INTEGER liFreq, liStart, liEnd;
+  int i;
+
+  for (i = 0; i < nCreators; i++) {
+    aCreators[i].m_hStartEvent = hStartEvent;
+    aCreators[i].m_Mode = Mode;
+    aCreators[i].m_nThreads = nThreads;
+    aCreators[i].m_nFailures = 0;
+    ahCreators[i] = CreateThread(NULL, 0, CreatorThreadProc, &aCreators[i], 0, NULL);
+  }
+
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+  SetEvent(hStartEvent);
+  WaitForMultipleObjects(nCreators, ahCreators, TRUE, INFINITE);
+  QueryPerformanceCounter(&liEnd);
+
+  nFailures = 0;
+  for (i = 0; i < nCreators; i++) {
+    nFailures += aCreators[i].m_nFailures;
+    CloseHandle(ahCreators[i]);
+  }
+  CloseHandle(hStartEvent);
+
+  return (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+}
+
+// Installs crash reporting with the given flags.
+static int Install(DWORD dwFlags) {
+  CR_INSTALL_INFO info;
+  memset(&info, 0, sizeof(CR_INSTALL_INFO));
+  info.cb = sizeof(CR_INSTALL_INFO);
+  info.pszAppName = L"CrashRpt Thread Benchmark";
+  info.pszAppVersion = L"1.0.0";
+#ifdef _DEBUG
+  WCHAR szCurDir[MAX_PATH] = {0};
+  GetModuleFileNameW(NULL, szCurDir, _MAX_PATH);
+  WCHAR* ptr = wcsrchr(szCurDir, L'\\');
+  if (ptr != NULL)
+    *(ptr) = 0;  // remove executable name
+  WCHAR szCrashReportDebugPath[MAX_PATH];
+  StringCchPrintfW(szCrashReportDebugPath, MAX_PATH, L"%s\\%s", szCurDir, L"CrashReportd.exe");
+  info.pszCrashReportPath = szCrashReportDebugPath;
+#endif
+  info.dwFlags = dwFlags;
+
+  int nResult = crInstall(&info);
+  if (nResult != 0) {
+    WCHAR szError[256];
+    crGetLastErrorMsg(szError, 256);
+    wprintf(L"crInstall() failed: %s\n", szError);
+  }
+  return nResult;
+}
+
+int main(int argc, char* argv[]) {
+  int nThreads = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_THREADS;
+  if (nThreads < 1)
+    nThreads = 1;
+
+  int nTotalFailures = 0;
+  printf("%-28s %8s %12s %14s\n", "Setup", "Creators", "Seconds", "Threads/s");
+
+  int nMode;
+  for (nMode = 0; nMode < BENCH_MODE_COUNT; nMode++) {
+    if (nMode != BENCH_NOT_INSTALLED) {
+      DWORD dwFlags = CR_INST_ALL_POSSIBLE_HANDLERS;
+      if (nMode == BENCH_AUTO_HANDLERS || nMode == BENCH_AUTO_BREADCRUMB)
+        dwFlags |= CR_INST_AUTO_THREAD_HANDLERS;
+      if (Install(dwFlags) != 0)
+        return 1;
+    }
+
+    int nCreators;
+    for (nCreators = 1; nCreators <= BENCH_MAX_CREATORS; nCreators *= 4) {
+      int nFailures = 0;
+      double dSeconds = RunBench((BENCH_MODE)nMode, nCreators, nThreads, nFailures);
+      nTotalFailures += nFailures;
+
+      printf("%-28s %8d %12.3f %14.0f", g_aszModeNames[nMode], nCreators, dSeconds,
+             (double)(nCreators * nThreads - nFailures) / dSeconds);
+      if (nFailures != 0)
+        printf("  %d threads not created", nFailures);
+      printf("\n");
+    }
+
+    if (nMode != BENCH_NOT_INSTALLED)
+      crUninstall();
+  }
+
+  return nTotalFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: Zip64Test.cpp
+// Description: Packs sparse files larger than 4 GB with CZipWriter (stored, deflated in parallel
+// and deflated serially after the 4 GB offset), then reads the archive back with minizip's
+// unzip API and checks names, methods, sizes and CRCs of all entries.
+// The stored entry makes the archive itself larger than 4.5 GB, so the temporary
+// directory needs that much free space.
+
+#include "stdafx.h"
+#include "ZipWriter.h"
+#include "unzip.h"
+#include <winioctl.h>
+#include <stdio.h>
+
+#define TEST_LARGE_FILE_SIZE (4608ULL * 1024 * 1024)  /* 4.5 GB */
+#define TEST_CHUNK_SIZE (1024 * 1024)                 /* Read buffer size */
+
+// File packed into the test archive.
+struct Zip64TestEntry {
+  LPCSTR m_szName;    // Name of the entry.
+  ULONG64 m_ullSize;  // Size of the source file.
+  int m_nMethod;      // 0 to store, Z_DEFLATED to deflate.
+};
+
+// Creates a sparse file of the given size. A few marker bytes, one of them
+// just below the 4 GB offset, make the CRC depend on where the data ends up.
+static BOOL CreateSparseFile(LPCTSTR szFileName, ULONG64 ullSize) {
+  BOOL bStatus = FALSE;
+  DWORD dwBytes = 0;
+  LARGE_INTEGER liPos;
+  ULONG64 aullMarkers[3] = {0, 0xFFFFFFF0ULL, ullSize - 16};
+  int i;
+
+  HANDLE hFile = CreateFile(szFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  if (!DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dwBytes, NULL))
+    goto cleanup;
+
+  liPos.QuadPart = (LONGLONG)ullSize;
+  if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+    goto cleanup;
+
+  for (i = 0; i < (int)_countof(aullMarkers); i++) {
+    char szMarker[17];
+    sprintf_s(szMarker, _countof(szMarker), "CrashRpt%08x", (DWORD)aullMarkers[i]);
+    if (aullMarkers[i] + 16 > ullSize)
+      continue;
+
+    liPos.QuadPart = (LONGLONG)aullMarkers[i];
+    if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN) || !WriteFile(hFile, szMarker, 16, &dwBytes, NULL) || dwBytes != 16)
+      goto cleanup;
+  }
+
+  bStatus = TRUE;
+
+cleanup:
+
+  CloseHandle(hFile);
+  return bStatus;
+}
+
+// Returns CRC-32 of the whole file.
+static DWORD GetFileCrc32(LPCTSTR szFileName) {
+  uLong ulCrc32 = crc32(0L, Z_NULL, 0);
+  HANDLE hFile = CreateFile(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return 0;
+
+  std::vector<BYTE> aBuffer(TEST_CHUNK_SIZE);
+  DWORD dwBytesRead = 0;
+  while (ReadFile(hFile, &aBuffer[0], TEST_CHUNK_SIZE, &dwBytesRead, NULL) && dwBytesRead != 0)
+    ulCrc32 = crc32(ulCrc32, &aBuffer[0], dwBytesRead);
+
+  CloseHandle(hFile);
+  return (DWORD)ulCrc32;
+}
+
+// Reads the current entry of the archive, returns count of bytes read and their CRC-32.
+// Fails if unzip finds the data doesn't match the CRC in the archive.
+static BOOL ReadEntry(unzFile hUnzip, ULONG64& ullSize, DWORD& dwCrc32) {
+  std::vector<BYTE> aBuffer(TEST_CHUNK_SIZE);
+  uLong ulCrc32 = crc32(0L, Z_NULL, 0);
+  int nRead;
+
+  ullSize = 0;
+  if (unzOpenCurrentFile(hUnzip) != UNZ_OK)
+    return FALSE;
+
+  while ((nRead = unzReadCurrentFile(hUnzip, &aBuffer[0], TEST_CHUNK_SIZE)) > 0) {
+    ulCrc32 = crc32(ulCrc32, &aBuffer[0], nRead);
+    ullSize += nRead;
+  }
+
+  dwCrc32 = (DWORD)ulCrc32;
+  return unzCloseCurrentFile(hUnzip) == UNZ_OK && nRead == 0;
+}
+
+int main(int argc, char* argv[]) {
+  UNREFERENCED_PARAMETER(argc);
+  UNREFERENCED_PARAMETER(argv);
+
+  // Stored and parallel-deflated entries above 4 GB, a parallel-deflated entry just below
+  // ZIP64_MIN_ENTRY_SIZE and a small entry whose local header lies above 4 GB
+  const Zip64TestEntry aEntries[] = {
+    {"stored.bin", TEST_LARGE_FILE_SIZE, 0},
+    {"deflated.bin", TEST_LARGE_FILE_SIZE, Z_DEFLATED},
+    {"threshold.bin", ZIP64_MIN_ENTRY_SIZE - 1, Z_DEFLATED},
+    {"small.txt", 4099, Z_DEFLATED}
+  };
+  DWORD adwCrc32[_countof(aEntries)];
+  int nFailures = 0;
+  int i;
+
+  TCHAR szTempPath[MAX_PATH];
+  if (!GetTempPath(MAX_PATH, szTempPath)) {
+    printf("Couldn't get the temporary directory.\n");
+    return 1;
+  }
+  CString sSrcFile = CString(szTempPath) + _T("Zip64Test.src");
+  CString sZipFile = CString(szTempPath) + _T("Zip64Test.zip");
+
+  // Pack the files
+  CZipWriter zip;
+  if (!zip.Open(sZipFile)) {
+    printf("Couldn't create the archive.\n");
+    return 1;
+  }
+
+  for (i = 0; i < (int)_countof(aEntries); i++) {
+    if (!CreateSparseFile(sSrcFile, aEntries[i].m_ullSize)) {
+      printf("Couldn't create sparse file for %s (error %u).\n", aEntries[i].m_szName, GetLastError());
+      zip.Close();
+      DeleteFile(sSrcFile);
+      DeleteFile(sZipFile);
+      return 1;
+    }
+    adwCrc32[i] = GetFileCrc32(sSrcFile);
+
+    HANDLE hFile = CreateFile(sSrcFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LONG64 lAdded = 0;
+    ZIP_ADD_RESULT result = ZIP_ADD_NO_ENTRY;
+    LARGE_INTEGER liFreq, liStart, liEnd;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liStart);
+    if (hFile != INVALID_HANDLE_VALUE) {
+      result = zip.AddFile(CString(aEntries[i].m_szName), _T(""), hFile, (LONG64)aEntries[i].m_ullSize,
+                           aEntries[i].m_nMethod, aEntries[i].m_nMethod == 0 ? 0 : Z_DEFAULT_COMPRESSION, lAdded, nullptr, nullptr);
+      CloseHandle(hFile);
+    }
+    QueryPerformanceCounter(&liEnd);
+    DeleteFile(sSrcFile);
+
+    BOOL bAdded = result == ZIP_ADD_OK && lAdded == (LONG64)aEntries[i].m_ullSize;
+    if (!bAdded)
+      nFailures++;
+
+    printf("Added %-14s %14I64u bytes in %8.2f s  %s\n", aEntries[i].m_szName, aEntries[i].m_ullSize,
+           (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart, bAdded ? "OK" : "FAILED");
+  }
+
+  // The central directory has ZIP64 records, as offsets exceed 4 GB
+  if (!zip.Close()) {
+    printf("Couldn't write the central directory.\n");
+    nFailures++;
+  }
+
+  // Read the archive back
+  unzFile hUnzip = unzOpen64((const void*)sZipFile.GetString());
+  if (hUnzip == NULL) {
+    printf("Couldn't open the archive for reading.\n");
+    DeleteFile(sZipFile);
+    return 1;
+  }
+
+  unz_global_info64 gi;
+  if (unzGetGlobalInfo64(hUnzip, &gi) != UNZ_OK || gi.number_entry != _countof(aEntries)) {
+    printf("The archive doesn't have %d entries.\n", (int)_countof(aEntries));
+    nFailures++;
+  }
+
+  int nResult = unzGoToFirstFile(hUnzip);
+  for (i = 0; i < (int)_countof(aEntries) && nResult == UNZ_OK; i++, nResult = unzGoToNextFile(hUnzip)) {
+    unz_file_info64 info;
+    char szName[MAX_PATH];
+    ULONG64 ullSize = 0;
+    DWORD dwCrc32 = 0;
+
+    BOOL bCheck = unzGetCurrentFileInfo64(hUnzip, &info, szName, sizeof(szName), NULL, 0, NULL, 0) == UNZ_OK &&
+                  strcmp(szName, aEntries[i].m_szName) == 0 &&
+                  info.compression_method == (uLong)aEntries[i].m_nMethod &&
+                  info.uncompressed_size == aEntries[i].m_ullSize &&
+                  info.crc == adwCrc32[i] &&
+                  (aEntries[i].m_nMethod != 0 || info.compressed_size == aEntries[i].m_ullSize) &&
+                  ReadEntry(hUnzip, ullSize, dwCrc32) &&
+                  ullSize == aEntries[i].m_ullSize && dwCrc32 == adwCrc32[i];
+    if (!bCheck)
+      nFailures++;
+
+    printf("Read  %-14s %14I64u bytes, CRC %08x  %s\n", aEntries[i].m_szName, ullSize, dwCrc32, bCheck ? "OK" : "FAILED");
+  }
+
+  if (i != (int)_countof(aEntries)) {
+    printf("Only %d entries could be read.\n", i);
+    nFailures++;
+  }
+
+  unzClose(hUnzip);
+  DeleteFile(sZipFile);
+
+  return nFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/*************************************************************************************
+This file is a part of CrashRpt library.
+Copyright (c) 2003-2013 The CrashRpt project authors. All Rights Reserved.
+
+Use of this source code is governed by a BSD-style license
+that can be found in the License.txt file in the root of the source
+tree. All contributing project authors may
+be found in the Authors.txt file in the root of the source tree.
+***************************************************************************************/
+
+// File: ZipCodecBench.cpp
+// Description: Packs the files of a directory (an error report, typically) with CZipWriter twice:
+// deflating everything at the default level, and with the codec chosen by CZipWriter::SelectCodec().
+// Prints time and archive size of both runs and the codec chosen for each file,
+// to check the ZIP_STORE_ENTROPY and ZIP_FAST_ENTROPY thresholds against real data.
+// Usage: ZipCodecBench <directory>
+
+#include "stdafx.h"
+#include "ZipWriter.h"
+#include <stdio.h>
+
+#define BENCH_CHUNK_SIZE (1024 * 1024)  /* Read buffer size */
+
+// Reads the whole file, so both runs find it in the file cache.
+static void WarmUpFile(LPCTSTR szFileName) {
+  HANDLE hFile = CreateFile(szFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return;
+
+  std::vector<BYTE> aBuffer(BENCH_CHUNK_SIZE);
+  DWORD dwBytesRead = 0;
+  while (ReadFile(hFile, &aBuffer[0], BENCH_CHUNK_SIZE, &dwBytesRead, NULL) && dwBytesRead != 0)
+    ;
+
+  CloseHandle(hFile);
+}
+
+// Packs the files into a new archive, choosing the codec of each file if pCodecs is set
+// (it receives the name of the codec chosen). Returns FALSE if any file couldn't be added.
+static BOOL PackFiles(CString sDir, const std::vector<CString>& aFiles, CString sZipFile, std::vector<CString>* pCodecs, double& dSeconds) {
+  CZipWriter zip;
+  BOOL bStatus = TRUE;
+  LARGE_INTEGER liFreq, liStart, liEnd;
+  size_t i;
+
+  QueryPerformanceFrequency(&liFreq);
+  QueryPerformanceCounter(&liStart);
+
+  if (!zip.Open(sZipFile))
+    return FALSE;
+
+  for (i = 0; i < aFiles.size(); i++) {
+    HANDLE hFile = CreateFile(sDir + _T("\\") + aFiles[i], GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, NULL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      if (pCodecs != NULL)
+        pCodecs->push_back(_T("couldn't open"));
+      bStatus = FALSE;
+      continue;
+    }
+
+    LARGE_INTEGER lFileSize;
+    if (!GetFileSizeEx(hFile, &lFileSize))
+      lFileSize.QuadPart = 0;
+
+    int nMethod = Z_DEFLATED;
+    int nLevel = Z_DEFAULT_COMPRESSION;
+    if (pCodecs != NULL) {
+      CZipWriter::SelectCodec(aFiles[i], hFile, nMethod, nLevel);
+      pCodecs->push_back(nMethod == 0 ? _T("stored") : nLevel == Z_BEST_SPEED ? _T("fastest deflate") : _T("default deflate"));
+    }
+
+    LONG64 lAdded = 0;
+    if (zip.AddFile(aFiles[i], _T(""), hFile, lFileSize.QuadPart, nMethod, nLevel, lAdded, nullptr, nullptr) != ZIP_ADD_OK)
+      bStatus = FALSE;
+    CloseHandle(hFile);
+  }
+
+  if (!zip.Close())
+    bStatus = FALSE;
+
+  QueryPerformanceCounter(&liEnd);
+  dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFreq.QuadPart;
+
+  return bStatus;
+}
+
+// Returns size of the file, or -1 if it can't be opened.
+static LONG64 GetFileSize64(LPCTSTR szFileName) {
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+  if (!GetFileAttributesEx(szFileName, GetFileExInfoStandard, &fad))
+    return -1;
+  return ((LONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+}
+
+int _tmain(int argc, TCHAR* argv[]) {
+  if (argc < 2) {
+    printf("Usage: ZipCodecBench <directory>\n");
+    return 1;
+  }
+  CString sDir = argv[1];
+
+  // Collect the files of the directory
+  std::vector<CString> aFiles;
+  LONG64 lTotalSize = 0;
+  WIN32_FIND_DATA fd;
+  HANDLE hFind = FindFirstFile(sDir + _T("\\*"), &fd);
+  if (hFind == INVALID_HANDLE_VALUE) {
+    _tprintf(_T("Couldn't list directory %s.\n"), sDir.GetString());
+    return 1;
+  }
+  do {
+    if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+      continue;
+    aFiles.push_back(fd.cFileName);
+    lTotalSize += ((LONG64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+    WarmUpFile(sDir + _T("\\") + fd.cFileName);
+  } while (FindNextFile(hFind, &fd));
+  FindClose(hFind);
+
+  TCHAR szTempPath[MAX_PATH];
+  if (!GetTempPath(MAX_PATH, szTempPath)) {
+    printf("Couldn't get the temporary directory.\n");
+    return 1;
+  }
+  CString sZipFile = CString(szTempPath) + _T("ZipCodecBench.zip");
+
+  printf("%d files, %I64d bytes\n", (int)aFiles.size(), lTotalSize);
+
+  double dDeflateSeconds = 0;
+  BOOL bDeflate = PackFiles(sDir, aFiles, sZipFile, NULL, dDeflateSeconds);
+  LONG64 lDeflateSize = GetFileSize64(sZipFile);
+  DeleteFile(sZipFile);
+
+  std::vector<CString> aCodecs;
+  double dSelectSeconds = 0;
+  BOOL bSelect = PackFiles(sDir, aFiles, sZipFile, &aCodecs, dSelectSeconds);
+  LONG64 lSelectSize = GetFileSize64(sZipFile);
+  DeleteFile(sZipFile);
+
+  size_t i;
+  for (i = 0; i < aCodecs.size(); i++)
+    _tprintf(_T("  %-40s %s\n"), aFiles[i].GetString(), aCodecs[i].GetString());
+
+  printf("%-26s %10s %16s %8s  %s\n", "Run", "Seconds", "Archive bytes", "Ratio", "Check");
+  printf("%-26s %10.3f %16I64d %8.3f  %s\n", "deflate everything", dDeflateSeconds, lDeflateSize,
+         lTotalSize > 0 ? (double)lDeflateSize / lTotalSize : 0, bDeflate ? "OK" : "FAILED");
+  printf("%-26s %10.3f %16I64d %8.3f  %s\n", "SelectCodec()", dSelectSeconds, lSelectSize,
+         lTotalSize > 0 ? (double)lSelectSize / lTotalSize : 0, bSelect ? "OK" : "FAILED");
+
+  return bDeflate && bSelect ? 0 : 1;
+}